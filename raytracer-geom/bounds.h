@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector.h>
+#include <ray.h>
+#include <triangle.h>
+#include <sphere.h>
+#include <box.h>
+#include <disc.h>
+#include <cylinder.h>
+
+#include <algorithm>
+#include <cmath>
+
+// Axis-aligned bounding box, empty until extended.
+struct Bounds {
+    Vector min{INFINITY, INFINITY, INFINITY};
+    Vector max{-INFINITY, -INFINITY, -INFINITY};
+
+    void Extend(const Vector& point) {
+        for (int i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], point[i]);
+            max[i] = std::max(max[i], point[i]);
+        }
+    }
+    void Extend(const Bounds& other) {
+        for (int i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], other.min[i]);
+            max[i] = std::max(max[i], other.max[i]);
+        }
+    }
+
+    bool IsEmpty() const {
+        return min[0] > max[0];
+    }
+
+    Vector Center() const {
+        return (min + max).MultiplyOnScalar(.5);
+    }
+    Vector Extent() const {
+        return IsEmpty() ? Vector() : max - min;
+    }
+
+    double SurfaceArea() const {
+        Vector e = Extent();
+        return 2 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+    }
+
+    int LongestAxis() const {
+        Vector e = Extent();
+        return e[0] >= e[1] && e[0] >= e[2] ? 0 : (e[1] >= e[2] ? 1 : 2);
+    }
+
+    // Grown on every side by a tiny fraction of its size, so that rounding in the
+    // shape intersections never puts a hit outside.
+    Bounds Padded() const {
+        Bounds bounds = *this;
+        for (int i = 0; i < 3; ++i) {
+            double pad = 1e-9 * (1 + std::abs(min[i]) + std::abs(max[i]));
+            bounds.min[i] -= pad;
+            bounds.max[i] += pad;
+        }
+        return bounds;
+    }
+};
+
+// Clips [*t_near, *t_far] to the part of the ray inside bounds; inv_dir holds the
+// reciprocals of the ray direction. Returns false when nothing is left.
+bool ClipToBounds(const Ray& ray, const Vector& inv_dir, const Bounds& bounds, double* t_near,
+                  double* t_far) {
+    const Vector& orig = ray.GetOrigin();
+    for (int i = 0; i < 3; ++i) {
+        double t0 = (bounds.min[i] - orig[i]) * inv_dir[i];
+        double t1 = (bounds.max[i] - orig[i]) * inv_dir[i];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        // NaN from 0 * inf, a ray in the plane of a side, keeps the range.
+        *t_near = t0 > *t_near ? t0 : *t_near;
+        *t_far = t1 < *t_far ? t1 : *t_far;
+        if (*t_near > *t_far) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Vector InverseDirection(const Vector& dir) {
+    return {1 / dir[0], 1 / dir[1], 1 / dir[2]};
+}
+
+Bounds GetBounds(const Triangle& triangle) {
+    Bounds bounds;
+    for (size_t i = 0; i < 3; ++i) {
+        bounds.Extend(triangle[i]);
+    }
+    return bounds;
+}
+
+Bounds GetBounds(const Sphere& sphere) {
+    double r = sphere.GetRadius();
+    Vector extent{r, r, r};
+    return {sphere.GetCenter() - extent, sphere.GetCenter() + extent};
+}
+
+Bounds GetBounds(const Box& box) {
+    Bounds bounds;
+    bounds.Extend(box.GetMin());
+    bounds.Extend(box.GetMax());
+    return bounds;
+}
+
+// Bounds of a circle of radius r around center, in the plane with the unit normal.
+Bounds GetCircleBounds(const Vector& center, const Vector& normal, double r) {
+    Vector extent;
+    for (int i = 0; i < 3; ++i) {
+        extent[i] = r * std::sqrt(std::max(0., 1 - normal[i] * normal[i]));
+    }
+    return {center - extent, center + extent};
+}
+
+Bounds GetBounds(const Disc& disc) {
+    return GetCircleBounds(disc.GetCenter(), disc.GetNormal(), disc.GetRadius());
+}
+
+Bounds GetBounds(const Cylinder& cylinder) {
+    Vector axis = cylinder.GetTop() - cylinder.GetBottom();
+    axis.Normalize();
+    Bounds bounds = GetCircleBounds(cylinder.GetBottom(), axis, cylinder.GetRadius());
+    bounds.Extend(GetCircleBounds(cylinder.GetTop(), axis, cylinder.GetRadius()));
+    return bounds;
+}
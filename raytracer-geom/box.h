@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector.h>
+
+// Axis-aligned box between two opposite corners.
+class Box {
+public:
+    Box(const Vector& min, const Vector& max) : min_(min), max_(max) {
+    }
+
+    const Vector& GetMin() const {
+        return min_;
+    }
+    const Vector& GetMax() const {
+        return max_;
+    }
+
+private:
+    Vector min_;
+    Vector max_;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <triangle.h>
+#include <vector.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Unit vector packed into 32 bits: its octahedral projection, with each
+// coordinate as a 16-bit signed normalized integer. The error is below 1e-4.
+using OctahedralNormal = uint32_t;
+
+// Not the encoding of any vector, since -32768 is never produced.
+constexpr OctahedralNormal kNoNormal = 0x80008000u;
+
+constexpr double kOctahedralScale = 32767.;
+
+double SignNotZero(double x) {
+    return x >= 0 ? 1. : -1.;
+}
+
+OctahedralNormal EncodeOctahedral(const Vector& normal) {
+    double norm = std::abs(normal[0]) + std::abs(normal[1]) + std::abs(normal[2]);
+    double x = normal[0] / norm;
+    double y = normal[1] / norm;
+    if (normal[2] < 0) {
+        double folded_x = (1 - std::abs(y)) * SignNotZero(x);
+        y = (1 - std::abs(x)) * SignNotZero(y);
+        x = folded_x;
+    }
+    auto x_bits = static_cast<uint16_t>(static_cast<int16_t>(std::lround(x * kOctahedralScale)));
+    auto y_bits = static_cast<uint16_t>(static_cast<int16_t>(std::lround(y * kOctahedralScale)));
+    return static_cast<OctahedralNormal>(x_bits) | static_cast<OctahedralNormal>(y_bits) << 16;
+}
+
+// Unit vector encoded by EncodeOctahedral.
+Vector DecodeOctahedral(OctahedralNormal code) {
+    double x = static_cast<int16_t>(code & 0xffff) / kOctahedralScale;
+    double y = static_cast<int16_t>(code >> 16) / kOctahedralScale;
+    double z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        double folded_x = (1 - std::abs(y)) * SignNotZero(x);
+        y = (1 - std::abs(x)) * SignNotZero(y);
+        x = folded_x;
+    }
+    Vector normal(x, y, z);
+    normal.Normalize();
+    return normal;
+}
+
+// Triangle with float vertices relative to an origin shared by a chunk of
+// triangles, e.g. the center of their bounds.
+class QuantizedTriangle {
+public:
+    QuantizedTriangle(const Triangle& triangle, const Vector* origin) : origin_(origin) {
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t j = 0; j < 3; ++j) {
+                offsets_[3 * i + j] = static_cast<float>(triangle[i][j] - (*origin)[j]);
+            }
+        }
+    }
+
+    const Vector* Origin() const {
+        return origin_;
+    }
+
+    Triangle Decode() const {
+        const Vector& o = *origin_;
+        return Triangle(Vertex(0, o), Vertex(1, o), Vertex(2, o));
+    }
+
+private:
+    Vector Vertex(size_t index, const Vector& o) const {
+        const float* p = &offsets_[3 * index];
+        return Vector(o[0] + p[0], o[1] + p[1], o[2] + p[2]);
+    }
+
+    const Vector* origin_;
+    std::array<float, 9> offsets_;
+};
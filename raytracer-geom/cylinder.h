@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector.h>
+
+// Cylinder closed by two caps, around the segment from bottom to top.
+class Cylinder {
+public:
+    Cylinder(const Vector& bottom, const Vector& top, double radius)
+        : bottom_(bottom), top_(top), radius_(radius) {
+    }
+
+    const Vector& GetBottom() const {
+        return bottom_;
+    }
+    const Vector& GetTop() const {
+        return top_;
+    }
+    double GetRadius() const {
+        return radius_;
+    }
+
+private:
+    Vector bottom_;
+    Vector top_;
+    double radius_;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector.h>
+
+class Disc {
+public:
+    Disc(const Vector& center, const Vector& normal, double radius)
+        : center_(center), normal_(normal), radius_(radius) {
+        normal_.Normalize();
+    }
+
+    const Vector& GetCenter() const {
+        return center_;
+    }
+    const Vector& GetNormal() const {
+        return normal_;
+    }
+    double GetRadius() const {
+        return radius_;
+    }
+
+private:
+    Vector center_;
+    Vector normal_;
+    double radius_;
+};
@@ -4,77 +4,240 @@
 #include <sphere.h>
 #include <intersection.h>
 #include <triangle.h>
+#include <plane.h>
+#include <disc.h>
+#include <box.h>
+#include <cylinder.h>
 #include <ray.h>
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
 #include <optional>
+#include <utility>
 
 const double kEps = 0.00001;
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
-    Vector center = sphere.GetCenter();
+// Result of the lean ray tests run while searching for the closest hit: the
+// distance t along the ray and, for triangles, the barycentric weights u and v
+// of the second and the third vertex.
+struct HitParams {
+    double t = 0;
+    double u = 0;
+    double v = 0;
+};
+
+// The GetHitParams tests need a normalized ray direction and return false on a
+// miss. They leave the position and the normal to GetHitIntersection.
+bool GetHitParams(const Ray& ray, const Sphere& sphere, HitParams* params) {
     double radius = sphere.GetRadius();
-    Vector d = ray.GetDirection();
-    d.Normalize();
-    Vector orig = ray.GetOrigin();
-    Vector ll = center - orig;
+    const Vector& d = ray.GetDirection();
+    Vector ll = sphere.GetCenter() - ray.GetOrigin();
     double tca = DotProduct(ll, d);
     double d2 = DotProduct(ll, ll) - tca * tca;
     if (d2 > radius * radius) {
-        return std::optional<Intersection>();
+        return false;
     }
     double thc = std::sqrt(radius * radius - d2);
     double t0 = tca - thc;
     double t1 = tca + thc;
-    if (t0 > t1) {
-        std::swap(t0, t1);
-    }
     if (t0 < 0.0) {
         t0 = t1;
         if (t0 < 0.0) {
-            return std::optional<Intersection>();
+            return false;
+        }
+    }
+    params->t = t0;
+    return true;
+}
+
+// Moller-Trumbore, rejecting as soon as one of u, v or t is out of range.
+bool GetHitParams(const Ray& ray, const Triangle& triangle, HitParams* params) {
+    const Vector& d = ray.GetDirection();
+    Vector e1 = triangle[1] - triangle[0];
+    Vector e2 = triangle[2] - triangle[0];
+    Vector pp = CrossProduct(d, e2);
+    double div = DotProduct(pp, e1);
+    if (std::abs(div) < kEps) {
+        return false;
+    }
+    Vector tt = ray.GetOrigin() - triangle[0];
+    double u = DotProduct(pp, tt) / div;
+    if (u < 0.0 || u > 1.0) {
+        return false;
+    }
+    Vector qq = CrossProduct(tt, e1);
+    double v = DotProduct(qq, d) / div;
+    if (v < 0.0 || u + v > 1.0) {
+        return false;
+    }
+    double t = DotProduct(qq, e2) / div;
+    if (t < 0.0) {
+        return false;
+    }
+    *params = {t, u, v};
+    return true;
+}
+
+// Distance to the plane through point, or -1 when the ray is parallel to it.
+double PlaneDistance(const Ray& ray, const Vector& point, const Vector& normal) {
+    double denom = DotProduct(normal, ray.GetDirection());
+    if (std::abs(denom) < kEps) {
+        return -1;
+    }
+    return DotProduct(point - ray.GetOrigin(), normal) / denom;
+}
+
+bool GetHitParams(const Ray& ray, const Plane& plane, HitParams* params) {
+    params->t = PlaneDistance(ray, plane.GetPoint(), plane.GetNormal());
+    return params->t >= 0.0;
+}
+
+bool GetHitParams(const Ray& ray, const Disc& disc, HitParams* params) {
+    double t = PlaneDistance(ray, disc.GetCenter(), disc.GetNormal());
+    if (t < 0.0) {
+        return false;
+    }
+    Vector offset = ray.GetOrigin() + ray.GetDirection().MultiplyOnScalar(t) - disc.GetCenter();
+    params->t = t;
+    return DotProduct(offset, offset) <= disc.GetRadius() * disc.GetRadius();
+}
+
+// Slab test. From inside the box the ray hits the face it leaves through.
+bool GetHitParams(const Ray& ray, const Box& box, HitParams* params) {
+    const Vector& d = ray.GetDirection();
+    const Vector& orig = ray.GetOrigin();
+    double t_near = -INFINITY;
+    double t_far = INFINITY;
+    for (int i = 0; i < 3; ++i) {
+        if (d[i] == 0) {
+            if (orig[i] < box.GetMin()[i] || orig[i] > box.GetMax()[i]) {
+                return false;
+            }
+            continue;
+        }
+        double t0 = (box.GetMin()[i] - orig[i]) / d[i];
+        double t1 = (box.GetMax()[i] - orig[i]) / d[i];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_near = std::max(t_near, t0);
+        t_far = std::min(t_far, t1);
+    }
+    if (t_near > t_far || t_far < 0.0) {
+        return false;
+    }
+    params->t = t_near >= 0.0 ? t_near : t_far;
+    return true;
+}
+
+// Closest of the side and cap hits.
+bool GetHitParams(const Ray& ray, const Cylinder& cylinder, HitParams* params) {
+    const Vector& d = ray.GetDirection();
+    Vector axis = cylinder.GetTop() - cylinder.GetBottom();
+    double height = Length(axis);
+    axis.Normalize();
+    double radius = cylinder.GetRadius();
+    Vector oc = ray.GetOrigin() - cylinder.GetBottom();
+    double best = INFINITY;
+
+    Vector dd = d - axis.MultiplyOnScalar(DotProduct(d, axis));
+    Vector oo = oc - axis.MultiplyOnScalar(DotProduct(oc, axis));
+    double a = DotProduct(dd, dd);
+    double b = 2 * DotProduct(dd, oo);
+    double c = DotProduct(oo, oo) - radius * radius;
+    double discriminant = b * b - 4 * a * c;
+    if (a > kEps * kEps && discriminant >= 0) {
+        double root = std::sqrt(discriminant);
+        for (double t : {(-b - root) / (2 * a), (-b + root) / (2 * a)}) {
+            double h = DotProduct(oc + d.MultiplyOnScalar(t), axis);
+            if (t >= 0.0 && h >= 0 && h <= height) {
+                best = t;
+                break;
+            }
+        }
+    }
+    for (const Vector* cap : {&cylinder.GetBottom(), &cylinder.GetTop()}) {
+        double t = PlaneDistance(ray, *cap, axis);
+        if (t < 0.0 || t >= best) {
+            continue;
+        }
+        Vector offset = ray.GetOrigin() + d.MultiplyOnScalar(t) - *cap;
+        if (DotProduct(offset, offset) <= radius * radius) {
+            best = t;
         }
     }
-    double t = t0;
-    Vector pos = orig + d.MultiplyOnScalar(t);
-    double dist = Distance(pos, ray.GetOrigin());
-    Vector normal = center - pos;
+    params->t = best;
+    return best != INFINITY;
+}
+
+// Unnormalized normal of a surface at a point on it, facing either way.
+Vector GetGeometricNormal(const Sphere& sphere, const Vector& pos) {
+    return sphere.GetCenter() - pos;
+}
+
+Vector GetGeometricNormal(const Triangle& triangle, const Vector&) {
+    return CrossProduct(triangle[1] - triangle[0], triangle[2] - triangle[0]);
+}
+
+Vector GetGeometricNormal(const Plane& plane, const Vector&) {
+    return plane.GetNormal();
+}
+
+Vector GetGeometricNormal(const Disc& disc, const Vector&) {
+    return disc.GetNormal();
+}
+
+// Normal of the face closest to pos.
+Vector GetGeometricNormal(const Box& box, const Vector& pos) {
+    int axis = 0;
+    double best = INFINITY;
+    for (int i = 0; i < 3; ++i) {
+        double dist =
+            std::min(std::abs(pos[i] - box.GetMin()[i]), std::abs(pos[i] - box.GetMax()[i]));
+        if (dist < best) {
+            best = dist;
+            axis = i;
+        }
+    }
+    Vector normal;
+    normal[axis] = 1;
+    return normal;
+}
+
+Vector GetGeometricNormal(const Cylinder& cylinder, const Vector& pos) {
+    Vector axis = cylinder.GetTop() - cylinder.GetBottom();
+    double height = Length(axis);
+    axis.Normalize();
+    double h = DotProduct(pos - cylinder.GetBottom(), axis);
+    if (h < kEps || h > height - kEps) {
+        return axis;
+    }
+    return pos - cylinder.GetBottom() - axis.MultiplyOnScalar(h);
+}
+
+// Position and normal of a hit found by GetHitParams, with the normal turned
+// against the ray. The ray direction is normalized.
+template <class Shape>
+Intersection GetHitIntersection(const Ray& ray, const Shape& shape, double t) {
+    Vector pos = ray.GetOrigin() + ray.GetDirection().MultiplyOnScalar(t);
+    Vector normal = GetGeometricNormal(shape, pos);
     normal.Normalize();
-    if (DotProduct(normal, d) >= 0) {
+    if (DotProduct(normal, ray.GetDirection()) >= 0) {
         normal = normal.MultiplyOnScalar(-1);
     }
-    return Intersection(pos, normal, dist);
+    return Intersection(pos, normal, t);
 }
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
-    Vector e1 = triangle[1] - triangle[0];
-    Vector e2 = triangle[2] - triangle[0];
+
+template <class Shape>
+std::optional<Intersection> GetIntersection(const Ray& ray, const Shape& shape) {
     Vector d = ray.GetDirection();
     d.Normalize();
-    Vector n = CrossProduct(d, e2);
-    if (std::abs(DotProduct(e1, n)) < kEps) {
+    Ray unit_ray(ray.GetOrigin(), d);
+    HitParams params;
+    if (!GetHitParams(unit_ray, shape, &params)) {
         return std::optional<Intersection>();
-    } else {
-        Vector tt = ray.GetOrigin() - triangle[0];
-        Vector pp = CrossProduct(d, e2);
-        Vector qq = CrossProduct(tt, e1);
-        double div = DotProduct(pp, e1);
-        double t = DotProduct(qq, e2) / div;
-        double u = DotProduct(pp, tt) / div;
-        double v = DotProduct(qq, d) / div;
-        if (t < 0.0) {
-            return std::optional<Intersection>();
-        }
-        if ((u < 0.0 || u > 1.0) || (v < 0.0 || u + v > 1.0)) {
-            return std::optional<Intersection>();
-        }
-        Vector pos = ray.GetOrigin() + d.MultiplyOnScalar(t);
-        Vector normal = CrossProduct(pos - triangle[0], pos - triangle[1]);
-        normal.Normalize();
-        if (DotProduct(normal, d) >= 0) {
-            normal = normal.MultiplyOnScalar(-1);
-        }
-        double dist = Distance(pos, ray.GetOrigin());
-        return Intersection(pos, normal, dist);
     }
+    return GetHitIntersection(unit_ray, shape, params.t);
 }
 
 Vector Reflect(const Vector& ray, const Vector& normal) {
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector.h>
+
+class Plane {
+public:
+    Plane(const Vector& point, const Vector& normal) : point_(point), normal_(normal) {
+        normal_.Normalize();
+    }
+
+    const Vector& GetPoint() const {
+        return point_;
+    }
+    const Vector& GetNormal() const {
+        return normal_;
+    }
+
+private:
+    Vector point_;
+    Vector normal_;
+};
@@ -1,4 +1,6 @@
 #include <geometry.h>
+#include <compact.h>
+#include <transform.h>
 #include <util.h>
 
 #include <cmath>
@@ -218,6 +220,108 @@ TEST_CASE("Triangle intersection") {
     }
 }
 
+TEST_CASE("Hit params") {
+    Triangle triangle{{18, 4, 0}, {0, 15, 6}, {6, 0, 24}};
+    Vector target{10, 7, 6};
+    Vector origin{10, 7, -20};
+    Vector dir = target - origin;
+    dir.Normalize();
+    HitParams params;
+    REQUIRE(GetHitParams({origin, dir}, triangle, &params));
+    CHECK_THAT(params.t, WithinAbs(26.));
+    auto bars = GetBarycentricCoords(triangle, target);
+    CHECK_THAT(params.u, WithinAbs(bars[1]));
+    CHECK_THAT(params.v, WithinAbs(bars[2]));
+    CHECK_FALSE(GetHitParams({origin, dir.MultiplyOnScalar(-1)}, triangle, &params));
+
+    Sphere sphere{{0, 0, 0}, 2};
+    REQUIRE(GetHitParams({{5, 0, 0}, {-1, 0, 0}}, sphere, &params));
+    CHECK_THAT(params.t, WithinAbs(3.));
+    auto intersection = GetHitIntersection({{5, 0, 0}, {-1, 0, 0}}, sphere, params.t);
+    CheckWithinAbs(intersection.GetPosition(), {2, 0, 0});
+    CheckWithinAbs(intersection.GetNormal(), {1, 0, 0});
+}
+
+TEST_CASE("Analytic primitives intersection") {
+    Plane plane{{0, 1, 0}, {0, 2, 0}};
+    auto intersection = GetIntersection({{1, 3, 1}, {0, -2, 0}}, plane);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {1, 1, 1});
+    CheckWithinAbs(intersection->GetNormal(), {0, 1, 0});
+    CHECK_THAT(intersection->GetDistance(), WithinAbs(2.));
+    intersection = GetIntersection({{1, -1, 1}, {1, 1, 0}}, plane);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetNormal(), {0, -1, 0});
+    CHECK_FALSE(GetIntersection({{1, 3, 1}, {0, 1, 0}}, plane));
+    CHECK_FALSE(GetIntersection({{1, 3, 1}, {1, 0, 0}}, plane));
+
+    Disc disc{{0, 0, 0}, {0, 0, 1}, 2};
+    intersection = GetIntersection({{1, 1, 5}, {0, 0, -1}}, disc);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {1, 1, 0});
+    CheckWithinAbs(intersection->GetNormal(), {0, 0, 1});
+    CHECK_FALSE(GetIntersection({{2, 1, 5}, {0, 0, -1}}, disc));
+
+    Box box{{-1, -1, -1}, {1, 2, 3}};
+    intersection = GetIntersection({{5, 0, 0}, {-1, 0, 0}}, box);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {1, 0, 0});
+    CheckWithinAbs(intersection->GetNormal(), {1, 0, 0});
+    CHECK_THAT(intersection->GetDistance(), WithinAbs(4.));
+    intersection = GetIntersection({{0, 0, 0}, {0, 1, 0}}, box);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {0, 2, 0});
+    CheckWithinAbs(intersection->GetNormal(), {0, -1, 0});
+    intersection = GetIntersection({{0, 0, -5}, {0, 0, 1}}, box);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {0, 0, -1});
+    CHECK_FALSE(GetIntersection({{5, 3, 0}, {-1, 0, 0}}, box));
+    CHECK_FALSE(GetIntersection({{5, 0, 0}, {1, 0, 0}}, box));
+
+    Cylinder cylinder{{0, 0, 0}, {0, 4, 0}, 1};
+    intersection = GetIntersection({{5, 1, 0}, {-1, 0, 0}}, cylinder);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {1, 1, 0});
+    CheckWithinAbs(intersection->GetNormal(), {1, 0, 0});
+    CHECK_THAT(intersection->GetDistance(), WithinAbs(4.));
+    intersection = GetIntersection({{.5, 10, 0}, {0, -1, 0}}, cylinder);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {.5, 4, 0});
+    CheckWithinAbs(intersection->GetNormal(), {0, 1, 0});
+    intersection = GetIntersection({{0, 2, 0}, {0, -1, 0}}, cylinder);
+    REQUIRE(intersection);
+    CheckWithinAbs(intersection->GetPosition(), {0, 0, 0});
+    CheckWithinAbs(intersection->GetNormal(), {0, 1, 0});
+    CHECK_FALSE(GetIntersection({{5, 5, 0}, {-1, 0, 0}}, cylinder));
+    CHECK_FALSE(GetIntersection({{1.5, 10, 0}, {0, -1, 0}}, cylinder));
+}
+
+TEST_CASE("Compact vertex attributes") {
+    for (const Vector& axis : {Vector{1, 0, 0}, Vector{0, -1, 0}, Vector{0, 0, 1}, Vector{0, 0, -1}}) {
+        auto code = EncodeOctahedral(axis);
+        CHECK(code != kNoNormal);
+        CheckWithinAbs(DecodeOctahedral(code), axis);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        double phi = i * 2.399963;
+        double z = 1 - (2 * i + 1) / 1000.;
+        double r = std::sqrt(1 - z * z);
+        Vector normal{r * std::cos(phi), r * std::sin(phi), z};
+        auto code = EncodeOctahedral(normal.MultiplyOnScalar(i % 7 + 1));
+        CHECK(code != kNoNormal);
+        Vector decoded = DecodeOctahedral(code);
+        CHECK_THAT(Length(decoded), WithinAbs(1.));
+        CHECK(Length(decoded - normal) < 1e-4);
+    }
+
+    Vector origin{100, -50, 3};
+    Triangle triangle{{101.25, -49, 3.5}, {99.5, -50.75, 2}, {100, -50, 4.125}};
+    auto decoded = QuantizedTriangle(triangle, &origin).Decode();
+    for (size_t i = 0; i < 3; ++i) {
+        CheckWithinAbs(decoded[i], triangle[i]);
+    }
+}
+
 TEST_CASE("Refract, Reflect") {
     Vector normal{0, 1, 0};
     auto d = std::numbers::sqrt2 / 2;
@@ -283,3 +387,34 @@ TEST_CASE("Barycentric coords") {
         CheckCoords(t, {10, 7, 6}, {3. / 6, 2. / 6, 1. / 6});
     }
 }
+
+TEST_CASE("Matrix4") {
+    constexpr auto kShift = [] {
+        Matrix4 m;
+        m(3, 0) = kX;
+        m(3, 1) = kY;
+        m(3, 2) = kZ;
+        return m;
+    }();
+    static_assert(MultPointMatrix({1, 2, 3}, kShift)[2] == 3 + kZ);
+    static_assert(MultDirMatrix({1, 2, 3}, kShift)[2] == 3);
+
+    Matrix4 m;
+    m(0, 0) = 0;
+    m(0, 1) = 1;
+    m(1, 0) = -1;
+    m(1, 1) = 0;
+    m(2, 2) = 2;
+    m(3, 0) = kX;
+    CheckWithinAbs(MultPointMatrix({1, 1, 1}, m), {kX - 1, 1, 2});
+    CheckWithinAbs(MultDirMatrix({1, 1, 1}, m), {-1, 1, 2});
+
+    Matrix4 identity = m * m.Inverse();
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            CHECK_THAT(identity(i, j), WithinAbs(i == j ? 1. : 0.));
+        }
+    }
+    CheckWithinAbs(MultPointMatrix(MultPointMatrix({kX, kY, kZ}, m), m.Inverse()), {kX, kY, kZ});
+    CHECK(m.Transposed()(0, 3) == kX);
+}
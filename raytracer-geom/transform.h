@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector.h>
+
+#include <array>
+#include <utility>
+
+// 4x4 affine matrix stored inline. Points are row vectors multiplied from the
+// left: rows 0-2 are the images of the axes and row 3 is the translation.
+class Matrix4 {
+public:
+    constexpr Matrix4() : data_() {
+        for (int i = 0; i < 4; ++i) {
+            (*this)(i, i) = 1;
+        }
+    }
+
+    constexpr double& operator()(int row, int col) {
+        return data_[row * 4 + col];
+    }
+    constexpr double operator()(int row, int col) const {
+        return data_[row * 4 + col];
+    }
+
+    constexpr Matrix4 operator*(const Matrix4& other) const {
+        Matrix4 result;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                double sum = 0;
+                for (int k = 0; k < 4; ++k) {
+                    sum += (*this)(i, k) * other(k, j);
+                }
+                result(i, j) = sum;
+            }
+        }
+        return result;
+    }
+
+    constexpr Matrix4 Transposed() const {
+        Matrix4 result;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                result(i, j) = (*this)(j, i);
+            }
+        }
+        return result;
+    }
+
+    // Gauss-Jordan elimination with partial pivoting; the matrix must be invertible.
+    constexpr Matrix4 Inverse() const {
+        Matrix4 a = *this;
+        Matrix4 result;
+        for (int col = 0; col < 4; ++col) {
+            int pivot = col;
+            for (int row = col + 1; row < 4; ++row) {
+                if (Abs(a(row, col)) > Abs(a(pivot, col))) {
+                    pivot = row;
+                }
+            }
+            for (int k = 0; k < 4; ++k) {
+                std::swap(a.data_[col * 4 + k], a.data_[pivot * 4 + k]);
+                std::swap(result.data_[col * 4 + k], result.data_[pivot * 4 + k]);
+            }
+            double inv = 1 / a(col, col);
+            for (int k = 0; k < 4; ++k) {
+                a(col, k) *= inv;
+                result(col, k) *= inv;
+            }
+            for (int row = 0; row < 4; ++row) {
+                if (row == col) {
+                    continue;
+                }
+                double factor = a(row, col);
+                for (int k = 0; k < 4; ++k) {
+                    a(row, k) -= factor * a(col, k);
+                    result(row, k) -= factor * result(col, k);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    static constexpr double Abs(double x) {
+        return x < 0 ? -x : x;
+    }
+
+    std::array<double, 16> data_;
+};
+
+constexpr Vector MultPointMatrix(const Vector& point, const Matrix4& m) {
+    Vector ans;
+    for (int i = 0; i < 3; ++i) {
+        ans[i] = point[0] * m(0, i) + point[1] * m(1, i) + point[2] * m(2, i) + m(3, i);
+    }
+    double w = point[0] * m(0, 3) + point[1] * m(1, 3) + point[2] * m(2, 3) + m(3, 3);
+    if (w != 1 && w != 0) {
+        ans[0] /= w;
+        ans[1] /= w;
+        ans[2] /= w;
+    }
+    return ans;
+}
+
+constexpr Vector MultDirMatrix(const Vector& dir, const Matrix4& m) {
+    Vector ans;
+    for (int i = 0; i < 3; ++i) {
+        ans[i] = dir[0] * m(0, i) + dir[1] * m(1, i) + dir[2] * m(2, i);
+    }
+    return ans;
+}
@@ -6,16 +6,16 @@
 
 class Vector {
 public:
-    Vector() : data_() {
+    constexpr Vector() : data_() {
     }
 
-    Vector(double x, double y, double z) : data_({x, y, z}) {
+    constexpr Vector(double x, double y, double z) : data_({x, y, z}) {
     }
 
-    double& operator[](size_t ind) {
+    constexpr double& operator[](size_t ind) {
         return data_[ind];
     }
-    double operator[](size_t ind) const {
+    constexpr double operator[](size_t ind) const {
         return data_[ind];
     }
 
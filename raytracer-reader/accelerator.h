@@ -0,0 +1,185 @@
+#pragma once
+
+#include <primitives.h>
+#include <bounds.h>
+#include <ray.h>
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+enum class AcceleratorType { kAuto, kBruteForce, kGrid, kKdTree, kBvh };
+
+// Primitive of a PrimitiveSet; the order is the order of a brute-force search.
+struct PrimitiveRef {
+    PrimitiveType type;
+    uint32_t index;
+
+    auto operator<=>(const PrimitiveRef&) const = default;
+};
+
+// Closest-hit and any-hit queries over the primitives of a PrimitiveSet, which
+// has to outlive the accelerator. Rays have normalized directions, and hits come
+// without attributes. Every backend returns the hit a brute-force search would.
+class Accelerator {
+public:
+    explicit Accelerator(const PrimitiveSet& primitives) : primitives_(primitives) {
+    }
+    Accelerator(const Accelerator&) = delete;
+    Accelerator& operator=(const Accelerator&) = delete;
+    virtual ~Accelerator() = default;
+
+    const PrimitiveSet& GetPrimitives() const {
+        return primitives_;
+    }
+
+    virtual AcceleratorType GetType() const = 0;
+
+    virtual Hit ClosestHit(const Ray& ray) const = 0;
+
+    // Whether anything is hit no farther than max_distance.
+    virtual bool AnyHit(const Ray& ray, double max_distance) const = 0;
+
+    // hits holds a hit per ray.
+    virtual void ClosestHits(std::span<const Ray> rays, std::span<Hit> hits) const {
+        for (size_t i = 0; i < rays.size(); ++i) {
+            hits[i] = ClosestHit(rays[i]);
+        }
+    }
+
+    // AnyHit of every ray, with its own max distance.
+    virtual void AnyHits(std::span<const Ray> rays, std::span<const double> max_distances,
+                         std::span<bool> hits) const {
+        for (size_t i = 0; i < rays.size(); ++i) {
+            hits[i] = AnyHit(rays[i], max_distances[i]);
+        }
+    }
+
+    // Bytes of the structure, not counting the primitives.
+    virtual size_t MemoryBytes() const = 0;
+
+protected:
+    const PrimitiveSet& primitives_;
+};
+
+// Planes are the only primitives without bounds; the spatial backends test them
+// for every ray.
+constexpr bool IsBounded(PrimitiveType type) {
+    return type != PrimitiveType::kPlane;
+}
+
+// Bounded primitives with their bounds, and the unbounded ones.
+struct PrimitiveRefs {
+    std::vector<PrimitiveRef> bounded;
+    std::vector<Bounds> bounds;
+    std::vector<PrimitiveRef> unbounded;
+};
+
+PrimitiveRefs CollectPrimitives(const PrimitiveSet& primitives) {
+    PrimitiveRefs refs;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        for (size_t i = 0; i < block.size(); ++i) {
+            PrimitiveRef ref{type, static_cast<uint32_t>(i)};
+            if constexpr (IsBounded(decltype(type)::value)) {
+                refs.bounded.push_back(ref);
+                refs.bounds.push_back(GetBounds(GetShape(block[i])).Padded());
+            } else {
+                refs.unbounded.push_back(ref);
+            }
+        }
+    });
+    return refs;
+}
+
+template <PrimitiveType type>
+bool HitPrimitive(const PrimitiveSet& primitives, uint32_t index, const Ray& ray,
+                  HitParams* params) {
+    return GetHitParams(ray, GetShape(primitives.Block<type>()[index]), params);
+}
+
+bool HitPrimitive(const PrimitiveSet& primitives, PrimitiveRef ref, const Ray& ray,
+                  HitParams* params) {
+    switch (ref.type) {
+        case PrimitiveType::kTriangle:
+            return HitPrimitive<PrimitiveType::kTriangle>(primitives, ref.index, ray, params);
+        case PrimitiveType::kPackedTriangle:
+            return HitPrimitive<PrimitiveType::kPackedTriangle>(primitives, ref.index, ray, params);
+        case PrimitiveType::kQuantizedTriangle:
+            return HitPrimitive<PrimitiveType::kQuantizedTriangle>(primitives, ref.index, ray,
+                                                                   params);
+        case PrimitiveType::kSphere:
+            return HitPrimitive<PrimitiveType::kSphere>(primitives, ref.index, ray, params);
+        case PrimitiveType::kPlane:
+            return HitPrimitive<PrimitiveType::kPlane>(primitives, ref.index, ray, params);
+        case PrimitiveType::kBox:
+            return HitPrimitive<PrimitiveType::kBox>(primitives, ref.index, ray, params);
+        case PrimitiveType::kDisc:
+            return HitPrimitive<PrimitiveType::kDisc>(primitives, ref.index, ray, params);
+        case PrimitiveType::kCylinder:
+            return HitPrimitive<PrimitiveType::kCylinder>(primitives, ref.index, ray, params);
+    }
+    return false;
+}
+
+// Keeps hit as the closest of the hits it is offered. Equally far hits go to the
+// primitive a brute-force search meets first.
+bool UpdateClosest(const PrimitiveSet& primitives, PrimitiveRef ref, const Ray& ray, Hit* hit) {
+    HitParams params;
+    if (!HitPrimitive(primitives, ref, ray, &params) || params.t > hit->params.t) {
+        return false;
+    }
+    if (params.t == hit->params.t && hit->IsValid() &&
+        PrimitiveRef{hit->type, static_cast<uint32_t>(hit->index)} < ref) {
+        return false;
+    }
+    hit->type = ref.type;
+    hit->index = ref.index;
+    hit->params = params;
+    return true;
+}
+
+// Tests every primitive; the fastest for a handful of them. The search is that of
+// the kernel with features, so the blocks it skips have to be empty.
+template <KernelFeatures features = KernelFeatures{}>
+class BruteForce : public Accelerator {
+public:
+    explicit BruteForce(const PrimitiveSet& primitives) : Accelerator(primitives) {
+    }
+
+    AcceleratorType GetType() const override {
+        return AcceleratorType::kBruteForce;
+    }
+
+    Hit ClosestHit(const Ray& ray) const override {
+        return SearchClosestHit<features>(primitives_, ray);
+    }
+
+    bool AnyHit(const Ray& ray, double max_distance) const override {
+        return SearchAnyHit<features>(primitives_, ray, max_distance);
+    }
+
+    size_t MemoryBytes() const override {
+        return 0;
+    }
+};
+
+// Closest hit of a ray with any direction, through accelerator, with the hit
+// attributes computed by the kernel with features. The search is the one
+// accelerator was built with for its primitives, whatever features are.
+template <KernelFeatures features = KernelFeatures{}, bool attributes = true>
+Hit FindClosestHit(const Accelerator& accelerator, const Ray& ray) {
+    Vector d = ray.GetDirection();
+    d.Normalize();
+    Ray unit_ray(ray.GetOrigin(), d);
+    Hit hit = accelerator.ClosestHit(unit_ray);
+    if (attributes && hit.IsValid()) {
+        ComputeHitAttributes<features>(accelerator.GetPrimitives(), unit_ray, &hit);
+    }
+    return hit;
+}
+
+bool IsOccluded(const Accelerator& accelerator, const Ray& ray, double max_distance) {
+    Vector d = ray.GetDirection();
+    d.Normalize();
+    return accelerator.AnyHit(Ray(ray.GetOrigin(), d), max_distance);
+}
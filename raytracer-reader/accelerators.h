@@ -0,0 +1,137 @@
+#pragma once
+
+#include <accelerator.h>
+#include <bvh.h>
+#include <kd_tree.h>
+#include <uniform_grid.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// Statistics of a PrimitiveSet that the choice of an accelerator rests on.
+struct AcceleratorStats {
+    size_t bounded = 0;
+    // Boxes, discs and cylinders, whose tests cost more than a triangle test.
+    size_t analytic = 0;
+    size_t triangles = 0;
+    // Triangles whose normal is within about a degree of a coordinate axis.
+    size_t axis_aligned_triangles = 0;
+    // Fraction of the cells of a grid with a cell per bounded primitive that hold
+    // the center of one. Around 0.6 when they fill the volume evenly, and far
+    // less for surfaces.
+    double occupancy = 0;
+};
+
+AcceleratorStats GetAcceleratorStats(const PrimitiveSet& primitives) {
+    AcceleratorStats stats;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        constexpr PrimitiveType kType = decltype(type)::value;
+        if constexpr (IsBounded(kType)) {
+            stats.bounded += block.size();
+        }
+        if constexpr (kType == PrimitiveType::kBox || kType == PrimitiveType::kDisc ||
+                      kType == PrimitiveType::kCylinder) {
+            stats.analytic += block.size();
+        }
+        if constexpr (IsTriangle(kType)) {
+            stats.triangles += block.size();
+            for (const auto& obj : block) {
+                const auto& polygon = GetShape(obj);
+                Vector normal = CrossProduct(polygon[1] - polygon[0], polygon[2] - polygon[0]);
+                normal.Normalize();
+                double largest =
+                    std::max({std::abs(normal[0]), std::abs(normal[1]), std::abs(normal[2])});
+                stats.axis_aligned_triangles += largest > .9998;
+            }
+        }
+    });
+    if (stats.bounded == 0) {
+        return stats;
+    }
+    PrimitiveRefs refs = CollectPrimitives(primitives);
+    Bounds scene;
+    for (const auto& bounds : refs.bounds) {
+        scene.Extend(bounds);
+    }
+    Vector extent = scene.Extent();
+    double max_extent = std::max({extent[0], extent[1], extent[2]});
+    double volume = 1;
+    for (int i = 0; i < 3; ++i) {
+        volume *= std::max(extent[i], 1e-3 * max_extent);
+    }
+    double cells_per_unit = std::cbrt(stats.bounded / volume);
+    std::array<size_t, 3> resolution;
+    for (int i = 0; i < 3; ++i) {
+        resolution[i] = std::max<size_t>(1, std::lround(extent[i] * cells_per_unit));
+    }
+    std::vector<bool> occupied(resolution[0] * resolution[1] * resolution[2]);
+    size_t count = 0;
+    for (const auto& bounds : refs.bounds) {
+        Vector center = bounds.Center();
+        size_t cell = 0;
+        for (int i = 2; i >= 0; --i) {
+            double offset = extent[i] > 0 ? (center[i] - scene.min[i]) / extent[i] : 0;
+            size_t index = std::min(resolution[i] - 1, static_cast<size_t>(offset * resolution[i]));
+            cell = cell * resolution[i] + index;
+        }
+        count += !occupied[cell];
+        occupied[cell] = true;
+    }
+    stats.occupancy = static_cast<double>(count) / occupied.size();
+    return stats;
+}
+
+// The backend for a scene, from the "Accelerators" benchmark. Brute force wins
+// while its loop of cheap tests is shorter than a traversal. Many primitives that
+// fill the volume evenly suit the grid, axis-aligned triangles the kd-tree, and
+// everything else, like scanned meshes, the BVH.
+AcceleratorType SelectAccelerator(const AcceleratorStats& stats) {
+    constexpr size_t kMaxBruteForce = 16;
+    // Fewer primitives leave the occupancy to chance.
+    constexpr size_t kMinGrid = 256;
+    constexpr double kMinGridOccupancy = .4;
+    constexpr double kMinAxisAligned = .8;
+    if (stats.bounded <= kMaxBruteForce && stats.analytic == 0) {
+        return AcceleratorType::kBruteForce;
+    }
+    if (stats.bounded >= kMinGrid && stats.occupancy >= kMinGridOccupancy) {
+        return AcceleratorType::kGrid;
+    }
+    if (stats.axis_aligned_triangles >= kMinAxisAligned * stats.bounded) {
+        return AcceleratorType::kKdTree;
+    }
+    return AcceleratorType::kBvh;
+}
+
+bool HasOnlyTriangles(const PrimitiveSet& primitives) {
+    bool triangles_only = true;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        triangles_only &= IsTriangle(decltype(type)::value) || block.empty();
+    });
+    return triangles_only;
+}
+
+// Brute force of triangle-only primitives runs the kernel that skips the other
+// blocks.
+std::unique_ptr<Accelerator> MakeAccelerator(AcceleratorType type, const PrimitiveSet& primitives) {
+    if (type == AcceleratorType::kAuto) {
+        type = SelectAccelerator(GetAcceleratorStats(primitives));
+    }
+    switch (type) {
+        case AcceleratorType::kGrid:
+            return std::make_unique<UniformGrid>(primitives);
+        case AcceleratorType::kKdTree:
+            return std::make_unique<KdTree>(primitives);
+        case AcceleratorType::kBvh:
+            return std::make_unique<Bvh>(primitives);
+        default:
+            if (HasOnlyTriangles(primitives)) {
+                return std::make_unique<BruteForce<KernelFeatures{.triangles_only = true}>>(
+                    primitives);
+            }
+            return std::make_unique<BruteForce<>>(primitives);
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+// Monotonic memory resource: hands out memory from a few large blocks and
+// releases it all at once when destroyed. Blocks are aligned to their size so
+// that the kernel can back them with transparent huge pages.
+class Arena : public std::pmr::memory_resource {
+public:
+    static constexpr size_t kBlockSize = 2 << 20;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() override {
+        for (const auto& block : blocks_) {
+            ::operator delete(block.data, std::align_val_t(kBlockSize));
+        }
+    }
+
+    // Uninitialized room for count objects of type T.
+    template <class T>
+    T* Allocate(size_t count) {
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // Bytes handed out so far.
+    size_t BytesUsed() const {
+        return used_;
+    }
+    // Bytes of all blocks.
+    size_t BytesReserved() const {
+        size_t bytes = 0;
+        for (const auto& block : blocks_) {
+            bytes += block.size;
+        }
+        return bytes;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        size_t offset = (offset_ + alignment - 1) & ~(alignment - 1);
+        if (blocks_.empty() || offset + bytes > blocks_.back().size) {
+            size_t size = (std::max(bytes, size_t{1}) + kBlockSize - 1) / kBlockSize * kBlockSize;
+            auto* data = static_cast<char*>(::operator new(size, std::align_val_t(kBlockSize)));
+#ifdef MADV_HUGEPAGE
+            madvise(data, size, MADV_HUGEPAGE);
+#endif
+            blocks_.push_back({data, size});
+            offset = 0;
+        }
+        offset_ = offset + bytes;
+        used_ += bytes;
+        return blocks_.back().data + offset;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::vector<Block> blocks_;
+    size_t offset_ = 0;
+    size_t used_ = 0;
+};
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <accelerator.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Bounding volume hierarchy split by the surface area heuristic over binned
+// centroids. Suits large meshes of small triangles.
+class Bvh : public Accelerator {
+public:
+    static constexpr int kBins = 16;
+    static constexpr int kMaxLeafSize = 8;
+    // Relative to the cost of a primitive test.
+    static constexpr double kTraversalCost = .5;
+    // Deeper nodes are split at the median, which bounds the depth.
+    static constexpr int kMaxSahDepth = 64;
+    // Rays traced together by ClosestHits and AnyHits.
+    static constexpr int kPacketSize = 8;
+
+    explicit Bvh(const PrimitiveSet& primitives) : Accelerator(primitives) {
+        PrimitiveRefs refs = CollectPrimitives(primitives);
+        unbounded_ = std::move(refs.unbounded);
+        if (refs.bounded.empty()) {
+            return;
+        }
+        std::vector<uint32_t> order(refs.bounded.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<Vector> centers;
+        centers.reserve(refs.bounds.size());
+        for (const auto& bounds : refs.bounds) {
+            centers.push_back(bounds.Center());
+        }
+        nodes_.reserve(2 * order.size());
+        Build(refs.bounds, centers, &order, 0, order.size(), 0);
+        refs_.reserve(order.size());
+        for (uint32_t i : order) {
+            refs_.push_back(refs.bounded[i]);
+        }
+    }
+
+    AcceleratorType GetType() const override {
+        return AcceleratorType::kBvh;
+    }
+
+    Hit ClosestHit(const Ray& ray) const override {
+        Hit hit;
+        hit.params.t = INFINITY;
+        for (PrimitiveRef ref : unbounded_) {
+            UpdateClosest(primitives_, ref, ray, &hit);
+        }
+        Traverse(ray, hit.params.t, [&](const Node& node, double* t_max) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                UpdateClosest(primitives_, refs_[i], ray, &hit);
+            }
+            *t_max = hit.params.t;
+            return false;
+        });
+        return hit;
+    }
+
+    bool AnyHit(const Ray& ray, double max_distance) const override {
+        HitParams params;
+        for (PrimitiveRef ref : unbounded_) {
+            if (HitPrimitive(primitives_, ref, ray, &params) && params.t <= max_distance) {
+                return true;
+            }
+        }
+        bool hit = false;
+        Traverse(ray, max_distance, [&](const Node& node, double*) {
+            for (uint32_t i = node.offset; i < node.offset + node.count && !hit; ++i) {
+                hit = HitPrimitive(primitives_, refs_[i], ray, &params) &&
+                      params.t <= max_distance;
+            }
+            return hit;
+        });
+        return hit;
+    }
+
+    // Consecutive rays whose directions share an octant are traced as packets: a
+    // node is entered when any ray of the packet crosses its bounds, which are
+    // tested for the whole packet in loops the compiler vectorizes. Other rays are
+    // traced one by one.
+    void ClosestHits(std::span<const Ray> rays, std::span<Hit> hits) const override {
+        for (size_t first = 0; first < rays.size(); first += kPacketSize) {
+            auto packet_rays = rays.subspan(first, std::min<size_t>(kPacketSize, rays.size() - first));
+            Hit* packet_hits = hits.data() + first;
+            std::optional<RayPacket> packet = MakePacket(packet_rays);
+            if (!packet) {
+                for (size_t l = 0; l < packet_rays.size(); ++l) {
+                    packet_hits[l] = ClosestHit(packet_rays[l]);
+                }
+                continue;
+            }
+            for (size_t l = 0; l < packet_rays.size(); ++l) {
+                Hit& hit = packet_hits[l];
+                hit = Hit();
+                hit.params.t = INFINITY;
+                for (PrimitiveRef ref : unbounded_) {
+                    UpdateClosest(primitives_, ref, packet_rays[l], &hit);
+                }
+                packet->t_max[l] = hit.params.t;
+            }
+            TraversePacket(*packet, [&](const Node& node, uint32_t lanes) {
+                for (size_t l = 0; l < packet_rays.size(); ++l) {
+                    if (!(lanes >> l & 1)) {
+                        continue;
+                    }
+                    for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                        UpdateClosest(primitives_, refs_[i], packet_rays[l], &packet_hits[l]);
+                    }
+                    packet->t_max[l] = packet_hits[l].params.t;
+                }
+                return false;
+            });
+        }
+    }
+
+    void AnyHits(std::span<const Ray> rays, std::span<const double> max_distances,
+                 std::span<bool> hits) const override {
+        for (size_t first = 0; first < rays.size(); first += kPacketSize) {
+            auto packet_rays = rays.subspan(first, std::min<size_t>(kPacketSize, rays.size() - first));
+            const double* packet_max = max_distances.data() + first;
+            bool* packet_hits = hits.data() + first;
+            std::optional<RayPacket> packet = MakePacket(packet_rays);
+            if (!packet) {
+                for (size_t l = 0; l < packet_rays.size(); ++l) {
+                    packet_hits[l] = AnyHit(packet_rays[l], packet_max[l]);
+                }
+                continue;
+            }
+            HitParams params;
+            for (size_t l = 0; l < packet_rays.size(); ++l) {
+                packet_hits[l] = false;
+                for (PrimitiveRef ref : unbounded_) {
+                    if (HitPrimitive(primitives_, ref, packet_rays[l], &params) &&
+                        params.t <= packet_max[l]) {
+                        packet_hits[l] = true;
+                        packet->live &= ~(1u << l);
+                        break;
+                    }
+                }
+                packet->t_max[l] = packet_max[l];
+            }
+            TraversePacket(*packet, [&](const Node& node, uint32_t lanes) {
+                for (size_t l = 0; l < packet_rays.size(); ++l) {
+                    if (!(lanes >> l & 1)) {
+                        continue;
+                    }
+                    for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                        if (HitPrimitive(primitives_, refs_[i], packet_rays[l], &params) &&
+                            params.t <= packet_max[l]) {
+                            packet_hits[l] = true;
+                            packet->live &= ~(1u << l);
+                            break;
+                        }
+                    }
+                }
+                return packet->live == 0;
+            });
+        }
+    }
+
+    size_t MemoryBytes() const override {
+        return nodes_.capacity() * sizeof(Node) +
+               (refs_.capacity() + unbounded_.capacity()) * sizeof(PrimitiveRef);
+    }
+
+private:
+    struct Node {
+        Bounds bounds;
+        // Leaves: the first of their primitives in refs_. Inner nodes: the second
+        // child; the first one follows the node.
+        uint32_t offset = 0;
+        // Zero for inner nodes.
+        uint16_t count = 0;
+        uint8_t axis = 0;
+    };
+
+    // Rays of a packet by coordinate, padded to kPacketSize with lanes that hit
+    // nothing.
+    struct RayPacket {
+        std::array<std::array<double, kPacketSize>, 3> origin;
+        std::array<std::array<double, kPacketSize>, 3> inv_dir;
+        std::array<double, kPacketSize> t_max;
+        // Signs of the directions, the same for all the rays.
+        std::array<bool, 3> negative;
+        // Rays still searching, by lane.
+        uint32_t live;
+    };
+
+    // None when the directions of the rays do not share an octant.
+    static std::optional<RayPacket> MakePacket(std::span<const Ray> rays) {
+        RayPacket packet{};
+        for (int i = 0; i < 3; ++i) {
+            packet.negative[i] = rays[0].GetDirection()[i] < 0;
+        }
+        packet.t_max.fill(-INFINITY);
+        for (size_t l = 0; l < rays.size(); ++l) {
+            const Vector& dir = rays[l].GetDirection();
+            Vector inv_dir = InverseDirection(dir);
+            for (int i = 0; i < 3; ++i) {
+                if ((dir[i] < 0) != packet.negative[i]) {
+                    return std::nullopt;
+                }
+                packet.origin[i][l] = rays[l].GetOrigin()[i];
+                packet.inv_dir[i][l] = inv_dir[i];
+            }
+        }
+        packet.live = (1u << rays.size()) - 1;
+        return packet;
+    }
+
+    // Live lanes of packet that pass bounds no farther than their t_max; the slab
+    // test of ClipToBounds, lane by lane.
+    static uint32_t HitLanes(const RayPacket& packet, const Bounds& bounds) {
+        std::array<double, kPacketSize> t_near{};
+        std::array<double, kPacketSize> t_far = packet.t_max;
+        for (int i = 0; i < 3; ++i) {
+            double low = bounds.min[i];
+            double high = bounds.max[i];
+            for (int l = 0; l < kPacketSize; ++l) {
+                double t0 = (low - packet.origin[i][l]) * packet.inv_dir[i][l];
+                double t1 = (high - packet.origin[i][l]) * packet.inv_dir[i][l];
+                double enter = t0 > t1 ? t1 : t0;
+                double exit = t0 > t1 ? t0 : t1;
+                t_near[l] = enter > t_near[l] ? enter : t_near[l];
+                t_far[l] = exit < t_far[l] ? exit : t_far[l];
+            }
+        }
+        uint32_t lanes = 0;
+        for (int l = 0; l < kPacketSize; ++l) {
+            lanes |= static_cast<uint32_t>(t_near[l] <= t_far[l]) << l;
+        }
+        return lanes & packet.live;
+    }
+
+    // Calls visit_leaf(node, lanes) for the leaves some lanes of packet pass, near
+    // children first, until it returns true. visit_leaf may shrink t_max and live.
+    template <class Visit>
+    void TraversePacket(const RayPacket& packet, Visit&& visit_leaf) const {
+        if (nodes_.empty() || packet.live == 0) {
+            return;
+        }
+        std::array<uint32_t, 2 * kMaxSahDepth> stack;
+        int size = 0;
+        uint32_t index = 0;
+        while (true) {
+            const Node& node = nodes_[index];
+            if (uint32_t lanes = HitLanes(packet, node.bounds)) {
+                if (node.count == 0) {
+                    bool second_first = packet.negative[node.axis];
+                    stack[size++] = second_first ? index + 1 : node.offset;
+                    index = second_first ? node.offset : index + 1;
+                    continue;
+                }
+                if (visit_leaf(node, lanes)) {
+                    return;
+                }
+            }
+            if (size == 0) {
+                return;
+            }
+            index = stack[--size];
+        }
+    }
+
+    // Calls visit_leaf(node, &t_max) for the leaves the ray passes no farther than
+    // t_max, near children first, until it returns true.
+    template <class Visit>
+    void Traverse(const Ray& ray, double t_max, Visit&& visit_leaf) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        const Vector& dir = ray.GetDirection();
+        Vector inv_dir = InverseDirection(dir);
+        std::array<uint32_t, 2 * kMaxSahDepth> stack;
+        int size = 0;
+        uint32_t index = 0;
+        while (true) {
+            const Node& node = nodes_[index];
+            double t_near = 0;
+            double t_far = t_max;
+            if (ClipToBounds(ray, inv_dir, node.bounds, &t_near, &t_far)) {
+                if (node.count == 0) {
+                    bool second_first = dir[node.axis] < 0;
+                    stack[size++] = second_first ? index + 1 : node.offset;
+                    index = second_first ? node.offset : index + 1;
+                    continue;
+                }
+                if (visit_leaf(node, &t_max)) {
+                    return;
+                }
+            }
+            if (size == 0) {
+                return;
+            }
+            index = stack[--size];
+        }
+    }
+
+    uint32_t MakeLeaf(uint32_t index, size_t begin, size_t end) {
+        nodes_[index].offset = begin;
+        nodes_[index].count = end - begin;
+        return index;
+    }
+
+    uint32_t Build(const std::vector<Bounds>& bounds, const std::vector<Vector>& centers,
+                   std::vector<uint32_t>* order, size_t begin, size_t end, int depth) {
+        uint32_t index = nodes_.size();
+        nodes_.emplace_back();
+        Bounds node_bounds;
+        Bounds centroid_bounds;
+        for (size_t i = begin; i < end; ++i) {
+            node_bounds.Extend(bounds[(*order)[i]]);
+            centroid_bounds.Extend(centers[(*order)[i]]);
+        }
+        nodes_[index].bounds = node_bounds;
+        size_t count = end - begin;
+        if (count == 1) {
+            return MakeLeaf(index, begin, end);
+        }
+        int axis = centroid_bounds.LongestAxis();
+        double low = centroid_bounds.min[axis];
+        double extent = centroid_bounds.max[axis] - low;
+        auto first = order->begin();
+        size_t mid = begin + count / 2;
+        if (extent <= 0) {
+            if (count <= kMaxLeafSize) {
+                return MakeLeaf(index, begin, end);
+            }
+        } else if (depth < kMaxSahDepth) {
+            auto bin_of = [&](uint32_t i) {
+                return std::min(kBins - 1, static_cast<int>(kBins * (centers[i][axis] - low) / extent));
+            };
+            std::array<Bounds, kBins> bin_bounds;
+            std::array<size_t, kBins> bin_counts{};
+            for (size_t i = begin; i < end; ++i) {
+                int bin = bin_of((*order)[i]);
+                bin_bounds[bin].Extend(bounds[(*order)[i]]);
+                ++bin_counts[bin];
+            }
+            // Cost of the primitives to the right of each split, swept from the right.
+            std::array<double, kBins> right_costs{};
+            Bounds right;
+            size_t right_count = 0;
+            for (int bin = kBins - 1; bin > 0; --bin) {
+                right.Extend(bin_bounds[bin]);
+                right_count += bin_counts[bin];
+                right_costs[bin] = right_count ? right.SurfaceArea() * right_count : 0;
+            }
+            Bounds left;
+            size_t left_count = 0;
+            double best_cost = INFINITY;
+            int best_split = 0;
+            for (int bin = 1; bin < kBins; ++bin) {
+                left.Extend(bin_bounds[bin - 1]);
+                left_count += bin_counts[bin - 1];
+                double cost = (left_count ? left.SurfaceArea() * left_count : 0) + right_costs[bin];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_split = bin;
+                }
+            }
+            double area = node_bounds.SurfaceArea();
+            best_cost = kTraversalCost + (area > 0 ? best_cost / area : count);
+            if (best_cost >= count && count <= kMaxLeafSize) {
+                return MakeLeaf(index, begin, end);
+            }
+            mid = std::partition(first + begin, first + end,
+                                 [&](uint32_t i) { return bin_of(i) < best_split; }) -
+                  first;
+        }
+        if (mid == begin || mid == end || extent <= 0 || depth >= kMaxSahDepth) {
+            mid = begin + count / 2;
+            std::nth_element(first + begin, first + mid, first + end, [&](uint32_t a, uint32_t b) {
+                return centers[a][axis] < centers[b][axis];
+            });
+        }
+        nodes_[index].axis = axis;
+        Build(bounds, centers, order, begin, mid, depth + 1);
+        uint32_t second = Build(bounds, centers, order, mid, end, depth + 1);
+        nodes_[index].offset = second;
+        return index;
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<PrimitiveRef> refs_;
+    std::vector<PrimitiveRef> unbounded_;
+};
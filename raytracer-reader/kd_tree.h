@@ -0,0 +1,268 @@
+#pragma once
+
+#include <accelerator.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+// Kd-tree split by the surface area heuristic over the bounds of the primitives,
+// which may land in both halves. Split planes that fit axis-aligned walls cut
+// them off cleanly, so it suits architectural scenes.
+class KdTree : public Accelerator {
+public:
+    // Relative to the cost of a traversal step.
+    static constexpr double kIntersectCost = 80;
+    static constexpr double kEmptyBonus = .5;
+    static constexpr int kMaxDepth = 64;
+
+    explicit KdTree(const PrimitiveSet& primitives) : Accelerator(primitives) {
+        PrimitiveRefs refs = CollectPrimitives(primitives);
+        unbounded_ = std::move(refs.unbounded);
+        refs_ = std::move(refs.bounded);
+        if (refs_.empty()) {
+            return;
+        }
+        bounds_ = std::move(refs.bounds);
+        Bounds tree_bounds;
+        for (const auto& bounds : bounds_) {
+            tree_bounds.Extend(bounds);
+        }
+        tree_bounds_ = tree_bounds;
+        std::vector<uint32_t> indices(refs_.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        int depth = std::min<int>(kMaxDepth, std::lround(8 + 1.3 * std::log2(refs_.size())));
+        Build(tree_bounds, std::move(indices), depth, 0);
+        bounds_.clear();
+        bounds_.shrink_to_fit();
+    }
+
+    AcceleratorType GetType() const override {
+        return AcceleratorType::kKdTree;
+    }
+
+    Hit ClosestHit(const Ray& ray) const override {
+        Hit hit;
+        hit.params.t = INFINITY;
+        for (PrimitiveRef ref : unbounded_) {
+            UpdateClosest(primitives_, ref, ray, &hit);
+        }
+        Traverse(ray, hit.params.t, [&](const Node& node, double* t_max) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                UpdateClosest(primitives_, refs_[leaf_refs_[i]], ray, &hit);
+            }
+            *t_max = hit.params.t;
+            return false;
+        });
+        return hit;
+    }
+
+    bool AnyHit(const Ray& ray, double max_distance) const override {
+        HitParams params;
+        for (PrimitiveRef ref : unbounded_) {
+            if (HitPrimitive(primitives_, ref, ray, &params) && params.t <= max_distance) {
+                return true;
+            }
+        }
+        bool hit = false;
+        Traverse(ray, max_distance, [&](const Node& node, double*) {
+            for (uint32_t i = node.offset; i < node.offset + node.count && !hit; ++i) {
+                hit = HitPrimitive(primitives_, refs_[leaf_refs_[i]], ray, &params) &&
+                      params.t <= max_distance;
+            }
+            return hit;
+        });
+        return hit;
+    }
+
+    size_t MemoryBytes() const override {
+        return nodes_.capacity() * sizeof(Node) + leaf_refs_.capacity() * sizeof(uint32_t) +
+               (refs_.capacity() + unbounded_.capacity()) * sizeof(PrimitiveRef);
+    }
+
+private:
+    static constexpr uint8_t kLeaf = 3;
+
+    struct Node {
+        double split = 0;
+        // Leaves: the first of their entries in leaf_refs_. Inner nodes: the child
+        // above the split; the one below follows the node.
+        uint32_t offset = 0;
+        uint32_t count = 0;
+        uint8_t axis = kLeaf;
+    };
+
+    struct Edge {
+        double t;
+        uint32_t primitive;
+        bool start;
+
+        bool operator<(const Edge& other) const {
+            return t != other.t ? t < other.t : start > other.start;
+        }
+    };
+
+    // Calls visit_leaf(node, &t_max) for the leaves along the ray, front to back,
+    // until it returns true or the leaves start beyond t_max.
+    template <class Visit>
+    void Traverse(const Ray& ray, double t_max, Visit&& visit_leaf) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        double t_min = 0;
+        if (!ClipToBounds(ray, InverseDirection(ray.GetDirection()), tree_bounds_, &t_min,
+                          &t_max)) {
+            return;
+        }
+        const Vector& orig = ray.GetOrigin();
+        const Vector& dir = ray.GetDirection();
+        Vector inv_dir = InverseDirection(dir);
+        struct Entry {
+            uint32_t node;
+            double t_min;
+            double t_max;
+        };
+        std::array<Entry, kMaxDepth> stack;
+        int size = 0;
+        uint32_t index = 0;
+        double node_min = t_min;
+        double node_max = t_max;
+        while (true) {
+            if (t_max < node_min) {
+                return;
+            }
+            const Node& node = nodes_[index];
+            if (node.axis != kLeaf) {
+                int axis = node.axis;
+                double t_split = (node.split - orig[axis]) * inv_dir[axis];
+                bool below_first =
+                    orig[axis] < node.split || (orig[axis] == node.split && dir[axis] <= 0);
+                uint32_t first = below_first ? index + 1 : node.offset;
+                uint32_t second = below_first ? node.offset : index + 1;
+                if (t_split > node_max || t_split <= 0) {
+                    index = first;
+                } else if (t_split < node_min) {
+                    index = second;
+                } else {
+                    stack[size++] = {second, t_split, node_max};
+                    index = first;
+                    node_max = t_split;
+                }
+                continue;
+            }
+            if (visit_leaf(node, &t_max) || size == 0) {
+                return;
+            }
+            --size;
+            index = stack[size].node;
+            node_min = stack[size].t_min;
+            node_max = stack[size].t_max;
+        }
+    }
+
+    void MakeLeaf(uint32_t index, const std::vector<uint32_t>& indices) {
+        nodes_[index].offset = leaf_refs_.size();
+        nodes_[index].count = indices.size();
+        leaf_refs_.insert(leaf_refs_.end(), indices.begin(), indices.end());
+    }
+
+    void Build(const Bounds& node_bounds, std::vector<uint32_t> indices, int depth,
+               int bad_refines) {
+        uint32_t index = nodes_.size();
+        nodes_.emplace_back();
+        size_t count = indices.size();
+        if (count <= 1 || depth == 0) {
+            MakeLeaf(index, indices);
+            return;
+        }
+        Vector extent = node_bounds.Extent();
+        double inv_area = 1 / node_bounds.SurfaceArea();
+        double leaf_cost = kIntersectCost * count;
+        double best_cost = INFINITY;
+        int best_axis = -1;
+        size_t best_offset = 0;
+        std::vector<Edge> edges(2 * count);
+        std::vector<Edge> best_edges;
+        int axis = node_bounds.LongestAxis();
+        for (int retries = 0; retries < 3 && best_axis == -1; ++retries, axis = (axis + 1) % 3) {
+            for (size_t i = 0; i < count; ++i) {
+                const Bounds& bounds = bounds_[indices[i]];
+                edges[2 * i] = {bounds.min[axis], indices[i], true};
+                edges[2 * i + 1] = {bounds.max[axis], indices[i], false};
+            }
+            std::sort(edges.begin(), edges.end());
+            int other0 = (axis + 1) % 3;
+            int other1 = (axis + 2) % 3;
+            size_t below = 0;
+            size_t above = count;
+            for (size_t i = 0; i < edges.size(); ++i) {
+                if (!edges[i].start) {
+                    --above;
+                }
+                double t = edges[i].t;
+                if (t > node_bounds.min[axis] && t < node_bounds.max[axis]) {
+                    double side = extent[other0] * extent[other1];
+                    double perimeter = extent[other0] + extent[other1];
+                    double below_area = 2 * (side + (t - node_bounds.min[axis]) * perimeter);
+                    double above_area = 2 * (side + (node_bounds.max[axis] - t) * perimeter);
+                    double bonus = below == 0 || above == 0 ? kEmptyBonus : 0;
+                    double cost = 1 + kIntersectCost * (1 - bonus) * inv_area *
+                                          (below_area * below + above_area * above);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_offset = i;
+                    }
+                }
+                if (edges[i].start) {
+                    ++below;
+                }
+            }
+            if (best_axis != -1) {
+                best_edges = edges;
+            }
+        }
+        if (best_cost > leaf_cost) {
+            ++bad_refines;
+        }
+        if (best_axis == -1 || bad_refines == 3 || (best_cost > 4 * leaf_cost && count < 16)) {
+            MakeLeaf(index, indices);
+            return;
+        }
+        std::vector<uint32_t> below;
+        std::vector<uint32_t> above;
+        for (size_t i = 0; i < best_offset; ++i) {
+            if (best_edges[i].start) {
+                below.push_back(best_edges[i].primitive);
+            }
+        }
+        for (size_t i = best_offset + 1; i < best_edges.size(); ++i) {
+            if (!best_edges[i].start) {
+                above.push_back(best_edges[i].primitive);
+            }
+        }
+        double split = best_edges[best_offset].t;
+        indices.clear();
+        indices.shrink_to_fit();
+        Bounds below_bounds = node_bounds;
+        below_bounds.max[best_axis] = split;
+        Bounds above_bounds = node_bounds;
+        above_bounds.min[best_axis] = split;
+        Build(below_bounds, std::move(below), depth - 1, bad_refines);
+        nodes_[index].axis = best_axis;
+        nodes_[index].split = split;
+        nodes_[index].offset = nodes_.size();
+        Build(above_bounds, std::move(above), depth - 1, bad_refines);
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> leaf_refs_;
+    std::vector<PrimitiveRef> refs_;
+    std::vector<PrimitiveRef> unbounded_;
+    Bounds tree_bounds_;
+    // Only while building.
+    std::vector<Bounds> bounds_;
+};
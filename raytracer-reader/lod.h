@@ -0,0 +1,375 @@
+#pragma once
+
+#include <material.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+// Zero-based indices of a face vertex into the positions, texture coordinates
+// and normals of a file, -1 for missing texture coordinates or normal.
+struct FaceVertex {
+    int position;
+    int texcoord;
+    int normal;
+};
+
+struct MeshFace {
+    std::array<FaceVertex, 3> vertices;
+    const Material* material;
+};
+
+struct LodOptions {
+    // Simplified levels of a mesh, each with half the triangles of the one
+    // before; 0 turns simplification off.
+    int levels = 4;
+    // Meshes with fewer triangles are kept as they are.
+    size_t min_triangles = 256;
+};
+
+struct MeshLevel {
+    std::vector<MeshFace> faces;
+    // Largest distance from a vertex of the mesh to the simplified surface.
+    double error = 0;
+};
+
+// Error quadric of Garland and Heckbert: the sum of squared distances to a set
+// of planes, as the upper triangle of a symmetric 4x4 matrix.
+class Quadric {
+public:
+    Quadric() = default;
+
+    // Plane through point with unit normal.
+    Quadric(const Vector& normal, const Vector& point, double weight = 1) {
+        double a = normal[0];
+        double b = normal[1];
+        double c = normal[2];
+        double d = -DotProduct(normal, point);
+        q_ = {a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d};
+        for (double& value : q_) {
+            value *= weight;
+        }
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        for (size_t i = 0; i < q_.size(); ++i) {
+            q_[i] += other.q_[i];
+        }
+        return *this;
+    }
+
+    double Evaluate(const Vector& v) const {
+        double x = v[0];
+        double y = v[1];
+        double z = v[2];
+        return q_[0] * x * x + 2 * q_[1] * x * y + 2 * q_[2] * x * z + 2 * q_[3] * x +
+               q_[4] * y * y + 2 * q_[5] * y * z + 2 * q_[6] * y + q_[7] * z * z + 2 * q_[8] * z +
+               q_[9];
+    }
+
+    // The point of least error, if the planes pin one down.
+    bool Minimize(Vector* point) const {
+        double a00 = q_[0], a01 = q_[1], a02 = q_[2], a11 = q_[4], a12 = q_[5], a22 = q_[7];
+        double c00 = a11 * a22 - a12 * a12;
+        double c01 = a02 * a12 - a01 * a22;
+        double c02 = a01 * a12 - a02 * a11;
+        double det = a00 * c00 + a01 * c01 + a02 * c02;
+        double scale = std::abs(a00) + std::abs(a11) + std::abs(a22);
+        if (std::abs(det) <= 1e-9 * scale * scale * scale) {
+            return false;
+        }
+        double c11 = a00 * a22 - a02 * a02;
+        double c12 = a01 * a02 - a00 * a12;
+        double c22 = a00 * a11 - a01 * a01;
+        double b0 = -q_[3];
+        double b1 = -q_[6];
+        double b2 = -q_[8];
+        *point = Vector(c00 * b0 + c01 * b1 + c02 * b2, c01 * b0 + c11 * b1 + c12 * b2,
+                        c02 * b0 + c12 * b1 + c22 * b2)
+                     .MultiplyOnScalar(1 / det);
+        return true;
+    }
+
+private:
+    std::array<double, 10> q_ = {};
+};
+
+// Distance from p to the triangle (a, b, c), after Ericson's closest point.
+double PointTriangleDistance(const Vector& p, const Vector& a, const Vector& b, const Vector& c) {
+    Vector ab = b - a;
+    Vector ac = c - a;
+    Vector ap = p - a;
+    double d1 = DotProduct(ab, ap);
+    double d2 = DotProduct(ac, ap);
+    if (d1 <= 0 && d2 <= 0) {
+        return Length(ap);
+    }
+    Vector bp = p - b;
+    double d3 = DotProduct(ab, bp);
+    double d4 = DotProduct(ac, bp);
+    if (d3 >= 0 && d4 <= d3) {
+        return Length(bp);
+    }
+    double vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+        return Length(p - (a + ab.MultiplyOnScalar(d1 / (d1 - d3))));
+    }
+    Vector cp = p - c;
+    double d5 = DotProduct(ab, cp);
+    double d6 = DotProduct(ac, cp);
+    if (d6 >= 0 && d5 <= d6) {
+        return Length(cp);
+    }
+    double vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+        return Length(p - (a + ac.MultiplyOnScalar(d2 / (d2 - d6))));
+    }
+    double va = d3 * d6 - d5 * d4;
+    if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+        return Length(p - (b + (c - b).MultiplyOnScalar((d4 - d3) / ((d4 - d3) + (d5 - d6)))));
+    }
+    double denom = 1 / (va + vb + vc);
+    return Length(p - (a + ab.MultiplyOnScalar(vb * denom) + ac.MultiplyOnScalar(vc * denom)));
+}
+
+// Simplifies the mesh of faces by collapsing its cheapest edges by quadric error
+// into the point that minimizes it, and returns a level every time the triangle
+// count falls to half of the one before. Boundary edges are held in place by
+// planes across them, and collapses that would flip a face are skipped. The new
+// positions are appended to positions; corners keep their texture coordinates
+// and normals. Stops early when no edge can be collapsed.
+std::vector<MeshLevel> SimplifyMesh(std::vector<Vector>* positions,
+                                    const std::vector<MeshFace>& faces,
+                                    const LodOptions& options) {
+    constexpr double kBoundaryWeight = 100;
+    // Local vertices of the mesh, and its faces as triangles of them.
+    std::unordered_map<int, int> local_of;
+    std::vector<int> global_of;
+    std::vector<std::array<int, 3>> triangles;
+    for (const auto& face : faces) {
+        std::array<int, 3> triangle;
+        for (int k = 0; k < 3; ++k) {
+            auto [it, inserted] = local_of.try_emplace(face.vertices[k].position, global_of.size());
+            if (inserted) {
+                global_of.push_back(face.vertices[k].position);
+            }
+            triangle[k] = it->second;
+        }
+        triangles.push_back(triangle);
+    }
+    size_t vertex_count = global_of.size();
+    std::vector<Vector> original(vertex_count);
+    for (size_t v = 0; v < vertex_count; ++v) {
+        original[v] = (*positions)[global_of[v]];
+    }
+    std::vector<Vector> position = original;
+    std::vector<Quadric> quadrics(vertex_count);
+    std::vector<std::vector<int>> vertex_faces(vertex_count);
+    std::vector<bool> alive(triangles.size(), true);
+    size_t alive_count = 0;
+    auto face_normal = [&](const std::array<int, 3>& t) {
+        return CrossProduct(position[t[1]] - position[t[0]], position[t[2]] - position[t[0]]);
+    };
+    std::unordered_map<uint64_t, int> edge_faces;
+    auto edge_key = [](int a, int b) {
+        return static_cast<uint64_t>(std::min(a, b)) << 32 | static_cast<uint32_t>(std::max(a, b));
+    };
+    for (size_t f = 0; f < triangles.size(); ++f) {
+        const auto& t = triangles[f];
+        Vector normal = face_normal(t);
+        if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2] || Length(normal) == 0) {
+            alive[f] = false;
+            continue;
+        }
+        ++alive_count;
+        normal.Normalize();
+        Quadric plane(normal, position[t[0]]);
+        for (int k = 0; k < 3; ++k) {
+            quadrics[t[k]] += plane;
+            vertex_faces[t[k]].push_back(f);
+            ++edge_faces[edge_key(t[k], t[(k + 1) % 3])];
+        }
+    }
+    for (size_t f = 0; f < triangles.size(); ++f) {
+        if (!alive[f]) {
+            continue;
+        }
+        const auto& t = triangles[f];
+        Vector normal = face_normal(t);
+        normal.Normalize();
+        for (int k = 0; k < 3; ++k) {
+            int a = t[k];
+            int b = t[(k + 1) % 3];
+            if (edge_faces[edge_key(a, b)] == 1) {
+                Vector side = CrossProduct(position[b] - position[a], normal);
+                double length = Length(side);
+                if (length > 0) {
+                    Quadric border(side.MultiplyOnScalar(1 / length), position[a], kBoundaryWeight);
+                    quadrics[a] += border;
+                    quadrics[b] += border;
+                }
+            }
+        }
+    }
+
+    struct Collapse {
+        double cost;
+        int keep;
+        int remove;
+        uint32_t keep_version;
+        uint32_t remove_version;
+        Vector target;
+
+        bool operator>(const Collapse& other) const {
+            return cost > other.cost;
+        }
+    };
+    std::vector<uint32_t> version(vertex_count, 0);
+    std::vector<int> parent(vertex_count);
+    std::iota(parent.begin(), parent.end(), 0);
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<>> queue;
+    auto push = [&](int a, int b) {
+        Quadric sum = quadrics[a];
+        sum += quadrics[b];
+        Vector target;
+        if (!sum.Minimize(&target)) {
+            target = position[a];
+            Vector midpoint = (position[a] + position[b]).MultiplyOnScalar(.5);
+            for (const Vector& candidate : {position[b], midpoint}) {
+                if (sum.Evaluate(candidate) < sum.Evaluate(target)) {
+                    target = candidate;
+                }
+            }
+        }
+        queue.push({std::max(sum.Evaluate(target), 0.), a, b, version[a], version[b], target});
+    };
+    for (const auto& [key, count] : edge_faces) {
+        push(key >> 32, key & 0xffffffff);
+    }
+
+    // Whether moving the corners of vertex from to target flips or flattens a
+    // face that does not contain other.
+    auto flips = [&](int from, int other, const Vector& target) {
+        for (int f : vertex_faces[from]) {
+            const auto& t = triangles[f];
+            if (!alive[f] || std::find(t.begin(), t.end(), other) != t.end()) {
+                continue;
+            }
+            Vector before = face_normal(t);
+            std::array<Vector, 3> corners = {position[t[0]], position[t[1]], position[t[2]]};
+            for (int k = 0; k < 3; ++k) {
+                if (t[k] == from) {
+                    corners[k] = target;
+                }
+            }
+            Vector after = CrossProduct(corners[1] - corners[0], corners[2] - corners[0]);
+            if (DotProduct(before, after) <= .1 * Length(before) * Length(after)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto find = [&](int v) {
+        while (parent[v] != v) {
+            parent[v] = parent[parent[v]];
+            v = parent[v];
+        }
+        return v;
+    };
+    auto snapshot = [&] {
+        MeshLevel level;
+        std::vector<int> moved_index(vertex_count, -1);
+        for (size_t f = 0; f < triangles.size(); ++f) {
+            if (!alive[f]) {
+                continue;
+            }
+            MeshFace face = faces[f];
+            for (int k = 0; k < 3; ++k) {
+                int v = triangles[f][k];
+                if (moved_index[v] == -1) {
+                    moved_index[v] = positions->size();
+                    positions->push_back(position[v]);
+                }
+                face.vertices[k].position = moved_index[v];
+            }
+            level.faces.push_back(face);
+        }
+        // Every vertex lies on the faces around the one it was collapsed into.
+        for (size_t v = 0; v < vertex_count; ++v) {
+            int root = find(v);
+            double distance = INFINITY;
+            for (int f : vertex_faces[root]) {
+                const auto& t = triangles[f];
+                if (alive[f] && std::find(t.begin(), t.end(), root) != t.end()) {
+                    distance = std::min(distance, PointTriangleDistance(original[v], position[t[0]],
+                                                                        position[t[1]],
+                                                                        position[t[2]]));
+                }
+            }
+            if (distance < INFINITY) {
+                level.error = std::max(level.error, distance);
+            }
+        }
+        return level;
+    };
+
+    std::vector<MeshLevel> levels;
+    size_t target_count = alive_count / 2;
+    while (static_cast<int>(levels.size()) < options.levels && !queue.empty()) {
+        Collapse collapse = queue.top();
+        queue.pop();
+        int keep = collapse.keep;
+        int remove = collapse.remove;
+        if (version[keep] != collapse.keep_version || version[remove] != collapse.remove_version ||
+            flips(keep, remove, collapse.target) || flips(remove, keep, collapse.target)) {
+            continue;
+        }
+        position[keep] = collapse.target;
+        quadrics[keep] += quadrics[remove];
+        parent[remove] = keep;
+        ++version[keep];
+        ++version[remove];
+        for (int f : vertex_faces[remove]) {
+            auto& t = triangles[f];
+            if (!alive[f]) {
+                continue;
+            }
+            if (std::find(t.begin(), t.end(), keep) != t.end()) {
+                alive[f] = false;
+                --alive_count;
+            } else {
+                std::replace(t.begin(), t.end(), remove, keep);
+                vertex_faces[keep].push_back(f);
+            }
+        }
+        vertex_faces[remove].clear();
+        std::erase_if(vertex_faces[keep], [&](int f) { return !alive[f]; });
+        std::vector<int> neighbours;
+        for (int f : vertex_faces[keep]) {
+            for (int v : triangles[f]) {
+                if (v != keep && std::find(neighbours.begin(), neighbours.end(), v) ==
+                                     neighbours.end()) {
+                    neighbours.push_back(v);
+                }
+            }
+        }
+        for (int v : neighbours) {
+            push(keep, v);
+        }
+        if (alive_count <= target_count) {
+            levels.push_back(snapshot());
+            target_count = alive_count / 2;
+        }
+    }
+    // Coarser levels never claim less error than finer ones.
+    for (size_t i = 1; i < levels.size(); ++i) {
+        levels[i].error = std::max(levels[i].error, levels[i - 1].error);
+    }
+    return levels;
+}
@@ -1,10 +1,17 @@
 #pragma once
 
 #include <vector.h>
+
+#include <cstdint>
 #include <string>
 
-struct Material {
-    std::string name;
+// Texture of a TextureCache.
+using TextureHandle = int32_t;
+constexpr TextureHandle kNoTexture = -1;
+
+// What shading reads of a Material. Textured surfaces shade a copy with the
+// texture in diffuse_color, which this keeps free of the name.
+struct MaterialShading {
     Vector ambient_color;
     Vector diffuse_color;
     Vector specular_color;
@@ -12,4 +19,10 @@ struct Material {
     double specular_exponent;
     double refraction_index;
     Vector albedo;
+    // Multiplies diffuse_color where the surface has texture coordinates.
+    TextureHandle diffuse_map = kNoTexture;
+};
+
+struct Material : MaterialShading {
+    std::string name;
 };
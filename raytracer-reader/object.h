@@ -1,16 +1,30 @@
 #pragma once
 
-#include <vector>
+#include <array>
+#include <span>
 
 #include <triangle.h>
+#include <compact.h>
 #include <material.h>
 #include <sphere.h>
+#include <plane.h>
+#include <box.h>
+#include <disc.h>
+#include <cylinder.h>
 #include <vector.h>
 
+struct TexCoord {
+    float u = 0;
+    float v = 0;
+};
+
+// Triangle with an optional normal and texture coordinates per vertex. Both
+// belong to the scene.
 struct Object {
     const Material* material = nullptr;
     Triangle polygon;
-    std::vector<Vector> normals;
+    std::span<const Vector> normals;
+    std::span<const TexCoord> texcoords = {};
 
     const Vector* GetNormal(size_t index) const {
         return &normals[index];
@@ -21,3 +35,63 @@ struct SphereObject {
     const Material* material = nullptr;
     Sphere sphere;
 };
+
+// Analytic primitive that only needs its shape and material.
+template <class Shape>
+struct ShapeObject {
+    const Material* material = nullptr;
+    Shape shape;
+};
+
+// Triangle with octahedral vertex normals, kNoNormal when it has none, and the
+// texture coordinates of its vertices in the scene, if any.
+template <class Polygon>
+struct PackedObject {
+    const Material* material = nullptr;
+    Polygon polygon;
+    std::array<OctahedralNormal, 3> normals = {kNoNormal, kNoNormal, kNoNormal};
+    const TexCoord* texcoords = nullptr;
+
+    bool HasNormals() const {
+        return normals[0] != kNoNormal;
+    }
+};
+
+using PackedTriangleObject = PackedObject<Triangle>;
+using QuantizedTriangleObject = PackedObject<QuantizedTriangle>;
+
+using PlaneObject = ShapeObject<Plane>;
+using BoxObject = ShapeObject<Box>;
+using DiscObject = ShapeObject<Disc>;
+using CylinderObject = ShapeObject<Cylinder>;
+
+const Triangle& GetShape(const Object& obj) {
+    return obj.polygon;
+}
+
+const Sphere& GetShape(const SphereObject& obj) {
+    return obj.sphere;
+}
+
+const Triangle& GetShape(const PackedTriangleObject& obj) {
+    return obj.polygon;
+}
+
+Triangle GetShape(const QuantizedTriangleObject& obj) {
+    return obj.polygon.Decode();
+}
+
+template <class Shape>
+const Shape& GetShape(const ShapeObject<Shape>& obj) {
+    return obj.shape;
+}
+
+// Texture coordinates of the three vertices, nullptr if there are none.
+const TexCoord* GetTexCoords(const Object& obj) {
+    return obj.texcoords.empty() ? nullptr : obj.texcoords.data();
+}
+
+template <class Polygon>
+const TexCoord* GetTexCoords(const PackedObject<Polygon>& obj) {
+    return obj.texcoords;
+}
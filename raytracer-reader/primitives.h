@@ -0,0 +1,253 @@
+#pragma once
+
+#include <object.h>
+#include <geometry.h>
+#include <intersection.h>
+#include <ray.h>
+
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Kinds of primitives, in the order of the blocks of a PrimitiveSet.
+enum class PrimitiveType : uint8_t {
+    kTriangle,
+    kPackedTriangle,
+    kQuantizedTriangle,
+    kSphere,
+    kPlane,
+    kBox,
+    kDisc,
+    kCylinder
+};
+
+constexpr bool IsTriangle(PrimitiveType type) {
+    return type == PrimitiveType::kTriangle || type == PrimitiveType::kPackedTriangle ||
+           type == PrimitiveType::kQuantizedTriangle;
+}
+
+// Closed primitives bound a volume, so a refracted ray continues inside them.
+constexpr bool IsClosed(PrimitiveType type) {
+    return type == PrimitiveType::kSphere || type == PrimitiveType::kBox ||
+           type == PrimitiveType::kCylinder;
+}
+
+// All primitives of a scene, kept in one block per kind. Searches run a tight
+// loop over every block in turn, so the shape code is chosen once per block
+// instead of once per primitive. A block is an array of whole objects, shape and
+// material side by side, not an array per field: the primitives are tested one
+// at a time, and the scene, relighting and level of detail move and rewrite
+// whole objects.
+class PrimitiveSet {
+public:
+    template <PrimitiveType type>
+    using Constant = std::integral_constant<PrimitiveType, type>;
+
+    PrimitiveSet() = default;
+
+    // Moves the primitives of other into blocks of exactly their size, allocated
+    // from resource.
+    PrimitiveSet(PrimitiveSet&& other, std::pmr::memory_resource* resource)
+        : PrimitiveSet(resource, std::make_index_sequence<kTypes>()) {
+        ForEachBlock([&](auto type, auto& block) {
+            auto& source = other.Block<decltype(type)::value>();
+            block.reserve(source.size());
+            std::move(source.begin(), source.end(), std::back_inserter(block));
+            source.clear();
+        });
+    }
+
+    template <class Obj>
+    void Add(Obj obj) {
+        std::get<std::pmr::vector<Obj>>(blocks_).push_back(std::move(obj));
+    }
+
+    template <PrimitiveType type>
+    auto& Block() {
+        return std::get<static_cast<size_t>(type)>(blocks_);
+    }
+    template <PrimitiveType type>
+    const auto& Block() const {
+        return std::get<static_cast<size_t>(type)>(blocks_);
+    }
+
+    // Calls func(Constant<type>(), block) for the blocks in PrimitiveType order.
+    template <class Func>
+    void ForEachBlock(Func&& func) const {
+        ForEachBlock(*this, func, std::make_index_sequence<kTypes>());
+    }
+    template <class Func>
+    void ForEachBlock(Func&& func) {
+        ForEachBlock(*this, func, std::make_index_sequence<kTypes>());
+    }
+
+    const Material* GetMaterial(PrimitiveType type, int index) const {
+        const Material* material = nullptr;
+        ForEachBlock([&](auto block_type, const auto& block) {
+            if (block_type == type) {
+                material = block[index].material;
+            }
+        });
+        return material;
+    }
+
+    size_t Size() const {
+        size_t size = 0;
+        ForEachBlock([&](auto, const auto& block) { size += block.size(); });
+        return size;
+    }
+
+private:
+    static constexpr size_t kTypes = 8;
+
+    template <size_t... types>
+    PrimitiveSet(std::pmr::memory_resource* resource, std::index_sequence<types...>)
+        : blocks_(((void)types, resource)...) {
+    }
+
+    template <class Set, class Func, size_t... types>
+    static void ForEachBlock(Set& set, Func& func, std::index_sequence<types...>) {
+        (func(Constant<static_cast<PrimitiveType>(types)>(), std::get<types>(set.blocks_)), ...);
+    }
+
+    std::tuple<std::pmr::vector<Object>, std::pmr::vector<PackedTriangleObject>,
+               std::pmr::vector<QuantizedTriangleObject>, std::pmr::vector<SphereObject>,
+               std::pmr::vector<PlaneObject>, std::pmr::vector<BoxObject>,
+               std::pmr::vector<DiscObject>, std::pmr::vector<CylinderObject>>
+        blocks_;
+};
+
+// Properties of a scene and of a render that the ray kernels are specialized
+// on. Every flag that is set only allows a shortcut; the default is the generic
+// kernel, which handles any scene.
+struct KernelFeatures {
+    // Every primitive is a triangle. Brute-force searches and the hit attributes
+    // skip the other blocks; the other backends only visit primitives that exist.
+    bool triangles_only = false;
+    // No triangle has vertex normals.
+    bool flat_normals = false;
+    // Reflected and refracted rays never contribute, because of the materials or
+    // because the recursion depth is 0.
+    bool no_reflection = false;
+    bool no_refraction = false;
+
+    bool operator==(const KernelFeatures&) const = default;
+};
+
+// Whether the kernel with features skips the block of type.
+template <KernelFeatures features, PrimitiveType type>
+constexpr bool SkipsBlock() {
+    return features.triangles_only && !IsTriangle(type);
+}
+
+// Closest hit of a ray: a primitive of a PrimitiveSet, where it is hit and the
+// normal to shade it with.
+struct Hit {
+    PrimitiveType type = PrimitiveType::kTriangle;
+    int index = -1;
+    HitParams params;
+    std::optional<Intersection> intersection;
+    Vector shading_normal;
+    // Interpolated texture coordinates of a triangle that has them, and how far
+    // they move per unit of distance on the triangle.
+    std::optional<TexCoord> texcoord;
+    double texcoord_scale = 0;
+
+    bool IsValid() const {
+        return index != -1;
+    }
+};
+
+// Fills in the position, the geometric normal, the shading normal and the texture
+// coordinates of a hit found by the lean search. Triangles with vertex normals or
+// texture coordinates interpolate them with the barycentric weights of the hit;
+// packed normals are decoded only here. The ray direction is normalized.
+template <KernelFeatures features = KernelFeatures{}>
+void ComputeHitAttributes(const PrimitiveSet& primitives, const Ray& ray, Hit* hit) {
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        if constexpr (!SkipsBlock<features, decltype(type)::value>()) {
+            if (type != hit->type) {
+                return;
+            }
+            const auto& obj = block[hit->index];
+            const auto& shape = GetShape(obj);
+            hit->intersection = GetHitIntersection(ray, shape, hit->params.t);
+            hit->shading_normal = hit->intersection->GetNormal();
+            double u = hit->params.u;
+            double v = hit->params.v;
+            if constexpr (IsTriangle(decltype(type)::value)) {
+                if (const TexCoord* uv = GetTexCoords(obj)) {
+                    hit->texcoord = TexCoord{
+                        static_cast<float>(uv[0].u * (1 - u - v) + uv[1].u * u + uv[2].u * v),
+                        static_cast<float>(uv[0].v * (1 - u - v) + uv[1].v * u + uv[2].v * v)};
+                    double uv_area = std::abs((uv[1].u - uv[0].u) * (uv[2].v - uv[0].v) -
+                                              (uv[2].u - uv[0].u) * (uv[1].v - uv[0].v));
+                    double area = Length(CrossProduct(shape[1] - shape[0], shape[2] - shape[0]));
+                    hit->texcoord_scale = area > 0 ? std::sqrt(uv_area / area) : 0;
+                }
+            }
+            if constexpr (features.flat_normals) {
+                return;
+            }
+            if constexpr (decltype(type)::value == PrimitiveType::kTriangle) {
+                if (!obj.normals.empty()) {
+                    hit->shading_normal = obj.normals[0].MultiplyOnScalar(1 - u - v) +
+                                          obj.normals[1].MultiplyOnScalar(u) +
+                                          obj.normals[2].MultiplyOnScalar(v);
+                }
+            } else if constexpr (IsTriangle(decltype(type)::value)) {
+                if (obj.HasNormals()) {
+                    hit->shading_normal =
+                        DecodeOctahedral(obj.normals[0]).MultiplyOnScalar(1 - u - v) +
+                        DecodeOctahedral(obj.normals[1]).MultiplyOnScalar(u) +
+                        DecodeOctahedral(obj.normals[2]).MultiplyOnScalar(v);
+                }
+            }
+        }
+    });
+}
+
+// Closest primitive hit by a ray with a normalized direction. Only the primitive
+// and its HitParams are filled in.
+template <KernelFeatures features = KernelFeatures{}>
+Hit SearchClosestHit(const PrimitiveSet& primitives, const Ray& unit_ray) {
+    Hit hit;
+    hit.params.t = INFINITY;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        if constexpr (!SkipsBlock<features, decltype(type)::value>()) {
+            HitParams params;
+            for (size_t i = 0; i < block.size(); ++i) {
+                if (GetHitParams(unit_ray, GetShape(block[i]), &params) &&
+                    params.t < hit.params.t) {
+                    hit.type = type;
+                    hit.index = i;
+                    hit.params = params;
+                }
+            }
+        }
+    });
+    return hit;
+}
+
+// Whether anything is hit no farther than max_distance along a ray with a
+// normalized direction; stops at the first such hit.
+template <KernelFeatures features = KernelFeatures{}>
+bool SearchAnyHit(const PrimitiveSet& primitives, const Ray& unit_ray, double max_distance) {
+    bool occluded = false;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        if constexpr (!SkipsBlock<features, decltype(type)::value>()) {
+            HitParams params;
+            for (size_t i = 0; i < block.size() && !occluded; ++i) {
+                occluded = GetHitParams(unit_ray, GetShape(block[i]), &params) &&
+                           params.t <= max_distance;
+            }
+        }
+    });
+    return occluded;
+}
@@ -3,8 +3,20 @@
 #include <material.h>
 #include <vector.h>
 #include <object.h>
+#include <primitives.h>
+#include <arena.h>
+#include <accelerators.h>
 #include <light.h>
+#include <lod.h>
+#include <texture_cache.h>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
 #include <vector>
 #include <unordered_map>
 #include <string>
@@ -14,34 +26,384 @@
 #include <sstream>
 #include <utility>
 
+// How ReadScene stores triangles.
+enum class VertexFormat {
+    // Double vertices, vertex normals as Vectors in the arena.
+    kFull,
+    // Double vertices, octahedral vertex normals inline.
+    kCompact,
+    // Float vertices relative to the center of each chunk of kQuantizationChunk
+    // triangles in file order, octahedral vertex normals inline.
+    kQuantized
+};
+
+constexpr size_t kQuantizationChunk = 1024;
+
+struct ReadOptions {
+    VertexFormat vertex_format = VertexFormat::kFull;
+    // Simplified levels of the meshes, the o and g groups of the file.
+    LodOptions lod = {};
+};
+
+// Memory used by a scene, in bytes.
+struct SceneFootprint {
+    size_t triangles = 0;
+    size_t spheres = 0;
+    // Planes, boxes, discs and cylinders.
+    size_t analytic = 0;
+    size_t normals = 0;
+    size_t texcoords = 0;
+    size_t lights = 0;
+    size_t materials = 0;
+    // Arena memory not handed out yet.
+    size_t arena_slack = 0;
+    // Accelerators built so far.
+    size_t accelerators = 0;
+    // Simplified triangles and the primitives of the levels in use.
+    size_t lod = 0;
+
+    size_t Total() const {
+        return triangles + spheres + analytic + normals + texcoords + lights + materials +
+               arena_slack + accelerators + lod;
+    }
+};
+
+// Simplified levels of the meshes of a scene. Level 0 of a mesh is its range of
+// the triangle block of the scene; the others are ranges of the same block of
+// primitives, ordered from fine to coarse.
+struct MeshLod {
+    struct Level {
+        size_t begin;
+        size_t end;
+        // Largest distance from the mesh to the level.
+        double error;
+    };
+
+    Vector min;
+    Vector max;
+    std::vector<Level> levels;
+};
+
+struct SceneLod {
+    std::vector<MeshLod> meshes;
+    PrimitiveSet primitives;
+};
+
+struct LodStats {
+    size_t triangles_loaded = 0;
+    size_t triangles_traced = 0;
+};
+
+size_t CountTriangles(const PrimitiveSet& primitives) {
+    size_t count = 0;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        if constexpr (IsTriangle(decltype(type)::value)) {
+            count += block.size();
+        }
+    });
+    return count;
+}
+
+// Scenes read from files keep their primitives and vertex attributes in an arena
+// that is released at once with the scene. A scene can be moved but not copied.
 class Scene {
 public:
-    Scene(std::vector<Object> objects, std::vector<SphereObject> sph_objects,
-          std::vector<Light> lights, std::unordered_map<std::string, Material>&& mats)
-        : objects_(objects),
-          sph_objects_(sph_objects),
-          lights_(lights),
-          materials_(std::move(mats)) {
+    // The primitives may refer to the vertex attributes of another scene, which
+    // then has to outlive this one.
+    Scene(PrimitiveSet primitives, std::vector<Light> lights,
+          std::unordered_map<std::string, Material>&& mats,
+          std::unique_ptr<Arena> arena = nullptr, SceneLod lod = {})
+        : arena_(std::move(arena)),
+          primitives_(std::move(primitives)),
+          lod_(std::move(lod)),
+          lights_(std::move(lights)),
+          materials_(std::move(mats)),
+          features_(DetectFeatures(primitives_)),
+          auto_accelerator_(SelectAccelerator(GetAcceleratorStats(primitives_))) {
+    }
+
+    // The accelerators of other refer to its primitives, so they are built again.
+    Scene(Scene&& other)
+        : arena_(std::move(other.arena_)),
+          primitives_(std::move(other.primitives_)),
+          lod_(std::move(other.lod_)),
+          lights_(std::move(other.lights_)),
+          materials_(std::move(other.materials_)),
+          features_(other.features_),
+          auto_accelerator_(other.auto_accelerator_) {
     }
+    // The blocks of the target would outlive its arena.
+    Scene& operator=(Scene&&) = delete;
 
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    const PrimitiveSet& GetPrimitives() const {
+        return primitives_;
     }
-    const std::vector<SphereObject>& GetSphereObjects() const {
-        return sph_objects_;
+    const std::pmr::vector<Object>& GetObjects() const {
+        return primitives_.Block<PrimitiveType::kTriangle>();
+    }
+    const std::pmr::vector<SphereObject>& GetSphereObjects() const {
+        return primitives_.Block<PrimitiveType::kSphere>();
     }
     const std::vector<Light>& GetLights() const {
         return lights_;
     }
+    // Not while the scene is being rendered.
+    void SetLights(std::vector<Light> lights) {
+        lights_ = std::move(lights);
+    }
     const std::unordered_map<std::string, Material>& GetMaterials() const {
         return materials_;
     }
 
+    // What the scene lets the ray kernels leave out, whatever the render options.
+    const KernelFeatures& GetKernelFeatures() const {
+        return features_;
+    }
+
+    // The accelerator of type, kAuto for the one chosen from the scene statistics.
+    // Built on first use; safe to call from several threads.
+    const Accelerator& GetAccelerator(AcceleratorType type = AcceleratorType::kAuto) const {
+        if (type == AcceleratorType::kAuto) {
+            type = auto_accelerator_;
+        }
+        std::lock_guard lock(accelerator_mutex_);
+        auto& accelerator = accelerators_[static_cast<size_t>(type)];
+        if (!accelerator) {
+            accelerator = MakeAccelerator(type, primitives_);
+        }
+        return *accelerator;
+    }
+
+    const SceneLod& GetLod() const {
+        return lod_;
+    }
+
+    // Coarsest level of every mesh whose error stays within pixel_error pixels
+    // from eye, for pixels pixel_spread wide at distance 1; full detail for
+    // meshes around eye, and for all of them when pixel_error is 0.
+    std::vector<int> SelectLod(const Vector& eye, double pixel_spread, double pixel_error) const {
+        std::vector<int> levels(lod_.meshes.size(), 0);
+        if (pixel_error <= 0) {
+            return levels;
+        }
+        for (size_t i = 0; i < levels.size(); ++i) {
+            const auto& mesh = lod_.meshes[i];
+            Vector center = (mesh.min + mesh.max).MultiplyOnScalar(.5);
+            double distance = Length(eye - center) - Length(mesh.max - mesh.min) / 2;
+            if (distance <= 0) {
+                continue;
+            }
+            double allowed = pixel_error * pixel_spread * distance;
+            while (levels[i] + 1 < static_cast<int>(mesh.levels.size()) &&
+                   mesh.levels[levels[i] + 1].error <= allowed) {
+                ++levels[i];
+            }
+        }
+        return levels;
+    }
+
+    // The primitives of the scene with every mesh at its level. They refer to the
+    // vertex attributes of the scene.
+    PrimitiveSet GetLodPrimitives(const std::vector<int>& levels) const {
+        std::vector<std::pair<size_t, size_t>> replaced;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (levels[i] > 0) {
+                const auto& full = lod_.meshes[i].levels[0];
+                replaced.emplace_back(full.begin, full.end);
+            }
+        }
+        std::sort(replaced.begin(), replaced.end());
+        PrimitiveSet result;
+        primitives_.ForEachBlock([&](auto type, const auto& block) {
+            auto& target = result.Block<decltype(type)::value>();
+            if constexpr (IsTriangle(decltype(type)::value)) {
+                if (block.empty()) {
+                    return;
+                }
+                size_t next = 0;
+                for (auto [begin, end] : replaced) {
+                    target.insert(target.end(), block.begin() + next, block.begin() + begin);
+                    next = end;
+                }
+                target.insert(target.end(), block.begin() + next, block.end());
+                const auto& simplified = lod_.primitives.Block<decltype(type)::value>();
+                for (size_t i = 0; i < levels.size(); ++i) {
+                    if (levels[i] > 0) {
+                        const auto& level = lod_.meshes[i].levels[levels[i]];
+                        target.insert(target.end(), simplified.begin() + level.begin,
+                                      simplified.begin() + level.end);
+                    }
+                }
+            } else {
+                target.assign(block.begin(), block.end());
+            }
+        });
+        return result;
+    }
+
+    // Accelerator of type over GetLodPrimitives(levels); the one of GetAccelerator
+    // at full detail. The last few used are kept for the next frames. Built
+    // without the lock, so threads asking for other views do not wait.
+    std::shared_ptr<const Accelerator> GetLodAccelerator(AcceleratorType type,
+                                                         const std::vector<int>& levels) const {
+        if (std::all_of(levels.begin(), levels.end(), [](int level) { return level == 0; })) {
+            return std::shared_ptr<const Accelerator>(std::shared_ptr<void>(), &GetAccelerator(type));
+        }
+        if (type == AcceleratorType::kAuto) {
+            type = auto_accelerator_;
+        }
+        // Moves a cached view to the front and returns it.
+        auto find = [&]() -> std::shared_ptr<LodView> {
+            auto it = std::find_if(lod_views_.begin(), lod_views_.end(), [&](const auto& view) {
+                return view->type == type && view->levels == levels;
+            });
+            if (it == lod_views_.end()) {
+                return nullptr;
+            }
+            std::rotate(lod_views_.begin(), it, it + 1);
+            return lod_views_.front();
+        };
+        {
+            std::lock_guard lock(accelerator_mutex_);
+            if (auto view = find()) {
+                return std::shared_ptr<const Accelerator>(view, view->accelerator.get());
+            }
+        }
+        auto view = std::make_shared<LodView>(type, levels, GetLodPrimitives(levels));
+        view->accelerator = MakeAccelerator(type, view->primitives);
+        std::lock_guard lock(accelerator_mutex_);
+        // Another thread may have built the same view meanwhile.
+        if (auto cached = find()) {
+            return std::shared_ptr<const Accelerator>(cached, cached->accelerator.get());
+        }
+        lod_views_.insert(lod_views_.begin(), view);
+        if (lod_views_.size() > kLodViews) {
+            lod_views_.pop_back();
+        }
+        return std::shared_ptr<const Accelerator>(view, view->accelerator.get());
+    }
+
+    LodStats GetLodStats(const std::vector<int>& levels) const {
+        LodStats stats;
+        stats.triangles_loaded = CountTriangles(primitives_);
+        stats.triangles_traced = stats.triangles_loaded;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            const auto& full = lod_.meshes[i].levels[0];
+            const auto& level = lod_.meshes[i].levels[levels[i]];
+            stats.triangles_traced += (level.end - level.begin) - (full.end - full.begin);
+        }
+        return stats;
+    }
+
+    SceneFootprint MemoryFootprint() const {
+        SceneFootprint footprint;
+        primitives_.ForEachBlock([&](auto type, const auto& block) {
+            size_t bytes = block.capacity() * sizeof(*block.data());
+            if constexpr (decltype(type)::value == PrimitiveType::kTriangle) {
+                footprint.triangles += bytes;
+                for (const auto& obj : block) {
+                    footprint.normals += obj.normals.size_bytes();
+                    footprint.texcoords += obj.texcoords.size_bytes();
+                }
+            } else if constexpr (decltype(type)::value == PrimitiveType::kQuantizedTriangle) {
+                footprint.triangles += bytes;
+                const Vector* origin = nullptr;
+                for (const auto& obj : block) {
+                    if (obj.polygon.Origin() != origin) {
+                        origin = obj.polygon.Origin();
+                        footprint.triangles += sizeof(Vector);
+                    }
+                    footprint.texcoords += obj.texcoords ? 3 * sizeof(TexCoord) : 0;
+                }
+            } else if constexpr (IsTriangle(decltype(type)::value)) {
+                footprint.triangles += bytes;
+                for (const auto& obj : block) {
+                    footprint.texcoords += obj.texcoords ? 3 * sizeof(TexCoord) : 0;
+                }
+            } else if constexpr (decltype(type)::value == PrimitiveType::kSphere) {
+                footprint.spheres += bytes;
+            } else {
+                footprint.analytic += bytes;
+            }
+        });
+        footprint.lights = lights_.capacity() * sizeof(Light);
+        footprint.materials = materials_.bucket_count() * sizeof(void*);
+        for (const auto& [name, material] : materials_) {
+            // A node holds the key, the material and the link to the next node.
+            footprint.materials += sizeof(std::string) + sizeof(Material) + sizeof(void*) +
+                                   name.capacity() + material.name.capacity();
+        }
+        if (arena_) {
+            footprint.arena_slack = arena_->BytesReserved() - arena_->BytesUsed();
+        }
+        lod_.primitives.ForEachBlock([&](auto type, const auto& block) {
+            footprint.lod += block.capacity() * sizeof(*block.data());
+            if constexpr (decltype(type)::value == PrimitiveType::kTriangle) {
+                for (const auto& obj : block) {
+                    footprint.lod += obj.normals.size_bytes() + obj.texcoords.size_bytes();
+                }
+            }
+        });
+        std::lock_guard lock(accelerator_mutex_);
+        for (const auto& accelerator : accelerators_) {
+            footprint.accelerators += accelerator ? accelerator->MemoryBytes() : 0;
+        }
+        for (const auto& view : lod_views_) {
+            view->primitives.ForEachBlock([&](auto, const auto& block) {
+                footprint.lod += block.capacity() * sizeof(*block.data());
+            });
+            footprint.accelerators += view->accelerator->MemoryBytes();
+        }
+        return footprint;
+    }
+
+private:
+    static constexpr size_t kLodViews = 4;
+
+    struct LodView {
+        LodView(AcceleratorType type, std::vector<int> levels, PrimitiveSet primitives)
+            : type(type), levels(std::move(levels)), primitives(std::move(primitives)) {
+        }
+
+        AcceleratorType type;
+        std::vector<int> levels;
+        PrimitiveSet primitives;
+        std::unique_ptr<Accelerator> accelerator;
+    };
+
+    static KernelFeatures DetectFeatures(const PrimitiveSet& primitives) {
+        KernelFeatures features{.triangles_only = true,
+                                .flat_normals = true,
+                                .no_reflection = true,
+                                .no_refraction = true};
+        primitives.ForEachBlock([&](auto type, const auto& block) {
+            for (const auto& obj : block) {
+                features.no_reflection &= obj.material->albedo[1] == 0;
+                features.no_refraction &= obj.material->albedo[2] == 0;
+                if constexpr (decltype(type)::value == PrimitiveType::kTriangle) {
+                    features.flat_normals &= obj.normals.empty();
+                } else if constexpr (IsTriangle(decltype(type)::value)) {
+                    features.flat_normals &= !obj.HasNormals();
+                } else {
+                    features.triangles_only = false;
+                }
+            }
+        });
+        return features;
+    }
+
 private:
-    std::vector<Object> objects_;
-    std::vector<SphereObject> sph_objects_;
+    // Declared first to be destroyed last.
+    std::unique_ptr<Arena> arena_;
+    PrimitiveSet primitives_;
+    SceneLod lod_;
     std::vector<Light> lights_;
     std::unordered_map<std::string, Material> materials_;
+    KernelFeatures features_;
+    AcceleratorType auto_accelerator_;
+    mutable std::mutex accelerator_mutex_;
+    mutable std::array<std::unique_ptr<Accelerator>, 5> accelerators_;
+    mutable std::vector<std::shared_ptr<LodView>> lod_views_;
 };
 
 std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::path& path) {
@@ -80,6 +442,14 @@ std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::p
                     file >> mat.refraction_index;
                 } else if (line == "al") {
                     file >> mat.albedo[0] >> mat.albedo[1] >> mat.albedo[2];
+                } else if (line == "map_Kd") {
+                    // Options before the file name are ignored.
+                    std::getline(file, line);
+                    std::istringstream words(line);
+                    std::string name;
+                    while (words >> name) {
+                    }
+                    mat.diffuse_map = GetTextureCache().Register(path.parent_path() / name);
                 }
                 file >> line;
             }
@@ -117,43 +487,111 @@ std::vector<std::string> SplitString(std::string s, std::string del) {
     return res;
 }
 
-std::vector<int> GetVertex(std::string s) {
-    size_t found = s.find("//");
-    std::vector<int> ans;
-    if (found != std::string::npos) {
-        std::vector<std::string> result = SplitString(StripString(s), "//");
-        for (auto x : result) {
-            if (!x.empty()) {
-                ans.push_back(std::stoi(x));
-            }
+// Indices of the position, texture coordinates and normal of a face vertex
+// "v", "v/vt", "v//vn" or "v/vt/vn", 0 for the ones it leaves out.
+std::array<int, 3> GetVertex(std::string s) {
+    std::array<int, 3> ans = {0, 0, 0};
+    std::vector<std::string> result = SplitString(StripString(s), "/");
+    for (size_t i = 0; i < std::min(result.size(), ans.size()); ++i) {
+        if (!result[i].empty()) {
+            ans[i] = std::stoi(result[i]);
         }
-    } else {
-        std::vector<std::string> result = SplitString(StripString(s), "/");
-        for (auto x : result) {
-            if (!x.empty()) {
-                ans.push_back(std::stoi(x));
+    }
+    return ans;
+}
+
+// Zero-based index of a 1-based or negative, relative OBJ index into count
+// elements, -1 for 0.
+int ResolveIndex(int index, size_t count) {
+    if (index < 0) {
+        return index + static_cast<int>(count);
+    }
+    return index - 1;
+}
+
+// Moves the packed triangles of primitives to the quantized block, chunk by
+// chunk, with the chunk origins allocated from arena.
+void QuantizeTriangles(PrimitiveSet* primitives, Arena* arena) {
+    auto& packed = primitives->Block<PrimitiveType::kPackedTriangle>();
+    for (size_t begin = 0; begin < packed.size(); begin += kQuantizationChunk) {
+        size_t end = std::min(packed.size(), begin + kQuantizationChunk);
+        Vector min(INFINITY, INFINITY, INFINITY);
+        Vector max(-INFINITY, -INFINITY, -INFINITY);
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t k = 0; k < 3; ++k) {
+                for (size_t j = 0; j < 3; ++j) {
+                    min[j] = std::min(min[j], packed[i].polygon[k][j]);
+                    max[j] = std::max(max[j], packed[i].polygon[k][j]);
+                }
             }
         }
+        Vector* origin = arena->Allocate<Vector>(1);
+        new (origin) Vector((min + max).MultiplyOnScalar(.5));
+        for (size_t i = begin; i < end; ++i) {
+            primitives->Add(QuantizedTriangleObject{packed[i].material,
+                                                    QuantizedTriangle(packed[i].polygon, origin),
+                                                    packed[i].normals, packed[i].texcoords});
+        }
     }
-    if (ans.size() <= 2) {
-        return ans;
-    }
-    std::swap(ans[1], ans[2]);
-    ans.pop_back();
-    return ans;
+    packed.clear();
 }
 
-Scene ReadScene(const std::filesystem::path& path) {
+Scene ReadScene(const std::filesystem::path& path, const ReadOptions& options = {}) {
     std::filesystem::path directory = path.parent_path();
     std::vector<Vector> points;
     std::vector<Vector> normals;
+    std::vector<TexCoord> texcoords;
     std::ifstream file(path);
     std::string line;
     std::unordered_map<std::string, Material> materials;
-    std::vector<Object> objects;
-    std::vector<SphereObject> sph_objects;
+    auto arena = std::make_unique<Arena>();
+    PrimitiveSet primitives;
     std::vector<Light> lights;
     std::string curr_material;
+    // Faces of the o and g groups, from their first triangle on; kept only to be
+    // simplified.
+    struct Mesh {
+        size_t begin = 0;
+        std::vector<MeshFace> faces;
+    };
+    std::vector<Mesh> meshes(1);
+    auto add_triangle = [&](const MeshFace& face, PrimitiveSet* target) {
+        const auto& [a, b, c] = face.vertices;
+        const Material* material = face.material;
+        Triangle polygon(points[a.position], points[b.position], points[c.position]);
+        const TexCoord* vertex_texcoords = nullptr;
+        if (a.texcoord != -1 && b.texcoord != -1 && c.texcoord != -1) {
+            std::array<TexCoord, 3> values = {texcoords[a.texcoord], texcoords[b.texcoord],
+                                              texcoords[c.texcoord]};
+            TexCoord* data = arena->Allocate<TexCoord>(values.size());
+            std::uninitialized_copy(values.begin(), values.end(), data);
+            vertex_texcoords = data;
+        }
+        bool has_normals = a.normal != -1 && b.normal != -1 && c.normal != -1;
+        if (options.vertex_format != VertexFormat::kFull) {
+            PackedTriangleObject obj{material, polygon};
+            if (has_normals) {
+                obj.normals = {EncodeOctahedral(normals[a.normal]),
+                               EncodeOctahedral(normals[b.normal]),
+                               EncodeOctahedral(normals[c.normal])};
+            }
+            obj.texcoords = vertex_texcoords;
+            target->Add(obj);
+            return;
+        }
+        std::span<const Vector> vertex_normals;
+        if (has_normals) {
+            std::array<Vector, 3> values = {normals[a.normal], normals[b.normal], normals[c.normal]};
+            Vector* data = arena->Allocate<Vector>(values.size());
+            std::uninitialized_copy(values.begin(), values.end(), data);
+            vertex_normals = std::span<const Vector>(data, values.size());
+        }
+        std::span<const TexCoord> texcoord_span;
+        if (vertex_texcoords) {
+            texcoord_span = std::span<const TexCoord>(vertex_texcoords, 3);
+        }
+        target->Add(Object(material, polygon, vertex_normals, texcoord_span));
+    };
     while (file >> line) {
         if (line == "mtllib") {
             std::string mtl_path;
@@ -163,10 +601,22 @@ Scene ReadScene(const std::filesystem::path& path) {
             double x, y, z;
             file >> x >> y >> z;
             points.emplace_back(x, y, z);
+        } else if (line == "vt") {
+            // v and a third coordinate are optional.
+            std::getline(file, line);
+            std::istringstream coordinates(line);
+            TexCoord texcoord;
+            coordinates >> texcoord.u >> texcoord.v;
+            texcoords.push_back(texcoord);
         } else if (line == "vn") {
             double x, y, z;
             file >> x >> y >> z;
             normals.emplace_back(x, y, z);
+        } else if (line == "o" || line == "g") {
+            std::getline(file, line);
+            if (!meshes.back().faces.empty()) {
+                meshes.push_back({CountTriangles(primitives), {}});
+            }
         } else if (line == "usemtl") {
             file >> curr_material;
         } else if (line == "S") {
@@ -174,7 +624,25 @@ Scene ReadScene(const std::filesystem::path& path) {
             file >> x >> y >> z >> r;
             Sphere s(Vector(x, y, z), r);
             SphereObject sph(&materials[curr_material], s);
-            sph_objects.push_back(sph);
+            primitives.Add(sph);
+        } else if (line == "PL") {
+            Vector point, normal;
+            file >> point[0] >> point[1] >> point[2] >> normal[0] >> normal[1] >> normal[2];
+            primitives.Add(PlaneObject{&materials[curr_material], Plane(point, normal)});
+        } else if (line == "B") {
+            Vector min, max;
+            file >> min[0] >> min[1] >> min[2] >> max[0] >> max[1] >> max[2];
+            primitives.Add(BoxObject{&materials[curr_material], Box(min, max)});
+        } else if (line == "D") {
+            Vector center, normal;
+            double r;
+            file >> center[0] >> center[1] >> center[2] >> normal[0] >> normal[1] >> normal[2] >> r;
+            primitives.Add(DiscObject{&materials[curr_material], Disc(center, normal, r)});
+        } else if (line == "C") {
+            Vector bottom, top;
+            double r;
+            file >> bottom[0] >> bottom[1] >> bottom[2] >> top[0] >> top[1] >> top[2] >> r;
+            primitives.Add(CylinderObject{&materials[curr_material], Cylinder(bottom, top, r)});
         } else if (line == "P") {
             double x, y, z, r, g, b;
             file >> x >> y >> z >> r >> g >> b;
@@ -183,94 +651,58 @@ Scene ReadScene(const std::filesystem::path& path) {
         } else if (line == "f") {
             std::string s;
             std::getline(file, s);
-            std::vector<std::string> vertices = SplitString(StripString(s), " ");
-            std::string v0 = vertices[0];
-            std::string v1 = vertices[1];
-            std::string v2 = vertices[2];
-            std::vector<int> num_v0 = GetVertex(v0);
-            int ind = 0;
-            if (num_v0.size() == 2) {
-                ind = 1;
-            }
-            int v0_ind = num_v0[0];
-            if (v0_ind < 0) {
-                v0_ind = num_v0[0] + points.size();
-            } else {
-                --v0_ind;
-            }
-            std::vector<int> num_v1 = GetVertex(v1);
-            int v1_ind = num_v1[0];
-            if (v1_ind < 0) {
-                v1_ind = num_v1[0] + points.size();
-            } else {
-                --v1_ind;
-            }
-            std::vector<int> num_v2 = GetVertex(v2);
-            int v2_ind = num_v2[0];
-            if (v2_ind < 0) {
-                v2_ind = num_v2[0] + points.size();
-            } else {
-                --v2_ind;
-            }
-            int v0_n, v1_n, v2_n;
-            if (ind) {
-                v0_n = num_v0[1];
-                if (v0_n < 0) {
-                    v0_n = num_v0[1] + normals.size();
-                } else {
-                    --v0_n;
+            // A fan of triangles around the first vertex.
+            std::vector<FaceVertex> face;
+            for (const auto& vertex : SplitString(StripString(s), " ")) {
+                if (vertex.empty()) {
+                    continue;
                 }
-                v1_n = num_v1[1];
-                if (v1_n < 0) {
-                    v1_n = num_v1[1] + normals.size();
-                } else {
-                    --v1_n;
-                }
-                v2_n = num_v2[1];
-                if (v2_n < 0) {
-                    v2_n = num_v2[1] + normals.size();
-                } else {
-                    --v2_n;
-                }
-                std::vector<Vector> nrmls = {normals[v0_n], normals[v1_n], normals[v2_n]};
-                objects.push_back(Object(&materials[curr_material],
-                                         Triangle(points[v0_ind], points[v1_ind], points[v2_ind]),
-                                         nrmls));
-            } else {
-                objects.push_back(Object(&materials[curr_material],
-                                         Triangle(points[v0_ind], points[v1_ind], points[v2_ind]),
-                                         {}));
+                auto [position, texcoord, normal] = GetVertex(vertex);
+                face.push_back({ResolveIndex(position, points.size()),
+                                ResolveIndex(texcoord, texcoords.size()),
+                                ResolveIndex(normal, normals.size())});
             }
-            for (size_t i = 3; i < vertices.size(); ++i) {
-                v1 = v2;
-                v1_ind = v2_ind;
-                v2 = vertices[i];
-                num_v2 = GetVertex(v2);
-                v2_ind = num_v2[0];
-                if (v2_ind < 0) {
-                    v2_ind = num_v2[0] + points.size();
-                } else {
-                    --v2_ind;
+            for (size_t i = 2; i < face.size(); ++i) {
+                MeshFace triangle{{face[0], face[i - 1], face[i]}, &materials[curr_material]};
+                add_triangle(triangle, &primitives);
+                if (options.lod.levels > 0) {
+                    meshes.back().faces.push_back(triangle);
                 }
-                if (ind) {
-                    v1_n = v2_n;
-                    v2_n = num_v2[1];
-                    if (v2_n < 0) {
-                        v2_n = num_v2[1] + normals.size();
-                    } else {
-                        --v2_n;
-                    }
-                    std::vector<Vector> nrmls = {normals[v0_n], normals[v1_n], normals[v2_n]};
-                    objects.push_back(
-                        Object(&materials[curr_material],
-                               Triangle(points[v0_ind], points[v1_ind], points[v2_ind]), nrmls));
-                } else {
-                    objects.push_back(
-                        Object(&materials[curr_material],
-                               Triangle(points[v0_ind], points[v1_ind], points[v2_ind]), {}));
+            }
+        }
+    }
+    SceneLod lod;
+    for (const auto& mesh : meshes) {
+        if (options.lod.levels <= 0 || mesh.faces.size() < options.lod.min_triangles) {
+            continue;
+        }
+        MeshLod entry{Vector(INFINITY, INFINITY, INFINITY), Vector(-INFINITY, -INFINITY, -INFINITY),
+                      {{mesh.begin, mesh.begin + mesh.faces.size(), 0}}};
+        for (const auto& face : mesh.faces) {
+            for (const auto& vertex : face.vertices) {
+                for (int j = 0; j < 3; ++j) {
+                    entry.min[j] = std::min(entry.min[j], points[vertex.position][j]);
+                    entry.max[j] = std::max(entry.max[j], points[vertex.position][j]);
                 }
             }
         }
+        for (const auto& level : SimplifyMesh(&points, mesh.faces, options.lod)) {
+            size_t begin = CountTriangles(lod.primitives);
+            for (const auto& face : level.faces) {
+                add_triangle(face, &lod.primitives);
+            }
+            entry.levels.push_back({begin, CountTriangles(lod.primitives), level.error});
+        }
+        if (entry.levels.size() > 1) {
+            lod.meshes.push_back(std::move(entry));
+        }
+    }
+    if (options.vertex_format == VertexFormat::kQuantized) {
+        QuantizeTriangles(&primitives, arena.get());
+        QuantizeTriangles(&lod.primitives, arena.get());
     }
-    return Scene(objects, sph_objects, lights, std::move(materials));
+    PrimitiveSet packed(std::move(primitives), arena.get());
+    SceneLod packed_lod{std::move(lod.meshes), PrimitiveSet(std::move(lod.primitives), arena.get())};
+    return Scene(std::move(packed), std::move(lights), std::move(materials), std::move(arena),
+                 std::move(packed_lod));
 }
@@ -1,6 +1,23 @@
 #include <scene.h>
 #include <util.h>
 
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <memory_resource>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <unistd.h>
+
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
 
@@ -136,3 +153,605 @@ TEST_CASE("Scene") {
     Check(back_wall.albedo, .5, 0., 0.);
     Check(back_wall.diffuse_color, .725, .91, .88);
 }
+
+TEST_CASE("Analytic primitives") {
+    const auto scene = ReadScene(GetFileDir(__FILE__) / "shapes/scene.obj");
+    const auto& primitives = scene.GetPrimitives();
+    CHECK(primitives.Size() == 6);
+    CHECK(scene.GetObjects().empty());
+    CHECK(scene.GetSphereObjects().size() == 1);
+
+    const auto& planes = primitives.Block<PrimitiveType::kPlane>();
+    REQUIRE(planes.size() == 1);
+    Check(planes[0].shape.GetNormal(), 0., 1., 0.);
+
+    const auto& boxes = primitives.Block<PrimitiveType::kBox>();
+    REQUIRE(boxes.size() == 2);
+    Check(boxes[0].shape.GetMin(), -1., 0., -1.);
+    Check(boxes[1].shape.GetMax(), 3., 1., 3.);
+    CHECK(boxes[1].material == boxes[0].material);
+
+    const auto& discs = primitives.Block<PrimitiveType::kDisc>();
+    REQUIRE(discs.size() == 1);
+    Check(discs[0].shape.GetCenter(), 0., 1., 0.);
+    Check(discs[0].shape.GetNormal(), 0., 0., -1.);
+    CHECK_THAT(discs[0].shape.GetRadius(), WithinAbs(.5));
+
+    const auto& cylinders = primitives.Block<PrimitiveType::kCylinder>();
+    REQUIRE(cylinders.size() == 1);
+    Check(cylinders[0].shape.GetTop(), 0., 1., 0.);
+    CHECK_THAT(cylinders[0].shape.GetRadius(), WithinAbs(.25));
+    CHECK(primitives.GetMaterial(PrimitiveType::kCylinder, 0) ==
+          primitives.GetMaterial(PrimitiveType::kSphere, 0));
+}
+
+TEST_CASE("Arena") {
+    Arena arena;
+    CHECK(arena.BytesReserved() == 0);
+    auto* bytes = arena.Allocate<char>(3);
+    auto* values = arena.Allocate<double>(4);
+    CHECK(reinterpret_cast<uintptr_t>(bytes) % Arena::kBlockSize == 0);
+    CHECK(reinterpret_cast<uintptr_t>(values) % alignof(double) == 0);
+    CHECK(reinterpret_cast<char*>(values) - bytes == 8);
+    CHECK(arena.BytesUsed() == 3 + 4 * sizeof(double));
+    CHECK(arena.BytesReserved() == Arena::kBlockSize);
+
+    auto* large = arena.Allocate<char>(Arena::kBlockSize + 1);
+    CHECK(reinterpret_cast<uintptr_t>(large) % Arena::kBlockSize == 0);
+    CHECK(arena.BytesReserved() == 3 * Arena::kBlockSize);
+
+    std::pmr::vector<int> vector(&arena);
+    vector.assign(100, 7);
+    CHECK(arena.BytesUsed() >= 3 + 4 * sizeof(double) + Arena::kBlockSize + 1 + 100 * sizeof(int));
+}
+
+TEST_CASE("Memory footprint") {
+    auto scene = ReadScene(GetFileDir(__FILE__) / "box/cube.obj");
+    auto footprint = scene.MemoryFootprint();
+    CHECK(footprint.triangles == 10 * sizeof(Object));
+    CHECK(footprint.spheres == 2 * sizeof(SphereObject));
+    CHECK(footprint.analytic == 0);
+    CHECK(footprint.normals == 10 * 3 * sizeof(Vector));
+    CHECK(footprint.lights == 2 * sizeof(Light));
+    CHECK(footprint.materials > 9 * sizeof(Material));
+    CHECK(footprint.Total() >= Arena::kBlockSize);
+
+    const Vector* normal = scene.GetObjects()[6].GetNormal(2);
+    Scene moved(std::move(scene));
+    CHECK(moved.GetObjects()[6].GetNormal(2) == normal);
+    Check(*normal, -1., 0., 0.);
+    CHECK(moved.MemoryFootprint().Total() == footprint.Total());
+}
+
+TEST_CASE("Compact vertex attributes") {
+    const auto path = GetFileDir(__FILE__) / "box/cube.obj";
+    const auto full = ReadScene(path);
+    const auto compact = ReadScene(path, {VertexFormat::kCompact});
+    const auto quantized = ReadScene(path, {VertexFormat::kQuantized});
+    CHECK(compact.GetObjects().empty());
+    CHECK(quantized.GetObjects().empty());
+    const auto& packed = compact.GetPrimitives().Block<PrimitiveType::kPackedTriangle>();
+    const auto& floats = quantized.GetPrimitives().Block<PrimitiveType::kQuantizedTriangle>();
+    REQUIRE(packed.size() == full.GetObjects().size());
+    REQUIRE(floats.size() == full.GetObjects().size());
+    for (size_t i = 0; i < packed.size(); ++i) {
+        const auto& obj = full.GetObjects()[i];
+        auto polygon = GetShape(floats[i]);
+        CHECK(packed[i].material->name == obj.material->name);
+        CHECK(floats[i].material->name == obj.material->name);
+        CHECK(floats[i].polygon.Origin() == floats[0].polygon.Origin());
+        for (size_t k = 0; k < 3; ++k) {
+            Vector normal = *obj.GetNormal(k);
+            normal.Normalize();
+            CHECK(Length(DecodeOctahedral(packed[i].normals[k]) - normal) < 1e-4);
+            CHECK(floats[i].normals[k] == packed[i].normals[k]);
+            CHECK(Length(packed[i].polygon[k] - obj.polygon[k]) == 0);
+            CHECK(Length(polygon[k] - obj.polygon[k]) < 1e-6);
+        }
+    }
+    CHECK(compact.GetKernelFeatures() == full.GetKernelFeatures());
+    CHECK(quantized.GetKernelFeatures() == full.GetKernelFeatures());
+
+    auto footprint = full.MemoryFootprint();
+    auto compact_footprint = compact.MemoryFootprint();
+    auto quantized_footprint = quantized.MemoryFootprint();
+    CHECK(compact_footprint.normals == 0);
+    CHECK(compact_footprint.triangles == 10 * sizeof(PackedTriangleObject));
+    CHECK(quantized_footprint.triangles == 10 * sizeof(QuantizedTriangleObject) + sizeof(Vector));
+    CHECK(quantized_footprint.triangles < compact_footprint.triangles);
+    CHECK(compact_footprint.triangles < footprint.triangles + footprint.normals);
+}
+
+namespace {
+
+// Every backend has to give the hits of brute force, for rays from inside and
+// outside the scene, one by one and in batches.
+void CheckAccelerators(const PrimitiveSet& primitives, double scale) {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> coord(-scale, scale);
+    BruteForce brute_force(primitives);
+    std::vector<Ray> rays;
+    for (int i = 0; i < 2000; ++i) {
+        Vector dir(coord(rng), coord(rng), coord(rng));
+        dir.Normalize();
+        rays.emplace_back(Vector(coord(rng), coord(rng), coord(rng)), dir);
+    }
+    // Rays along the axes hit the sides of the cells and nodes edge-on.
+    rays.emplace_back(Vector(0, .5, 4 * scale), Vector(0, 0, -1));
+    rays.emplace_back(Vector(-4 * scale, .5, 0), Vector(1, 0, 0));
+    // Bundles of close rays from one origin, which the batches trace as packets.
+    std::uniform_real_distribution<double> jitter(-.05, .05);
+    for (int bundle = 0; bundle < 100; ++bundle) {
+        Vector origin(coord(rng), coord(rng), coord(rng));
+        Vector target(coord(rng) / 4, coord(rng) / 4, coord(rng) / 4);
+        for (int i = 0; i < 8; ++i) {
+            Vector dir = target - origin;
+            dir.Normalize();
+            dir = dir + Vector(jitter(rng), jitter(rng), jitter(rng));
+            dir.Normalize();
+            rays.emplace_back(origin, dir);
+        }
+    }
+    std::vector<double> max_distances;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        max_distances.push_back(i % 3 == 0 ? INFINITY : std::abs(coord(rng)));
+    }
+    for (auto type : {AcceleratorType::kGrid, AcceleratorType::kKdTree, AcceleratorType::kBvh}) {
+        auto accelerator = MakeAccelerator(type, primitives);
+        CHECK(accelerator->GetType() == type);
+        std::vector<Hit> hits(rays.size());
+        accelerator->ClosestHits(rays, hits);
+        for (size_t i = 0; i < rays.size(); ++i) {
+            Hit expected = brute_force.ClosestHit(rays[i]);
+            REQUIRE(hits[i].IsValid() == expected.IsValid());
+            if (expected.IsValid()) {
+                CHECK(hits[i].type == expected.type);
+                CHECK(hits[i].index == expected.index);
+                CHECK(hits[i].params.t == expected.params.t);
+            }
+            for (double distance : {.1 * scale, scale, double{INFINITY}}) {
+                CHECK(accelerator->AnyHit(rays[i], distance) ==
+                      brute_force.AnyHit(rays[i], distance));
+            }
+        }
+        std::unique_ptr<bool[]> any_hits(new bool[rays.size()]);
+        accelerator->AnyHits(rays, max_distances, {any_hits.get(), rays.size()});
+        for (size_t i = 0; i < rays.size(); ++i) {
+            CHECK(any_hits[i] == brute_force.AnyHit(rays[i], max_distances[i]));
+        }
+    }
+    if (HasOnlyTriangles(primitives)) {
+        BruteForce<KernelFeatures{.triangles_only = true}> triangles(primitives);
+        for (const auto& ray : rays) {
+            Hit hit = triangles.ClosestHit(ray);
+            Hit expected = brute_force.ClosestHit(ray);
+            REQUIRE(hit.IsValid() == expected.IsValid());
+            CHECK(hit.index == expected.index);
+            CHECK(triangles.AnyHit(ray, scale) == brute_force.AnyHit(ray, scale));
+        }
+    }
+}
+
+}  // namespace
+
+TEST_CASE("Accelerators") {
+    const auto current_dir = GetFileDir(__FILE__);
+    CheckAccelerators(ReadScene(current_dir / "box/cube.obj").GetPrimitives(), 2);
+    CheckAccelerators(ReadScene(current_dir / "shapes/scene.obj").GetPrimitives(), 3);
+
+    Material material;
+    PrimitiveSet soup;
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> coord(-5, 5);
+    std::uniform_real_distribution<double> offset(-.3, .3);
+    for (int i = 0; i < 3000; ++i) {
+        Vector a(coord(rng), coord(rng), coord(rng));
+        Vector b = a + Vector(offset(rng), offset(rng), offset(rng));
+        Vector c = a + Vector(offset(rng), offset(rng), offset(rng));
+        soup.Add(Object{&material, Triangle(a, b, c), {}});
+    }
+    CheckAccelerators(soup, 6);
+    soup.Add(SphereObject{&material, Sphere({0, 0, 0}, 1)});
+    soup.Add(PlaneObject{&material, Plane({0, -4, 0}, {0, 1, 0})});
+    CheckAccelerators(soup, 6);
+
+    AcceleratorStats stats = GetAcceleratorStats(soup);
+    CHECK(stats.bounded == 3001);
+    CHECK(stats.triangles == 3000);
+    CHECK(stats.occupancy > .5);
+    CHECK(SelectAccelerator(stats) == AcceleratorType::kGrid);
+    stats.occupancy = .1;
+    CHECK(SelectAccelerator(stats) == AcceleratorType::kBvh);
+    stats.axis_aligned_triangles = stats.bounded;
+    CHECK(SelectAccelerator(stats) == AcceleratorType::kKdTree);
+    CHECK(SelectAccelerator({.bounded = 12, .triangles = 12}) == AcceleratorType::kBruteForce);
+    CHECK(SelectAccelerator({.bounded = 5, .analytic = 4, .occupancy = 1}) ==
+          AcceleratorType::kBvh);
+
+    auto scene = ReadScene(current_dir / "box/cube.obj");
+    CHECK(scene.GetAccelerator().GetType() == AcceleratorType::kBruteForce);
+    const Accelerator& bvh = scene.GetAccelerator(AcceleratorType::kBvh);
+    CHECK(&scene.GetAccelerator(AcceleratorType::kBvh) == &bvh);
+    CHECK(scene.MemoryFootprint().accelerators == bvh.MemoryBytes());
+}
+
+namespace {
+
+// Directory of a test under the temp directory, named after the process so that
+// runs do not share it, and removed with its files when the test ends.
+class TempDirectory {
+public:
+    explicit TempDirectory(const std::string& name) {
+        static std::atomic<int> count = 0;
+        path_ = std::filesystem::temp_directory_path() /
+                (name + "_" + std::to_string(getpid()) + "_" + std::to_string(count++));
+        std::filesystem::create_directories(path_);
+    }
+
+    ~TempDirectory() {
+        std::error_code error;
+        std::filesystem::remove_all(path_, error);
+    }
+
+    TempDirectory(const TempDirectory&) = delete;
+    TempDirectory& operator=(const TempDirectory&) = delete;
+
+    std::filesystem::path operator/(const std::filesystem::path& name) const {
+        return path_ / name;
+    }
+
+private:
+    std::filesystem::path path_;
+};
+
+using Texel = std::array<uint8_t, 3>;
+
+void WriteTexture(const std::filesystem::path& path, int width, int height,
+                  const std::function<Texel(int, int)>& texel) {
+    std::vector<uint8_t> data;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            Texel value = texel(x, y);
+            data.insert(data.end(), value.begin(), value.end());
+        }
+    }
+    png_image image{};
+    image.version = PNG_IMAGE_VERSION;
+    image.width = width;
+    image.height = height;
+    image.format = PNG_FORMAT_RGB;
+    REQUIRE(png_image_write_to_file(&image, path.c_str(), 0, data.data(), 0, nullptr));
+}
+
+Texel Pattern(int x, int y) {
+    return {static_cast<uint8_t>(x * 7 + y * 13), static_cast<uint8_t>(x), static_cast<uint8_t>(y)};
+}
+
+}  // namespace
+
+TEST_CASE("Texture cache") {
+    const TempDirectory dir("raytracer_texture_cache");
+    WriteTexture(dir / "pattern.png", 200, 100, Pattern);
+    const auto& linear = GetTexelTable();
+
+    TextureCache cache(size_t{1} << 20);
+    TextureHandle handle = cache.Register(dir / "pattern.png");
+    CHECK(cache.Register(dir / "." / "pattern.png") == handle);
+    CHECK(cache.GetStats().textures_prepared == 0);
+    std::vector<std::pair<int, int>> sizes = {{200, 100}, {100, 50}, {50, 25}, {25, 12},
+                                              {12, 6},    {6, 3},    {3, 1},   {1, 1}};
+    CHECK(cache.GetLevelSizes(handle) == sizes);
+    CHECK(cache.GetStats().textures_prepared == 1);
+
+    for (int y = 0; y < 100; ++y) {
+        for (int x = 0; x < 200; ++x) {
+            Texel texel = Pattern(x, y);
+            Check(cache.GetTexel(handle, 0, x, y), linear[texel[0]], linear[texel[1]],
+                  linear[texel[2]]);
+        }
+    }
+    // Texel centers, repeated.
+    for (auto [x, y] : {std::pair{0, 0}, {199, 99}, {64, 37}, {130, 70}}) {
+        double u = (x + .5) / 200;
+        double v = 1 - (y + .5) / 100;
+        Vector texel = cache.GetTexel(handle, 0, x, y);
+        CHECK(Length(cache.Sample(handle, u, v, 0) - texel) < 1e-12);
+        CHECK(Length(cache.Sample(handle, u + 2, v - 1, 0) - texel) < 1e-9);
+    }
+    // The last level is the mean of the image, up to rounding on every level.
+    Vector mean;
+    for (int y = 0; y < 100; ++y) {
+        for (int x = 0; x < 200; ++x) {
+            mean = mean + cache.GetTexel(handle, 0, x, y).MultiplyOnScalar(1. / 20000);
+        }
+    }
+    CHECK(Length(cache.Sample(handle, .3, .6, 1e3) - mean) < .02);
+    CHECK(Length(cache.Sample(handle, .3, .6, 1e3) - cache.GetTexel(handle, 7, 0, 0)) < 1e-12);
+
+    TextureCacheStats stats = cache.GetStats();
+    CHECK(stats.lookups == stats.thread_hits + stats.shared_hits + stats.misses);
+    CHECK(stats.HitRate() > .99);
+    CHECK(stats.evictions == 0);
+    // The 8 tiles of the image and the one of the last level.
+    CHECK(stats.misses == 9);
+    CHECK(stats.resident_bytes == 9 * TextureCache::kTileBytes);
+
+    cache.SetBudget(3 * TextureCache::kTileBytes);
+    CHECK(cache.GetStats().resident_bytes == 3 * TextureCache::kTileBytes);
+    CHECK(cache.GetStats().evictions == 6);
+
+    // A rewritten file gets a new handle; the old one keeps its tiles.
+    WriteTexture(dir / "pattern.png", 100, 100, Pattern);
+    TextureHandle rewritten = cache.Register(dir / "pattern.png");
+    CHECK(rewritten != handle);
+    cache.Prepare(rewritten);
+    CHECK(cache.GetStats().textures_prepared == 2);
+    CHECK(cache.GetLevelSizes(rewritten)[0] == std::pair{100, 100});
+    CHECK(cache.GetLevelSizes(handle)[0] == std::pair{200, 100});
+
+    CHECK_THROWS(cache.Sample(cache.Register(dir / "missing.png"), .5, .5, 0));
+    CHECK_THROWS(cache.Sample(12345, .5, .5, 0));
+}
+
+TEST_CASE("Texture cache budget") {
+    const TempDirectory dir("raytracer_texture_cache");
+    WriteTexture(dir / "large.png", 512, 512, Pattern);
+
+    // Threads sample random points through room for 4 tiles, and get what a cache
+    // with room for all gives.
+    constexpr int kThreads = 4;
+    constexpr int kSamples = 20000;
+    TextureCache reference(size_t{1} << 30);
+    TextureCache cache(4 * TextureCache::kTileBytes);
+    TextureHandle handle = cache.Register(dir / "large.png");
+    TextureHandle reference_handle = reference.Register(dir / "large.png");
+    std::vector<std::vector<Vector>> colors(kThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            std::uniform_real_distribution<double> coord(-1, 2);
+            std::uniform_real_distribution<double> width(0, .01);
+            for (int i = 0; i < kSamples; ++i) {
+                double u = coord(rng);
+                double v = coord(rng);
+                colors[t].push_back(cache.Sample(handle, u, v, width(rng)));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (int t = 0; t < kThreads; ++t) {
+        std::mt19937 rng(t);
+        std::uniform_real_distribution<double> coord(-1, 2);
+        std::uniform_real_distribution<double> width(0, .01);
+        for (int i = 0; i < kSamples; ++i) {
+            double u = coord(rng);
+            double v = coord(rng);
+            REQUIRE(Length(colors[t][i] - reference.Sample(reference_handle, u, v, width(rng))) == 0);
+        }
+    }
+
+    TextureCacheStats stats = cache.GetStats();
+    CHECK(stats.textures_prepared == 1);
+    CHECK(stats.resident_bytes <= 4 * TextureCache::kTileBytes);
+    CHECK(stats.lookups == stats.thread_hits + stats.shared_hits + stats.misses);
+    CHECK(stats.evictions > 0);
+    // Threads that miss the same tile at once all count the miss.
+    CHECK(stats.misses >= stats.evictions + stats.resident_bytes / TextureCache::kTileBytes);
+    CHECK(reference.GetStats().evictions == 0);
+}
+
+TEST_CASE("Texture coordinates") {
+    const TempDirectory dir("raytracer_texture_coordinates");
+    WriteTexture(dir / "checker.png", 2, 2, [](int x, int y) {
+        uint8_t value = (x + y) % 2 ? 0 : 255;
+        return Texel{value, value, value};
+    });
+    std::ofstream(dir / "quad.mtl") << "newmtl textured\n"
+                                       "Kd 1 1 1\n"
+                                       "map_Kd -s 1 1 1 checker.png\n"
+                                       "newmtl plain\n"
+                                       "Kd 1 0 0\n";
+    // A unit quad at z = 0 with texture coordinates twice its size, a triangle
+    // with normals only and one with texture coordinates only.
+    std::ofstream(dir / "quad.obj") << "mtllib quad.mtl\n"
+                                       "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                                       "vt 0 0\nvt 2 0 0\nvt 2 2\nvt 0 2\n"
+                                       "vn 0 0 1\n"
+                                       "usemtl textured\n"
+                                       "f 1/1/1 2/2/1  3/3/1 4/4/1\n"
+                                       "usemtl plain\n"
+                                       "f 1//1 2//1 3//1\n"
+                                       "f -4/-4 -3/-3 -2/-2\n";
+    for (auto format : {VertexFormat::kFull, VertexFormat::kCompact, VertexFormat::kQuantized}) {
+        auto scene = ReadScene(dir / "quad.obj", {format});
+        const Material& textured = scene.GetMaterials().at("textured");
+        CHECK(textured.diffuse_map != kNoTexture);
+        CHECK(textured.diffuse_map == GetTextureCache().Register(dir / "checker.png"));
+        CHECK(scene.GetMaterials().at("plain").diffuse_map == kNoTexture);
+
+        std::vector<std::vector<TexCoord>> texcoords;
+        std::vector<bool> has_normals;
+        scene.GetPrimitives().ForEachBlock([&](auto, const auto& block) {
+            if constexpr (requires { GetTexCoords(block[0]); }) {
+                for (const auto& obj : block) {
+                    const TexCoord* uv = GetTexCoords(obj);
+                    texcoords.push_back(uv ? std::vector<TexCoord>(uv, uv + 3)
+                                           : std::vector<TexCoord>());
+                    if constexpr (requires { obj.HasNormals(); }) {
+                        has_normals.push_back(obj.HasNormals());
+                    } else {
+                        has_normals.push_back(!obj.normals.empty());
+                    }
+                }
+            }
+        });
+        REQUIRE(texcoords.size() == 4);
+        CHECK(has_normals == std::vector<bool>{true, true, true, false});
+        REQUIRE(texcoords[1].size() == 3);
+        CHECK(texcoords[1][0].u == 0);
+        CHECK(texcoords[1][1].u == 2);
+        CHECK(texcoords[1][2].v == 2);
+        CHECK(texcoords[2].empty());
+        REQUIRE(texcoords[3].size() == 3);
+        CHECK(texcoords[3][2].u == 2);
+        CHECK(scene.MemoryFootprint().texcoords == 3 * 3 * sizeof(TexCoord));
+
+        // The plain triangles only cover the lower right half of the quad.
+        Hit hit = FindClosestHit(scene.GetAccelerator(), Ray({.25, .75, 1}, {0, 0, -1}));
+        REQUIRE(hit.IsValid());
+        CHECK(scene.GetPrimitives().GetMaterial(hit.type, hit.index) == &textured);
+        REQUIRE(hit.texcoord);
+        CHECK_THAT(hit.texcoord->u, Catch::Matchers::WithinAbs(.5, 1e-6));
+        CHECK_THAT(hit.texcoord->v, Catch::Matchers::WithinAbs(1.5, 1e-6));
+        CHECK_THAT(hit.texcoord_scale, Catch::Matchers::WithinAbs(2, 1e-6));
+    }
+}
+
+// Closed sphere around center as OBJ lines, with outward vertex normals and faces
+// given by negative indices.
+std::string SphereMesh(const Vector& center, double radius, int rings, int segments) {
+    std::vector<Vector> directions = {{0, 1, 0}, {0, -1, 0}};
+    for (int r = 1; r < rings; ++r) {
+        double theta = M_PI * r / rings;
+        for (int s = 0; s < segments; ++s) {
+            double phi = 2 * M_PI * s / segments;
+            directions.emplace_back(std::sin(theta) * std::cos(phi), std::cos(theta),
+                                    std::sin(theta) * std::sin(phi));
+        }
+    }
+    std::ostringstream out;
+    for (const auto& d : directions) {
+        Vector p = center + d.MultiplyOnScalar(radius);
+        out << "v " << p[0] << ' ' << p[1] << ' ' << p[2] << "\n";
+        out << "vn " << d[0] << ' ' << d[1] << ' ' << d[2] << "\n";
+    }
+    int count = directions.size();
+    auto vertex = [&](int r, int s) {
+        if (r == 0) {
+            return 0;
+        }
+        if (r == rings) {
+            return 1;
+        }
+        return 2 + (r - 1) * segments + s % segments;
+    };
+    auto face = [&](int a, int b, int c) {
+        Vector normal = CrossProduct(directions[b] - directions[a], directions[c] - directions[a]);
+        if (DotProduct(normal, directions[a] + directions[b] + directions[c]) < 0) {
+            std::swap(b, c);
+        }
+        out << "f";
+        for (int v : {a, b, c}) {
+            out << ' ' << v - count << "//" << v - count;
+        }
+        out << "\n";
+    };
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            if (r > 0) {
+                face(vertex(r, s), vertex(r, s + 1), vertex(r + 1, s));
+            }
+            if (r + 1 < rings) {
+                face(vertex(r, s + 1), vertex(r + 1, s + 1), vertex(r + 1, s));
+            }
+        }
+    }
+    return out.str();
+}
+
+TEST_CASE("Level of detail") {
+    const TempDirectory dir("raytracer_level_of_detail");
+    std::ofstream(dir / "sphere.obj") << "o sphere\n"
+                                      << SphereMesh({0, 0, 0}, 1, 32, 64)
+                                      << "g quad\n"
+                                         "v 5 0 0\nv 6 0 0\nv 6 1 0\nv 5 1 0\n"
+                                         "f -4 -3 -2 -1\n"
+                                         "S 0 5 0 1\n";
+    constexpr size_t kTriangles = 2 * 64 * 31;
+    for (auto format : {VertexFormat::kFull, VertexFormat::kCompact, VertexFormat::kQuantized}) {
+        auto scene = ReadScene(dir / "sphere.obj", {format});
+        const auto& lod = scene.GetLod();
+        REQUIRE(lod.meshes.size() == 1);
+        const auto& mesh = lod.meshes[0];
+        Check(mesh.min, -1);
+        Check(mesh.max, 1);
+        REQUIRE(mesh.levels.size() == 5);
+        CHECK(mesh.levels[0].begin == 0);
+        CHECK(mesh.levels[0].end == kTriangles);
+        CHECK(mesh.levels[0].error == 0);
+        for (size_t k = 1; k < mesh.levels.size(); ++k) {
+            size_t count = mesh.levels[k].end - mesh.levels[k].begin;
+            size_t previous = mesh.levels[k - 1].end - mesh.levels[k - 1].begin;
+            CHECK(count <= previous / 2);
+            CHECK(count > previous / 3);
+            CHECK(mesh.levels[k].error >= mesh.levels[k - 1].error);
+        }
+        CHECK(mesh.levels[1].error > 0);
+        CHECK(mesh.levels[1].error < .01);
+        CHECK(mesh.levels[4].error < .1);
+        CHECK(scene.MemoryFootprint().lod > 0);
+
+        CHECK(scene.SelectLod({0, 0, 0}, 1e-3, 1) == std::vector<int>{0});
+        CHECK(scene.SelectLod({0, 0, 1e5}, 1e-3, 1) == std::vector<int>{4});
+        CHECK(scene.SelectLod({0, 0, 1e5}, 1e-3, 0) == std::vector<int>{0});
+        double distance = mesh.levels[2].error / 1e-3 + std::sqrt(3.);
+        CHECK(scene.SelectLod({0, 0, distance * 1.01}, 1e-3, 1) == std::vector<int>{2});
+
+        // Every level stays closed and within its error of the sphere; the quad and
+        // the analytic sphere stay as they are.
+        std::mt19937 rng(5);
+        std::normal_distribution<double> normal;
+        for (int level = 0; level < 5; ++level) {
+            auto primitives = scene.GetLodPrimitives({level});
+            auto stats = scene.GetLodStats({level});
+            CHECK(stats.triangles_loaded == kTriangles + 2);
+            CHECK(stats.triangles_traced == CountTriangles(primitives));
+            CHECK(stats.triangles_traced ==
+                  mesh.levels[level].end - mesh.levels[level].begin + 2);
+            CHECK(primitives.Block<PrimitiveType::kSphere>().size() == 1);
+            if (format == VertexFormat::kFull) {
+                for (const auto& obj : primitives.Block<PrimitiveType::kTriangle>()) {
+                    CHECK(obj.normals.size() == (obj.polygon[0][0] < 4 ? 3 : 0));
+                }
+            }
+            auto accelerator = scene.GetLodAccelerator(AcceleratorType::kAuto, {level});
+            double error = mesh.levels[level].error;
+            for (int i = 0; i < 200; ++i) {
+                Vector from(normal(rng), normal(rng), normal(rng));
+                from.Normalize();
+                from = from.MultiplyOnScalar(3);
+                Vector to(normal(rng), normal(rng), normal(rng));
+                to = to.MultiplyOnScalar(.2);
+                Vector direction = to - from;
+                direction.Normalize();
+                Ray ray(from, direction);
+                Hit hit = FindClosestHit(*accelerator, ray);
+                REQUIRE(hit.IsValid());
+                double radius = Length(hit.intersection->GetPosition());
+                CHECK(std::abs(radius - 1) <= error + .02);
+            }
+        }
+        CHECK(&*scene.GetLodAccelerator(AcceleratorType::kAuto, {0}) == &scene.GetAccelerator());
+        CHECK(scene.GetLodAccelerator(AcceleratorType::kAuto, {3}) ==
+              scene.GetLodAccelerator(AcceleratorType::kAuto, {3}));
+
+        // A view in use moves to the front, so newer views evict the others first.
+        std::weak_ptr<const Accelerator> second =
+            scene.GetLodAccelerator(AcceleratorType::kAuto, {2});
+        std::weak_ptr<const Accelerator> first =
+            scene.GetLodAccelerator(AcceleratorType::kAuto, {1});
+        for (int level = 2; level < 5; ++level) {
+            scene.GetLodAccelerator(AcceleratorType::kBruteForce, {level});
+        }
+        CHECK_FALSE(first.expired());
+        CHECK(second.expired());
+    }
+
+    CHECK(ReadScene(dir / "sphere.obj", {.lod = {.levels = 0}}).GetLod().meshes.empty());
+    CHECK(ReadScene(dir / "sphere.obj", {.lod = {.min_triangles = kTriangles + 1}})
+              .GetLod()
+              .meshes.empty());
+}
@@ -0,0 +1,453 @@
+#pragma once
+
+#include <material.h>
+#include <vector.h>
+
+#include <fcntl.h>
+#include <png.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct TextureCacheStats {
+    // Tile reads of Sample, and where they were served from: the tiles the thread
+    // read last, the shared table, or the tile files.
+    uint64_t lookups = 0;
+    uint64_t thread_hits = 0;
+    uint64_t shared_hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t textures_prepared = 0;
+    // Bytes of tiles in the shared table.
+    size_t resident_bytes = 0;
+
+    double HitRate() const {
+        return lookups ? static_cast<double>(thread_hits + shared_hits) / lookups : 0;
+    }
+};
+
+// Linear values of 8-bit texels, which carry the gamma of the images.
+const std::array<float, 256>& GetTexelTable() {
+    static const std::array<float, 256> kTable = [] {
+        std::array<float, 256> table;
+        for (int i = 0; i < 256; ++i) {
+            table[i] = std::pow(i / 255.f, 2.2f);
+        }
+        return table;
+    }();
+    return kTable;
+}
+
+uint8_t EncodeTexel(float value) {
+    return std::lround(255 * std::pow(std::clamp(value, 0.f, 1.f), 1 / 2.2f));
+}
+
+// Texture maps paged through a fixed memory budget, so that scenes can refer to
+// far more texels than fit in memory. Prepare, or else the first lookup of a
+// texture, decodes its PNG and writes its whole mipmap pyramid, in tiles of
+// kTileSize^2 texels, to a file in the cache directory; after that only tiles are
+// read. The decode holds the whole image in memory, so the budget bounds the
+// tiles but not that peak. The shared table
+// keeps at most the budget of tiles, dropping the least recently used of a shard
+// first. Every thread also keeps the last tiles it read, one per hash slot, so most
+// lookups take no lock; those tiles may outlive their eviction.
+//
+// All methods may be called from several threads.
+class TextureCache {
+public:
+    static constexpr int kTileSize = 64;
+    static constexpr size_t kTileBytes = kTileSize * kTileSize * 3;
+
+    // Without a directory the tile files go to a new one in the temporary
+    // directory. The files are removed with the cache.
+    explicit TextureCache(size_t budget_bytes, std::filesystem::path directory = {})
+        : id_(NextId()), budget_(budget_bytes), directory_(std::move(directory)) {
+        if (directory_.empty()) {
+            directory_ = std::filesystem::temp_directory_path() /
+                         ("raytracer-textures-" + std::to_string(getpid()) + "-" +
+                          std::to_string(id_));
+        }
+    }
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    ~TextureCache() {
+        std::error_code error;
+        for (size_t handle = 0; handle < count_; ++handle) {
+            Texture& texture = GetTexture(handle);
+            if (texture.fd != -1) {
+                close(texture.fd);
+                std::filesystem::remove(texture.tiles, error);
+            }
+        }
+        // Only succeeds if nothing else is in it.
+        std::filesystem::remove(directory_, error);
+    }
+
+    // Handle of the PNG image at path, the same for the same path while the file
+    // keeps its size and modification time; a changed file gets a new handle. The
+    // image is not read until it is prepared or sampled.
+    TextureHandle Register(const std::filesystem::path& path) {
+        std::error_code error;
+        auto size = std::filesystem::file_size(path, error);
+        auto modified = std::filesystem::last_write_time(path, error);
+        std::string key = path.lexically_normal().string() + '\n' + std::to_string(size) + '\n' +
+                          std::to_string(modified.time_since_epoch().count());
+        std::lock_guard lock(register_mutex_);
+        if (auto it = handles_.find(key); it != handles_.end()) {
+            return it->second;
+        }
+        if (count_ == kChunks * kChunkSize) {
+            throw std::runtime_error("Too many textures");
+        }
+        auto handle = static_cast<TextureHandle>(count_);
+        auto& chunk = chunks_[handle / kChunkSize];
+        if (!chunk) {
+            chunk = std::make_unique<Texture[]>(kChunkSize);
+        }
+        chunk[handle % kChunkSize].source = path;
+        handles_.emplace(std::move(key), handle);
+        ++count_;
+        return handle;
+    }
+
+    // Decodes the image and writes its tiles unless that was done already, so that
+    // no lookup has to wait for it.
+    void Prepare(TextureHandle handle) {
+        GetPrepared(handle);
+    }
+
+    // Trilinear filtered linear color at (u, v), with v up and the texture
+    // repeated outside [0, 1). width is the size of the footprint in texture
+    // coordinates and picks the mipmap levels.
+    Vector Sample(TextureHandle handle, double u, double v, double width) {
+        const Texture& texture = GetPrepared(handle);
+        double levels = texture.levels.size();
+        double texels = width * std::max(texture.levels[0].width, texture.levels[0].height);
+        double lod = texels > 1 ? std::min(std::log2(texels), levels - 1) : 0;
+        int level = static_cast<int>(lod);
+        double t = lod - level;
+        Vector color = Bilinear(handle, texture, level, u, v);
+        if (t > 0) {
+            color = color.MultiplyOnScalar(1 - t) +
+                    Bilinear(handle, texture, level + 1, u, v).MultiplyOnScalar(t);
+        }
+        return color;
+    }
+
+    // Linear color of texel (x, y) of a mipmap level, row 0 at the top.
+    Vector GetTexel(TextureHandle handle, int level, int x, int y) {
+        return ReadTexel(handle, GetPrepared(handle), level, x, y);
+    }
+
+    // Width and height of every mipmap level, the image first.
+    std::vector<std::pair<int, int>> GetLevelSizes(TextureHandle handle) {
+        std::vector<std::pair<int, int>> sizes;
+        for (const auto& level : GetPrepared(handle).levels) {
+            sizes.emplace_back(level.width, level.height);
+        }
+        return sizes;
+    }
+
+    void SetBudget(size_t bytes) {
+        budget_ = bytes;
+        EvictOverBudget(0);
+    }
+
+    TextureCacheStats GetStats() const {
+        return {lookups_.load(std::memory_order_relaxed),
+                thread_hits_.load(std::memory_order_relaxed),
+                shared_hits_.load(std::memory_order_relaxed),
+                misses_.load(std::memory_order_relaxed),
+                evictions_.load(std::memory_order_relaxed),
+                prepared_.load(std::memory_order_relaxed),
+                resident_.load(std::memory_order_relaxed)};
+    }
+
+private:
+    static constexpr size_t kChunkSize = 1024;
+    static constexpr size_t kChunks = 4096;
+    static constexpr int kShardBits = 6;
+    static constexpr int kRecentBits = 6;
+    static constexpr int kRecentTiles = 1 << kRecentBits;
+
+    using Tile = std::array<uint8_t, kTileBytes>;
+
+    struct Level {
+        int width;
+        int height;
+        int tiles_x;
+        // Index of the first tile of the level in the tile file.
+        uint64_t first_tile;
+    };
+
+    struct Texture {
+        std::filesystem::path source;
+        std::once_flag prepared;
+        std::vector<Level> levels;
+        std::filesystem::path tiles;
+        int fd = -1;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first.
+        std::list<std::pair<uint64_t, std::shared_ptr<const Tile>>> lru;
+        std::unordered_map<uint64_t, decltype(lru)::iterator> index;
+    };
+
+    struct RecentTile {
+        uint64_t cache = 0;
+        uint64_t key = 0;
+        std::shared_ptr<const Tile> tile;
+    };
+
+    static uint64_t NextId() {
+        static std::atomic<uint64_t> next = 1;
+        return next++;
+    }
+
+    // Handles come from Register, which published their chunk.
+    Texture& GetTexture(size_t handle) {
+        return chunks_[handle / kChunkSize][handle % kChunkSize];
+    }
+
+    const Texture& GetPrepared(TextureHandle handle) {
+        if (handle < 0 || static_cast<size_t>(handle) >= count_) {
+            throw std::out_of_range("Unknown texture " + std::to_string(handle));
+        }
+        Texture& texture = GetTexture(handle);
+        std::call_once(texture.prepared, [&] { WriteTiles(handle, &texture); });
+        return texture;
+    }
+
+    // Decodes the image and writes the tiles of all levels, level by level, row
+    // of tiles by row of tiles. Tiles over the edge repeat the last texel. Every
+    // level halves the one before, averaging 2x2 texels in linear color (2x3 or
+    // 3x3 along odd sides), so only two levels are in memory at a time.
+    void WriteTiles(TextureHandle handle, Texture* texture) {
+        png_image image{};
+        image.version = PNG_IMAGE_VERSION;
+        std::vector<uint8_t> texels;
+        if (png_image_begin_read_from_file(&image, texture->source.c_str())) {
+            image.format = PNG_FORMAT_RGB;
+            texels.resize(PNG_IMAGE_SIZE(image));
+            png_image_finish_read(&image, nullptr, texels.data(), 0, nullptr);
+        }
+        if (PNG_IMAGE_FAILED(image)) {
+            throw std::runtime_error("Can't read texture " + texture->source.string() + ": " +
+                                     image.message);
+        }
+
+        std::filesystem::create_directories(directory_);
+        std::filesystem::path tiles = directory_ / (std::to_string(handle) + ".tiles");
+        std::ofstream out(tiles, std::ios::binary);
+        const auto& linear = GetTexelTable();
+        int width = image.width;
+        int height = image.height;
+        std::vector<Level> levels;
+        uint64_t first_tile = 0;
+        Tile tile;
+        while (true) {
+            int tiles_x = (width + kTileSize - 1) / kTileSize;
+            int tiles_y = (height + kTileSize - 1) / kTileSize;
+            levels.push_back({width, height, tiles_x, first_tile});
+            first_tile += static_cast<uint64_t>(tiles_x) * tiles_y;
+            for (int ty = 0; ty < tiles_y; ++ty) {
+                for (int tx = 0; tx < tiles_x; ++tx) {
+                    for (int y = 0; y < kTileSize; ++y) {
+                        int sy = std::min(ty * kTileSize + y, height - 1);
+                        for (int x = 0; x < kTileSize; ++x) {
+                            int sx = std::min(tx * kTileSize + x, width - 1);
+                            std::copy_n(&texels[(static_cast<size_t>(sy) * width + sx) * 3], 3,
+                                        &tile[(y * kTileSize + x) * 3]);
+                        }
+                    }
+                    out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+                }
+            }
+            if (width == 1 && height == 1) {
+                break;
+            }
+
+            int next_width = std::max(width / 2, 1);
+            int next_height = std::max(height / 2, 1);
+            std::vector<uint8_t> next(static_cast<size_t>(next_width) * next_height * 3);
+            for (int y = 0; y < next_height; ++y) {
+                int y0 = y * height / next_height;
+                int y1 = (y + 1) * height / next_height;
+                for (int x = 0; x < next_width; ++x) {
+                    int x0 = x * width / next_width;
+                    int x1 = (x + 1) * width / next_width;
+                    for (int c = 0; c < 3; ++c) {
+                        float sum = 0;
+                        for (int sy = y0; sy < y1; ++sy) {
+                            for (int sx = x0; sx < x1; ++sx) {
+                                sum += linear[texels[(static_cast<size_t>(sy) * width + sx) * 3 + c]];
+                            }
+                        }
+                        next[(static_cast<size_t>(y) * next_width + x) * 3 + c] =
+                            EncodeTexel(sum / ((y1 - y0) * (x1 - x0)));
+                    }
+                }
+            }
+            texels = std::move(next);
+            width = next_width;
+            height = next_height;
+        }
+        out.close();
+        int fd = out ? open(tiles.c_str(), O_RDONLY) : -1;
+        if (fd == -1) {
+            throw std::runtime_error("Can't write tiles of " + texture->source.string() + " to " +
+                                     tiles.string());
+        }
+        texture->levels = std::move(levels);
+        texture->tiles = std::move(tiles);
+        texture->fd = fd;
+        prepared_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Vector Bilinear(TextureHandle handle, const Texture& texture, int level, double u, double v) {
+        const Level& size = texture.levels[level];
+        double x = (u - std::floor(u)) * size.width - .5;
+        double y = (1 - (v - std::floor(v))) * size.height - .5;
+        int x0 = std::floor(x);
+        int y0 = std::floor(y);
+        double fx = x - x0;
+        double fy = y - y0;
+        auto wrap = [](int i, int n) {
+            i %= n;
+            return i < 0 ? i + n : i;
+        };
+        int x1 = wrap(x0 + 1, size.width);
+        int y1 = wrap(y0 + 1, size.height);
+        x0 = wrap(x0, size.width);
+        y0 = wrap(y0, size.height);
+        Vector top = ReadTexel(handle, texture, level, x0, y0).MultiplyOnScalar(1 - fx) +
+                     ReadTexel(handle, texture, level, x1, y0).MultiplyOnScalar(fx);
+        Vector bottom = ReadTexel(handle, texture, level, x0, y1).MultiplyOnScalar(1 - fx) +
+                        ReadTexel(handle, texture, level, x1, y1).MultiplyOnScalar(fx);
+        return top.MultiplyOnScalar(1 - fy) + bottom.MultiplyOnScalar(fy);
+    }
+
+    Vector ReadTexel(TextureHandle handle, const Texture& texture, int level, int x, int y) {
+        const Level& size = texture.levels[level];
+        uint32_t tile_index = (y / kTileSize) * size.tiles_x + x / kTileSize;
+        uint64_t key = static_cast<uint64_t>(handle) << 37 | static_cast<uint64_t>(level) << 32 |
+                       tile_index;
+        const Tile& tile = FetchTile(texture, level, key, tile_index);
+        const uint8_t* texel = &tile[((y % kTileSize) * kTileSize + x % kTileSize) * 3];
+        const auto& linear = GetTexelTable();
+        return {linear[texel[0]], linear[texel[1]], linear[texel[2]]};
+    }
+
+    // The tile stays valid until the next FetchTile of the thread.
+    const Tile& FetchTile(const Texture& texture, int level, uint64_t key, uint32_t tile_index) {
+        thread_local std::array<RecentTile, kRecentTiles> recent;
+        lookups_.fetch_add(1, std::memory_order_relaxed);
+        RecentTile& slot = recent[(key * 0x9e3779b97f4a7c15) >> (64 - kRecentBits)];
+        if (slot.cache == id_ && slot.key == key) {
+            thread_hits_.fetch_add(1, std::memory_order_relaxed);
+            return *slot.tile;
+        }
+
+        size_t shard_index = (key * 0xff51afd7ed558ccd) >> (64 - kShardBits);
+        Shard& shard = shards_[shard_index];
+        std::shared_ptr<const Tile> tile;
+        {
+            std::lock_guard lock(shard.mutex);
+            if (auto it = shard.index.find(key); it != shard.index.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                tile = it->second->second;
+            }
+        }
+        if (tile) {
+            shared_hits_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            tile = ReadTile(texture, level, tile_index);
+            {
+                std::lock_guard lock(shard.mutex);
+                auto [it, inserted] = shard.index.try_emplace(key);
+                if (inserted) {
+                    shard.lru.emplace_front(key, tile);
+                    it->second = shard.lru.begin();
+                    resident_ += kTileBytes;
+                } else {
+                    // Another thread read it meanwhile.
+                    tile = it->second->second;
+                }
+            }
+            EvictOverBudget(shard_index);
+        }
+        slot = {id_, key, std::move(tile)};
+        return *slot.tile;
+    }
+
+    std::shared_ptr<const Tile> ReadTile(const Texture& texture, int level, uint32_t tile_index) {
+        auto tile = std::make_shared<Tile>();
+        off_t offset = (texture.levels[level].first_tile + tile_index) * kTileBytes;
+        if (pread(texture.fd, tile->data(), kTileBytes, offset) != static_cast<ssize_t>(kTileBytes)) {
+            throw std::runtime_error("Can't read tiles of " + texture.source.string());
+        }
+        return tile;
+    }
+
+    // Drops tiles from the end of the shards, starting at first_shard, until the
+    // table fits the budget.
+    void EvictOverBudget(size_t first_shard) {
+        for (size_t i = 0; i < shards_.size() && resident_ > budget_; ++i) {
+            Shard& shard = shards_[(first_shard + i) % shards_.size()];
+            std::lock_guard lock(shard.mutex);
+            while (!shard.lru.empty() && resident_ > budget_) {
+                shard.index.erase(shard.lru.back().first);
+                shard.lru.pop_back();
+                resident_ -= kTileBytes;
+                evictions_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    const uint64_t id_;
+    std::atomic<size_t> budget_;
+    std::filesystem::path directory_;
+
+    std::mutex register_mutex_;
+    std::unordered_map<std::string, TextureHandle> handles_;
+    std::atomic<size_t> count_ = 0;
+    std::array<std::unique_ptr<Texture[]>, kChunks> chunks_;
+
+    std::array<Shard, 1 << kShardBits> shards_;
+    std::atomic<size_t> resident_ = 0;
+
+    std::atomic<uint64_t> lookups_ = 0;
+    std::atomic<uint64_t> thread_hits_ = 0;
+    std::atomic<uint64_t> shared_hits_ = 0;
+    std::atomic<uint64_t> misses_ = 0;
+    std::atomic<uint64_t> evictions_ = 0;
+    std::atomic<uint64_t> prepared_ = 0;
+};
+
+constexpr size_t kTextureBudget = size_t{1} << 30;
+
+// Where ReadScene registers the texture maps of materials.
+TextureCache& GetTextureCache() {
+    static TextureCache kCache(kTextureBudget);
+    return kCache;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <accelerator.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Grid of equal cells over the bounds of the scene, each listing the primitives
+// whose bounds overlap it; rays walk the cells in order. Cheap to build, and
+// good for primitives of similar size spread evenly.
+class UniformGrid : public Accelerator {
+public:
+    static constexpr double kCellsPerPrimitive = 2;
+    static constexpr int kMaxResolution = 128;
+
+    explicit UniformGrid(const PrimitiveSet& primitives) : Accelerator(primitives) {
+        PrimitiveRefs refs = CollectPrimitives(primitives);
+        unbounded_ = std::move(refs.unbounded);
+        if (refs.bounded.empty()) {
+            return;
+        }
+        for (const auto& bounds : refs.bounds) {
+            bounds_.Extend(bounds);
+        }
+        Vector extent = bounds_.Extent();
+        double max_extent = std::max({extent[0], extent[1], extent[2]});
+        // Flat scenes still get a volume to spread the cells over.
+        double volume = 1;
+        for (int i = 0; i < 3; ++i) {
+            volume *= std::max(extent[i], 1e-3 * max_extent);
+        }
+        double cells_per_unit = std::cbrt(kCellsPerPrimitive * refs.bounded.size() / volume);
+        for (int i = 0; i < 3; ++i) {
+            resolution_[i] = std::clamp(static_cast<int>(std::lround(extent[i] * cells_per_unit)),
+                                        1, kMaxResolution);
+            cell_size_[i] = extent[i] / resolution_[i];
+            inv_cell_size_[i] = extent[i] > 0 ? 1 / cell_size_[i] : 0;
+        }
+        size_t cells = static_cast<size_t>(resolution_[0]) * resolution_[1] * resolution_[2];
+        cell_start_.assign(cells + 1, 0);
+        auto for_each_cell = [&](const Bounds& bounds, auto&& func) {
+            std::array<int, 3> low = CellOf(bounds.min);
+            std::array<int, 3> high = CellOf(bounds.max);
+            for (int z = low[2]; z <= high[2]; ++z) {
+                for (int y = low[1]; y <= high[1]; ++y) {
+                    for (int x = low[0]; x <= high[0]; ++x) {
+                        func(CellIndex({x, y, z}));
+                    }
+                }
+            }
+        };
+        for (const auto& bounds : refs.bounds) {
+            for_each_cell(bounds, [&](size_t cell) { ++cell_start_[cell + 1]; });
+        }
+        for (size_t cell = 0; cell < cells; ++cell) {
+            cell_start_[cell + 1] += cell_start_[cell];
+        }
+        cell_refs_.resize(cell_start_.back());
+        std::vector<uint32_t> fill(cell_start_.begin(), cell_start_.end() - 1);
+        for (size_t i = 0; i < refs.bounded.size(); ++i) {
+            for_each_cell(refs.bounds[i],
+                          [&](size_t cell) { cell_refs_[fill[cell]++] = refs.bounded[i]; });
+        }
+    }
+
+    AcceleratorType GetType() const override {
+        return AcceleratorType::kGrid;
+    }
+
+    Hit ClosestHit(const Ray& ray) const override {
+        Hit hit;
+        hit.params.t = INFINITY;
+        for (PrimitiveRef ref : unbounded_) {
+            UpdateClosest(primitives_, ref, ray, &hit);
+        }
+        Walk(ray, hit.params.t, [&](size_t cell, double t_exit) {
+            for (uint32_t i = cell_start_[cell]; i < cell_start_[cell + 1]; ++i) {
+                UpdateClosest(primitives_, cell_refs_[i], ray, &hit);
+            }
+            return hit.params.t < t_exit;
+        });
+        return hit;
+    }
+
+    bool AnyHit(const Ray& ray, double max_distance) const override {
+        HitParams params;
+        for (PrimitiveRef ref : unbounded_) {
+            if (HitPrimitive(primitives_, ref, ray, &params) && params.t <= max_distance) {
+                return true;
+            }
+        }
+        bool hit = false;
+        Walk(ray, max_distance, [&](size_t cell, double) {
+            for (uint32_t i = cell_start_[cell]; i < cell_start_[cell + 1] && !hit; ++i) {
+                hit = HitPrimitive(primitives_, cell_refs_[i], ray, &params) &&
+                      params.t <= max_distance;
+            }
+            return hit;
+        });
+        return hit;
+    }
+
+    size_t MemoryBytes() const override {
+        return cell_start_.capacity() * sizeof(uint32_t) +
+               (cell_refs_.capacity() + unbounded_.capacity()) * sizeof(PrimitiveRef);
+    }
+
+private:
+    std::array<int, 3> CellOf(const Vector& point) const {
+        std::array<int, 3> cell;
+        for (int i = 0; i < 3; ++i) {
+            cell[i] = std::clamp(static_cast<int>((point[i] - bounds_.min[i]) * inv_cell_size_[i]),
+                                 0, resolution_[i] - 1);
+        }
+        return cell;
+    }
+
+    size_t CellIndex(const std::array<int, 3>& cell) const {
+        return (static_cast<size_t>(cell[2]) * resolution_[1] + cell[1]) * resolution_[0] + cell[0];
+    }
+
+    // Calls visit(cell, t_exit) for the cells the ray passes no farther than
+    // t_max, in order, until it returns true.
+    template <class Visit>
+    void Walk(const Ray& ray, double t_max, Visit&& visit) const {
+        if (cell_refs_.empty()) {
+            return;
+        }
+        const Vector& orig = ray.GetOrigin();
+        const Vector& dir = ray.GetDirection();
+        Vector inv_dir = InverseDirection(dir);
+        double t_min = 0;
+        if (!ClipToBounds(ray, inv_dir, bounds_, &t_min, &t_max)) {
+            return;
+        }
+        std::array<int, 3> cell = CellOf(orig + dir.MultiplyOnScalar(t_min));
+        std::array<double, 3> next_t;
+        std::array<double, 3> delta_t;
+        std::array<int, 3> step;
+        std::array<int, 3> end;
+        for (int i = 0; i < 3; ++i) {
+            if (dir[i] > 0) {
+                next_t[i] = (bounds_.min[i] + (cell[i] + 1) * cell_size_[i] - orig[i]) * inv_dir[i];
+                delta_t[i] = cell_size_[i] * inv_dir[i];
+                step[i] = 1;
+                end[i] = resolution_[i];
+            } else if (dir[i] < 0) {
+                next_t[i] = (bounds_.min[i] + cell[i] * cell_size_[i] - orig[i]) * inv_dir[i];
+                delta_t[i] = -cell_size_[i] * inv_dir[i];
+                step[i] = -1;
+                end[i] = -1;
+            } else {
+                next_t[i] = INFINITY;
+                delta_t[i] = 0;
+                step[i] = 0;
+                end[i] = -1;
+            }
+        }
+        while (true) {
+            int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2)
+                                             : (next_t[1] < next_t[2] ? 1 : 2);
+            if (visit(CellIndex(cell), next_t[axis]) || next_t[axis] > t_max) {
+                return;
+            }
+            cell[axis] += step[axis];
+            if (cell[axis] == end[axis]) {
+                return;
+            }
+            next_t[axis] += delta_t[axis];
+        }
+    }
+
+    Bounds bounds_;
+    std::array<int, 3> resolution_ = {1, 1, 1};
+    Vector cell_size_;
+    Vector inv_cell_size_;
+    // Primitives of cell c are cell_refs_[cell_start_[c]] to cell_refs_[cell_start_[c + 1]].
+    std::vector<uint32_t> cell_start_;
+    std::vector<PrimitiveRef> cell_refs_;
+    std::vector<PrimitiveRef> unbounded_;
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <vector.h>
+#include <light.h>
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numbers>
+
+// Hits shaded together in structure-of-arrays lanes. The loops over the lanes
+// have no branches or calls in their bodies, so the compiler turns them into
+// vector instructions of the target, 2 or 4 lanes at a time. That is why
+// std::sqrt, which may set errno, and clamps ahead of longer computations get
+// loops of their own, and why masks are lanes of 0 and 1 to multiply by.
+constexpr size_t kShadeBatch = 64;
+
+using Lanes = std::array<double, kShadeBatch>;
+
+struct VectorLanes {
+    std::array<Lanes, 3> c;
+
+    void Set(size_t lane, const Vector& v) {
+        for (int k = 0; k < 3; ++k) {
+            c[k][lane] = v[k];
+        }
+    }
+    Vector Get(size_t lane) const {
+        return {c[0][lane], c[1][lane], c[2][lane]};
+    }
+};
+
+// DotProduct of every lane.
+Lanes DotLanes(const VectorLanes& a, const VectorLanes& b) {
+    Lanes dot;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        dot[i] = a.c[0][i] * b.c[0][i] + a.c[1][i] * b.c[1][i] + a.c[2][i] * b.c[2][i];
+    }
+    return dot;
+}
+
+Lanes SqrtLanes(const Lanes& x) {
+    Lanes root;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        root[i] = std::sqrt(x[i]);
+    }
+    return root;
+}
+
+// Vector::Normalize of every lane.
+void NormalizeLanes(VectorLanes* v) {
+    Lanes norm = SqrtLanes(DotLanes(*v, *v));
+    for (int k = 0; k < 3; ++k) {
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            v->c[k][i] /= norm[i];
+        }
+    }
+}
+
+// std::pow of every lane for a base in [0, 1] and a non-negative exponent, as
+// exp2(exponent * log2(base)) by polynomials; the relative error stays below
+// 1e-9 for the exponents of materials. Bases below 1e-300 count as 1e-300.
+Lanes PowLanes(const Lanes& base, const Lanes& exponent) {
+    constexpr double kMinBase = 1e-300;
+    constexpr uint64_t kMantissa = (uint64_t{1} << 52) - 1;
+    // Carries into the exponent bits for mantissas above that of sqrt(2).
+    constexpr uint64_t kAboveSqrt2 =
+        kMantissa - (std::bit_cast<uint64_t>(std::numbers::sqrt2) & kMantissa);
+    Lanes x;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        x[i] = base[i] < kMinBase ? kMinBase : base[i];
+    }
+    Lanes y;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        uint64_t bits = std::bit_cast<uint64_t>(x[i]);
+        // x = m * 2^e with m in [sqrt(1/2), sqrt(2)].
+        uint64_t above = ((bits & kMantissa) + kAboveSqrt2) >> 52;
+        double e = static_cast<int32_t>((bits >> 52) + above) - 1023;
+        double m = std::bit_cast<double>((bits & kMantissa) | ((1023 - above) << 52));
+        // ln(m) = 2 atanh(s), with |s| < .18.
+        double s = (m - 1) / (m + 1);
+        double s2 = s * s;
+        double ln_m =
+            2 * s *
+            (1 + s2 * (1. / 3 + s2 * (1. / 5 + s2 * (1. / 7 + s2 * (1. / 9 + s2 * (1. / 11 + s2 / 13))))));
+        y[i] = exponent[i] * (e + ln_m * std::numbers::log2e);
+    }
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        y[i] = y[i] < -1022 ? -1022 : y[i];
+    }
+    Lanes power;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        // 2^y = 2^k * e^(f ln 2) with k = trunc(y) and |f| < 1, by the Taylor
+        // series up to the 12th power.
+        int32_t k = static_cast<int32_t>(y[i]);
+        double f = (y[i] - k) * std::numbers::ln2;
+        double p =
+            1 + f * (1 + f * (1. / 2 + f * (1. / 6 + f * (1. / 24 + f * (1. / 120 + f * (1. / 720 +
+            f * (1. / 5040 + f * (1. / 40320 + f * (1. / 362880 + f * (1. / 3628800 +
+            f * (1. / 39916800 + f * (1. / 479001600))))))))))));
+        double scale = std::bit_cast<double>(static_cast<uint64_t>(static_cast<uint32_t>(k + 1023))
+                                             << 52);
+        power[i] = p * scale;
+    }
+    return power;
+}
+
+// Reflect of every lane, normalized.
+VectorLanes ReflectLanes(const VectorLanes& dir, const VectorLanes& normal) {
+    Lanes cos1 = DotLanes(normal, dir);
+    VectorLanes reflected;
+    for (int k = 0; k < 3; ++k) {
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            reflected.c[k][i] = dir.c[k][i] + normal.c[k][i] * (2 * -cos1[i]);
+        }
+    }
+    NormalizeLanes(&reflected);
+    return reflected;
+}
+
+// Refract of every lane with its ratio of refraction indices eta, normalized.
+// valid is 1 in the lanes that refract and 0 in those of total internal
+// reflection, whose directions are garbage.
+VectorLanes RefractLanes(const VectorLanes& dir, const VectorLanes& normal, const Lanes& eta,
+                         Lanes* valid) {
+    Lanes cos1 = DotLanes(normal, dir);
+    Lanes sin1_squared;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        sin1_squared[i] = 1 - cos1[i] * cos1[i];
+    }
+    Lanes sin2 = SqrtLanes(sin1_squared);
+    Lanes cos2_squared;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        sin2[i] *= eta[i];
+        cos2_squared[i] = 1 - sin2[i] * sin2[i];
+    }
+    Lanes cos2 = SqrtLanes(cos2_squared);
+    Lanes refracts;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        refracts[i] = sin2[i] > 1.0 ? 0. : 1.;
+    }
+    *valid = refracts;
+    VectorLanes refracted;
+    for (int k = 0; k < 3; ++k) {
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            refracted.c[k][i] = dir.c[k][i] * eta[i] + normal.c[k][i] * (eta[i] * -cos1[i] - cos2[i]);
+        }
+    }
+    NormalizeLanes(&refracted);
+    return refracted;
+}
+
+// Surfaces of a batch as GetPointColorBase sees them.
+struct SurfaceLanes {
+    VectorLanes position;
+    // Normalized, like the direction to the viewer.
+    VectorLanes normal;
+    VectorLanes view;
+    VectorLanes diffuse;
+    VectorLanes specular;
+    Lanes exponent;
+    Lanes albedo;
+};
+
+// GetLightColor of light in every lane, as if visible, scaled by the albedo.
+VectorLanes LightLanes(const Light& light, const SurfaceLanes& surface) {
+    VectorLanes to_light;
+    for (int k = 0; k < 3; ++k) {
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            to_light.c[k][i] = light.position[k] - surface.position.c[k][i];
+        }
+    }
+    NormalizeLanes(&to_light);
+    Lanes cos_light = DotLanes(to_light, surface.normal);
+    VectorLanes reflected;
+    for (int k = 0; k < 3; ++k) {
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            reflected.c[k][i] = surface.normal.c[k][i] * (2 * cos_light[i]) - to_light.c[k][i];
+        }
+    }
+    NormalizeLanes(&reflected);
+    Lanes cos_view = DotLanes(reflected, surface.view);
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        cos_light[i] = cos_light[i] > 0 ? cos_light[i] : 0;
+        cos_view[i] = cos_view[i] > 0 ? cos_view[i] : 0;
+    }
+    Lanes highlight = PowLanes(cos_view, surface.exponent);
+    VectorLanes color;
+    for (int k = 0; k < 3; ++k) {
+        double intensity = light.intensity[k];
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            double diffuse = surface.diffuse.c[k][i] * cos_light[i] * intensity;
+            double specular = surface.specular.c[k][i] * intensity * highlight[i];
+            color.c[k][i] = (diffuse + specular) * surface.albedo[i];
+        }
+    }
+    return color;
+}
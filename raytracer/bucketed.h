@@ -0,0 +1,192 @@
+#pragma once
+
+#include <raytracer.h>
+#include <hdr_output.h>
+#include <tone_mapping.h>
+#include <tiles.h>
+
+#include <png.h>
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+// 8-bit RGB PNG written a row at a time, top row first.
+class PngWriter {
+public:
+    PngWriter(const std::filesystem::path& path, int width, int height)
+        : width_(width), bytes_(static_cast<size_t>(width) * 3) {
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) {
+            throw std::runtime_error("Can't open " + path.string());
+        }
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        info_ = png_ ? png_create_info_struct(png_) : nullptr;
+        if (!info_ || setjmp(png_jmpbuf(png_))) {
+            Close();
+            throw std::runtime_error("Can't write " + path.string());
+        }
+        png_init_io(png_, file_);
+        png_set_IHDR(png_, info_, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_, info_);
+    }
+
+    PngWriter(const PngWriter&) = delete;
+    PngWriter& operator=(const PngWriter&) = delete;
+
+    ~PngWriter() {
+        Close();
+    }
+
+    void WriteRow(const RGB* pixels) {
+        for (int x = 0; x < width_; ++x) {
+            bytes_[3 * x] = pixels[x].r;
+            bytes_[3 * x + 1] = pixels[x].g;
+            bytes_[3 * x + 2] = pixels[x].b;
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            throw std::runtime_error("PNG write failed");
+        }
+        png_write_row(png_, bytes_.data());
+    }
+
+    void Finish() {
+        if (setjmp(png_jmpbuf(png_))) {
+            throw std::runtime_error("PNG write failed");
+        }
+        png_write_end(png_, nullptr);
+        if (!Close()) {
+            throw std::runtime_error("PNG write failed");
+        }
+    }
+
+private:
+    bool Close() {
+        if (png_) {
+            png_destroy_write_struct(&png_, info_ ? &info_ : nullptr);
+        }
+        bool closed = !file_ || std::fclose(file_) == 0;
+        file_ = nullptr;
+        return closed;
+    }
+
+    int width_;
+    std::vector<png_byte> bytes_;
+    FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+};
+
+struct BucketOptions {
+    // Rows traced and held in memory at a time; rounded up to whole tiles.
+    int band_height = 128;
+    // Where the linear frame waits for the second pass; output with .spool
+    // appended when empty.
+    std::filesystem::path spool = {};
+};
+
+// Renders a PNG to output holding one band of rows in memory, so the frame may be
+// far larger than RAM. The tone map of radiance and the normalization of depth need
+// the maximum of the whole frame: those modes spool the linear bands to disk and
+// convert them in a second pass. The image equals that of Render. The filter of
+// RenderOptions::denoise reaches across bands, so it is rejected.
+void RenderBucketed(const Scene& scene, const CameraOptions& camera_options,
+                    const RenderOptions& render_options, const std::filesystem::path& output,
+                    const BucketOptions& bucket_options = {}) {
+    if (Denoises(render_options)) {
+        throw std::invalid_argument("RenderBucketed cannot denoise");
+    }
+    ScopedJobContext context(render_options.priority);
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    int tile_size = render_options.tile_size;
+    int band_height = std::min(
+        height, (std::max(bucket_options.band_height, 1) + tile_size - 1) / tile_size * tile_size);
+    int channels = FrameChannels(render_options.mode);
+    bool two_pass = render_options.mode != RenderMode::kNormal;
+
+    Framebuffer band(width, band_height, channels);
+    std::vector<RGB> pixels(static_cast<size_t>(width) * band_height);
+    float max_value = 0.f;
+    PngWriter png(output, width, height);
+    auto write_band = [&](int rows) {
+        ParallelFor(0, rows, [&](int y) {
+            RGB* out = pixels.data() + static_cast<size_t>(y) * width;
+            if (render_options.mode == RenderMode::kDepth) {
+                DepthToRow(band.Row(y), width, max_value, out);
+            } else if (render_options.mode == RenderMode::kNormal) {
+                NormalToRow(band.Row(y), width, out);
+            } else {
+                ToneMapRow(band.Row(y), width, max_value, out);
+            }
+        });
+        for (int y = 0; y < rows; ++y) {
+            png.WriteRow(pixels.data() + static_cast<size_t>(y) * width);
+        }
+    };
+
+    std::filesystem::path spool_path = bucket_options.spool;
+    if (spool_path.empty()) {
+        spool_path = output;
+        spool_path += ".spool";
+    }
+    struct RemoveOnExit {
+        std::filesystem::path path;
+        ~RemoveOnExit() {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+    };
+    std::optional<RemoveOnExit> spool_remover;
+    std::optional<BinaryFile> spool;
+    if (two_pass) {
+        spool_remover.emplace(spool_path);
+        spool.emplace(spool_path);
+    }
+    size_t row_bytes = static_cast<size_t>(width) * channels * sizeof(float);
+    auto accelerator = GetFrameAccelerator(scene, camera_options, render_options);
+
+    for (int y0 = 0; y0 < height; y0 += band_height) {
+        int rows = std::min(band_height, height - y0);
+        std::vector<Tile> tiles = SplitIntoTiles(width, rows, tile_size);
+        if (render_options.pixel_order == PixelOrder::kSpaceFilling) {
+            SortTilesHilbert(&tiles, tile_size);
+        }
+        std::vector<float> tile_max(tiles.size(), 0.f);
+        ParallelFor(0, tiles.size(), [&](int t) {
+            Tile tile = tiles[t];
+            tile.y0 += y0;
+            tile.y1 += y0;
+            tile_max[t] =
+                RenderTile(scene, *accelerator, camera_options, render_options, tile, &band, 0, y0);
+        });
+        for (float value : tile_max) {
+            max_value = std::max(max_value, value);
+        }
+        if (!two_pass) {
+            write_band(rows);
+            continue;
+        }
+        for (int y = 0; y < rows; ++y) {
+            spool->Write(band.Row(y), row_bytes);
+        }
+    }
+
+    if (two_pass) {
+        spool->Seek(0);
+        for (int y0 = 0; y0 < height; y0 += band_height) {
+            int rows = std::min(band_height, height - y0);
+            for (int y = 0; y < rows; ++y) {
+                spool->Read(band.Row(y), row_bytes);
+            }
+            write_band(rows);
+        }
+    }
+    png.Finish();
+}
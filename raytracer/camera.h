@@ -0,0 +1,125 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <transform.h>
+#include <ray.h>
+#include <vector.h>
+
+#include <cmath>
+#include <utility>
+
+Matrix4 LookAt(const Vector& from, const Vector& to) {
+    Matrix4 matr;
+    Vector forward = from - to;
+    forward.Normalize();
+    Vector tmp = Vector(0, 1, 0);
+    Vector right = CrossProduct(tmp, forward);
+    if (Length(right) < 1e-9) {
+        if (DotProduct(tmp, forward) < 0) {
+            tmp = Vector(0, 0, 1);
+        } else {
+            tmp = Vector(0, 0, -1);
+        }
+    }
+    if ((to - from)[2] < 0) {
+        tmp = Vector(tmp[0], tmp[1], -tmp[2]);
+    }
+    right = CrossProduct(tmp, forward);
+    right.Normalize();
+    Vector up = CrossProduct(forward, right);
+    up.Normalize();
+    for (int i = 0; i < 3; ++i) {
+        matr(0, i) = right[i];
+        matr(1, i) = up[i];
+        matr(2, i) = forward[i];
+        matr(3, i) = from[i];
+    }
+    return matr;
+}
+
+// Pinhole camera described by CameraOptions. The world-space direction through a
+// point of the image plane is affine in pixel coordinates, so it is built from
+// precomputed per-row and per-column steps instead of a matrix product per ray.
+// Pixel (y, x) has its center at coordinates (y, x).
+class Camera {
+public:
+    explicit Camera(const CameraOptions& options)
+        : origin_(options.look_from),
+          camera_to_world_(LookAt(options.look_from, options.look_to)) {
+        double height = 2 * std::tan(options.fov / 2);
+        double pixel_size = height / options.screen_height;
+        pixel_spread_ = pixel_size;
+        double width = height * options.screen_width / options.screen_height;
+        image_left_ = -width / 2 + pixel_size / 2;
+        image_top_ = height / 2 - pixel_size / 2;
+        top_left_ = MultDirMatrix({image_left_, image_top_, -1}, camera_to_world_);
+        right_step_ = MultDirMatrix({pixel_size, 0, 0}, camera_to_world_);
+        down_step_ = MultDirMatrix({0, -pixel_size, 0}, camera_to_world_);
+    }
+
+    const Vector& GetOrigin() const {
+        return origin_;
+    }
+    const Matrix4& GetCameraToWorld() const {
+        return camera_to_world_;
+    }
+    // Width of a pixel at distance 1 along the view direction.
+    double GetPixelSpread() const {
+        return pixel_spread_;
+    }
+
+    // Normalized direction through the image point (y, x).
+    Vector GetDirection(double y, double x) const {
+        Vector dir = top_left_ + down_step_.MultiplyOnScalar(y) + right_step_.MultiplyOnScalar(x);
+        dir.Normalize();
+        return dir;
+    }
+    Ray GetRay(double y, double x) const {
+        return Ray(origin_, GetDirection(y, x));
+    }
+
+    // Position of the world point p in camera space, where the camera looks down -z.
+    Vector ToCameraSpace(const Vector& p) const {
+        Vector offset = p - origin_;
+        Vector result;
+        for (int i = 0; i < 3; ++i) {
+            result[i] = offset[0] * camera_to_world_(i, 0) + offset[1] * camera_to_world_(i, 1) +
+                        offset[2] * camera_to_world_(i, 2);
+        }
+        return result;
+    }
+    // Image coordinates (x, y) of the camera-space point p in front of the camera;
+    // the inverse of GetDirection.
+    std::pair<double, double> Project(const Vector& p) const {
+        double depth = -p[2];
+        return {(p[0] / depth - image_left_) / pixel_spread_,
+                (image_top_ - p[1] / depth) / pixel_spread_};
+    }
+    // Length of the direction through the image point (y, x) before it is
+    // normalized: the distance along the ray per unit of camera-space depth.
+    double GetDepthScale(double y, double x) const {
+        double dx = image_left_ + pixel_spread_ * x;
+        double dy = image_top_ - pixel_spread_ * y;
+        return std::sqrt(dx * dx + dy * dy + 1);
+    }
+
+    // Directions through the pixels x0, ..., x1 - 1 of row y; same values as GetDirection.
+    void GetRowDirections(int y, int x0, int x1, Vector* out) const {
+        Vector row_start = top_left_ + down_step_.MultiplyOnScalar(y);
+        for (int x = x0; x < x1; ++x) {
+            Vector dir = row_start + right_step_.MultiplyOnScalar(x);
+            dir.Normalize();
+            out[x - x0] = dir;
+        }
+    }
+
+private:
+    Vector origin_;
+    Matrix4 camera_to_world_;
+    double pixel_spread_;
+    double image_left_;
+    double image_top_;
+    Vector top_left_;
+    Vector right_step_;
+    Vector down_step_;
+};
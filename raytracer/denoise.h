@@ -0,0 +1,152 @@
+#pragma once
+
+#include <framebuffer.h>
+#include <parallel.h>
+#include <options/render_options.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// Passes past this reach further than any frame is wide.
+constexpr int kMaxDenoiseIterations = 16;
+
+// e^-x for x >= 0, to about 1e-4 relative while x is small, as 2^(integer part)
+// built in the exponent bits times a polynomial of the fraction. Large x is bent
+// towards 80 rather than clamped: a comparison would keep loops of it from
+// vectorizing.
+float FastExpNegative(float x) {
+    float power = -x / (1.f + x * (1.f / 80)) * 1.44269504f;
+    int whole = static_cast<int>(power);
+    float t = (power - whole) * .693147181f;
+    float fraction =
+        1.f + t * (1.f + t * (.5f + t * (1.f / 6 + t * (1.f / 24 + t * (1.f / 120)))));
+    return std::bit_cast<float>(static_cast<uint32_t>(whole + 127) << 23) * fraction;
+}
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) of the 3-channel
+// color. Every pass blurs with the 5x5 B3-spline kernel spread 2^pass pixels
+// apart, each neighbour weighted down by its difference to the pixel in color,
+// depth and normal, so noise is averaged within surfaces but not across their
+// edges. depth and normal are the frames of kDepth and kNormal for the same
+// camera; pixels where nothing was hit count as one surface.
+//
+// Rows are filtered in parallel, in runs of kRun pixels whose sums live in local
+// arrays. The frames are copied to padded planes first, so a kernel tap is one
+// branch-free loop of unit-stride loads over a run that the compiler vectorizes.
+void Denoise(const Framebuffer& depth, const Framebuffer& normal, const DenoiseOptions& options,
+             Framebuffer* color) {
+    if (options.iterations <= 0) {
+        return;
+    }
+    if (options.iterations > kMaxDenoiseIterations) {
+        throw std::invalid_argument("Too many denoising iterations: " +
+                                    std::to_string(options.iterations));
+    }
+    constexpr int kRun = 64;
+    constexpr float kKernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+    enum Plane { kNormalX, kNormalY, kNormalZ, kDepth, kDepthScale, kMissed, kInside, kPlanes };
+    int width = color->Width();
+    int height = color->Height();
+    int pad = 2 << (options.iterations - 1);
+    int runs = (width + kRun - 1) / kRun;
+    int padded = pad + runs * kRun + pad;
+
+    // Row y of plane k is row y * planes + k; the padding stays zero, outside.
+    Framebuffer guide(padded, height * kPlanes, 1);
+    Framebuffer colors[2] = {Framebuffer(padded, height * 3, 1), Framebuffer(padded, height * 3, 1)};
+    ParallelFor(0, height, [&](int y) {
+        auto plane = [&](int k) { return guide.Row(y * kPlanes + k) + pad; };
+        for (int x = 0; x < width; ++x) {
+            float z = depth.Row(y)[x];
+            for (int c = 0; c < 3; ++c) {
+                plane(kNormalX + c)[x] = normal.Row(y)[3 * x + c];
+                colors[0].Row(3 * y + c)[pad + x] = color->Row(y)[3 * x + c];
+            }
+            plane(kDepth)[x] = z;
+            plane(kDepthScale)[x] =
+                options.sigma_depth > 0
+                    ? 1.f / (options.sigma_depth * std::max(std::abs(z), 1e-6f))
+                    : 0.f;
+            plane(kMissed)[x] = z < 0 ? 1.f : 0.f;
+            plane(kInside)[x] = 1.f;
+        }
+    });
+
+    for (int pass = 0; pass < options.iterations; ++pass) {
+        int step = 1 << pass;
+        float sigma = options.sigma_color / step;
+        float color_scale = 1.f / (sigma * sigma);
+        const Framebuffer& src = colors[pass % 2];
+        Framebuffer& dst = colors[(pass + 1) % 2];
+        ParallelFor(0, height, [&](int y) {
+            const float* p[kPlanes];
+            for (int k = 0; k < kPlanes; ++k) {
+                p[k] = guide.Row(y * kPlanes + k);
+            }
+            const float* p_color[3] = {src.Row(3 * y), src.Row(3 * y + 1), src.Row(3 * y + 2)};
+            for (int run = 0; run < runs; ++run) {
+                int begin = pad + run * kRun;
+                float weights[kRun] = {};
+                float sums[3][kRun] = {};
+                for (int ky = -2; ky <= 2; ++ky) {
+                    int qy = y + ky * step;
+                    if (qy < 0 || qy >= height) {
+                        continue;
+                    }
+                    const float* q[kPlanes];
+                    for (int k = 0; k < kPlanes; ++k) {
+                        q[k] = guide.Row(qy * kPlanes + k);
+                    }
+                    const float* q_color[3] = {src.Row(3 * qy), src.Row(3 * qy + 1),
+                                               src.Row(3 * qy + 2)};
+                    for (int kx = -2; kx <= 2; ++kx) {
+                        int a = begin;
+                        int b = begin + kx * step;
+                        float tap = kKernel[ky + 2] * kKernel[kx + 2];
+                        float depth_factor =
+                            1.f / (step * std::max(1.f, std::hypot(1.f * kx, 1.f * ky)));
+                        for (int i = 0; i < kRun; ++i) {
+                            float dr = p_color[0][a + i] - q_color[0][b + i];
+                            float dg = p_color[1][a + i] - q_color[1][b + i];
+                            float db = p_color[2][a + i] - q_color[2][b + i];
+                            float cosine = p[kNormalX][a + i] * q[kNormalX][b + i] +
+                                           p[kNormalY][a + i] * q[kNormalY][b + i] +
+                                           p[kNormalZ][a + i] * q[kNormalZ][b + i] +
+                                           p[kMissed][a + i] * q[kMissed][b + i];
+                            float exponent =
+                                (dr * dr + dg * dg + db * db) * color_scale +
+                                std::abs(p[kDepth][a + i] - q[kDepth][b + i]) *
+                                    p[kDepthScale][a + i] * depth_factor +
+                                (1.f - cosine) * options.normal_power;
+                            float weight = tap * q[kInside][b + i] * FastExpNegative(exponent);
+                            weights[i] += weight;
+                            sums[0][i] += weight * q_color[0][b + i];
+                            sums[1][i] += weight * q_color[1][b + i];
+                            sums[2][i] += weight * q_color[2][b + i];
+                        }
+                    }
+                }
+                int count = std::min(kRun, width - run * kRun);
+                for (int c = 0; c < 3; ++c) {
+                    float* out = dst.Row(3 * y + c) + begin;
+                    for (int i = 0; i < count; ++i) {
+                        out[i] = sums[c][i] / weights[i];
+                    }
+                }
+            }
+        });
+    }
+
+    const Framebuffer& result = colors[options.iterations % 2];
+    ParallelFor(0, height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                color->Row(y)[3 * x + c] = result.Row(3 * y + c)[pad + x];
+            }
+        }
+    });
+}
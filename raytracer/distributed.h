@@ -0,0 +1,298 @@
+#pragma once
+
+#include <raytracer.h>
+#include <socket_messages.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Tile protocol between a coordinator and its render workers:
+//   kJob      coordinator -> worker: scene path, CameraOptions, RenderOptions
+//   kTile     coordinator -> worker: tile index, Tile
+//   kPixels   worker -> coordinator: tile index, tile maximum, tile pixels row by row
+//   kShutdown coordinator -> worker
+// Options are sent as raw structs, so workers must be built from the same sources
+// as the coordinator.
+enum class TileMessage : uint32_t { kJob, kTile, kPixels, kShutdown };
+
+// Serves one coordinator connection until shutdown or disconnect. The scene is
+// loaded once, when the job arrives.
+void RunRenderWorker(int fd) {
+    std::optional<Message> job = ReceiveMessage(fd);
+    if (!job || job->type != static_cast<uint32_t>(TileMessage::kJob)) {
+        return;
+    }
+    std::filesystem::path scene_path = job->payload.GetString();
+    auto camera_options = job->payload.Get<CameraOptions>();
+    auto render_options = job->payload.Get<RenderOptions>();
+    Scene scene = ReadScene(scene_path);
+    auto accelerator = GetFrameAccelerator(scene, camera_options, render_options);
+    int channels = FrameChannels(render_options.mode);
+    while (std::optional<Message> message = ReceiveMessage(fd)) {
+        if (message->type != static_cast<uint32_t>(TileMessage::kTile)) {
+            break;
+        }
+        auto index = message->payload.Get<int32_t>();
+        auto tile = message->payload.Get<Tile>();
+        Framebuffer pixels(tile.x1 - tile.x0, tile.y1 - tile.y0, channels);
+        float max_value = RenderTile(scene, *accelerator, camera_options, render_options, tile,
+                                     &pixels, tile.x0, tile.y0);
+        MessageWriter reply;
+        reply.Put<int32_t>(index);
+        reply.Put(max_value);
+        for (int y = 0; y < pixels.Height(); ++y) {
+            reply.PutFloats(pixels.Row(y), static_cast<size_t>(pixels.Width()) * channels);
+        }
+        if (!SendMessage(fd, TileMessage::kPixels, reply)) {
+            break;
+        }
+    }
+}
+
+// A connected worker. pid is -1 for workers this process did not start.
+struct WorkerProcess {
+    int fd;
+    pid_t pid = -1;
+};
+
+// Descriptor of the coordinator connection in a worker started by
+// LaunchLocalWorkers.
+constexpr int kWorkerFd = 3;
+
+// Starts count workers by running executable --render-worker, each connected
+// to the caller through a socket pair on kWorkerFd; a program without a
+// directory is searched in PATH. Workers are never forked without exec: the
+// threads of the render scheduler do not survive a fork, and a child could
+// block on a lock one of them held.
+std::vector<WorkerProcess> LaunchLocalWorkers(int count, const std::filesystem::path& executable) {
+    std::string program = executable.string();
+    std::string fd = std::to_string(kWorkerFd);
+    char* argv[] = {program.data(), const_cast<char*>("--render-worker"), fd.data(), nullptr};
+    std::vector<WorkerProcess> workers;
+    for (int i = 0; i < count; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            throw std::runtime_error("socketpair failed");
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], kWorkerFd);
+        pid_t pid;
+        int error = posix_spawnp(&pid, program.c_str(), &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (error != 0) {
+            close(fds[0]);
+            throw std::runtime_error("Cannot start " + program + ": " + std::strerror(error));
+        }
+        workers.push_back({fds[0], pid});
+    }
+    return workers;
+}
+
+// Runs a worker of LaunchLocalWorkers if the arguments of main ask for one, and
+// then tells main to exit.
+bool RunRenderWorkerFromArgs(int argc, char** argv) {
+    if (argc < 3 || std::strcmp(argv[1], "--render-worker") != 0) {
+        return false;
+    }
+    RunRenderWorker(std::stoi(argv[2]));
+    return true;
+}
+
+struct DistributedOptions {
+    int workers = 4;
+    // Program run by every local worker, see LaunchLocalWorkers.
+    std::filesystem::path worker_executable = "raytracer_server";
+    // A worker that returns nothing for this long is killed and its tiles re-sent.
+    std::chrono::milliseconds stall_timeout{10000};
+    // Tiles queued on a worker at once, so it never waits for the next one.
+    int tiles_in_flight = 2;
+};
+
+// Hands the tiles of the frame out to workers and assembles their pixels. Tiles
+// of a worker that dies or stalls go to the others; if none are left the rest is
+// traced in this process. The result is bit-identical to RenderFrame; with
+// RenderOptions::denoise it is filtered here, like the frame of Render.
+RenderedFrame RenderDistributed(const std::filesystem::path& scene_path,
+                                const CameraOptions& camera_options,
+                                const RenderOptions& render_options,
+                                std::vector<WorkerProcess> processes,
+                                const DistributedOptions& options = {}) {
+    using Clock = std::chrono::steady_clock;
+    struct WorkerState {
+        WorkerProcess process;
+        bool alive = true;
+        std::deque<int> assigned = {};
+        Clock::time_point last_progress = {};
+    };
+    int channels = FrameChannels(render_options.mode);
+    RenderedFrame result{
+        Framebuffer(camera_options.screen_width, camera_options.screen_height, channels)};
+    std::vector<Tile> tiles = SplitIntoTiles(camera_options.screen_width,
+                                             camera_options.screen_height, render_options.tile_size);
+    std::vector<float> tile_max(tiles.size(), 0.f);
+    std::vector<bool> done(tiles.size(), false);
+    size_t remaining = tiles.size();
+    std::deque<int> pending;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        pending.push_back(t);
+    }
+
+    std::vector<WorkerState> workers;
+    for (const auto& process : processes) {
+        workers.push_back({process});
+    }
+    auto fail = [&](WorkerState& worker) {
+        worker.alive = false;
+        for (auto it = worker.assigned.rbegin(); it != worker.assigned.rend(); ++it) {
+            pending.push_front(*it);
+        }
+        worker.assigned.clear();
+        if (worker.process.pid > 0) {
+            kill(worker.process.pid, SIGKILL);
+        }
+        close(worker.process.fd);
+    };
+    timeval receive_timeout{options.stall_timeout.count() / 1000,
+                            options.stall_timeout.count() % 1000 * 1000};
+    MessageWriter job;
+    job.PutString(scene_path.string());
+    job.Put(camera_options);
+    job.Put(render_options);
+    for (auto& worker : workers) {
+        setsockopt(worker.process.fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout,
+                   sizeof(receive_timeout));
+        if (!SendMessage(worker.process.fd, TileMessage::kJob, job)) {
+            fail(worker);
+        }
+    }
+
+    auto receive_tile = [&](WorkerState& worker) {
+        std::optional<Message> message = ReceiveMessage(worker.process.fd);
+        if (!message || message->type != static_cast<uint32_t>(TileMessage::kPixels)) {
+            return false;
+        }
+        auto index = message->payload.Get<int32_t>();
+        auto it = std::find(worker.assigned.begin(), worker.assigned.end(), index);
+        if (it == worker.assigned.end()) {
+            return false;
+        }
+        worker.assigned.erase(it);
+        worker.last_progress = Clock::now();
+        if (done[index]) {
+            return true;
+        }
+        const Tile& tile = tiles[index];
+        tile_max[index] = message->payload.Get<float>();
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            message->payload.GetFloats(result.frame.Row(y) + tile.x0 * channels,
+                                       static_cast<size_t>(tile.x1 - tile.x0) * channels);
+        }
+        done[index] = true;
+        --remaining;
+        return true;
+    };
+
+    while (remaining > 0) {
+        std::vector<pollfd> fds;
+        std::vector<WorkerState*> polled;
+        for (auto& worker : workers) {
+            while (worker.alive && !pending.empty() &&
+                   static_cast<int>(worker.assigned.size()) < options.tiles_in_flight) {
+                int index = pending.front();
+                pending.pop_front();
+                if (done[index]) {
+                    continue;
+                }
+                MessageWriter request;
+                request.Put<int32_t>(index);
+                request.Put(tiles[index]);
+                if (worker.assigned.empty()) {
+                    worker.last_progress = Clock::now();
+                }
+                worker.assigned.push_back(index);
+                if (!SendMessage(worker.process.fd, TileMessage::kTile, request)) {
+                    fail(worker);
+                }
+            }
+            if (worker.alive && !worker.assigned.empty()) {
+                fds.push_back({worker.process.fd, POLLIN, 0});
+                polled.push_back(&worker);
+            }
+        }
+        if (polled.empty()) {
+            break;
+        }
+        poll(fds.data(), fds.size(), 50);
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents != 0 && !receive_tile(*polled[i])) {
+                fail(*polled[i]);
+            }
+        }
+        auto now = Clock::now();
+        for (WorkerState* worker : polled) {
+            if (worker->alive && !worker->assigned.empty() &&
+                now - worker->last_progress > options.stall_timeout) {
+                fail(*worker);
+            }
+        }
+    }
+
+    std::optional<Scene> scene;
+    if (remaining > 0) {
+        scene.emplace(ReadScene(scene_path));
+        auto accelerator = GetFrameAccelerator(*scene, camera_options, render_options);
+        std::vector<int> left(pending.begin(), pending.end());
+        ParallelFor(0, left.size(), [&](int k) {
+            int index = left[k];
+            if (!done[index]) {
+                tile_max[index] = RenderTile(*scene, *accelerator, camera_options,
+                                             render_options, tiles[index], &result.frame);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        if (worker.alive) {
+            SendMessage(worker.process.fd, TileMessage::kShutdown);
+            close(worker.process.fd);
+        }
+        if (worker.process.pid > 0) {
+            waitpid(worker.process.pid, nullptr, 0);
+        }
+    }
+    for (float value : tile_max) {
+        result.max_value = std::max(result.max_value, value);
+    }
+    if (Denoises(render_options)) {
+        if (!scene) {
+            scene.emplace(ReadScene(scene_path));
+        }
+        DenoiseFrame(*scene, camera_options, render_options, &result);
+    }
+    return result;
+}
+
+RenderedFrame RenderDistributed(const std::filesystem::path& scene_path,
+                                const CameraOptions& camera_options,
+                                const RenderOptions& render_options,
+                                const DistributedOptions& options = {}) {
+    return RenderDistributed(scene_path, camera_options, render_options,
+                             LaunchLocalWorkers(options.workers, options.worker_executable),
+                             options);
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+struct SequenceFrame {
+    CameraOptions camera;
+    // Written as PNG unless empty.
+    std::filesystem::path output;
+    // Applied to the scene just before the frame is traced, once the frames before
+    // it are traced; the other stages never read the scene.
+    std::function<void(Scene&)> update = {};
+};
+
+struct SequenceOptions {
+    // Frames traced but not written yet; tracing waits for one to be written
+    // once there are this many.
+    int max_in_flight = 2;
+    // Called on the encoding thread with every image, in order, before it is
+    // written.
+    std::function<void(int, const Image&)> on_frame = {};
+};
+
+struct StageStats {
+    int frames = 0;
+    // Time spent on the frames, and waiting for a frame or for room for one.
+    double busy_ms = 0;
+    double waiting_ms = 0;
+};
+
+struct SequenceStats {
+    double wall_ms = 0;
+    StageStats trace;
+    StageStats tone_map;
+    StageStats encode;
+    // Most frames traced but not written at once.
+    int max_in_flight = 0;
+
+    // Share of the wall time a stage was busy.
+    double Utilization(const StageStats& stage) const {
+        return wall_ms > 0 ? stage.busy_ms / wall_ms : 0;
+    }
+};
+
+// Queue between two stages of RenderSequence. Pop waits for an item and returns
+// none once the queue is closed and empty.
+template <class T>
+class StageQueue {
+public:
+    void Push(T item) {
+        {
+            std::lock_guard lock(mutex_);
+            items_.push_back(std::move(item));
+        }
+        ready_.notify_one();
+    }
+
+    std::optional<T> Pop() {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(items_.front());
+        items_.pop_front();
+        return item;
+    }
+
+    void Close() {
+        {
+            std::lock_guard lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+// Renders the frames of a sequence of scene through three stages that overlap:
+// frame N + 1 is traced on all cores while frame N is tone mapped on one
+// background thread and encoded to PNG on another. At most
+// SequenceOptions::max_in_flight frames are past tracing at once, which bounds
+// the memory of the frames waiting. Each image is that of Render for its camera
+// and the scene as updated. The first error of a stage stops the sequence and is
+// rethrown once all stages are done.
+SequenceStats RenderSequence(Scene& scene, const std::vector<SequenceFrame>& frames,
+                             const RenderOptions& render_options,
+                             const SequenceOptions& options = {}) {
+    using Clock = std::chrono::steady_clock;
+    auto elapsed_ms = [](Clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    };
+    auto start = Clock::now();
+    SequenceStats stats;
+    std::mutex mutex;
+    std::condition_variable written;
+    int in_flight = 0;
+    std::exception_ptr error;
+    auto fail = [&] {
+        std::lock_guard lock(mutex);
+        if (!error) {
+            error = std::current_exception();
+        }
+    };
+    auto failed = [&] {
+        std::lock_guard lock(mutex);
+        return error != nullptr;
+    };
+
+    struct Traced {
+        int index;
+        RenderedFrame result;
+    };
+    struct Mapped {
+        int index;
+        Image image;
+    };
+    StageQueue<Traced> traced;
+    StageQueue<Mapped> mapped;
+
+    // A stage that fails keeps taking frames, without work, so that those before
+    // it do not wait for room forever.
+    std::thread tone_map([&] {
+        for (;;) {
+            auto wait_start = Clock::now();
+            std::optional<Traced> item = traced.Pop();
+            stats.tone_map.waiting_ms += elapsed_ms(wait_start);
+            if (!item) {
+                break;
+            }
+            auto busy_start = Clock::now();
+            std::optional<Image> image;
+            if (!failed()) {
+                try {
+                    image = ToImage(item->result, render_options.mode);
+                } catch (...) {
+                    fail();
+                }
+            }
+            if (!image) {
+                image.emplace(0, 0);
+            }
+            stats.tone_map.busy_ms += elapsed_ms(busy_start);
+            ++stats.tone_map.frames;
+            mapped.Push({item->index, std::move(*image)});
+        }
+        mapped.Close();
+    });
+    std::thread encode([&] {
+        for (;;) {
+            auto wait_start = Clock::now();
+            std::optional<Mapped> item = mapped.Pop();
+            stats.encode.waiting_ms += elapsed_ms(wait_start);
+            if (!item) {
+                break;
+            }
+            auto busy_start = Clock::now();
+            if (!failed()) {
+                try {
+                    if (options.on_frame) {
+                        options.on_frame(item->index, item->image);
+                    }
+                    const auto& output = frames[item->index].output;
+                    if (!output.empty()) {
+                        item->image.Write(output);
+                    }
+                } catch (...) {
+                    fail();
+                }
+            }
+            stats.encode.busy_ms += elapsed_ms(busy_start);
+            ++stats.encode.frames;
+            {
+                std::lock_guard lock(mutex);
+                --in_flight;
+            }
+            written.notify_one();
+        }
+    });
+
+    for (int index = 0; index < static_cast<int>(frames.size()); ++index) {
+        auto wait_start = Clock::now();
+        {
+            std::unique_lock lock(mutex);
+            written.wait(lock, [&] { return in_flight < std::max(options.max_in_flight, 1); });
+            if (error) {
+                break;
+            }
+            ++in_flight;
+            stats.max_in_flight = std::max(stats.max_in_flight, in_flight);
+        }
+        stats.trace.waiting_ms += elapsed_ms(wait_start);
+        auto busy_start = Clock::now();
+        const SequenceFrame& frame = frames[index];
+        std::optional<RenderedFrame> result;
+        try {
+            if (frame.update) {
+                frame.update(scene);
+            }
+            result = RenderFrame(scene, frame.camera, render_options);
+            if (Denoises(render_options)) {
+                DenoiseFrame(scene, frame.camera, render_options, &*result);
+            }
+        } catch (...) {
+            fail();
+        }
+        stats.trace.busy_ms += elapsed_ms(busy_start);
+        if (!result) {
+            std::lock_guard lock(mutex);
+            --in_flight;
+            break;
+        }
+        ++stats.trace.frames;
+        traced.Push({index, std::move(*result)});
+    }
+    traced.Close();
+    tone_map.join();
+    encode.join();
+    stats.wall_ms = elapsed_ms(start);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return stats;
+}
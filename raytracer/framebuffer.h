@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+// Contiguous float image. Every row starts on a cache line, so per-row passes
+// can be vectorized without peeling.
+class Framebuffer {
+public:
+    static constexpr size_t kAlignment = 64;
+
+    Framebuffer(int width, int height, int channels = 3)
+        : width_(width),
+          height_(height),
+          channels_(channels),
+          stride_(RoundUp(static_cast<size_t>(width) * channels)),
+          data_(Allocate(stride_ * height)) {
+        Fill(0.f);
+    }
+
+    int Width() const {
+        return width_;
+    }
+    int Height() const {
+        return height_;
+    }
+    int Channels() const {
+        return channels_;
+    }
+    // Distance between the starts of two consecutive rows, in floats.
+    size_t Stride() const {
+        return stride_;
+    }
+
+    float* Row(int y) {
+        return data_.get() + y * stride_;
+    }
+    const float* Row(int y) const {
+        return data_.get() + y * stride_;
+    }
+
+    void SetPixel(const Vector& value, int y, int x) {
+        float* pixel = Row(y) + x * channels_;
+        for (int c = 0; c < channels_; ++c) {
+            pixel[c] = value[c];
+        }
+    }
+    Vector GetPixel(int y, int x) const {
+        const float* pixel = Row(y) + x * channels_;
+        Vector value;
+        for (int c = 0; c < channels_; ++c) {
+            value[c] = pixel[c];
+        }
+        return value;
+    }
+
+    void Fill(float value) {
+        std::fill(data_.get(), data_.get() + stride_ * height_, value);
+    }
+
+private:
+    struct AlignedDeleter {
+        void operator()(float* ptr) const {
+            ::operator delete[](ptr, std::align_val_t(kAlignment));
+        }
+    };
+
+    static size_t RoundUp(size_t count) {
+        constexpr size_t kFloats = kAlignment / sizeof(float);
+        return (count + kFloats - 1) / kFloats * kFloats;
+    }
+
+    static std::unique_ptr<float[], AlignedDeleter> Allocate(size_t count) {
+        void* ptr = ::operator new[](std::max<size_t>(count, 1) * sizeof(float),
+                                     std::align_val_t(kAlignment));
+        return std::unique_ptr<float[], AlignedDeleter>(static_cast<float*>(ptr));
+    }
+
+    int width_;
+    int height_;
+    int channels_;
+    size_t stride_;
+    std::unique_ptr<float[], AlignedDeleter> data_;
+};
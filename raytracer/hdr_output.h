@@ -0,0 +1,238 @@
+#pragma once
+
+#include <framebuffer.h>
+#include <tiles.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Receives finished tiles while a frame is still being traced. WriteTile may be
+// called concurrently from several render threads.
+class FrameSink {
+public:
+    virtual ~FrameSink() = default;
+
+    virtual void WriteTile(const Framebuffer& frame, const Tile& tile) = 0;
+    virtual void Finish() {
+    }
+};
+
+class BinaryFile {
+public:
+    explicit BinaryFile(const std::filesystem::path& path)
+        : file_(path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc) {
+        if (!file_) {
+            throw std::runtime_error("Can't open " + path.string());
+        }
+    }
+
+    void Seek(uint64_t offset) {
+        file_.seekp(offset);
+    }
+    uint64_t Tell() {
+        return file_.tellp();
+    }
+    void Write(const void* data, size_t size) {
+        file_.write(static_cast<const char*>(data), size);
+        if (!file_) {
+            throw std::runtime_error("Write failed");
+        }
+    }
+    void Read(void* data, size_t size) {
+        file_.read(static_cast<char*>(data), size);
+        if (!file_) {
+            throw std::runtime_error("Read failed");
+        }
+    }
+    void WriteString(const std::string& s) {
+        Write(s.data(), s.size() + 1);
+    }
+    template <class T>
+    void WriteLittleEndian(T value) {
+        static_assert(std::endian::native == std::endian::little);
+        Write(&value, sizeof(value));
+    }
+    void Flush() {
+        file_.flush();
+    }
+
+private:
+    std::fstream file_;
+};
+
+// Portable float map: linear float RGB (or greyscale for one channel), stored
+// bottom row first. Every row has a fixed offset, so tiles land in place.
+class PfmWriter : public FrameSink {
+public:
+    PfmWriter(const std::filesystem::path& path, int width, int height, int channels)
+        : file_(path), width_(width), height_(height), channels_(channels) {
+        std::string header = std::string(channels == 1 ? "Pf" : "PF") + "\n" +
+                             std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+        file_.Write(header.data(), header.size());
+        data_offset_ = header.size();
+        uint64_t row_bytes = static_cast<uint64_t>(width) * channels * sizeof(float);
+        if (height > 0 && row_bytes > 0) {
+            file_.Seek(data_offset_ + row_bytes * height - 1);
+            file_.Write("", 1);
+        }
+    }
+
+    void WriteTile(const Framebuffer& frame, const Tile& tile) override {
+        std::lock_guard lock(mutex_);
+        uint64_t row_bytes = static_cast<uint64_t>(width_) * channels_ * sizeof(float);
+        size_t count = static_cast<size_t>(tile.x1 - tile.x0) * channels_;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            file_.Seek(data_offset_ + row_bytes * (height_ - 1 - y) +
+                       static_cast<uint64_t>(tile.x0) * channels_ * sizeof(float));
+            file_.Write(frame.Row(y) + tile.x0 * channels_, count * sizeof(float));
+        }
+    }
+
+    void Finish() override {
+        std::lock_guard lock(mutex_);
+        file_.Flush();
+    }
+
+private:
+    BinaryFile file_;
+    int width_;
+    int height_;
+    int channels_;
+    uint64_t data_offset_;
+    std::mutex mutex_;
+};
+
+// Single-part tiled OpenEXR with FLOAT channels and no compression. Tiles are
+// appended in completion order (lineOrder RANDOM_Y); the offset table is
+// patched in Finish.
+class ExrWriter : public FrameSink {
+public:
+    ExrWriter(const std::filesystem::path& path, int width, int height, int channels,
+              int tile_size)
+        : file_(path),
+          width_(width),
+          height_(height),
+          channels_(channels),
+          tile_size_(tile_size),
+          tiles_x_((width + tile_size - 1) / tile_size),
+          tiles_y_((height + tile_size - 1) / tile_size),
+          offsets_(static_cast<size_t>(tiles_x_) * tiles_y_, 0) {
+        file_.WriteLittleEndian<int32_t>(20000630);
+        file_.WriteLittleEndian<int32_t>(2 | 0x200);
+
+        std::vector<std::string> names = ChannelNames();
+        WriteAttributeHeader("channels", "chlist", names.size() * 18 + 1);
+        for (const auto& name : names) {
+            file_.WriteString(name);
+            file_.WriteLittleEndian<int32_t>(2);
+            file_.WriteLittleEndian<int32_t>(0);
+            file_.WriteLittleEndian<int32_t>(1);
+            file_.WriteLittleEndian<int32_t>(1);
+        }
+        file_.Write("", 1);
+        WriteAttributeHeader("compression", "compression", 1);
+        file_.WriteLittleEndian<uint8_t>(0);
+        for (const char* window : {"dataWindow", "displayWindow"}) {
+            WriteAttributeHeader(window, "box2i", 16);
+            file_.WriteLittleEndian<int32_t>(0);
+            file_.WriteLittleEndian<int32_t>(0);
+            file_.WriteLittleEndian<int32_t>(width - 1);
+            file_.WriteLittleEndian<int32_t>(height - 1);
+        }
+        WriteAttributeHeader("lineOrder", "lineOrder", 1);
+        file_.WriteLittleEndian<uint8_t>(2);
+        WriteAttributeHeader("pixelAspectRatio", "float", 4);
+        file_.WriteLittleEndian<float>(1.f);
+        WriteAttributeHeader("screenWindowCenter", "v2f", 8);
+        file_.WriteLittleEndian<float>(0.f);
+        file_.WriteLittleEndian<float>(0.f);
+        WriteAttributeHeader("screenWindowWidth", "float", 4);
+        file_.WriteLittleEndian<float>(1.f);
+        WriteAttributeHeader("tiles", "tiledesc", 9);
+        file_.WriteLittleEndian<uint32_t>(tile_size);
+        file_.WriteLittleEndian<uint32_t>(tile_size);
+        file_.WriteLittleEndian<uint8_t>(0);
+        file_.Write("", 1);
+
+        table_offset_ = file_.Tell();
+        WriteOffsetTable();
+    }
+
+    // The tile must lie on the tile_size grid this writer was created with.
+    void WriteTile(const Framebuffer& frame, const Tile& tile) override {
+        int tx = tile.x0 / tile_size_;
+        int ty = tile.y0 / tile_size_;
+        int tile_width = tile.x1 - tile.x0;
+        if (tile.x0 % tile_size_ || tile.y0 % tile_size_ ||
+            tile_width != std::min(tile_size_, width_ - tile.x0) ||
+            tile.y1 - tile.y0 != std::min(tile_size_, height_ - tile.y0)) {
+            throw std::invalid_argument("Tile is not aligned to the EXR tile grid");
+        }
+        // Scanlines of a tile store each channel contiguously, channels sorted by name.
+        std::vector<float> data;
+        data.reserve(static_cast<size_t>(tile_width) * (tile.y1 - tile.y0) * channels_);
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            const float* row = frame.Row(y);
+            for (int c = channels_ - 1; c >= 0; --c) {
+                for (int x = tile.x0; x < tile.x1; ++x) {
+                    data.push_back(row[x * channels_ + c]);
+                }
+            }
+        }
+        std::lock_guard lock(mutex_);
+        offsets_[ty * tiles_x_ + tx] = file_.Tell();
+        file_.WriteLittleEndian<int32_t>(tx);
+        file_.WriteLittleEndian<int32_t>(ty);
+        file_.WriteLittleEndian<int32_t>(0);
+        file_.WriteLittleEndian<int32_t>(0);
+        file_.WriteLittleEndian<int32_t>(data.size() * sizeof(float));
+        file_.Write(data.data(), data.size() * sizeof(float));
+    }
+
+    void Finish() override {
+        std::lock_guard lock(mutex_);
+        uint64_t end = file_.Tell();
+        file_.Seek(table_offset_);
+        WriteOffsetTable();
+        file_.Seek(end);
+        file_.Flush();
+    }
+
+private:
+    std::vector<std::string> ChannelNames() const {
+        if (channels_ == 1) {
+            return {"Y"};
+        }
+        return {"B", "G", "R"};
+    }
+
+    void WriteAttributeHeader(const std::string& name, const std::string& type, int32_t size) {
+        file_.WriteString(name);
+        file_.WriteString(type);
+        file_.WriteLittleEndian<int32_t>(size);
+    }
+
+    void WriteOffsetTable() {
+        for (uint64_t offset : offsets_) {
+            file_.WriteLittleEndian<uint64_t>(offset);
+        }
+    }
+
+    BinaryFile file_;
+    int width_;
+    int height_;
+    int channels_;
+    int tile_size_;
+    int tiles_x_;
+    int tiles_y_;
+    uint64_t table_offset_;
+    std::vector<uint64_t> offsets_;
+    std::mutex mutex_;
+};
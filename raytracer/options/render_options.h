@@ -1,8 +1,70 @@
 #pragma once
 
-enum class RenderMode { kDepth, kNormal, kFull };
+#include <accelerator.h>
+#include <sampler.h>
+#include <scheduler.h>
+
+enum class RenderMode { kDepth, kNormal, kFull, kPathTrace };
+
+enum class PixelOrder { kScanline, kSpaceFilling };
+
+enum class PrimaryVisibility { kTrace, kRasterize };
+
+// Edge-avoiding filter of the radiance of Render, guided by the depth and normals
+// of the primary rays. The defaults are tuned on the Cornell box.
+struct DenoiseOptions {
+    // A-trous passes, each with twice the reach of the last; 0 turns the filter
+    // off, 3 suits most frames and more than 16 are rejected.
+    int iterations = 0;
+    // Radiance difference that cuts the weight of a neighbour by e in the first
+    // pass, at one path per pixel. It shrinks with the square root of the paths
+    // and halves every pass.
+    float sigma_color = 1.f;
+    // Depth difference, relative to the depth and per pixel of distance, that cuts
+    // the weight by e; 0 ignores depth.
+    float sigma_depth = .05f;
+    // Weight falls as exp(-normal_power * (1 - cos)) of the angle between normals.
+    float normal_power = 64.f;
+};
 
 struct RenderOptions {
+    // Recursion depth of kFull. kPathTrace ends paths by Russian roulette instead.
     int depth;
     RenderMode mode = RenderMode::kFull;
+    // Paths per pixel of kPathTrace.
+    int samples = 16;
+    // Where the paths of kPathTrace draw their random numbers from.
+    SamplerType sampler = SamplerType::kSobol;
+    // Scrambles the sampler; frames rendered with different seeds are independent.
+    uint32_t seed = 0;
+    int tile_size = 32;
+    // Use kernels specialized on the scene and the options; off forces the
+    // generic kernel.
+    bool specialize = true;
+    // kAuto lets the scene pick the accelerator from its statistics.
+    AcceleratorType accelerator = AcceleratorType::kAuto;
+    // Meshes are traced at the coarsest level of detail whose error projects to at
+    // most this many pixels; 0 traces them all at full detail.
+    double lod_pixel_error = .5;
+    // kSpaceFilling hands out tiles along a Hilbert curve and traces the pixels of
+    // a tile in Morton order, so consecutive rays touch nearby geometry. The
+    // image does not change.
+    PixelOrder pixel_order = PixelOrder::kScanline;
+    // kRasterize scan-converts the triangles and spheres into a visibility buffer
+    // for the primary hits of kDepth, kNormal and kFull instead of tracing them.
+    // Scenes with other primitives and kPathTrace are traced.
+    PrimaryVisibility primary_visibility = PrimaryVisibility::kTrace;
+    // Applied to kPathTrace frames by Render, RenderToFile, PathTrace,
+    // RenderDistributed and RenderSequence, not by RenderFrame. RenderBucketed
+    // rejects it.
+    DenoiseOptions denoise = {};
+    // Class of the tasks of the render on the shared scheduler; kInteractive
+    // previews overtake kBackground frames at the next tile. A render is cancelled
+    // by the stop token of the ScopedJobContext it runs in: tiles not started are
+    // skipped and left black.
+    JobPriority priority = JobPriority::kNormal;
+    // kFull shades the primary hits in batches, the Phong terms of several hits
+    // at once in vector lanes; off shades them one by one. The images agree up to
+    // rounding.
+    bool batch_shading = true;
 };
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <scheduler.h>
+
+#include <functional>
+
+// Calls func(i) for every i in [begin, end) as one job of the render scheduler,
+// with the priority and cancellation of the calling thread. Indices are handed
+// out one by one, so uneven rows or tiles are balanced between threads.
+template <class Func>
+void ParallelFor(int begin, int end, Func&& func) {
+    GetRenderScheduler().Run(begin, end, std::function<void(int)>(std::ref(func)));
+}
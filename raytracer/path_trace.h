@@ -0,0 +1,125 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <vector>
+
+struct PathTraceOptions {
+    // Once it passes, the running pass is abandoned and no new one starts; the
+    // first pass always completes.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Stops like the deadline, but also during the first pass.
+    std::stop_token stop_token = {};
+};
+
+struct PathTraceProgress {
+    int pass = 0;
+    // Paths per pixel so far.
+    int samples = 0;
+    uint64_t paths = 0;
+    double seconds = 0;
+    bool is_final = false;
+
+    double SamplesPerSecond() const {
+        return seconds > 0 ? paths / seconds : 0;
+    }
+};
+
+using PathTraceCallback = std::function<void(const RenderedFrame&, const PathTraceProgress&)>;
+
+// Path traces RenderOptions::samples paths per pixel in passes of 1, 1, 2, 4, ...
+// samples, each doubling the count, and hands the mean radiance after every pass
+// to on_pass. Threads take whole tiles, whose running sums no other thread
+// touches. Sample k of a pixel does not depend on the pass, so the result is
+// that of RenderFrame up to the rounding of the sums between passes, and with
+// RenderOptions::denoise every pass is filtered like the frame of Render. Returns
+// the mean of the finished passes, which is black if none finished.
+RenderedFrame PathTrace(const Scene& scene, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, const PathTraceOptions& options = {},
+                        const PathTraceCallback& on_pass = {}) {
+    using Clock = std::chrono::steady_clock;
+    ScopedJobContext context(render_options.priority);
+    auto frame_accelerator = GetFrameAccelerator(scene, camera_options, render_options);
+    const Accelerator& accelerator = *frame_accelerator;
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    Camera camera(camera_options);
+    std::vector<Tile> tiles = SplitIntoTiles(width, height, render_options.tile_size);
+    if (render_options.pixel_order == PixelOrder::kSpaceFilling) {
+        SortTilesHilbert(&tiles, render_options.tile_size);
+    }
+    Framebuffer sums(width, height);
+    RenderedFrame result{Framebuffer(width, height)};
+    PathTraceProgress progress;
+    int total = std::max(render_options.samples, 1);
+    std::unique_ptr<Sampler> sampler =
+        MakeSampler(render_options.sampler, total, render_options.seed);
+    std::optional<DenoiseGuide> guide;
+    if (Denoises(render_options)) {
+        guide.emplace(width, height);
+    }
+    auto start = Clock::now();
+    for (int pass = 0; progress.samples < total; ++pass) {
+        int first = progress.samples;
+        int last = std::min(total, std::max(1, 2 * first));
+        std::atomic<bool> abandoned = false;
+        WithKernel(SelectKernel(scene, render_options), [&]<KernelFeatures features>() {
+            ParallelFor(0, tiles.size(), [&](int t) {
+                if (abandoned.load(std::memory_order_relaxed) ||
+                    options.stop_token.stop_requested() ||
+                    (pass > 0 && Clock::now() >= options.deadline)) {
+                    abandoned.store(true, std::memory_order_relaxed);
+                    return;
+                }
+                const Tile& tile = tiles[t];
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        Vector sum = SumPathSamples<features>(
+                            accelerator, scene.GetLights(), camera, *sampler, y, x, first, last,
+                            guide ? &*guide : nullptr);
+                        sums.SetPixel(sums.GetPixel(y, x) + sum, y, x);
+                    }
+                }
+            });
+        });
+        // A pass cut short would bias the mean; keep the passes finished before it.
+        if (CurrentJobContext().stop_token.stop_requested()) {
+            result.cancelled = true;
+            break;
+        }
+        if (abandoned) {
+            break;
+        }
+
+        progress.pass = pass;
+        progress.samples = last;
+        progress.paths += static_cast<uint64_t>(last - first) * width * height;
+        progress.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        progress.is_final = last == total;
+        float scale = 1.f / last;
+        ParallelFor(0, height, [&](int y) {
+            const float* src = sums.Row(y);
+            float* dst = result.frame.Row(y);
+            for (int k = 0; k < width * 3; ++k) {
+                dst[k] = src[k] * scale;
+            }
+        });
+        if (guide) {
+            DenoiseFrame(*guide, render_options.denoise, last, &result);
+        } else {
+            result.max_value = MaxValue(result.frame);
+        }
+        if (on_pass) {
+            on_pass(result, progress);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <raytracer.h>
+#include <path_trace.h>
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <stop_token>
+#include <vector>
+
+struct ProgressiveOptions {
+    // Once it passes, the running pass is abandoned and no new one starts. The
+    // first pass always completes so that there is an image to show.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Stops rendering like the deadline, but also during the first pass.
+    std::stop_token stop_token = {};
+    // The first pass traces one pixel of every initial_stride x initial_stride block.
+    int initial_stride = 4;
+    // Recursion depth of the reduced passes; the last pass uses RenderOptions::depth.
+    int preview_depth = 1;
+};
+
+struct ProgressivePass {
+    int index;
+    int stride;
+    int depth;
+    bool is_final;
+};
+
+using ProgressCallback = std::function<void(const Image&, const ProgressivePass&)>;
+
+// Renders in passes of increasing resolution and then at full recursion depth,
+// handing every finished pass to on_pass. Pixels traced by a coarser pass are
+// not traced again, and the full-depth pass shades the primary hits found by
+// the earlier ones. kPathTrace renders full-resolution passes of doubling sample
+// counts instead, through PathTrace. Returns the image of the last finished pass.
+Image RenderProgressive(const Scene& scene, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, const ProgressiveOptions& options,
+                        const ProgressCallback& on_pass = {}) {
+    ScopedJobContext context(render_options.priority);
+    if (render_options.mode == RenderMode::kPathTrace) {
+        std::optional<Image> last;
+        PathTrace(scene, camera_options, render_options, {options.deadline, options.stop_token},
+                  [&](const RenderedFrame& frame, const PathTraceProgress& progress) {
+                      last = ToImage(frame, render_options.mode);
+                      if (on_pass) {
+                          on_pass(*last, {progress.pass, 1, render_options.depth,
+                                          progress.is_final});
+                      }
+                  });
+        if (!last) {
+            return Image(camera_options.screen_width, camera_options.screen_height);
+        }
+        return std::move(*last);
+    }
+    auto frame_accelerator = GetFrameAccelerator(scene, camera_options, render_options);
+    const Accelerator& accelerator = *frame_accelerator;
+    const auto& lights = scene.GetLights();
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    bool full = render_options.mode == RenderMode::kFull;
+    int preview_depth = full ? std::min(options.preview_depth, render_options.depth) : 0;
+
+    std::vector<ProgressivePass> passes;
+    for (int stride = std::bit_floor(static_cast<unsigned>(std::max(options.initial_stride, 1)));
+         stride >= 1; stride /= 2) {
+        passes.push_back({static_cast<int>(passes.size()), stride, preview_depth, false});
+    }
+    if (full && render_options.depth > preview_depth) {
+        passes.push_back({static_cast<int>(passes.size()), 1, render_options.depth, false});
+    }
+    passes.back().is_final = true;
+
+    Camera camera(camera_options);
+    Framebuffer frame(width, height, FrameChannels(render_options.mode));
+    std::vector<Hit> hits(static_cast<size_t>(width) * height);
+    std::optional<Image> last;
+    int prev_stride = 0;
+    for (const auto& pass : passes) {
+        std::atomic<bool> abandoned = false;
+        auto should_stop = [&] {
+            return options.stop_token.stop_requested() ||
+                   (pass.index > 0 && std::chrono::steady_clock::now() >= options.deadline);
+        };
+        bool reshade = pass.stride == prev_stride;
+        ParallelFor(0, (height + pass.stride - 1) / pass.stride, [&](int k) {
+            if (abandoned || should_stop()) {
+                abandoned = true;
+                return;
+            }
+            int y = k * pass.stride;
+            bool on_coarse_row = prev_stride > 0 && y % prev_stride == 0;
+            for (int x = 0; x < width; x += pass.stride) {
+                if (!reshade && on_coarse_row && x % prev_stride == 0) {
+                    continue;
+                }
+                Ray ray = camera.GetRay(y, x);
+                Hit& hit = hits[static_cast<size_t>(y) * width + x];
+                if (!reshade) {
+                    hit = FindClosestHit(accelerator, ray);
+                }
+                if (render_options.mode == RenderMode::kDepth) {
+                    frame.Row(y)[x] = hit.IsValid() ? hit.intersection->GetDistance() : -1.f;
+                } else if (render_options.mode == RenderMode::kNormal) {
+                    frame.SetPixel(hit.IsValid() ? hit.shading_normal : Vector(), y, x);
+                } else {
+                    frame.SetPixel(
+                        hit.IsValid() ? ShadeHit(accelerator, lights, ray, hit, pass.depth, 0,
+                                                 {0, camera.GetPixelSpread()})
+                                      : Vector(),
+                        y, x);
+                }
+            }
+        });
+        if (abandoned) {
+            break;
+        }
+        prev_stride = pass.stride;
+
+        // Pixels not traced yet show the traced pixel at the corner of their block.
+        RenderedFrame shown{Framebuffer(width, height, frame.Channels())};
+        ParallelFor(0, height, [&](int y) {
+            const float* src = frame.Row(y - y % pass.stride);
+            float* dst = shown.frame.Row(y);
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < frame.Channels(); ++c) {
+                    dst[x * frame.Channels() + c] =
+                        src[(x - x % pass.stride) * frame.Channels() + c];
+                }
+            }
+        });
+        shown.max_value = MaxValue(shown.frame);
+        last = ToImage(shown, render_options.mode);
+        if (on_pass) {
+            on_pass(*last, pass);
+        }
+        if (options.stop_token.stop_requested()) {
+            break;
+        }
+    }
+    return last ? std::move(*last) : Image(width, height);
+}
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <camera.h>
+#include <parallel.h>
+#include <tiles.h>
+#include <primitives.h>
+#include <geometry.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+// Closest primitive through the center of a pixel. For triangles u and v are the
+// barycentric weights of the second and third vertex; depth is the distance along
+// the normalized ray.
+struct VisibilitySample {
+    int32_t index = -1;
+    PrimitiveType type = PrimitiveType::kTriangle;
+    float u = 0;
+    float v = 0;
+    float depth = 0;
+};
+
+class VisibilityBuffer {
+public:
+    VisibilityBuffer(int width, int height)
+        : width_(width), height_(height), samples_(static_cast<size_t>(width) * height) {
+    }
+
+    int Width() const {
+        return width_;
+    }
+    int Height() const {
+        return height_;
+    }
+    const VisibilitySample& At(int y, int x) const {
+        return samples_[static_cast<size_t>(y) * width_ + x];
+    }
+    VisibilitySample& At(int y, int x) {
+        return samples_[static_cast<size_t>(y) * width_ + x];
+    }
+
+private:
+    int width_;
+    int height_;
+    std::vector<VisibilitySample> samples_;
+};
+
+// Surfaces closer to the camera plane than this are clipped away.
+constexpr double kNearPlane = 1e-6;
+// Primitives set up and binned by one task of Rasterize.
+constexpr size_t kRasterChunk = 4096;
+
+// Whether Rasterize covers every primitive: triangles and spheres only.
+bool CanRasterize(const PrimitiveSet& primitives) {
+    bool supported = true;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        if constexpr (!IsTriangle(decltype(type)::value) &&
+                      decltype(type)::value != PrimitiveType::kSphere) {
+            supported &= block.empty();
+        }
+    });
+    return supported;
+}
+
+// Twice the signed area of (a, b, p) as sign * (dx * (py - ay) - dy * (px - ax)),
+// with the endpoints of the edge ordered, so that the triangles on both sides of
+// an edge see exactly opposite values and cover every pixel center on it.
+struct ScreenEdge {
+    double ax;
+    double ay;
+    double dx;
+    double dy;
+    double sign;
+
+    ScreenEdge() = default;
+    ScreenEdge(double x0, double y0, double x1, double y1) : sign(1) {
+        if (std::tie(x0, y0) > std::tie(x1, y1)) {
+            std::swap(x0, x1);
+            std::swap(y0, y1);
+            sign = -1;
+        }
+        ax = x0;
+        ay = y0;
+        dx = x1 - x0;
+        dy = y1 - y0;
+    }
+
+    double operator()(double px, double py) const {
+        return sign * (dx * (py - ay) - dy * (px - ax));
+    }
+};
+
+// Triangle in image coordinates, one of the one or two a primitive is left as
+// after clipping by the near plane.
+struct ScreenTriangle {
+    int32_t index;
+    PrimitiveType type;
+    // Edge k is opposite corner k.
+    std::array<ScreenEdge, 3> edges = {};
+    // Reciprocal camera-space depth of the corners.
+    std::array<double, 3> inv_depth = {};
+    // Barycentric weights of the corners in the primitive.
+    std::array<std::array<double, 3>, 3> weights = {};
+    // Pixels whose centers may be covered.
+    Tile bounds = {};
+};
+
+struct ScreenSphere {
+    int32_t index;
+    Tile bounds;
+};
+
+// Pixels of a width x height image whose centers lie in [x_min, x_max] x [y_min, y_max].
+Tile PixelBounds(double x_min, double x_max, double y_min, double y_max, int width, int height) {
+    auto clamp = [](double value, int limit) {
+        return static_cast<int>(std::clamp(value, 0., static_cast<double>(limit)));
+    };
+    return {clamp(std::ceil(x_min), width), clamp(std::ceil(y_min), height),
+            clamp(std::floor(x_max) + 1, width), clamp(std::floor(y_max) + 1, height)};
+}
+
+// Clips the triangle with camera-space corners by the near plane and appends what
+// is left, projected, to out.
+void SetUpTriangle(const Camera& camera, int width, int height, PrimitiveType type, int32_t index,
+                   const std::array<Vector, 3>& corners, std::vector<ScreenTriangle>* out) {
+    struct ClipVertex {
+        Vector position;
+        std::array<double, 3> weights;
+    };
+    std::array<ClipVertex, 4> polygon;
+    int size = 0;
+    for (int k = 0; k < 3; ++k) {
+        const Vector& p = corners[k];
+        const Vector& q = corners[(k + 1) % 3];
+        bool p_inside = p[2] <= -kNearPlane;
+        bool q_inside = q[2] <= -kNearPlane;
+        std::array<double, 3> p_weights = {};
+        p_weights[k] = 1;
+        if (p_inside) {
+            polygon[size++] = {p, p_weights};
+        }
+        if (p_inside != q_inside) {
+            double s = (-kNearPlane - p[2]) / (q[2] - p[2]);
+            std::array<double, 3> weights = {};
+            weights[k] = 1 - s;
+            weights[(k + 1) % 3] = s;
+            polygon[size++] = {p + (q - p).MultiplyOnScalar(s), weights};
+        }
+    }
+    for (int k = 2; k < size; ++k) {
+        ScreenTriangle triangle{index, type};
+        double x_min = INFINITY, x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+        int fan[3] = {0, k - 1, k};
+        std::array<std::pair<double, double>, 3> projected;
+        for (int c = 0; c < 3; ++c) {
+            const ClipVertex& vertex = polygon[fan[c]];
+            auto [x, y] = camera.Project(vertex.position);
+            projected[c] = {x, y};
+            triangle.inv_depth[c] = -1 / vertex.position[2];
+            triangle.weights[c] = vertex.weights;
+            x_min = std::min(x_min, x);
+            x_max = std::max(x_max, x);
+            y_min = std::min(y_min, y);
+            y_max = std::max(y_max, y);
+        }
+        for (int c = 0; c < 3; ++c) {
+            auto [x0, y0] = projected[(c + 1) % 3];
+            auto [x1, y1] = projected[(c + 2) % 3];
+            triangle.edges[c] = ScreenEdge(x0, y0, x1, y1);
+        }
+        triangle.bounds = PixelBounds(x_min, x_max, y_min, y_max, width, height);
+        if (triangle.bounds.x0 < triangle.bounds.x1 && triangle.bounds.y0 < triangle.bounds.y1) {
+            out->push_back(triangle);
+        }
+    }
+}
+
+// Pixels the sphere may cover: the projection of its bounding cube, none when it
+// lies wholly behind the near plane, or the whole image when it straddles it.
+Tile SphereBounds(const Camera& camera, int width, int height, const Sphere& sphere) {
+    Vector center = camera.ToCameraSpace(sphere.GetCenter());
+    double radius = sphere.GetRadius();
+    if (center[2] - radius > -kNearPlane) {
+        return {0, 0, 0, 0};
+    }
+    if (center[2] + radius > -kNearPlane) {
+        return {0, 0, width, height};
+    }
+    double x_min = INFINITY, x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+    for (int corner = 0; corner < 8; ++corner) {
+        // The bounding cube of the sphere in camera space.
+        Vector p = center + Vector(corner & 1 ? radius : -radius, corner & 2 ? radius : -radius,
+                                   corner & 4 ? radius : -radius);
+        auto [x, y] = camera.Project(p);
+        x_min = std::min(x_min, x);
+        x_max = std::max(x_max, x);
+        y_min = std::min(y_min, y);
+        y_max = std::max(y_max, y);
+    }
+    return PixelBounds(x_min, x_max, y_min, y_max, width, height);
+}
+
+// Scan-converts the triangles and spheres of primitives into the closest
+// primitive at every pixel center of the camera. Chunks of primitives are set up
+// and binned to the tiles of tile_size they overlap in parallel, then the tiles
+// are rasterized in parallel, each with a buffer of camera-space depths of its
+// own. Triangles are clipped by the near plane and interpolated
+// perspective-correctly; spheres are intersected analytically over their
+// projected bounds. The other primitives are left out, see CanRasterize.
+VisibilityBuffer Rasterize(const PrimitiveSet& primitives, const CameraOptions& camera_options,
+                           int tile_size) {
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    Camera camera(camera_options);
+    VisibilityBuffer buffer(width, height);
+    std::vector<Tile> tiles = SplitIntoTiles(width, height, tile_size);
+    int tiles_x = (width + tile_size - 1) / tile_size;
+
+    struct Chunk {
+        PrimitiveType type;
+        size_t begin;
+        size_t end;
+        std::vector<ScreenTriangle> triangles = {};
+        std::vector<ScreenSphere> spheres = {};
+        // Triangles or spheres of the chunk that overlap every tile.
+        std::vector<std::vector<uint32_t>> bins = {};
+    };
+    std::vector<Chunk> chunks;
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        for (size_t begin = 0; begin < block.size(); begin += kRasterChunk) {
+            chunks.push_back({type, begin, std::min(block.size(), begin + kRasterChunk)});
+        }
+    });
+    ParallelFor(0, chunks.size(), [&](int c) {
+        Chunk& chunk = chunks[c];
+        chunk.bins.resize(tiles.size());
+        auto bin = [&](const Tile& bounds, uint32_t item) {
+            for (int ty = bounds.y0 / tile_size; ty * tile_size < bounds.y1; ++ty) {
+                for (int tx = bounds.x0 / tile_size; tx * tile_size < bounds.x1; ++tx) {
+                    chunk.bins[ty * tiles_x + tx].push_back(item);
+                }
+            }
+        };
+        primitives.ForEachBlock([&](auto type, const auto& block) {
+            if (type != chunk.type) {
+                return;
+            }
+            for (size_t i = chunk.begin; i < chunk.end; ++i) {
+                if constexpr (IsTriangle(decltype(type)::value)) {
+                    const auto& shape = GetShape(block[i]);
+                    size_t first = chunk.triangles.size();
+                    SetUpTriangle(camera, width, height, type, i,
+                                  {camera.ToCameraSpace(shape[0]), camera.ToCameraSpace(shape[1]),
+                                   camera.ToCameraSpace(shape[2])},
+                                  &chunk.triangles);
+                    for (size_t t = first; t < chunk.triangles.size(); ++t) {
+                        bin(chunk.triangles[t].bounds, t);
+                    }
+                } else if constexpr (decltype(type)::value == PrimitiveType::kSphere) {
+                    Tile bounds = SphereBounds(camera, width, height, GetShape(block[i]));
+                    if (bounds.x0 < bounds.x1 && bounds.y0 < bounds.y1) {
+                        chunk.spheres.push_back({static_cast<int32_t>(i), bounds});
+                        bin(bounds, chunk.spheres.size() - 1);
+                    }
+                }
+            }
+        });
+    });
+
+    const auto& spheres = primitives.Block<PrimitiveType::kSphere>();
+    ParallelFor(0, tiles.size(), [&](int t) {
+        const Tile& tile = tiles[t];
+        int tile_width = tile.x1 - tile.x0;
+        std::vector<double> depth(static_cast<size_t>(tile_width) * (tile.y1 - tile.y0), INFINITY);
+        std::vector<double> scale(depth.size());
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                scale[(y - tile.y0) * tile_width + (x - tile.x0)] = camera.GetDepthScale(y, x);
+            }
+        }
+        auto closest = [&](int y, int x) -> double& {
+            return depth[(y - tile.y0) * tile_width + (x - tile.x0)];
+        };
+        for (const Chunk& chunk : chunks) {
+            for (uint32_t item : chunk.bins[t]) {
+                if (!IsTriangle(chunk.type)) {
+                    const ScreenSphere& screen = chunk.spheres[item];
+                    const Sphere& sphere = spheres[screen.index].sphere;
+                    int y1 = std::min(tile.y1, screen.bounds.y1);
+                    int x1 = std::min(tile.x1, screen.bounds.x1);
+                    for (int y = std::max(tile.y0, screen.bounds.y0); y < y1; ++y) {
+                        for (int x = std::max(tile.x0, screen.bounds.x0); x < x1; ++x) {
+                            HitParams params;
+                            if (!GetHitParams(camera.GetRay(y, x), sphere, &params)) {
+                                continue;
+                            }
+                            double w =
+                                params.t / scale[(y - tile.y0) * tile_width + (x - tile.x0)];
+                            if (w < closest(y, x)) {
+                                closest(y, x) = w;
+                                buffer.At(y, x) = {screen.index, PrimitiveType::kSphere};
+                            }
+                        }
+                    }
+                    continue;
+                }
+                const ScreenTriangle& tri = chunk.triangles[item];
+                int y1 = std::min(tile.y1, tri.bounds.y1);
+                int x1 = std::min(tile.x1, tri.bounds.x1);
+                for (int y = std::max(tile.y0, tri.bounds.y0); y < y1; ++y) {
+                    for (int x = std::max(tile.x0, tri.bounds.x0); x < x1; ++x) {
+                        std::array<double, 3> edge = {tri.edges[0](x, y), tri.edges[1](x, y),
+                                                      tri.edges[2](x, y)};
+                        // Either winding faces the camera.
+                        bool front = edge[0] >= 0 && edge[1] >= 0 && edge[2] >= 0;
+                        bool back = edge[0] <= 0 && edge[1] <= 0 && edge[2] <= 0;
+                        if (!front && !back) {
+                            continue;
+                        }
+                        double area = edge[0] + edge[1] + edge[2];
+                        double inv_depth = 0;
+                        for (int k = 0; k < 3; ++k) {
+                            edge[k] *= tri.inv_depth[k];
+                            inv_depth += edge[k];
+                        }
+                        if (area == 0 || inv_depth == 0) {
+                            continue;
+                        }
+                        double w = area / inv_depth;
+                        if (w >= closest(y, x)) {
+                            continue;
+                        }
+                        closest(y, x) = w;
+                        std::array<double, 3> weights = {};
+                        for (int k = 0; k < 3; ++k) {
+                            for (int j = 0; j < 3; ++j) {
+                                weights[j] += edge[k] / inv_depth * tri.weights[k][j];
+                            }
+                        }
+                        buffer.At(y, x) = {tri.index, tri.type, static_cast<float>(weights[1]),
+                                           static_cast<float>(weights[2])};
+                    }
+                }
+            }
+        }
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                size_t offset = (y - tile.y0) * tile_width + (x - tile.x0);
+                if (buffer.At(y, x).index != -1) {
+                    buffer.At(y, x).depth = static_cast<float>(depth[offset] * scale[offset]);
+                }
+            }
+        }
+    });
+    return buffer;
+}
+
+// Hit of sample along the pixel ray unit_ray, with its attributes as the kernel
+// with features computes them. The distance is measured again on the primitive, so
+// that the hit lies on the surface as closely as a traced one and secondary rays
+// leave it alike.
+template <KernelFeatures features = KernelFeatures{}>
+Hit ResolveSample(const PrimitiveSet& primitives, const Ray& unit_ray,
+                  const VisibilitySample& sample) {
+    Hit hit;
+    if (sample.index == -1) {
+        return hit;
+    }
+    hit.type = sample.type;
+    hit.index = sample.index;
+    hit.params = {sample.depth, sample.u, sample.v};
+    primitives.ForEachBlock([&](auto type, const auto& block) {
+        if (type != hit.type) {
+            return;
+        }
+        if constexpr (IsTriangle(decltype(type)::value)) {
+            const auto& shape = GetShape(block[hit.index]);
+            Vector normal = CrossProduct(shape[1] - shape[0], shape[2] - shape[0]);
+            normal.Normalize();
+            double t = PlaneDistance(unit_ray, shape[0], normal);
+            if (t >= 0) {
+                hit.params.t = t;
+            }
+        } else if constexpr (decltype(type)::value == PrimitiveType::kSphere) {
+            HitParams params;
+            if (GetHitParams(unit_ray, GetShape(block[hit.index]), &params)) {
+                hit.params.t = params.t;
+            }
+        }
+    });
+    ComputeHitAttributes<features>(primitives, unit_ray, &hit);
+    return hit;
+}
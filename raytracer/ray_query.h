@@ -0,0 +1,91 @@
+#pragma once
+
+#include <scene.h>
+#include <accelerator.h>
+#include <parallel.h>
+
+#include <algorithm>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+struct RayQueryOptions {
+    AcceleratorType accelerator = AcceleratorType::kAuto;
+    // Off leaves the intersection, normal and texture coordinates of the hits
+    // empty, which saves their cost when only the distance or the primitive is
+    // needed.
+    bool attributes = true;
+};
+
+// Rays handed to one task of the scheduler; the accelerators trace them in packets.
+constexpr size_t kRayQueryChunk = 256;
+
+// Splits rays into chunks of normalized rays, traced on the render scheduler,
+// and calls query(first, unit_rays) for each. Chunks whose directions all have
+// length 1 are handed over as they are; the others are copied, normalized, into
+// a buffer every thread reuses.
+template <class Query>
+void ForEachRayChunk(std::span<const Ray> rays, Query&& query) {
+    int chunks = (rays.size() + kRayQueryChunk - 1) / kRayQueryChunk;
+    ParallelFor(0, chunks, [&](int chunk) {
+        size_t first = chunk * kRayQueryChunk;
+        std::span<const Ray> chunk_rays =
+            rays.subspan(first, std::min(kRayQueryChunk, rays.size() - first));
+        // Normalizing leaves directions of length exactly 1 as they are.
+        if (std::all_of(chunk_rays.begin(), chunk_rays.end(),
+                        [](const Ray& ray) { return ray.GetDirection().Length() == 1; })) {
+            query(first, chunk_rays);
+            return;
+        }
+        // Taken out of the thread's buffer, so a query that starts another search
+        // on this thread gets a buffer of its own.
+        thread_local std::vector<Ray> buffer;
+        std::vector<Ray> unit_rays = std::move(buffer);
+        unit_rays.clear();
+        for (const Ray& ray : chunk_rays) {
+            Vector d = ray.GetDirection();
+            d.Normalize();
+            unit_rays.emplace_back(ray.GetOrigin(), d);
+        }
+        query(first, std::span<const Ray>(unit_rays));
+        buffer = std::move(unit_rays);
+    });
+}
+
+// Closest hit of every ray in scene, written to the hit of the same index; hits
+// like those of FindClosestHit. Directions need not be normalized: hit distances
+// are along the normalized direction. The rays are split between the threads of
+// the render scheduler, at the priority of the calling thread.
+void IntersectClosest(const Scene& scene, std::span<const Ray> rays, std::span<Hit> hits,
+                      const RayQueryOptions& options = {}) {
+    if (hits.size() != rays.size()) {
+        throw std::invalid_argument("IntersectClosest needs a hit per ray");
+    }
+    const Accelerator& accelerator = scene.GetAccelerator(options.accelerator);
+    ForEachRayChunk(rays, [&](size_t first, std::span<const Ray> unit_rays) {
+        std::span<Hit> chunk_hits = hits.subspan(first, unit_rays.size());
+        accelerator.ClosestHits(unit_rays, chunk_hits);
+        if (!options.attributes) {
+            return;
+        }
+        for (size_t i = 0; i < unit_rays.size(); ++i) {
+            if (chunk_hits[i].IsValid()) {
+                ComputeHitAttributes(scene.GetPrimitives(), unit_rays[i], &chunk_hits[i]);
+            }
+        }
+    });
+}
+
+// Whether every ray hits anything no farther than its t_max, a distance along the
+// ray like that of IsOccluded.
+void IntersectAny(const Scene& scene, std::span<const Ray> rays, std::span<const double> t_max,
+                  std::span<bool> hits, const RayQueryOptions& options = {}) {
+    if (t_max.size() != rays.size() || hits.size() != rays.size()) {
+        throw std::invalid_argument("IntersectAny needs a t_max and a result per ray");
+    }
+    const Accelerator& accelerator = scene.GetAccelerator(options.accelerator);
+    ForEachRayChunk(rays, [&](size_t first, std::span<const Ray> unit_rays) {
+        accelerator.AnyHits(unit_rays, t_max.subspan(first, unit_rays.size()),
+                            hits.subspan(first, unit_rays.size()));
+    });
+}
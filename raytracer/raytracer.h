@@ -11,195 +11,145 @@
 #include <image.h>
 #include <options/camera_options.h>
 #include <options/render_options.h>
+#include <camera.h>
+#include <framebuffer.h>
+#include <tone_mapping.h>
+#include <parallel.h>
+#include <tiles.h>
+#include <hdr_output.h>
+#include <denoise.h>
+#include <sampler.h>
+#include <sampling.h>
+#include <rasterizer.h>
+#include <batch_shading.h>
 
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
 
-std::vector<std::vector<double>> LookAt(Vector from, Vector to) {
-    std::vector<std::vector<double>> matr(4, std::vector<double>(4));
-    for (int i = 0; i < 4; ++i) {
-        matr[i][i] = 1;
-    }
-    Vector forward = from - to;
-    forward.Normalize();
-    Vector tmp = Vector(0, 1, 0);
-    Vector right = CrossProduct(tmp, forward);
-    if (Length(right) < 1e-9) {
-        if (DotProduct(tmp, forward) < 0) {
-            tmp = Vector(0, 0, 1);
-        } else {
-            tmp = Vector(0, 0, -1);
-        }
-    }
-    if ((to - from)[2] < 0) {
-        tmp = Vector(tmp[0], tmp[1], -tmp[2]);
-    }
-    right = CrossProduct(tmp, forward);
-    right.Normalize();
-    Vector up = CrossProduct(forward, right);
-    up.Normalize();
-    for (int i = 0; i < 3; ++i) {
-        matr[0][i] = right[i];
-        matr[1][i] = up[i];
-        matr[2][i] = forward[i];
-        matr[3][i] = from[i];
-    }
-    return matr;
+template <KernelFeatures features = KernelFeatures{}>
+bool IsLightVis(const Light& light, Vector pos, const Accelerator& accelerator, Vector normal) {
+    Vector dir = light.position - pos;
+    double dist = Distance(light.position, pos);
+    dir.Normalize();
+    Ray ray = Ray(pos + normal.MultiplyOnScalar(0.0000000001), dir);
+    return !IsOccluded(accelerator, ray, dist);
 }
 
-Vector MultPointMatrix(Vector point, const std::vector<std::vector<double>> m) {
-    Vector ans;
-    ans[0] = point[0] * m[0][0] + point[1] * m[1][0] + point[2] * m[2][0] + m[3][0];
-    ans[1] = point[0] * m[0][1] + point[1] * m[1][1] + point[2] * m[2][1] + m[3][1];
-    ans[2] = point[0] * m[0][2] + point[1] * m[1][2] + point[2] * m[2][2] + m[3][2];
-    double w = point[0] * m[0][3] + point[1] * m[1][3] + point[2] * m[2][3] + m[3][3];
-    if (w != 1 && w != 0) {
-        ans[0] /= w;
-        ans[1] /= w;
-        ans[2] /= w;
-    }
-    return ans;
+Vector MultiplyComp(Vector a, Vector b) {
+    return Vector(a[0] * b[0], a[1] * b[1], a[2] * b[2]);
 }
 
-Vector MultDirMatrix(Vector point, const std::vector<std::vector<double>> m) {
-    Vector ans;
-    ans[0] = point[0] * m[0][0] + point[1] * m[1][0] + point[2] * m[2][0];
-    ans[1] = point[0] * m[0][1] + point[1] * m[1][1] + point[2] * m[2][1];
-    ans[2] = point[0] * m[0][2] + point[1] * m[1][2] + point[2] * m[2][2];
-    return ans;
+double MaxComponent(const Vector& v) {
+    return std::max({v[0], v[1], v[2]});
 }
 
-bool IsLightVis(const Light& light, Vector pos, const std::vector<Object>& objects,
-                const std::vector<SphereObject>& sph_objects, Vector normal) {
-    Vector dir = light.position - pos;
-    double dist = Distance(light.position, pos);
-    dir.Normalize();
-    Ray ray = Ray(pos + normal.MultiplyOnScalar(0.0000000001), dir);
-    for (auto& obj : objects) {
-        std::optional<Intersection> intr = GetIntersection(ray, obj.polygon);
-        if (intr.has_value()) {
-            if (intr->GetDistance() <= dist) {
-                return false;
-            }
-        }
+// Width of the beam of a pixel along a ray: width at the origin of the ray,
+// growing by spread per unit of distance. A ray cone of Amanatides, without the
+// curvature of the surfaces it bounced off.
+struct RayCone {
+    double width = 0;
+    double spread = 0;
+
+    RayCone Advance(double distance) const {
+        return {width + spread * distance, spread};
     }
-    for (auto& obj : sph_objects) {
-        std::optional<Intersection> intr = GetIntersection(ray, obj.sphere);
-        if (intr.has_value()) {
-            if (intr->GetDistance() <= dist) {
-                return false;
-            }
-        }
+};
+
+// Color of the diffuse map of mat at hit, filtered over a footprint of width in
+// world units; none for untextured materials and surfaces.
+std::optional<Vector> GetDiffuseTexture(const MaterialShading& mat, const Hit& hit, double width) {
+    if (mat.diffuse_map == kNoTexture || !hit.texcoord) {
+        return std::nullopt;
     }
-    return true;
+    return GetTextureCache().Sample(mat.diffuse_map, hit.texcoord->u, hit.texcoord->v,
+                                    width * hit.texcoord_scale);
 }
 
-Vector MultiplyComp(Vector a, Vector b) {
-    return Vector(a[0] * b[0], a[1] * b[1], a[2] * b[2]);
+// mat, or its copy in textured with the diffuse color multiplied by the texture
+// at hit.
+const MaterialShading& GetSurfaceMaterial(const MaterialShading& mat, const Hit& hit,
+                                          double width, std::optional<MaterialShading>* textured) {
+    std::optional<Vector> texture = GetDiffuseTexture(mat, hit, width);
+    if (!texture) {
+        return mat;
+    }
+    textured->emplace(mat);
+    (*textured)->diffuse_color = MultiplyComp(mat.diffuse_color, *texture);
+    return **textured;
+}
+
+// Diffuse and specular light of a visible light source, before the albedo. The
+// normal and the direction to the viewer vv are normalized.
+Vector GetLightColor(const Light& light_source, const Vector& normal, const MaterialShading& mat,
+                     const Vector& pos, const Vector& vv) {
+    Vector light = light_source.position - pos;
+    light.Normalize();
+    Vector rr = normal.MultiplyOnScalar(2 * DotProduct(light, normal)) - light;
+    rr.Normalize();
+    double d2 = std::pow(std::max(0.0, DotProduct(rr, vv)), mat.specular_exponent);
+    Vector spec = MultiplyComp(mat.specular_color, light_source.intensity);
+    Vector specular = spec.MultiplyOnScalar(d2);
+    double d1 = std::max(0.0, DotProduct(light, normal));
+    Vector diffuse = MultiplyComp(mat.diffuse_color.MultiplyOnScalar(d1), light_source.intensity);
+    return diffuse + specular;
 }
 
-Vector GetPointColorBase(const std::vector<Object>& objects,
-                         const std::vector<SphereObject>& sph_objects,
-                         const std::vector<Light>& lights, Vector normal, const Material mat,
-                         Vector pos, Vector ray) {
+template <KernelFeatures features = KernelFeatures{}>
+Vector GetPointColorBase(const Accelerator& accelerator, const std::vector<Light>& lights,
+                         Vector normal, const MaterialShading& mat, Vector pos, Vector ray) {
     Vector color = mat.ambient_color + mat.intensity;
-    Vector rr;
-    Vector light;
     Vector vv = ray.MultiplyOnScalar(-1);
     vv.Normalize();
     normal.Normalize();
     for (size_t i = 0; i < lights.size(); ++i) {
-        if (IsLightVis(lights[i], pos, objects, sph_objects, normal)) {
-            light = lights[i].position - pos;
-            light.Normalize();
-            rr = normal.MultiplyOnScalar(2 * DotProduct(light, normal)) - light;
-            rr.Normalize();
-            double d2 = std::pow(std::max(0.0, DotProduct(rr, vv)), mat.specular_exponent);
-            Vector spec = MultiplyComp(mat.specular_color, lights[i].intensity);
-            Vector specular = spec.MultiplyOnScalar(d2);
-            double d1 = std::max(0.0, DotProduct(light, normal));
-            Vector diffuse =
-                MultiplyComp(mat.diffuse_color.MultiplyOnScalar(d1), lights[i].intensity);
-            Vector c = diffuse + specular;
+        if (IsLightVis<features>(lights[i], pos, accelerator, normal)) {
+            Vector c = GetLightColor(lights[i], normal, mat, pos, vv);
             color = color + c.MultiplyOnScalar(mat.albedo[0]);
         }
     }
     return color;
 }
 
-Vector GetPixelColor(const std::vector<Object>& objects,
-                     const std::vector<SphereObject>& sph_objects, const std::vector<Light>& lights,
-                     Ray ray, int rec_depth, int is_inside) {
-    if (rec_depth == -1) {
-        return {0, 0, 0};
-    }
-    double min_d = INFINITY;
-    bool is_sphere = 0;
-    int min_obj = -1;
-    std::optional<Intersection> intr_min;
-    Vector pixel_c;
-    int counter = 0;
-    for (auto& obj : objects) {
-        std::optional<Intersection> intr = GetIntersection(ray, obj.polygon);
-        if (intr.has_value()) {
-            double dist = intr->GetDistance();
-            if (dist < min_d) {
-                min_d = dist;
-                min_obj = counter;
-                intr_min = intr;
-            }
-        }
-        ++counter;
-    }
-    counter = 0;
-    for (auto& obj : sph_objects) {
-        std::optional<Intersection> intr = GetIntersection(ray, obj.sphere);
-        if (intr.has_value()) {
-            double dist = intr->GetDistance();
-            if (dist < min_d) {
-                min_d = dist;
-                min_obj = counter;
-                intr_min = intr;
-                is_sphere = true;
-            }
-        }
-        ++counter;
-    }
-    Vector normal = {0, 0, 0};
-    Material mat;
-    if (min_obj == -1) {
-        return {0, 0, 0};
+// The cone of ray picks the mipmap levels of the textures it hits; the default
+// samples their finest level.
+template <KernelFeatures features = KernelFeatures{}>
+Vector GetPixelColor(const Accelerator& accelerator, const std::vector<Light>& lights, Ray ray,
+                     int rec_depth, int is_inside, const RayCone& cone = {});
+
+// Color seen along ray given its closest hit, including reflected and
+// refracted light down to rec_depth more bounces.
+template <KernelFeatures features = KernelFeatures{}>
+Vector ShadeHit(const Accelerator& accelerator, const std::vector<Light>& lights, const Ray& ray,
+                const Hit& hit, int rec_depth, int is_inside, const RayCone& cone = {}) {
+    Vector normal = hit.shading_normal;
+    RayCone hit_cone = cone.Advance(hit.intersection->GetDistance());
+    std::optional<MaterialShading> textured;
+    const MaterialShading& mat =
+        GetSurfaceMaterial(*accelerator.GetPrimitives().GetMaterial(hit.type, hit.index), hit,
+                           hit_cone.width, &textured);
+    Vector pos = hit.intersection->GetPosition();
+    Vector pixel_c =
+        GetPointColorBase<features>(accelerator, lights, normal, mat, pos, ray.GetDirection());
+    if constexpr (features.no_reflection && features.no_refraction) {
+        return pixel_c;
     }
-    if (!is_sphere) {
-        Object obj = objects[min_obj];
-        normal = intr_min->GetNormal();
-        if (!obj.normals.empty()) {
-            Vector bars = GetBarycentricCoords(obj.polygon, intr_min->GetPosition());
-            normal = obj.normals[0].MultiplyOnScalar(bars[0]) +
-                     obj.normals[1].MultiplyOnScalar(bars[1]) +
-                     obj.normals[2].MultiplyOnScalar(bars[2]);
-        }
-        mat = *obj.material;
-        Vector c = GetPointColorBase(objects, sph_objects, lights, normal, mat,
-                                     intr_min->GetPosition(), ray.GetDirection());
-        pixel_c = c;
-    } else {
-        SphereObject obj = sph_objects[min_obj];
-        normal = intr_min->GetNormal();
-        mat = *obj.material;
-        Vector c = GetPointColorBase(objects, sph_objects, lights, normal, mat,
-                                     intr_min->GetPosition(), ray.GetDirection());
-        pixel_c = c;
-    }
-    Vector pos = intr_min->GetPosition();
     Vector ray_dir = ray.GetDirection();
     ray_dir.Normalize();
-    if (is_inside == 0) {
+    if (!features.no_reflection && is_inside == 0) {
         Vector refl_ray_dir = Reflect(ray_dir, normal);
         refl_ray_dir.Normalize();
         Ray refl_ray = {pos + normal.MultiplyOnScalar(0.000000001), refl_ray_dir};
-        Vector i_refl = GetPixelColor(objects, sph_objects, lights, refl_ray, rec_depth - 1, 0);
+        Vector i_refl =
+            GetPixelColor<features>(accelerator, lights, refl_ray, rec_depth - 1, 0, hit_cone);
         pixel_c = pixel_c + i_refl.MultiplyOnScalar(mat.albedo[1]);
     }
+    if constexpr (features.no_refraction) {
+        return pixel_c;
+    }
     double eta = 1.0 / mat.refraction_index;
     double tr_coef = mat.albedo[2];
     if (is_inside == 1) {
@@ -211,181 +161,754 @@ Vector GetPixelColor(const std::vector<Object>& objects,
         Vector retr_ray_dir = *retr_ray_dir_opt;
         retr_ray_dir.Normalize();
         Ray retr_ray = {pos - normal.MultiplyOnScalar(0.000000002), retr_ray_dir};
-        Vector i_retr = GetPixelColor(objects, sph_objects, lights, retr_ray, rec_depth - 1,
-                                      is_sphere && (1 - is_inside));
+        Vector i_retr = GetPixelColor<features>(accelerator, lights, retr_ray, rec_depth - 1,
+                                                IsClosed(hit.type) && (1 - is_inside), hit_cone);
         pixel_c = pixel_c + i_retr.MultiplyOnScalar(tr_coef);
     }
     return pixel_c;
 }
 
-Image Render(const std::filesystem::path& path, const CameraOptions& camera_options,
-             const RenderOptions& render_options) {
-    // std::cout<<"hi\n";
-    Image img = Image(camera_options.screen_width, camera_options.screen_height);
-    Scene scene = ReadScene(path);
-    std::vector<Object> objects = scene.GetObjects();
-    std::vector<SphereObject> sph_objects = scene.GetSphereObjects();
-    std::vector<Light> lights = scene.GetLights();
-    std::unordered_map<std::string, Material> materials = scene.GetMaterials();
-    double height = 2 * std::tan(camera_options.fov / 2);
-    double pixel_size = height / camera_options.screen_height;
-    double width = height * camera_options.screen_width / camera_options.screen_height;
-    double curr_x = -width / 2 + pixel_size / 2;
-    double curr_y = height / 2 - pixel_size / 2;
-    std::vector<std::vector<double>> m = LookAt(camera_options.look_from, camera_options.look_to);
-    if (render_options.mode == RenderMode::kDepth) {
-        std::vector<std::vector<double>> pixel_d(
-            camera_options.screen_height, std::vector<double>(camera_options.screen_width, -1.0));
-        double max_d = 0;
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            curr_x = -width / 2 + pixel_size / 2;
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector ray_dir = Vector(curr_x, curr_y, -1);
-                ray_dir.Normalize();
-                Vector dir_world = MultDirMatrix(ray_dir, m);
-                dir_world.Normalize();
-                Ray ray = Ray(camera_options.look_from, dir_world);
-                double min_d = INFINITY;
-                for (auto& obj : objects) {
-                    std::optional<Intersection> intr = GetIntersection(ray, obj.polygon);
-                    if (intr.has_value()) {
-                        double dist = intr->GetDistance();
-                        if (dist < min_d) {
-                            min_d = dist;
-                        }
-                    }
+template <KernelFeatures features>
+Vector GetPixelColor(const Accelerator& accelerator, const std::vector<Light>& lights, Ray ray,
+                     int rec_depth, int is_inside, const RayCone& cone) {
+    if (rec_depth == -1) {
+        return {0, 0, 0};
+    }
+    Hit hit = FindClosestHit<features>(accelerator, ray);
+    if (!hit.IsValid()) {
+        return {0, 0, 0};
+    }
+    return ShadeHit<features>(accelerator, lights, ray, hit, rec_depth, is_inside, cone);
+}
+
+// ShadeHit of the primary hits of rays, kShadeBatch at a time: the local light in
+// the lanes of batch_shading.h, then the reflected and refracted rays one by one.
+// Only the rays that hit anything take lanes, so the batches stay full. colors
+// gets a color per ray, black where it hit nothing. The colors differ from those
+// of ShadeHit only by the rounding of PowLanes.
+template <KernelFeatures features = KernelFeatures{}>
+void ShadeHits(const Accelerator& accelerator, const std::vector<Light>& lights,
+               std::span<const Ray> rays, std::span<const Hit> hits, int rec_depth,
+               const RayCone& cone, std::span<Vector> colors) {
+    const PrimitiveSet& primitives = accelerator.GetPrimitives();
+    // Taken out of the thread's buffer, so a nested call on this thread gets a
+    // buffer of its own.
+    thread_local std::vector<size_t> buffer;
+    std::vector<size_t> shaded = std::move(buffer);
+    shaded.clear();
+    for (size_t k = 0; k < rays.size(); ++k) {
+        if (hits[k].IsValid()) {
+            shaded.push_back(k);
+        } else {
+            colors[k] = Vector();
+        }
+    }
+    for (size_t first = 0; first < shaded.size(); first += kShadeBatch) {
+        size_t count = std::min(kShadeBatch, shaded.size() - first);
+        SurfaceLanes surface;
+        VectorLanes color;
+        VectorLanes dir;
+        Lanes reflection;
+        Lanes eta;
+        Lanes transmission;
+        std::array<RayCone, kShadeBatch> cones;
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            if (i >= count) {
+                // The lanes past the last hit shade a copy of the first one.
+                for (VectorLanes* lanes : {&surface.position, &surface.normal, &surface.view,
+                                           &surface.diffuse, &surface.specular, &color, &dir}) {
+                    lanes->Set(i, lanes->Get(0));
                 }
-                for (auto& obj : sph_objects) {
-                    std::optional<Intersection> intr = GetIntersection(ray, obj.sphere);
-                    if (intr.has_value()) {
-                        double dist = intr->GetDistance();
-                        if (dist < min_d) {
-                            min_d = dist;
-                        }
-                    }
+                for (Lanes* lanes : {&surface.exponent, &surface.albedo, &reflection, &eta,
+                                     &transmission}) {
+                    (*lanes)[i] = (*lanes)[0];
                 }
-                if (min_d < INFINITY) {
-                    pixel_d[i][j] = min_d;
-                    if (min_d > max_d) {
-                        max_d = min_d;
-                    }
+                continue;
+            }
+            const Hit& hit = hits[shaded[first + i]];
+            cones[i] = cone.Advance(hit.intersection->GetDistance());
+            std::optional<MaterialShading> textured;
+            const MaterialShading& mat = GetSurfaceMaterial(
+                *primitives.GetMaterial(hit.type, hit.index), hit, cones[i].width, &textured);
+            const Vector& ray_dir = rays[shaded[first + i]].GetDirection();
+            surface.position.Set(i, hit.intersection->GetPosition());
+            surface.normal.Set(i, hit.shading_normal);
+            surface.view.Set(i, ray_dir.MultiplyOnScalar(-1));
+            surface.diffuse.Set(i, mat.diffuse_color);
+            surface.specular.Set(i, mat.specular_color);
+            surface.exponent[i] = mat.specular_exponent;
+            surface.albedo[i] = mat.albedo[0];
+            color.Set(i, mat.ambient_color + mat.intensity);
+            dir.Set(i, ray_dir);
+            reflection[i] = mat.albedo[1];
+            eta[i] = 1.0 / mat.refraction_index;
+            transmission[i] = mat.albedo[2];
+        }
+        // ShadeHit reflects and refracts about the normal as it comes.
+        VectorLanes normal = surface.normal;
+        NormalizeLanes(&surface.normal);
+        NormalizeLanes(&surface.view);
+        NormalizeLanes(&dir);
+
+        for (const Light& light : lights) {
+            Lanes visible;
+            for (size_t i = 0; i < kShadeBatch; ++i) {
+                visible[i] = i < count && IsLightVis<features>(light, surface.position.Get(i),
+                                                               accelerator, surface.normal.Get(i));
+            }
+            VectorLanes light_color = LightLanes(light, surface);
+            for (int k = 0; k < 3; ++k) {
+                for (size_t i = 0; i < kShadeBatch; ++i) {
+                    color.c[k][i] += light_color.c[k][i] * visible[i];
                 }
-                curr_x += pixel_size;
             }
-            curr_y -= pixel_size;
         }
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                if (pixel_d[i][j] == -1.0) {
-                    img.SetPixel({255, 255, 255}, i, j);
-                } else {
-                    int c = std::round(pixel_d[i][j] / max_d * 255);
-                    img.SetPixel({c, c, c}, i, j);
+
+        VectorLanes reflected;
+        VectorLanes refracted;
+        Lanes refracts;
+        if constexpr (!features.no_reflection) {
+            reflected = ReflectLanes(dir, normal);
+        }
+        if constexpr (!features.no_refraction) {
+            refracted = RefractLanes(dir, normal, eta, &refracts);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            size_t k = shaded[first + i];
+            Vector pixel_c = color.Get(i);
+            Vector pos = surface.position.Get(i);
+            Vector n = normal.Get(i);
+            if constexpr (!features.no_reflection) {
+                Ray refl_ray = {pos + n.MultiplyOnScalar(0.000000001), reflected.Get(i)};
+                Vector i_refl =
+                    GetPixelColor<features>(accelerator, lights, refl_ray, rec_depth - 1, 0, cones[i]);
+                pixel_c = pixel_c + i_refl.MultiplyOnScalar(reflection[i]);
+            }
+            if constexpr (!features.no_refraction) {
+                if (refracts[i] > 0) {
+                    Ray retr_ray = {pos - n.MultiplyOnScalar(0.000000002), refracted.Get(i)};
+                    Vector i_retr =
+                        GetPixelColor<features>(accelerator, lights, retr_ray, rec_depth - 1,
+                                                IsClosed(hits[k].type), cones[i]);
+                    pixel_c = pixel_c + i_retr.MultiplyOnScalar(transmission[i]);
                 }
             }
+            colors[k] = pixel_c;
         }
-    } else if (render_options.mode == RenderMode::kFull) {
-        std::vector<std::vector<Vector>> pixel_d(
-            camera_options.screen_height,
-            std::vector<Vector>(camera_options.screen_width, {0, 0, 0}));
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            curr_x = -width / 2 + pixel_size / 2;
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector ray_dir = Vector(curr_x, curr_y, -1);
-                ray_dir.Normalize();
-                Vector dir_world = MultDirMatrix(ray_dir, m);
-                dir_world.Normalize();
-                Ray ray = Ray(camera_options.look_from, dir_world);
-                pixel_d[i][j] =
-                    GetPixelColor(objects, sph_objects, lights, ray, render_options.depth, 0);
-                curr_x += pixel_size;
+    }
+    buffer = std::move(shaded);
+}
+
+// The distance along the normalized ray is its t, so no hit attributes are needed.
+template <KernelFeatures features = KernelFeatures{}>
+double GetPixelDepth(const Accelerator& accelerator, const Ray& ray) {
+    Hit hit = FindClosestHit<features, false>(accelerator, ray);
+    return hit.IsValid() ? hit.params.t : -1.0;
+}
+
+template <KernelFeatures features = KernelFeatures{}>
+Vector GetPixelNormal(const Accelerator& accelerator, const Ray& ray) {
+    Hit hit = FindClosestHit<features>(accelerator, ray);
+    return hit.IsValid() ? hit.shading_normal : Vector(0, 0, 0);
+}
+
+// Distance and shading normal of the first hit of a path, as kDepth and kNormal
+// record them: -1 and zero when it hits nothing.
+struct PrimaryHit {
+    float depth = -1.f;
+    Vector normal;
+};
+
+// Depth and normals of the first hits of the paths, which guide the filter of
+// RenderOptions::denoise: those of the first path through every pixel.
+struct DenoiseGuide {
+    DenoiseGuide(int width, int height) : depth(width, height, 1), normal(width, height) {
+    }
+
+    void Record(int y, int x, const PrimaryHit& hit) {
+        depth.Row(y)[x] = hit.depth;
+        normal.SetPixel(hit.normal, y, x);
+    }
+
+    Framebuffer depth;
+    Framebuffer normal;
+};
+
+// Paths start ending by Russian roulette after this many bounces.
+constexpr int kRouletteBounce = 3;
+// Bounds paths trapped between perfect mirrors.
+constexpr int kMaxPathBounces = 256;
+
+// Radiance along ray from one random path. The light of the point lights at
+// every vertex is the local term of kFull, GetLightColor scaled by albedo[0],
+// and Ke is emitted. Read as BRDFs for point lights that make a white diffuse
+// surface facing them reflect their intensity, that is Kd / pi for diffuse and
+// Ks cos^Ns / (pi cos) around the mirror direction for glossy light. One lobe
+// is followed from every vertex, chosen in proportion to its weight: diffuse,
+// glossy, the mirror of albedo[1] or the refraction of albedo[2]. Every vertex
+// draws four dimensions, whether it needs them or not, so that a dimension means
+// the same choice in every path: a pair for the direction, then the lobe and the
+// roulette. The cone of ray, kept along the path, filters the textures. The first
+// hit goes to primary, if given.
+template <KernelFeatures features = KernelFeatures{}>
+Vector TracePath(const Accelerator& accelerator, const std::vector<Light>& lights, Ray ray,
+                 SampleStream* samples, RayCone cone = {}, PrimaryHit* primary = nullptr) {
+    Vector radiance;
+    Vector throughput(1, 1, 1);
+    bool inside = false;
+    for (int bounce = 0; bounce < kMaxPathBounces; ++bounce) {
+        Hit hit = FindClosestHit<features>(accelerator, ray);
+        if (!hit.IsValid()) {
+            break;
+        }
+        if (bounce == 0 && primary) {
+            *primary = {static_cast<float>(hit.params.t), hit.shading_normal};
+        }
+        cone = cone.Advance(hit.intersection->GetDistance());
+        std::optional<MaterialShading> textured;
+        const MaterialShading& mat =
+            GetSurfaceMaterial(*accelerator.GetPrimitives().GetMaterial(hit.type, hit.index), hit,
+                               cone.width, &textured);
+        Vector pos = hit.intersection->GetPosition();
+        Vector dir = ray.GetDirection();
+        dir.Normalize();
+        Vector normal = hit.shading_normal;
+        normal.Normalize();
+        if (DotProduct(normal, dir) > 0) {
+            normal = normal.MultiplyOnScalar(-1);
+        }
+        radiance = radiance + MultiplyComp(throughput, mat.intensity);
+        double u1 = samples->Next();
+        double u2 = samples->Next();
+        double u_lobe = samples->Next();
+        double u_roulette = samples->Next();
+
+        double local = inside ? 0 : mat.albedo[0];
+        Vector vv = dir.MultiplyOnScalar(-1);
+        if (local > 0) {
+            for (const auto& light : lights) {
+                if (IsLightVis<features>(light, pos, accelerator, normal)) {
+                    Vector c = GetLightColor(light, normal, mat, pos, vv);
+                    radiance = radiance + MultiplyComp(throughput, c).MultiplyOnScalar(local);
+                }
             }
-            curr_y -= pixel_size;
         }
-        double max_c = 0;
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                max_c = std::max(max_c, pixel_d[i][j][0]);
-                max_c = std::max(max_c, pixel_d[i][j][1]);
-                max_c = std::max(max_c, pixel_d[i][j][2]);
+
+        double exponent = mat.specular_exponent;
+        Vector diffuse = mat.diffuse_color.MultiplyOnScalar(local);
+        // The Phong lobe is sampled exactly, leaving a constant weight.
+        Vector glossy = mat.specular_color.MultiplyOnScalar(local * 2 / (exponent + 1));
+        Vector mirror_dir = Reflect(dir, normal);
+        mirror_dir.Normalize();
+        double weights[4] = {MaxComponent(diffuse), MaxComponent(glossy),
+                             features.no_reflection || inside ? 0 : mat.albedo[1],
+                             features.no_refraction ? 0 : (inside ? 1 : mat.albedo[2])};
+        double total = weights[0] + weights[1] + weights[2] + weights[3];
+        if (total <= 0) {
+            break;
+        }
+        double u = u_lobe * total;
+        int chosen = 0;
+        while (chosen < 3 && (u >= weights[chosen] || weights[chosen] == 0)) {
+            u -= weights[chosen];
+            ++chosen;
+        }
+        // Rounding may run past the last lobe that has weight.
+        while (weights[chosen] == 0) {
+            --chosen;
+        }
+        double inv_p = total / weights[chosen];
+        Vector origin = pos + normal.MultiplyOnScalar(0.000000001);
+        Vector next_dir;
+        if (chosen == 0) {
+            next_dir = SampleCosineHemisphere(normal, u1, u2);
+            throughput = MultiplyComp(throughput, diffuse).MultiplyOnScalar(inv_p);
+        } else if (chosen == 1) {
+            next_dir = SamplePhongLobe(mirror_dir, exponent, u1, u2);
+            if (DotProduct(next_dir, normal) <= 0) {
+                break;
             }
+            throughput = MultiplyComp(throughput, glossy).MultiplyOnScalar(inv_p);
+        } else if (chosen == 2) {
+            next_dir = mirror_dir;
+            throughput = throughput.MultiplyOnScalar(inv_p * mat.albedo[1]);
+        } else {
+            double eta = inside ? mat.refraction_index : 1 / mat.refraction_index;
+            std::optional<Vector> refracted = Refract(dir, normal, eta);
+            // Total internal reflection keeps the path on this side.
+            if (refracted) {
+                next_dir = *refracted;
+                origin = pos - normal.MultiplyOnScalar(0.000000002);
+                inside = !inside && IsClosed(hit.type);
+            } else {
+                next_dir = mirror_dir;
+            }
+            throughput = throughput.MultiplyOnScalar(inv_p * weights[3]);
         }
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector v = pixel_d[i][j];
-                Vector c_new;
-                for (int h = 0; h < 3; ++h) {
-                    double tmp = v[h] * (1 + v[h] / (max_c * max_c)) / (1 + v[h]);
-                    c_new[h] = std::pow(tmp, 1 / 2.2);
-                }
-                if (!(c_new[0] == c_new[0])) {
-                    c_new[0] = 0;
-                }
-                if (!(c_new[1] == c_new[1])) {
-                    c_new[1] = 0;
+        if (bounce >= kRouletteBounce) {
+            double survival = std::min(.95, MaxComponent(throughput));
+            if (u_roulette >= survival) {
+                break;
+            }
+            throughput = throughput.MultiplyOnScalar(1 / survival);
+        }
+        next_dir.Normalize();
+        ray = Ray(origin, next_dir);
+    }
+    return radiance;
+}
+
+// Camera ray of a path through pixel (y, x), jittered within the pixel by the
+// first two dimensions of samples.
+Ray GetPathRay(const Camera& camera, SampleStream* samples, int y, int x) {
+    double dx = samples->Next() - .5;
+    double dy = samples->Next() - .5;
+    return camera.GetRay(y + dy, x + dx);
+}
+
+// Sum of the path samples [first, last) through pixel (y, x). Sample k of a pixel
+// reads only its own coordinates of sampler, so it follows the same path whichever
+// thread or pass traces it. The first hit of sample 0 goes to guide, if given.
+template <KernelFeatures features = KernelFeatures{}>
+Vector SumPathSamples(const Accelerator& accelerator, const std::vector<Light>& lights,
+                      const Camera& camera, const Sampler& sampler, int y, int x, int first,
+                      int last, DenoiseGuide* guide = nullptr) {
+    Vector sum;
+    for (int k = first; k < last; ++k) {
+        SampleStream samples(sampler, x, y, k);
+        bool records = k == 0 && guide;
+        PrimaryHit primary;
+        sum = sum + TracePath<features>(accelerator, lights, GetPathRay(camera, &samples, y, x),
+                                        &samples, {0, camera.GetPixelSpread()},
+                                        records ? &primary : nullptr);
+        if (records) {
+            guide->Record(y, x, primary);
+        }
+    }
+    return sum;
+}
+
+// Linear result of a render: radiance for kFull and kPathTrace, distance for kDepth (one channel,
+// -1 where nothing was hit) and the shading normal for kNormal (zero where nothing
+// was hit). max_value is the largest radiance or distance in the frame. A cancelled
+// frame misses some of its tiles. guide holds the first hits of the paths when
+// RenderOptions::denoise is to filter the frame.
+struct RenderedFrame {
+    Framebuffer frame;
+    float max_value = 0.f;
+    bool cancelled = false;
+    std::optional<DenoiseGuide> guide = {};
+};
+
+int FrameChannels(RenderMode mode) {
+    return mode == RenderMode::kDepth ? 1 : 3;
+}
+
+// Kernel features of a render of scene: those of the scene, plus no secondary
+// rays for depth and normals or at recursion depth 0. Without RenderOptions::specialize it is the generic
+// kernel.
+KernelFeatures SelectKernel(const Scene& scene, const RenderOptions& render_options) {
+    if (!render_options.specialize) {
+        return {};
+    }
+    KernelFeatures features = scene.GetKernelFeatures();
+    if (render_options.mode == RenderMode::kDepth || render_options.mode == RenderMode::kNormal ||
+        (render_options.mode == RenderMode::kFull && render_options.depth == 0)) {
+        features.no_reflection = true;
+        features.no_refraction = true;
+    }
+    return features;
+}
+
+// Calls func.template operator()<kernel>() for the kernel equal to features. All
+// combinations of the flags are compiled in.
+template <int index = 0, class Func>
+void WithKernel(const KernelFeatures& features, Func&& func) {
+    if constexpr (index < 16) {
+        constexpr KernelFeatures kKernel{.triangles_only = (index & 1) != 0,
+                                         .flat_normals = (index & 2) != 0,
+                                         .no_reflection = (index & 4) != 0,
+                                         .no_refraction = (index & 8) != 0};
+        if (features == kKernel) {
+            func.template operator()<kKernel>();
+        } else {
+            WithKernel<index + 1>(features, func);
+        }
+    }
+}
+
+// The primary hits of kDepth, kNormal and kFull come from visibility, if any,
+// instead of being traced. kFull with RenderOptions::batch_shading traces and
+// shades the pixels in batches, in the order they come. kPathTrace records the
+// first hits of its paths in guide, if given.
+template <RenderMode mode, KernelFeatures features>
+float RenderTileKernel(const Accelerator& accelerator, const std::vector<Light>& lights,
+                       const CameraOptions& camera_options, const RenderOptions& render_options,
+                       const Tile& tile, Framebuffer* frame, int origin_x, int origin_y,
+                       const VisibilityBuffer* visibility, DenoiseGuide* guide) {
+    Camera camera(camera_options);
+    std::unique_ptr<Sampler> sampler;
+    if constexpr (mode == RenderMode::kPathTrace) {
+        sampler =
+            MakeSampler(render_options.sampler, render_options.samples, render_options.seed);
+    }
+    float max_value = 0.f;
+    auto trace = [&](int i, int j, const Vector& dir) {
+        Ray ray = Ray(camera.GetOrigin(), dir);
+        float* row = frame->Row(i - origin_y);
+        int x = j - origin_x;
+        if (mode != RenderMode::kPathTrace && visibility) {
+            const VisibilitySample& sample = visibility->At(i, j);
+            if constexpr (mode == RenderMode::kDepth) {
+                row[x] = sample.index == -1 ? -1.f : sample.depth;
+                max_value = std::max(max_value, row[x]);
+                return;
+            }
+            Hit hit = ResolveSample<features>(accelerator.GetPrimitives(), ray, sample);
+            if constexpr (mode == RenderMode::kFull) {
+                Vector color;
+                if (hit.IsValid() && render_options.depth >= 0) {
+                    color = ShadeHit<features>(accelerator, lights, ray, hit, render_options.depth, 0,
+                                               {0, camera.GetPixelSpread()});
                 }
-                if (!(c_new[2] == c_new[2])) {
-                    c_new[2] = 0;
+                frame->SetPixel(color, i - origin_y, x);
+                for (int h = 0; h < 3; ++h) {
+                    max_value = row[3 * x + h] > max_value ? row[3 * x + h] : max_value;
                 }
-                int c1 = std::round(c_new[0] * 255);
-                int c2 = std::round(c_new[1] * 255);
-                int c3 = std::round(c_new[2] * 255);
-                img.SetPixel({c1, c2, c3}, i, j);
+            } else {
+                frame->SetPixel(hit.IsValid() ? hit.shading_normal : Vector(0, 0, 0), i - origin_y,
+                                x);
             }
+            return;
         }
-    } else if (render_options.mode == RenderMode::kNormal) {
-        std::vector<std::vector<double>> pixel_d(
-            camera_options.screen_height, std::vector<double>(camera_options.screen_width, 0.0));
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            curr_x = -width / 2 + pixel_size / 2;
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector ray_dir = Vector(curr_x, curr_y, -1);
-                ray_dir.Normalize();
-                Vector dir_world = MultDirMatrix(ray_dir, m);
-                dir_world.Normalize();
-                Ray ray = Ray(camera_options.look_from, dir_world);
-                double min_d = 1000000000;
-                for (auto& obj : objects) {
-                    std::optional<Intersection> intr = GetIntersection(ray, obj.polygon);
-                    if (intr.has_value()) {
-                        double dist = intr->GetDistance();
-                        if (dist < min_d) {
-                            min_d = dist;
-                            Vector normal = intr->GetNormal();
-                            if (!obj.normals.empty()) {
-                                Vector bars =
-                                    GetBarycentricCoords(obj.polygon, intr->GetPosition());
-                                normal = obj.normals[0].MultiplyOnScalar(bars[0]) +
-                                         obj.normals[1].MultiplyOnScalar(bars[1]) +
-                                         obj.normals[2].MultiplyOnScalar(bars[2]);
-                            }
-                            normal = normal.MultiplyOnScalar(0.5) + Vector(0.5, 0.5, 0.5);
-                            int c1 = std::round(normal[0] * 255);
-                            int c2 = std::round(normal[1] * 255);
-                            int c3 = std::round(normal[2] * 255);
-                            img.SetPixel({c1, c2, c3}, i, j);
-                        }
-                    }
+        if constexpr (mode == RenderMode::kDepth) {
+            row[x] = GetPixelDepth<features>(accelerator, ray);
+            max_value = std::max(max_value, row[x]);
+        } else if constexpr (mode == RenderMode::kFull) {
+            frame->SetPixel(GetPixelColor<features>(accelerator, lights, ray, render_options.depth,
+                                                    0, {0, camera.GetPixelSpread()}),
+                            i - origin_y, x);
+            for (int h = 0; h < 3; ++h) {
+                max_value = row[3 * x + h] > max_value ? row[3 * x + h] : max_value;
+            }
+        } else if constexpr (mode == RenderMode::kPathTrace) {
+            int samples = render_options.samples;
+            Vector sum = SumPathSamples<features>(accelerator, lights, camera, *sampler, i, j, 0,
+                                                  samples, guide);
+            frame->SetPixel(sum.MultiplyOnScalar(1. / samples), i - origin_y, x);
+            for (int h = 0; h < 3; ++h) {
+                max_value = row[3 * x + h] > max_value ? row[3 * x + h] : max_value;
+            }
+        } else {
+            frame->SetPixel(GetPixelNormal<features>(accelerator, ray), i - origin_y, x);
+        }
+    };
+    struct PendingPixel {
+        int i;
+        int j;
+        Vector dir;
+    };
+    struct KernelBuffers {
+        std::vector<PendingPixel> pending;
+        std::vector<Ray> rays;
+        std::vector<Hit> hits;
+        std::vector<Vector> colors;
+        std::vector<Vector> directions;
+    };
+    // Misses take no lanes, so several batches of pixels are shaded at once to
+    // fill them.
+    constexpr size_t kPendingPixels = 4 * kShadeBatch;
+    // Taken out of the thread's buffers, so a tile that starts on this thread
+    // while this one waits gets buffers of its own.
+    thread_local KernelBuffers thread_buffers;
+    KernelBuffers buffers = std::move(thread_buffers);
+    std::vector<PendingPixel>& pending = buffers.pending;
+    std::vector<Ray>& rays = buffers.rays;
+    std::vector<Hit>& hits = buffers.hits;
+    std::vector<Vector>& colors = buffers.colors;
+    std::vector<Vector>& directions = buffers.directions;
+    pending.clear();
+    auto shade_pending = [&] {
+        if constexpr (mode == RenderMode::kFull) {
+            const PrimitiveSet& primitives = accelerator.GetPrimitives();
+            // The directions of GetRowDirections are normalized already.
+            rays.clear();
+            for (const auto& pixel : pending) {
+                rays.emplace_back(camera.GetOrigin(), pixel.dir);
+            }
+            hits.assign(pending.size(), Hit{});
+            if (visibility) {
+                for (size_t k = 0; k < pending.size(); ++k) {
+                    hits[k] = ResolveSample<features>(primitives, rays[k],
+                                                      visibility->At(pending[k].i, pending[k].j));
                 }
-                for (auto& obj : sph_objects) {
-                    std::optional<Intersection> intr = GetIntersection(ray, obj.sphere);
-                    if (intr.has_value()) {
-                        double dist = intr->GetDistance();
-                        if (dist < min_d) {
-                            min_d = dist;
-                            Vector normal = intr->GetNormal();
-                            normal = normal.MultiplyOnScalar(0.5) + Vector(0.5, 0.5, 0.5);
-                            int c1 = std::round(normal[0] * 255);
-                            int c2 = std::round(normal[1] * 255);
-                            int c3 = std::round(normal[2] * 255);
-                            img.SetPixel({c1, c2, c3}, i, j);
-                        }
+            } else {
+                accelerator.ClosestHits(rays, hits);
+                for (size_t k = 0; k < pending.size(); ++k) {
+                    if (hits[k].IsValid()) {
+                        ComputeHitAttributes<features>(primitives, rays[k], &hits[k]);
                     }
                 }
-                curr_x += pixel_size;
             }
-            curr_y -= pixel_size;
+            colors.assign(pending.size(), Vector());
+            if (render_options.depth >= 0) {
+                ShadeHits<features>(accelerator, lights, rays, hits, render_options.depth,
+                                    {0, camera.GetPixelSpread()}, colors);
+            }
+            for (size_t k = 0; k < pending.size(); ++k) {
+                int x = pending[k].j - origin_x;
+                frame->SetPixel(colors[k], pending[k].i - origin_y, x);
+                const float* row = frame->Row(pending[k].i - origin_y);
+                for (int h = 0; h < 3; ++h) {
+                    max_value = row[3 * x + h] > max_value ? row[3 * x + h] : max_value;
+                }
+            }
+        }
+        pending.clear();
+    };
+    auto visit = [&](int i, int j, const Vector& dir) {
+        if (mode != RenderMode::kFull || !render_options.batch_shading) {
+            trace(i, j, dir);
+            return;
+        }
+        pending.push_back({i, j, dir});
+        if (pending.size() == kPendingPixels) {
+            shade_pending();
+        }
+    };
+    int width = tile.x1 - tile.x0;
+    if (render_options.pixel_order == PixelOrder::kScanline) {
+        directions.resize(width);
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            camera.GetRowDirections(i, tile.x0, tile.x1, directions.data());
+            for (int j = tile.x0; j < tile.x1; ++j) {
+                visit(i, j, directions[j - tile.x0]);
+            }
+        }
+    } else {
+        directions.resize(static_cast<size_t>(width) * (tile.y1 - tile.y0));
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            camera.GetRowDirections(i, tile.x0, tile.x1,
+                                    directions.data() + (i - tile.y0) * width);
+        }
+        ForEachMorton(width, tile.y1 - tile.y0, [&](int x, int y) {
+            visit(tile.y0 + y, tile.x0 + x, directions[y * width + x]);
+        });
+    }
+    shade_pending();
+    thread_buffers = std::move(buffers);
+    return max_value;
+}
+
+// Prepares the textures of the materials of scene, one task each, so that no
+// tile stops to decode one while the others wait for it.
+void PrepareTextures(const Scene& scene) {
+    std::vector<TextureHandle> textures;
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        if (material.diffuse_map != kNoTexture) {
+            textures.push_back(material.diffuse_map);
+        }
+    }
+    ParallelFor(0, textures.size(), [&](int i) { GetTextureCache().Prepare(textures[i]); });
+}
+
+// Accelerator over the meshes of scene at the levels of detail the camera calls
+// for under render_options.lod_pixel_error. Resolved once per frame and handed to
+// every tile, after the textures of the scene are prepared.
+std::shared_ptr<const Accelerator> GetFrameAccelerator(const Scene& scene,
+                                                       const CameraOptions& camera_options,
+                                                       const RenderOptions& render_options) {
+    PrepareTextures(scene);
+    Camera camera(camera_options);
+    return scene.GetLodAccelerator(
+        render_options.accelerator,
+        scene.SelectLod(camera.GetOrigin(), camera.GetPixelSpread(), render_options.lod_pixel_error));
+}
+
+// Traces the pixels of tile through accelerator, that of GetFrameAccelerator, into
+// frame, which holds the image pixel (x, y) at (x - origin_x, y - origin_y).
+// Returns the largest value written. The primary hits come from visibility, if
+// given, a buffer of the whole image, and the first hits of the paths go to guide,
+// if given, one of the whole image.
+float RenderTile(const Scene& scene, const Accelerator& accelerator,
+                 const CameraOptions& camera_options, const RenderOptions& render_options,
+                 const Tile& tile, Framebuffer* frame, int origin_x = 0, int origin_y = 0,
+                 const VisibilityBuffer* visibility = nullptr, DenoiseGuide* guide = nullptr) {
+    float max_value = 0.f;
+    WithKernel(SelectKernel(scene, render_options), [&]<KernelFeatures features>() {
+        auto render = [&]<RenderMode mode>() {
+            max_value = RenderTileKernel<mode, features>(
+                accelerator, scene.GetLights(), camera_options, render_options, tile, frame,
+                origin_x, origin_y, visibility, guide);
+        };
+        if (render_options.mode == RenderMode::kDepth) {
+            render.template operator()<RenderMode::kDepth>();
+        } else if (render_options.mode == RenderMode::kFull) {
+            render.template operator()<RenderMode::kFull>();
+        } else if (render_options.mode == RenderMode::kPathTrace) {
+            render.template operator()<RenderMode::kPathTrace>();
+        } else {
+            render.template operator()<RenderMode::kNormal>();
         }
+    });
+    return max_value;
+}
+
+// Primary hits of the frame over the primitives of accelerator by
+// RenderOptions::primary_visibility; none when they are to be traced.
+std::optional<VisibilityBuffer> RasterizeFrame(const Accelerator& accelerator,
+                                               const CameraOptions& camera_options,
+                                               const RenderOptions& render_options) {
+    if (render_options.primary_visibility != PrimaryVisibility::kRasterize ||
+        render_options.mode == RenderMode::kPathTrace) {
+        return std::nullopt;
+    }
+    if (!CanRasterize(accelerator.GetPrimitives())) {
+        return std::nullopt;
+    }
+    return Rasterize(accelerator.GetPrimitives(), camera_options, render_options.tile_size);
+}
+
+// Whether the frames of render_options are filtered by RenderOptions::denoise.
+bool Denoises(const RenderOptions& render_options) {
+    return render_options.mode == RenderMode::kPathTrace && render_options.denoise.iterations > 0;
+}
+
+// Traces the frame tile by tile. Every finished tile is handed to sink, if any,
+// before the rest of the frame is done. Frames to be denoised keep their guide.
+RenderedFrame RenderFrame(const Scene& scene, const CameraOptions& camera_options,
+                          const RenderOptions& render_options, FrameSink* sink = nullptr) {
+    ScopedJobContext context(render_options.priority);
+    RenderedFrame result{Framebuffer(camera_options.screen_width, camera_options.screen_height,
+                                     FrameChannels(render_options.mode))};
+    if (Denoises(render_options)) {
+        result.guide.emplace(camera_options.screen_width, camera_options.screen_height);
+    }
+    auto accelerator = GetFrameAccelerator(scene, camera_options, render_options);
+    std::optional<VisibilityBuffer> visibility =
+        RasterizeFrame(*accelerator, camera_options, render_options);
+    std::vector<Tile> tiles = SplitIntoTiles(camera_options.screen_width,
+                                             camera_options.screen_height, render_options.tile_size);
+    if (render_options.pixel_order == PixelOrder::kSpaceFilling) {
+        SortTilesHilbert(&tiles, render_options.tile_size);
+    }
+    // Every tile reports its own maximum, so normalization needs no extra pass over the frame.
+    std::vector<float> tile_max(tiles.size(), 0.f);
+    std::atomic<size_t> traced = 0;
+    ParallelFor(0, tiles.size(), [&](int t) {
+        tile_max[t] = RenderTile(scene, *accelerator, camera_options, render_options, tiles[t],
+                                 &result.frame, 0, 0, visibility ? &*visibility : nullptr,
+                                 result.guide ? &*result.guide : nullptr);
+        if (sink) {
+            sink->WriteTile(result.frame, tiles[t]);
+        }
+        ++traced;
+    });
+    result.cancelled = traced < tiles.size();
+    if (sink) {
+        sink->Finish();
+    }
+    for (float value : tile_max) {
+        result.max_value = std::max(result.max_value, value);
+    }
+    return result;
+}
+
+Image ToImage(const RenderedFrame& result, RenderMode mode) {
+    if (mode == RenderMode::kDepth) {
+        return DepthToImage(result.frame, result.max_value);
+    } else if (mode == RenderMode::kNormal) {
+        return NormalToImage(result.frame);
+    }
+    return ToneMap(result.frame, result.max_value);
+}
+
+// The guide of a frame whose paths were traced elsewhere: the first hits of the
+// paths, traced here without the rest of them.
+DenoiseGuide RenderDenoiseGuide(const Scene& scene, const CameraOptions& camera_options,
+                                const RenderOptions& render_options) {
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+    DenoiseGuide guide(width, height);
+    auto accelerator = GetFrameAccelerator(scene, camera_options, render_options);
+    Camera camera(camera_options);
+    std::unique_ptr<Sampler> sampler =
+        MakeSampler(render_options.sampler, render_options.samples, render_options.seed);
+    WithKernel(SelectKernel(scene, render_options), [&]<KernelFeatures features>() {
+        ParallelFor(0, height, [&](int y) {
+            for (int x = 0; x < width; ++x) {
+                SampleStream samples(*sampler, x, y, 0);
+                Hit hit = FindClosestHit<features>(*accelerator,
+                                                   GetPathRay(camera, &samples, y, x));
+                guide.Record(y, x, hit.IsValid() ? PrimaryHit{static_cast<float>(hit.params.t),
+                                                              hit.shading_normal}
+                                                 : PrimaryHit{});
+            }
+        });
+    });
+    return guide;
+}
+
+// Filters result, the mean radiance of samples paths per pixel, by options.
+void DenoiseFrame(const DenoiseGuide& guide, DenoiseOptions options, int samples,
+                  RenderedFrame* result) {
+    options.sigma_color /= std::sqrt(std::max(samples, 1));
+    Denoise(guide.depth, guide.normal, options, &result->frame);
+    result->max_value = MaxValue(result->frame);
+}
+
+// Filters the path-traced radiance of result by RenderOptions::denoise, guided by
+// the first hits its paths recorded or, when it has none, by RenderDenoiseGuide.
+void DenoiseFrame(const Scene& scene, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, RenderedFrame* result) {
+    if (!result->guide) {
+        result->guide = RenderDenoiseGuide(scene, camera_options, render_options);
+    }
+    DenoiseFrame(*result->guide, render_options.denoise, render_options.samples, result);
+}
+
+Image Render(const Scene& scene, const CameraOptions& camera_options,
+             const RenderOptions& render_options) {
+    ScopedJobContext context(render_options.priority);
+    RenderedFrame result = RenderFrame(scene, camera_options, render_options);
+    if (Denoises(render_options)) {
+        DenoiseFrame(scene, camera_options, render_options, &result);
+    }
+    return ToImage(result, render_options.mode);
+}
+
+Image Render(const std::filesystem::path& path, const CameraOptions& camera_options,
+             const RenderOptions& render_options) {
+    return Render(ReadScene(path), camera_options, render_options);
+}
+
+// Writes the linear, un-tonemapped frame to output while it is traced. The format
+// follows the extension: .pfm or a tiled .exr. The filter of RenderOptions::denoise
+// needs the whole frame, so a denoised frame is written once it is finished.
+void RenderToFile(const Scene& scene, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, const std::filesystem::path& output) {
+    ScopedJobContext context(render_options.priority);
+    int channels = FrameChannels(render_options.mode);
+    std::unique_ptr<FrameSink> sink;
+    if (output.extension() == ".pfm") {
+        sink = std::make_unique<PfmWriter>(output, camera_options.screen_width,
+                                           camera_options.screen_height, channels);
+    } else if (output.extension() == ".exr") {
+        sink = std::make_unique<ExrWriter>(output, camera_options.screen_width,
+                                           camera_options.screen_height, channels,
+                                           render_options.tile_size);
+    } else {
+        throw std::invalid_argument("Unsupported HDR format " + output.string());
+    }
+    if (!Denoises(render_options)) {
+        RenderFrame(scene, camera_options, render_options, sink.get());
+        return;
+    }
+    RenderedFrame result = RenderFrame(scene, camera_options, render_options);
+    DenoiseFrame(scene, camera_options, render_options, &result);
+    for (const Tile& tile : SplitIntoTiles(camera_options.screen_width,
+                                           camera_options.screen_height, render_options.tile_size)) {
+        sink->WriteTile(result.frame, tile);
     }
-    return img;
+    sink->Finish();
 }
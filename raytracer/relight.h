@@ -0,0 +1,303 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct RelightOptions {
+    // Levels of secondary hits kept below the primary ones. Deeper light paths
+    // are traced again on every relight.
+    int cached_bounces = 4;
+};
+
+// Shading point of the Whitted ray tree of a pixel. Children are node indices
+// in the same row, kMiss when the ray hits nothing or is cut by the depth, and
+// kLive when they lie below the cached levels.
+struct GBufferNode {
+    static constexpr int kMiss = -1;
+    static constexpr int kLive = -2;
+
+    Vector position;
+    Vector normal;
+    Vector direction;
+    const Material* material;
+    // The diffuse map at the node, if it has one, and the cone of the ray there.
+    std::optional<Vector> texture;
+    RayCone cone;
+    PrimitiveType type;
+    int primitive;
+    bool is_inside;
+    int rec_depth;
+    int reflected = kMiss;
+    int refracted = kMiss;
+};
+
+// Keeps the geometry of a render so that changed lights and materials only
+// redo the shading: local lighting and the weighting of reflected and refracted
+// light. Shadow rays are kept per light and traced again only for the lights
+// that moved, and texture colors for the materials that keep their maps. The
+// scene has to outlive the relighter, which shares its vertex attributes. Only
+// RenderMode::kFull is supported.
+class Relighter {
+public:
+    Relighter(const Scene& scene, const CameraOptions& camera_options,
+              const RenderOptions& render_options, const RelightOptions& options = {})
+        : camera_options_(camera_options),
+          render_options_(render_options),
+          options_(options),
+          primitives_(scene.GetPrimitives()),
+          lights_(scene.GetLights()),
+          materials_(scene.GetMaterials().begin(), scene.GetMaterials().end()) {
+        if (render_options.mode != RenderMode::kFull) {
+            throw std::invalid_argument("Relighter supports only the full render mode");
+        }
+        std::unordered_map<const Material*, const Material*> own;
+        for (const auto& [name, material] : scene.GetMaterials()) {
+            own[&material] = &materials_.at(name);
+        }
+        primitives_.ForEachBlock([&](auto, auto& block) {
+            for (auto& obj : block) {
+                obj.material = own.at(obj.material);
+            }
+        });
+        accelerator_ = MakeAccelerator(render_options.accelerator, primitives_);
+        BuildGBuffer();
+    }
+
+    // The accelerator refers to the primitives of the relighter.
+    Relighter(const Relighter&) = delete;
+    Relighter& operator=(const Relighter&) = delete;
+
+    // Image with the current lights and materials.
+    Image Render() const {
+        RenderedFrame result{
+            Framebuffer(camera_options_.screen_width, camera_options_.screen_height)};
+        std::vector<float> row_max(result.frame.Height(), 0.f);
+        ParallelFor(0, result.frame.Height(), [&](int y) {
+            const auto& nodes = row_nodes_[y];
+            float* row = result.frame.Row(y);
+            for (int x = 0; x < result.frame.Width(); ++x) {
+                int root = roots_[static_cast<size_t>(y) * result.frame.Width() + x];
+                if (root != GBufferNode::kMiss) {
+                    result.frame.SetPixel(Shade(nodes, row_visibility_[y], root), y, x);
+                }
+                for (int c = 0; c < 3; ++c) {
+                    row_max[y] = row[3 * x + c] > row_max[y] ? row[3 * x + c] : row_max[y];
+                }
+            }
+        });
+        result.max_value = *std::max_element(row_max.begin(), row_max.end());
+        return ToImage(result, RenderMode::kFull);
+    }
+
+    // Materials are matched by name; a changed refraction index bends the
+    // refracted rays differently, so it makes the G-buffer be traced again, and
+    // so does a changed texture map. Unknown material names are rejected before
+    // anything changes.
+    Image Relight(const std::vector<Light>& lights,
+                  const std::unordered_map<std::string, Material>& materials = {}) {
+        for (const auto& [name, material] : materials) {
+            if (!materials_.contains(name)) {
+                throw std::invalid_argument("Unknown material " + name);
+            }
+        }
+        lights_ = lights;
+        bool retrace = false;
+        for (const auto& [name, material] : materials) {
+            auto it = materials_.find(name);
+            retrace |= it->second.refraction_index != material.refraction_index ||
+                       it->second.diffuse_map != material.diffuse_map;
+            it->second = material;
+        }
+        if (retrace) {
+            BuildGBuffer();
+        } else {
+            UpdateVisibility();
+        }
+        return Render();
+    }
+
+    size_t CachedNodes() const {
+        size_t count = 0;
+        for (const auto& nodes : row_nodes_) {
+            count += nodes.size();
+        }
+        return count;
+    }
+
+private:
+    void BuildGBuffer() {
+        int width = camera_options_.screen_width;
+        int height = camera_options_.screen_height;
+        Camera camera(camera_options_);
+        roots_.assign(static_cast<size_t>(width) * height, GBufferNode::kMiss);
+        row_nodes_.assign(height, {});
+        ParallelFor(0, height, [&](int y) {
+            for (int x = 0; x < width; ++x) {
+                roots_[static_cast<size_t>(y) * width + x] =
+                    Build(camera.GetRay(y, x), render_options_.depth, false, 0,
+                          {0, camera.GetPixelSpread()}, &row_nodes_[y]);
+            }
+        });
+        row_visibility_.assign(height, {});
+        visibility_positions_.clear();
+        UpdateVisibility();
+    }
+
+    // Traces the shadow rays of the lights that are new or moved since the last call.
+    void UpdateVisibility() {
+        size_t count = lights_.size();
+        bool all = visibility_positions_.size() != count;
+        std::vector<size_t> changed;
+        for (size_t i = 0; i < count; ++i) {
+            if (all || Distance(visibility_positions_[i], lights_[i].position) != 0) {
+                changed.push_back(i);
+            }
+        }
+        if (changed.empty()) {
+            return;
+        }
+        ParallelFor(0, static_cast<int>(row_nodes_.size()), [&](int y) {
+            const auto& nodes = row_nodes_[y];
+            auto& visibility = row_visibility_[y];
+            visibility.resize(nodes.size() * count);
+            for (size_t n = 0; n < nodes.size(); ++n) {
+                Vector normal = nodes[n].normal;
+                normal.Normalize();
+                for (size_t i : changed) {
+                    visibility[n * count + i] =
+                        IsLightVis(lights_[i], nodes[n].position, *accelerator_, normal);
+                }
+            }
+        });
+        visibility_positions_.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            visibility_positions_[i] = lights_[i].position;
+        }
+    }
+
+    int Build(const Ray& ray, int rec_depth, bool is_inside, int level, const RayCone& cone,
+              std::vector<GBufferNode>* nodes) const {
+        if (rec_depth == -1) {
+            return GBufferNode::kMiss;
+        }
+        Hit hit = FindClosestHit(*accelerator_, ray);
+        if (!hit.IsValid()) {
+            return GBufferNode::kMiss;
+        }
+        const Material* material = primitives_.GetMaterial(hit.type, hit.index);
+        RayCone hit_cone = cone.Advance(hit.intersection->GetDistance());
+        GBufferNode node{hit.intersection->GetPosition(),
+                         hit.shading_normal,
+                         ray.GetDirection(),
+                         material,
+                         GetDiffuseTexture(*material, hit, hit_cone.width),
+                         hit_cone,
+                         hit.type,
+                         hit.index,
+                         is_inside,
+                         rec_depth};
+        int index = nodes->size();
+        nodes->push_back(node);
+        auto child = [&](const std::optional<Ray>& child_ray, bool child_inside) {
+            if (!child_ray || rec_depth == 0) {
+                return GBufferNode::kMiss;
+            }
+            if (level == options_.cached_bounces) {
+                return GBufferNode::kLive;
+            }
+            return Build(*child_ray, rec_depth - 1, child_inside, level + 1, hit_cone, nodes);
+        };
+        int reflected = child(ReflectedRay(node), false);
+        (*nodes)[index].reflected = reflected;
+        int refracted = child(RefractedRay(node), IsClosed(hit.type) && !is_inside);
+        (*nodes)[index].refracted = refracted;
+        return index;
+    }
+
+    static std::optional<Ray> ReflectedRay(const GBufferNode& node) {
+        if (node.is_inside) {
+            return std::nullopt;
+        }
+        Vector ray_dir = node.direction;
+        ray_dir.Normalize();
+        Vector refl_ray_dir = Reflect(ray_dir, node.normal);
+        refl_ray_dir.Normalize();
+        return Ray(node.position + node.normal.MultiplyOnScalar(0.000000001), refl_ray_dir);
+    }
+
+    static std::optional<Ray> RefractedRay(const GBufferNode& node) {
+        Vector ray_dir = node.direction;
+        ray_dir.Normalize();
+        double eta = node.is_inside ? node.material->refraction_index
+                                    : 1.0 / node.material->refraction_index;
+        std::optional<Vector> retr_ray_dir = Refract(ray_dir, node.normal, eta);
+        if (!retr_ray_dir) {
+            return std::nullopt;
+        }
+        retr_ray_dir->Normalize();
+        return Ray(node.position - node.normal.MultiplyOnScalar(0.000000002), *retr_ray_dir);
+    }
+
+    // Same sum as ShadeHit and GetPointColorBase, over the cached tree.
+    Vector Shade(const std::vector<GBufferNode>& nodes, const std::vector<uint8_t>& visibility,
+                 int index) const {
+        const GBufferNode& node = nodes[index];
+        const MaterialShading& base = *node.material;
+        std::optional<MaterialShading> textured;
+        if (node.texture) {
+            textured = base;
+            textured->diffuse_color = MultiplyComp(textured->diffuse_color, *node.texture);
+        }
+        const MaterialShading& mat = textured ? *textured : base;
+        Vector color = mat.ambient_color + mat.intensity;
+        Vector vv = node.direction.MultiplyOnScalar(-1);
+        vv.Normalize();
+        Vector normal = node.normal;
+        normal.Normalize();
+        for (size_t i = 0; i < lights_.size(); ++i) {
+            if (visibility[index * lights_.size() + i]) {
+                Vector c = GetLightColor(lights_[i], normal, mat, node.position, vv);
+                color = color + c.MultiplyOnScalar(mat.albedo[0]);
+            }
+        }
+        auto child_color = [&](int child, const std::optional<Ray>& ray, bool child_inside) {
+            if (child == GBufferNode::kLive) {
+                return GetPixelColor(*accelerator_, lights_, *ray, node.rec_depth - 1, child_inside,
+                                     node.cone);
+            }
+            return child == GBufferNode::kMiss ? Vector() : Shade(nodes, visibility, child);
+        };
+        if (!node.is_inside) {
+            Vector i_refl = child_color(node.reflected, ReflectedRay(node), false);
+            color = color + i_refl.MultiplyOnScalar(mat.albedo[1]);
+        }
+        std::optional<Ray> refracted = RefractedRay(node);
+        if (refracted) {
+            double tr_coef = node.is_inside ? 1.0 : mat.albedo[2];
+            Vector i_retr =
+                child_color(node.refracted, refracted, IsClosed(node.type) && !node.is_inside);
+            color = color + i_retr.MultiplyOnScalar(tr_coef);
+        }
+        return color;
+    }
+
+    CameraOptions camera_options_;
+    RenderOptions render_options_;
+    RelightOptions options_;
+    PrimitiveSet primitives_;
+    std::unique_ptr<Accelerator> accelerator_;
+    std::vector<Light> lights_;
+    std::unordered_map<std::string, Material> materials_;
+    std::vector<int> roots_;
+    std::vector<std::vector<GBufferNode>> row_nodes_;
+    // Per row, whether each light is visible from each node, node-major.
+    std::vector<std::vector<uint8_t>> row_visibility_;
+    std::vector<Vector> visibility_positions_;
+};
@@ -0,0 +1,432 @@
+#pragma once
+
+#include <raytracer.h>
+#include <socket_messages.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Requests and replies of the render server:
+//   kRender   scene path, CameraOptions, RenderOptions, RenderOutput
+//   kImage    width, height, RGB bytes row by row
+//   kFrame    width, height, channels, max value, linear floats row by row
+//   kStats    request without payload; the reply carries ServerStats
+//   kError    message
+//   kShutdown stops the server
+enum class ServerMessage : uint32_t { kRender, kImage, kFrame, kStats, kError, kShutdown };
+
+enum class RenderOutput : uint8_t { kImage, kFrame };
+
+struct ServerStats {
+    uint64_t requests = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t evictions = 0;
+    uint64_t resident_scenes = 0;
+    uint64_t resident_bytes = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+    // Summed over the requests whose scene was cached or being loaded.
+    double total_hit_latency_ms = 0;
+};
+
+// Loaded scenes keyed by path and modification time, evicted least recently used
+// first once their total size exceeds the budget. A scene is measured with its
+// default accelerator built, and again by Remeasure once a render has built more.
+// Scenes handed out stay alive until their last user is done, even when evicted.
+class SceneCache {
+public:
+    explicit SceneCache(size_t budget_bytes) : budget_bytes_(budget_bytes) {
+    }
+
+    // Requests for a scene that is being loaded wait for that load and count as
+    // hits.
+    std::shared_ptr<const Scene> Get(const std::filesystem::path& path, bool* hit) {
+        std::string key = std::filesystem::absolute(path).lexically_normal().string();
+        auto mtime = std::filesystem::last_write_time(path);
+        std::promise<std::shared_ptr<const Scene>> promise;
+        std::shared_future<std::shared_ptr<const Scene>> pending;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end() && it->second->mtime == mtime) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                ++hits_;
+                *hit = true;
+                return it->second->scene;
+            }
+            auto loading = loading_.find(key);
+            if (loading != loading_.end() && loading->second.mtime == mtime) {
+                ++hits_;
+                pending = loading->second.scene;
+            } else {
+                loading_[key] = {mtime, promise.get_future().share()};
+            }
+        }
+        *hit = pending.valid();
+        if (pending.valid()) {
+            return pending.get();
+        }
+        std::shared_ptr<const Scene> scene;
+        size_t bytes;
+        try {
+            scene = std::make_shared<const Scene>(ReadScene(path));
+            scene->GetAccelerator();
+            bytes = scene->MemoryFootprint().Total();
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            std::lock_guard lock(mutex_);
+            EndLoad(key, mtime);
+            throw;
+        }
+        std::lock_guard lock(mutex_);
+        ++misses_;
+        EndLoad(key, mtime);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            Erase(it->second);
+        }
+        lru_.push_front({key, mtime, scene, bytes});
+        entries_[key] = lru_.begin();
+        resident_bytes_ += bytes;
+        Evict();
+        promise.set_value(scene);
+        return scene;
+    }
+
+    // Accounts for the accelerators and levels of detail scene has built since it
+    // was measured, if it is still cached.
+    void Remeasure(const std::shared_ptr<const Scene>& scene) {
+        size_t bytes = scene->MemoryFootprint().Total();
+        std::lock_guard lock(mutex_);
+        for (auto& entry : lru_) {
+            if (entry.scene == scene) {
+                resident_bytes_ += bytes - entry.bytes;
+                entry.bytes = bytes;
+                Evict();
+                return;
+            }
+        }
+    }
+
+    void FillStats(ServerStats* stats) const {
+        std::lock_guard lock(mutex_);
+        stats->cache_hits = hits_;
+        stats->cache_misses = misses_;
+        stats->evictions = evictions_;
+        stats->resident_scenes = lru_.size();
+        stats->resident_bytes = resident_bytes_;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::filesystem::file_time_type mtime;
+        std::shared_ptr<const Scene> scene;
+        size_t bytes;
+    };
+
+    struct Load {
+        std::filesystem::file_time_type mtime;
+        std::shared_future<std::shared_ptr<const Scene>> scene;
+    };
+
+    void Erase(std::list<Entry>::iterator it) {
+        resident_bytes_ -= it->bytes;
+        entries_.erase(it->key);
+        lru_.erase(it);
+    }
+
+    // Keeps the most recently used scene, however large.
+    void Evict() {
+        while (resident_bytes_ > budget_bytes_ && lru_.size() > 1) {
+            Erase(std::prev(lru_.end()));
+            ++evictions_;
+        }
+    }
+
+    // Forgets the load of key at mtime, unless a load of a newer file replaced it.
+    void EndLoad(const std::string& key, std::filesystem::file_time_type mtime) {
+        auto it = loading_.find(key);
+        if (it != loading_.end() && it->second.mtime == mtime) {
+            loading_.erase(it);
+        }
+    }
+
+    size_t budget_bytes_;
+    size_t resident_bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+    std::unordered_map<std::string, Load> loading_;
+    mutable std::mutex mutex_;
+};
+
+// Serves render requests on a Unix domain socket, one thread per connection.
+class RenderServer {
+public:
+    RenderServer(const std::string& socket_path, size_t cache_budget_bytes)
+        : socket_path_(socket_path),
+          listen_fd_(ListenUnixSocket(socket_path)),
+          cache_(cache_budget_bytes) {
+    }
+
+    ~RenderServer() {
+        Stop();
+        close(listen_fd_);
+        unlink(socket_path_.c_str());
+    }
+
+    // Accepts connections until Stop is called or a client sends kShutdown. Out of
+    // descriptors or memory, it waits for connections to close; on other errors of
+    // accept it closes the connections and throws.
+    void Serve() {
+        std::string error;
+        while (!stopped_) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    std::this_thread::sleep_for(kAcceptBackoff);
+                    continue;
+                }
+                if (!stopped_) {
+                    error = std::string("accept failed: ") + std::strerror(errno);
+                }
+                break;
+            }
+            std::lock_guard lock(connections_mutex_);
+            if (stopped_) {
+                close(fd);
+                break;
+            }
+            client_fds_.insert(fd);
+            std::thread([this, fd] { HandleConnection(fd); }).detach();
+        }
+        std::unique_lock lock(connections_mutex_);
+        for (int fd : client_fds_) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        connections_done_.wait(lock, [this] { return client_fds_.empty(); });
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    void Stop() {
+        stopped_ = true;
+        shutdown(listen_fd_, SHUT_RDWR);
+    }
+
+    ServerStats GetStats() const {
+        ServerStats stats;
+        {
+            std::lock_guard lock(stats_mutex_);
+            stats = stats_;
+        }
+        cache_.FillStats(&stats);
+        return stats;
+    }
+
+private:
+    static constexpr std::chrono::milliseconds kAcceptBackoff{50};
+
+    void HandleConnection(int fd) {
+        ServeClient(fd);
+        std::lock_guard lock(connections_mutex_);
+        client_fds_.erase(fd);
+        close(fd);
+        connections_done_.notify_all();
+    }
+
+    void ServeClient(int fd) {
+        while (std::optional<Message> request = ReceiveMessage(fd)) {
+            auto start = std::chrono::steady_clock::now();
+            auto type = static_cast<ServerMessage>(request->type);
+            if (type == ServerMessage::kShutdown) {
+                Stop();
+                return;
+            }
+            if (type == ServerMessage::kStats) {
+                MessageWriter reply;
+                reply.Put(GetStats());
+                SendMessage(fd, ServerMessage::kStats, reply);
+                continue;
+            }
+            bool sent = false;
+            bool hit = false;
+            try {
+                sent = HandleRender(fd, &request->payload, &hit);
+            } catch (const std::exception& e) {
+                MessageWriter reply;
+                reply.PutString(e.what());
+                sent = SendMessage(fd, ServerMessage::kError, reply);
+            }
+            std::chrono::duration<double, std::milli> latency =
+                std::chrono::steady_clock::now() - start;
+            std::lock_guard lock(stats_mutex_);
+            ++stats_.requests;
+            stats_.total_latency_ms += latency.count();
+            stats_.max_latency_ms = std::max(stats_.max_latency_ms, latency.count());
+            if (hit) {
+                stats_.total_hit_latency_ms += latency.count();
+            }
+            if (!sent) {
+                return;
+            }
+        }
+    }
+
+    bool HandleRender(int fd, MessageReader* request, bool* hit) {
+        std::filesystem::path scene_path = request->GetString();
+        auto camera_options = request->Get<CameraOptions>();
+        auto render_options = request->Get<RenderOptions>();
+        auto output = request->Get<RenderOutput>();
+        std::shared_ptr<const Scene> scene = cache_.Get(scene_path, hit);
+        RenderedFrame result = RenderFrame(*scene, camera_options, render_options);
+        cache_.Remeasure(scene);
+        MessageWriter reply;
+        reply.Put<int32_t>(result.frame.Width());
+        reply.Put<int32_t>(result.frame.Height());
+        if (output == RenderOutput::kFrame) {
+            reply.Put<int32_t>(result.frame.Channels());
+            reply.Put(result.max_value);
+            for (int y = 0; y < result.frame.Height(); ++y) {
+                reply.PutFloats(result.frame.Row(y),
+                                static_cast<size_t>(result.frame.Width()) *
+                                    result.frame.Channels());
+            }
+            return SendMessage(fd, ServerMessage::kFrame, reply);
+        }
+        Image img = ToImage(result, render_options.mode);
+        for (int y = 0; y < img.Height(); ++y) {
+            for (int x = 0; x < img.Width(); ++x) {
+                RGB pixel = img.GetPixel(y, x);
+                reply.Put<uint8_t>(pixel.r);
+                reply.Put<uint8_t>(pixel.g);
+                reply.Put<uint8_t>(pixel.b);
+            }
+        }
+        return SendMessage(fd, ServerMessage::kImage, reply);
+    }
+
+    std::string socket_path_;
+    int listen_fd_;
+    SceneCache cache_;
+    std::atomic<bool> stopped_ = false;
+    ServerStats stats_;
+    mutable std::mutex stats_mutex_;
+    std::unordered_set<int> client_fds_;
+    std::mutex connections_mutex_;
+    std::condition_variable connections_done_;
+};
+
+class RenderClient {
+public:
+    explicit RenderClient(const std::string& socket_path)
+        : fd_(ConnectUnixSocket(socket_path)) {
+    }
+    RenderClient(const RenderClient&) = delete;
+    RenderClient& operator=(const RenderClient&) = delete;
+    ~RenderClient() {
+        close(fd_);
+    }
+
+    Image Render(const std::filesystem::path& scene_path, const CameraOptions& camera_options,
+                 const RenderOptions& render_options) {
+        MessageReader reply =
+            Request(scene_path, camera_options, render_options, RenderOutput::kImage);
+        int width = reply.Get<int32_t>();
+        int height = reply.Get<int32_t>();
+        Image img(width, height);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int r = reply.Get<uint8_t>();
+                int g = reply.Get<uint8_t>();
+                int b = reply.Get<uint8_t>();
+                img.SetPixel({r, g, b}, y, x);
+            }
+        }
+        return img;
+    }
+
+    RenderedFrame RenderFrame(const std::filesystem::path& scene_path,
+                              const CameraOptions& camera_options,
+                              const RenderOptions& render_options) {
+        MessageReader reply =
+            Request(scene_path, camera_options, render_options, RenderOutput::kFrame);
+        int width = reply.Get<int32_t>();
+        int height = reply.Get<int32_t>();
+        int channels = reply.Get<int32_t>();
+        RenderedFrame result{Framebuffer(width, height, channels)};
+        result.max_value = reply.Get<float>();
+        for (int y = 0; y < height; ++y) {
+            reply.GetFloats(result.frame.Row(y), static_cast<size_t>(width) * channels);
+        }
+        return result;
+    }
+
+    ServerStats GetStats() {
+        return Receive(ServerMessage::kStats, ServerMessage::kStats, {}).Get<ServerStats>();
+    }
+
+    void Shutdown() {
+        SendMessage(fd_, ServerMessage::kShutdown);
+    }
+
+private:
+    MessageReader Request(const std::filesystem::path& scene_path,
+                          const CameraOptions& camera_options,
+                          const RenderOptions& render_options, RenderOutput output) {
+        MessageWriter request;
+        request.PutString(scene_path.string());
+        request.Put(camera_options);
+        request.Put(render_options);
+        request.Put(output);
+        return Receive(ServerMessage::kRender,
+                       output == RenderOutput::kImage ? ServerMessage::kImage
+                                                      : ServerMessage::kFrame,
+                       request);
+    }
+
+    MessageReader Receive(ServerMessage type, ServerMessage expected,
+                          const MessageWriter& request) {
+        if (!SendMessage(fd_, type, request)) {
+            throw std::runtime_error("Render server is not reachable");
+        }
+        std::optional<Message> reply = ReceiveMessage(fd_);
+        if (!reply) {
+            throw std::runtime_error("Render server closed the connection");
+        }
+        if (reply->type == static_cast<uint32_t>(ServerMessage::kError)) {
+            throw std::runtime_error(reply->payload.GetString());
+        }
+        if (reply->type != static_cast<uint32_t>(expected)) {
+            throw std::runtime_error("Unexpected reply from render server");
+        }
+        return std::move(reply->payload);
+    }
+
+    int fd_;
+};
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <sampling.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum class SamplerType { kIndependent, kStratified, kSobol, kBlueNoise };
+
+// Coordinates in [0, 1) of the samples of a pixel. Every coordinate is a pure
+// function of the pixel, the sample index and the dimension, so no schedule of
+// threads or tiles changes an image. Dimensions 2k and 2k + 1 form a pair that
+// is stratified jointly where the sampler stratifies.
+class Sampler {
+public:
+    virtual ~Sampler() = default;
+
+    virtual SamplerType GetType() const = 0;
+    virtual double Get(int x, int y, uint32_t sample, uint32_t dimension) const = 0;
+};
+
+uint32_t HashPixel(int x, int y, uint64_t seed) {
+    return MixBits(MixBits(seed ^ static_cast<uint32_t>(x)) ^ static_cast<uint32_t>(y));
+}
+
+// Uniform white noise.
+class IndependentSampler : public Sampler {
+public:
+    explicit IndependentSampler(uint64_t seed = 0) : seed_(seed) {
+    }
+
+    SamplerType GetType() const override {
+        return SamplerType::kIndependent;
+    }
+
+    double Get(int x, int y, uint32_t sample, uint32_t dimension) const override {
+        uint64_t bits = MixBits(MixBits(HashPixel(x, y, seed_) ^ sample) ^ dimension);
+        return (bits >> 11) * 0x1p-53;
+    }
+
+private:
+    uint64_t seed_;
+};
+
+// Kensler's hashed permutation of [0, size), picked by pattern.
+uint32_t PermuteIndex(uint32_t i, uint32_t size, uint32_t pattern) {
+    uint32_t w = size - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= pattern;
+        i *= 0xe170893d;
+        i ^= pattern >> 16;
+        i ^= (i & w) >> 4;
+        i ^= pattern >> 8;
+        i *= 0x0929eb3f;
+        i ^= pattern >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | pattern >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= size);
+    return (i + pattern) % size;
+}
+
+// Correlated multi-jittered sampling (Kensler): samples_per_pixel points per pair
+// of dimensions, one in each cell of a grid and in each row and column stratum.
+// Samples past samples_per_pixel start a new pattern.
+class StratifiedSampler : public Sampler {
+public:
+    explicit StratifiedSampler(int samples_per_pixel, uint64_t seed = 0)
+        : count_(std::max(samples_per_pixel, 1)),
+          columns_(std::ceil(std::sqrt(count_))),
+          rows_((count_ + columns_ - 1) / columns_),
+          seed_(seed) {
+    }
+
+    SamplerType GetType() const override {
+        return SamplerType::kStratified;
+    }
+
+    double Get(int x, int y, uint32_t sample, uint32_t dimension) const override {
+        uint32_t pattern = MixBits(HashPixel(x, y, seed_) ^ (dimension / 2) ^
+                                   (static_cast<uint64_t>(sample / count_) << 32));
+        uint32_t cell = PermuteIndex(sample % count_, columns_ * rows_, pattern * 0x51633e2d);
+        uint32_t column = cell % columns_;
+        uint32_t row = cell / columns_;
+        if (dimension % 2 == 0) {
+            uint32_t sub = PermuteIndex(row, rows_, pattern * 0x63d83595);
+            double jitter = (MixBits(cell ^ (static_cast<uint64_t>(pattern) << 32)) >> 11) * 0x1p-53;
+            return (column + (sub + jitter) / rows_) / columns_;
+        }
+        uint32_t sub = PermuteIndex(column, columns_, pattern * 0xa511e9b3);
+        double jitter = (MixBits(cell ^ (static_cast<uint64_t>(pattern) << 32) ^ 1) >> 11) * 0x1p-53;
+        return (row + (sub + jitter) / columns_) / rows_;
+    }
+
+private:
+    uint32_t count_;
+    uint32_t columns_;
+    uint32_t rows_;
+    uint64_t seed_;
+};
+
+uint32_t ReverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    return ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+}
+
+// Owen scrambling of the bits of x, highest first, by hashing (Burley 2020).
+uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return ReverseBits(x);
+}
+
+// The first two dimensions of the Sobol sequence, as 32-bit fractions.
+uint32_t Sobol2D(uint32_t index, uint32_t dimension) {
+    if (dimension == 0) {
+        return ReverseBits(index);
+    }
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+// Sample index of a pixel and pair of dimensions, shuffled, then 2D Sobol point
+// Owen-scrambled per pair: every power of two of samples is a (0, 2)-net, and
+// the pairs are decorrelated by padding rather than higher Sobol dimensions.
+double OwenSobol(uint32_t sample, uint32_t dimension, uint32_t seed) {
+    uint32_t pair_seed = MixBits(seed ^ (static_cast<uint64_t>(dimension / 2) << 32));
+    uint32_t index = NestedUniformScramble(sample, pair_seed);
+    uint32_t bits = Sobol2D(index, dimension % 2);
+    return NestedUniformScramble(bits, MixBits(pair_seed + 1 + dimension % 2)) * 0x1p-32;
+}
+
+class SobolSampler : public Sampler {
+public:
+    explicit SobolSampler(uint64_t seed = 0) : seed_(seed) {
+    }
+
+    SamplerType GetType() const override {
+        return SamplerType::kSobol;
+    }
+
+    double Get(int x, int y, uint32_t sample, uint32_t dimension) const override {
+        return OwenSobol(sample, dimension, HashPixel(x, y, seed_));
+    }
+
+private:
+    uint64_t seed_;
+};
+
+constexpr int kBlueNoiseSize = 64;
+
+// Ranks 0 to kBlueNoiseSize^2 - 1 of a tileable blue-noise mask made by Ulichney's
+// void-and-cluster method: thresholding it at any level leaves evenly spread
+// pixels.
+class BlueNoiseMask {
+public:
+    BlueNoiseMask() {
+        constexpr int kSize = kBlueNoiseSize;
+        constexpr int kPixels = kSize * kSize;
+        constexpr int kRadius = 6;
+        constexpr double kSigma = 1.9;
+        std::array<double, (2 * kRadius + 1) * (2 * kRadius + 1)> kernel;
+        for (int dy = -kRadius; dy <= kRadius; ++dy) {
+            for (int dx = -kRadius; dx <= kRadius; ++dx) {
+                kernel[(dy + kRadius) * (2 * kRadius + 1) + dx + kRadius] =
+                    std::exp(-(dx * dx + dy * dy) / (2 * kSigma * kSigma));
+            }
+        }
+        std::vector<bool> ones(kPixels);
+        std::vector<double> energy(kPixels);
+        auto update = [&](int p, double sign) {
+            int px = p % kSize;
+            int py = p / kSize;
+            for (int dy = -kRadius; dy <= kRadius; ++dy) {
+                for (int dx = -kRadius; dx <= kRadius; ++dx) {
+                    int q = (py + dy + kSize) % kSize * kSize + (px + dx + kSize) % kSize;
+                    energy[q] += sign * kernel[(dy + kRadius) * (2 * kRadius + 1) + dx + kRadius];
+                }
+            }
+        };
+        auto set = [&](int p, bool one) {
+            ones[p] = one;
+            update(p, one ? 1 : -1);
+        };
+        // The tightest cluster is the one with the most energy, the largest void
+        // the zero with the least.
+        auto extreme = [&](bool one) {
+            int best = -1;
+            for (int p = 0; p < kPixels; ++p) {
+                if (ones[p] == one &&
+                    (best == -1 || (one ? energy[p] > energy[best] : energy[p] < energy[best]))) {
+                    best = p;
+                }
+            }
+            return best;
+        };
+
+        // A random tenth of the pixels, relaxed by moving clusters into voids.
+        int initial = kPixels / 10;
+        for (uint32_t i = 0, placed = 0; placed < static_cast<uint32_t>(initial); ++i) {
+            int p = MixBits(i) % kPixels;
+            if (!ones[p]) {
+                set(p, true);
+                ++placed;
+            }
+        }
+        for (int i = 0; i < kPixels; ++i) {
+            int cluster = extreme(true);
+            set(cluster, false);
+            int void_pixel = extreme(false);
+            set(void_pixel, true);
+            if (void_pixel == cluster) {
+                break;
+            }
+        }
+        std::vector<bool> prototype = ones;
+        std::vector<double> prototype_energy = energy;
+        for (int rank = initial - 1; rank >= 0; --rank) {
+            int cluster = extreme(true);
+            set(cluster, false);
+            ranks_[cluster] = rank;
+        }
+        ones = std::move(prototype);
+        energy = std::move(prototype_energy);
+        for (int rank = initial; rank < kPixels; ++rank) {
+            int void_pixel = extreme(false);
+            set(void_pixel, true);
+            ranks_[void_pixel] = rank;
+        }
+    }
+
+    int Rank(int x, int y) const {
+        return ranks_[(y & (kBlueNoiseSize - 1)) * kBlueNoiseSize + (x & (kBlueNoiseSize - 1))];
+    }
+
+private:
+    std::array<uint16_t, kBlueNoiseSize * kBlueNoiseSize> ranks_;
+};
+
+const BlueNoiseMask& GetBlueNoiseMask() {
+    static const BlueNoiseMask kMask;
+    return kMask;
+}
+
+// One Owen-scrambled Sobol sequence for all pixels, rotated per pixel (Cranley-
+// Patterson) by the blue-noise mask, shifted differently for every dimension.
+// The error of neighbouring pixels is then anti-correlated, which reads as finer
+// noise at low sample counts.
+class BlueNoiseSampler : public Sampler {
+public:
+    explicit BlueNoiseSampler(uint64_t seed = 0) : seed_(MixBits(seed)), mask_(GetBlueNoiseMask()) {
+    }
+
+    SamplerType GetType() const override {
+        return SamplerType::kBlueNoise;
+    }
+
+    double Get(int x, int y, uint32_t sample, uint32_t dimension) const override {
+        uint32_t shift = MixBits(seed_ ^ dimension);
+        int rank = mask_.Rank(x + (shift & 0xffff), y + (shift >> 16));
+        double value = OwenSobol(sample, dimension, seed_) +
+                       (rank + .5) / (kBlueNoiseSize * kBlueNoiseSize);
+        return value >= 1 ? value - 1 : value;
+    }
+
+private:
+    uint32_t seed_;
+    const BlueNoiseMask& mask_;
+};
+
+std::unique_ptr<Sampler> MakeSampler(SamplerType type, int samples_per_pixel, uint64_t seed = 0) {
+    switch (type) {
+        case SamplerType::kIndependent:
+            return std::make_unique<IndependentSampler>(seed);
+        case SamplerType::kStratified:
+            return std::make_unique<StratifiedSampler>(samples_per_pixel, seed);
+        case SamplerType::kBlueNoise:
+            return std::make_unique<BlueNoiseSampler>(seed);
+        default:
+            return std::make_unique<SobolSampler>(seed);
+    }
+}
+
+// The dimensions of one sample of one pixel, in order.
+class SampleStream {
+public:
+    SampleStream(const Sampler& sampler, int x, int y, uint32_t sample)
+        : sampler_(sampler), x_(x), y_(y), sample_(sample) {
+    }
+
+    double Next() {
+        return sampler_.Get(x_, y_, sample_, dimension_++);
+    }
+
+private:
+    const Sampler& sampler_;
+    int x_;
+    int y_;
+    uint32_t sample_;
+    uint32_t dimension_ = 0;
+};
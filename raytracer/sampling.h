@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+
+// Mixes a 64-bit value into a well-distributed one (SplitMix64 finalizer).
+uint64_t MixBits(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+// Unit vectors t and b completing the unit n to an orthonormal basis (Duff et al.).
+void BuildBasis(const Vector& n, Vector* t, Vector* b) {
+    double sign = std::copysign(1., n[2]);
+    double a = -1 / (sign + n[2]);
+    double c = n[0] * n[1] * a;
+    *t = {1 + sign * n[0] * n[0] * a, sign * c, -sign * n[0]};
+    *b = {c, sign + n[1] * n[1] * a, -n[1]};
+}
+
+// Direction around the unit axis whose cosine to it is cos_theta, at angle phi.
+Vector FromSpherical(const Vector& axis, double cos_theta, double phi) {
+    Vector t;
+    Vector b;
+    BuildBasis(axis, &t, &b);
+    double sin_theta = std::sqrt(std::max(0., 1 - cos_theta * cos_theta));
+    return t.MultiplyOnScalar(sin_theta * std::cos(phi)) +
+           b.MultiplyOnScalar(sin_theta * std::sin(phi)) + axis.MultiplyOnScalar(cos_theta);
+}
+
+// Cosine-weighted direction in the hemisphere of the unit normal n, from two
+// uniform numbers; the density is cos / pi.
+Vector SampleCosineHemisphere(const Vector& n, double u1, double u2) {
+    return FromSpherical(n, std::sqrt(1 - u1), 2 * std::numbers::pi * u2);
+}
+
+// Direction around the unit axis with density (exponent + 1) / (2 pi) cos^exponent,
+// the lobe of a Phong BRDF.
+Vector SamplePhongLobe(const Vector& axis, double exponent, double u1, double u2) {
+    return FromSpherical(axis, std::pow(1 - u1, 1 / (exponent + 1)), 2 * std::numbers::pi * u2);
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+int GetThreadCount() {
+    static const int kCount = std::max(1u, std::thread::hardware_concurrency());
+    return kCount;
+}
+
+// Jobs of a higher class take every free worker before those of a lower one.
+enum class JobPriority { kInteractive, kNormal, kBackground };
+
+constexpr size_t kJobPriorities = 3;
+
+struct PriorityStats {
+    uint64_t jobs = 0;
+    uint64_t tasks = 0;
+    // Tasks skipped because their job was cancelled.
+    uint64_t cancelled_tasks = 0;
+    // Tasks skipped because another task of their job threw.
+    uint64_t aborted_tasks = 0;
+    // From submission to the first task started, and to the last task done.
+    double total_queue_ms = 0;
+    double max_queue_ms = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+};
+
+struct SchedulerStats {
+    int threads = 0;
+    // Jobs with tasks not started yet.
+    int active_jobs = 0;
+    // Tasks not started yet, by priority.
+    std::array<uint64_t, kJobPriorities> queued_tasks = {};
+    // Tasks taken from the range of another worker.
+    uint64_t steals = 0;
+    std::array<PriorityStats, kJobPriorities> priorities = {};
+};
+
+// Priority and cancellation of the jobs a thread submits. A worker runs every
+// task with the context of its job, so that nested jobs inherit it.
+struct JobContext {
+    JobPriority priority = JobPriority::kNormal;
+    std::stop_token stop_token = {};
+};
+
+JobContext& CurrentJobContext() {
+    thread_local JobContext context;
+    return context;
+}
+
+// Sets the job context of the calling thread for the lifetime of the object.
+class ScopedJobContext {
+public:
+    ScopedJobContext(JobPriority priority, std::stop_token stop_token)
+        : saved_(CurrentJobContext()) {
+        CurrentJobContext() = {priority, std::move(stop_token)};
+    }
+    // Keeps the stop token of the enclosing context.
+    explicit ScopedJobContext(JobPriority priority)
+        : ScopedJobContext(priority, CurrentJobContext().stop_token) {
+    }
+    ~ScopedJobContext() {
+        CurrentJobContext() = saved_;
+    }
+
+    ScopedJobContext(const ScopedJobContext&) = delete;
+    ScopedJobContext& operator=(const ScopedJobContext&) = delete;
+
+private:
+    JobContext saved_;
+};
+
+// Process-wide pool that runs the tasks of all jobs on one set of workers. A job
+// is split into one contiguous range of tasks per worker; a worker takes tasks
+// from the front of its own range and steals from the back of the others once it
+// is empty. After every task a worker picks the job to serve again: the highest
+// priority class with tasks left, and within it the jobs in turn, so a new job
+// preempts running ones of lower classes at the next task and shares the
+// workers with those of its own class. Tasks of a job whose stop token is
+// stopped are skipped.
+//
+// The workers run for the lifetime of the process and do not survive a fork, nor
+// do the locks they may hold; a forked child must exec before it renders, which is
+// how LaunchLocalWorkers starts its workers.
+class RenderScheduler {
+public:
+    explicit RenderScheduler(int threads) {
+        workers_.reserve(threads);
+        for (int i = 0; i < threads; ++i) {
+            workers_.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ~RenderScheduler() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        work_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    RenderScheduler(const RenderScheduler&) = delete;
+    RenderScheduler& operator=(const RenderScheduler&) = delete;
+
+    int ThreadCount() const {
+        return workers_.size();
+    }
+
+    // Calls func(i) for every i in [begin, end) as one job with context and waits
+    // for it. A worker that waits helps with the tasks of the job, so nested jobs
+    // cannot run out of workers. The first exception of a task cancels the rest
+    // of the job and is rethrown.
+    void Run(int begin, int end, const std::function<void(int)>& func,
+             const JobContext& context = CurrentJobContext()) {
+        if (end <= begin) {
+            return;
+        }
+        auto job = std::make_shared<Job>(begin, end, workers_.size(), func, context);
+        {
+            std::lock_guard lock(mutex_);
+            active_[Class(job->context.priority)].push_back(job);
+        }
+        work_.notify_all();
+        if (WorkerIndex() != -1) {
+            int index;
+            while (job->Take(WorkerIndex(), &index, &steals_)) {
+                RunTask(*job, index);
+            }
+        }
+        std::unique_lock lock(job->mutex);
+        job->done.wait(lock, [&] { return job->remaining == 0; });
+        if (job->error) {
+            std::rethrow_exception(job->error);
+        }
+    }
+
+    SchedulerStats GetStats() const {
+        std::lock_guard lock(mutex_);
+        SchedulerStats stats;
+        stats.threads = workers_.size();
+        stats.priorities = priorities_;
+        stats.steals = steals_.load();
+        for (size_t c = 0; c < kJobPriorities; ++c) {
+            for (const auto& job : active_[c]) {
+                uint64_t queued = job->Queued();
+                stats.active_jobs += queued > 0;
+                stats.queued_tasks[c] += queued;
+            }
+        }
+        return stats;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        Job(int begin, int end, size_t workers, const std::function<void(int)>& func,
+            const JobContext& context)
+            : func(func),
+              context(context),
+              ranges(workers),
+              tasks(end - begin),
+              remaining(end - begin),
+              submitted(Clock::now()) {
+            int64_t count = end - begin;
+            for (size_t w = 0; w < workers; ++w) {
+                ranges[w] = Pack(begin + count * w / workers, begin + count * (w + 1) / workers);
+            }
+        }
+
+        static uint64_t Pack(uint32_t first, uint32_t last) {
+            return static_cast<uint64_t>(first) << 32 | last;
+        }
+
+        // Next task for worker from its own range, or stolen from another.
+        bool Take(int worker, int* index, std::atomic<uint64_t>* steals) {
+            size_t own = worker % ranges.size();
+            uint64_t range = ranges[own].load();
+            while (static_cast<uint32_t>(range >> 32) < static_cast<uint32_t>(range)) {
+                uint32_t first = range >> 32;
+                if (ranges[own].compare_exchange_weak(range, Pack(first + 1, range))) {
+                    *index = first;
+                    return true;
+                }
+            }
+            for (size_t k = 1; k < ranges.size(); ++k) {
+                auto& victim = ranges[(own + k) % ranges.size()];
+                range = victim.load();
+                while (static_cast<uint32_t>(range >> 32) < static_cast<uint32_t>(range)) {
+                    uint32_t last = static_cast<uint32_t>(range) - 1;
+                    if (victim.compare_exchange_weak(range, Pack(range >> 32, last))) {
+                        ++*steals;
+                        *index = last;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        uint64_t Queued() const {
+            uint64_t queued = 0;
+            for (const auto& range : ranges) {
+                uint64_t value = range.load();
+                queued += static_cast<uint32_t>(value) - std::min<uint32_t>(value >> 32, value);
+            }
+            return queued;
+        }
+
+        const std::function<void(int)>& func;
+        JobContext context;
+        std::vector<std::atomic<uint64_t>> ranges;
+        std::mutex mutex;
+        std::condition_variable done;
+        const int tasks;
+        int remaining;
+        int cancelled = 0;
+        int aborted = 0;
+        std::exception_ptr error;
+        std::atomic<bool> failed = false;
+        Clock::time_point submitted;
+        std::atomic<bool> started = false;
+        double queue_ms = 0;
+    };
+
+    static size_t Class(JobPriority priority) {
+        return static_cast<size_t>(priority);
+    }
+
+    static int& WorkerIndex() {
+        thread_local int index = -1;
+        return index;
+    }
+
+    static double MillisecondsSince(Clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    }
+
+    void RunTask(Job& job, int index) {
+        if (!job.started.exchange(true)) {
+            job.queue_ms = MillisecondsSince(job.submitted);
+        }
+        bool aborted = job.failed;
+        bool cancelled = !aborted && job.context.stop_token.stop_requested();
+        std::exception_ptr error;
+        if (!aborted && !cancelled) {
+            try {
+                ScopedJobContext context(job.context.priority, job.context.stop_token);
+                job.func(index);
+            } catch (...) {
+                error = std::current_exception();
+                job.failed = true;
+            }
+        }
+        std::lock_guard lock(job.mutex);
+        job.cancelled += cancelled;
+        job.aborted += aborted;
+        if (error && !job.error) {
+            job.error = error;
+        }
+        if (--job.remaining == 0) {
+            Finish(job);
+            job.done.notify_all();
+        }
+    }
+
+    void Finish(const Job& job) {
+        std::lock_guard lock(mutex_);
+        PriorityStats& stats = priorities_[Class(job.context.priority)];
+        double latency_ms = MillisecondsSince(job.submitted);
+        ++stats.jobs;
+        stats.tasks += job.tasks;
+        stats.cancelled_tasks += job.cancelled;
+        stats.aborted_tasks += job.aborted;
+        stats.total_queue_ms += job.queue_ms;
+        stats.max_queue_ms = std::max(stats.max_queue_ms, job.queue_ms);
+        stats.total_latency_ms += latency_ms;
+        stats.max_latency_ms = std::max(stats.max_latency_ms, latency_ms);
+    }
+
+    // The job to take the next task from, with no tasks left in the jobs passed over
+    // dropped; none when there is no work.
+    std::shared_ptr<Job> PickJob() {
+        for (size_t c = 0; c < kJobPriorities; ++c) {
+            auto& jobs = active_[c];
+            while (!jobs.empty()) {
+                size_t slot = next_[c]++ % jobs.size();
+                if (jobs[slot]->Queued() > 0) {
+                    return jobs[slot];
+                }
+                jobs.erase(jobs.begin() + slot);
+            }
+        }
+        return nullptr;
+    }
+
+    void WorkerLoop(int worker) {
+        WorkerIndex() = worker;
+        for (;;) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock lock(mutex_);
+                work_.wait(lock, [&] { return stopping_ || (job = PickJob()); });
+                if (!job) {
+                    return;
+                }
+            }
+            int index;
+            if (job->Take(worker, &index, &steals_)) {
+                RunTask(*job, index);
+            }
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_;
+    bool stopping_ = false;
+    std::array<std::vector<std::shared_ptr<Job>>, kJobPriorities> active_;
+    std::array<size_t, kJobPriorities> next_ = {};
+    std::array<PriorityStats, kJobPriorities> priorities_ = {};
+    std::atomic<uint64_t> steals_ = 0;
+    std::vector<std::thread> workers_;
+};
+
+RenderScheduler& GetRenderScheduler() {
+    static RenderScheduler scheduler(GetThreadCount());
+    return scheduler;
+}
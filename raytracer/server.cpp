@@ -0,0 +1,26 @@
+#include <distributed.h>
+#include <render_server.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+int main(int argc, char** argv) {
+    if (RunRenderWorkerFromArgs(argc, argv)) {
+        return 0;
+    }
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <socket path> [cache budget in MiB]\n"
+                  << "       " << argv[0] << " --render-worker <fd>\n";
+        return 1;
+    }
+    size_t budget_mib = argc > 2 ? std::stoul(argv[2]) : 1024;
+    RenderServer server(argv[1], budget_mib << 20);
+    server.Serve();
+    ServerStats stats = server.GetStats();
+    std::cerr << "requests: " << stats.requests << ", cache hits: " << stats.cache_hits
+              << ", misses: " << stats.cache_misses << ", evictions: " << stats.evictions
+              << ", mean latency: "
+              << (stats.requests ? stats.total_latency_ms / stats.requests : 0) << " ms\n";
+    return 0;
+}
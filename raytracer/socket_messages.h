@@ -0,0 +1,163 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Length-prefixed messages over stream sockets. A message is a 4-byte type, a
+// 4-byte payload size and the payload. Values are written in host byte order:
+// both ends are expected to run on the same machine.
+class MessageWriter {
+public:
+    template <class T>
+    void Put(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        data_.insert(data_.end(), bytes, bytes + sizeof(T));
+    }
+    void PutString(const std::string& s) {
+        Put<uint32_t>(s.size());
+        data_.insert(data_.end(), s.begin(), s.end());
+    }
+    void PutFloats(const float* values, size_t count) {
+        const char* bytes = reinterpret_cast<const char*>(values);
+        data_.insert(data_.end(), bytes, bytes + count * sizeof(float));
+    }
+
+    const std::vector<char>& Data() const {
+        return data_;
+    }
+
+private:
+    std::vector<char> data_;
+};
+
+class MessageReader {
+public:
+    explicit MessageReader(std::vector<char> data) : data_(std::move(data)) {
+    }
+
+    template <class T>
+    T Get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    std::string GetString() {
+        uint32_t size = Get<uint32_t>();
+        const char* bytes = Take(size);
+        return std::string(bytes, size);
+    }
+    void GetFloats(float* values, size_t count) {
+        std::memcpy(values, Take(count * sizeof(float)), count * sizeof(float));
+    }
+
+private:
+    const char* Take(size_t size) {
+        if (data_.size() - pos_ < size) {
+            throw std::runtime_error("Truncated message");
+        }
+        pos_ += size;
+        return data_.data() + pos_ - size;
+    }
+
+    std::vector<char> data_;
+    size_t pos_ = 0;
+};
+
+struct Message {
+    uint32_t type;
+    MessageReader payload;
+};
+
+bool SendAll(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool ReceiveAll(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+template <class Type>
+bool SendMessage(int fd, Type type, const MessageWriter& payload = {}) {
+    uint32_t header[2] = {static_cast<uint32_t>(type),
+                          static_cast<uint32_t>(payload.Data().size())};
+    return SendAll(fd, header, sizeof(header)) &&
+           SendAll(fd, payload.Data().data(), payload.Data().size());
+}
+
+// Returns nothing if the peer closed the connection or the socket failed.
+std::optional<Message> ReceiveMessage(int fd) {
+    uint32_t header[2];
+    if (!ReceiveAll(fd, header, sizeof(header))) {
+        return std::nullopt;
+    }
+    std::vector<char> data(header[1]);
+    if (!ReceiveAll(fd, data.data(), data.size())) {
+        return std::nullopt;
+    }
+    return Message{header[0], MessageReader(std::move(data))};
+}
+
+sockaddr_un UnixSocketAddress(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path is too long: " + path);
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+int ListenUnixSocket(const std::string& path) {
+    sockaddr_un address = UnixSocketAddress(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Can't listen on " + path);
+    }
+    return fd;
+}
+
+int ConnectUnixSocket(const std::string& path) {
+    sockaddr_un address = UnixSocketAddress(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Can't connect to " + path);
+    }
+    return fd;
+}
@@ -0,0 +1,918 @@
+#include <options/camera_options.h>
+#include <options/render_options.h>
+#include <tests/commons.h>
+#include <raytracer.h>
+#include <relight.h>
+#include <bucketed.h>
+#include <path_trace.h>
+#include <ray_query.h>
+#include <frame_sequence.h>
+#include <util.h>
+#include <image.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <numbers>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+namespace {
+
+const CameraOptions kCameraOptions{.screen_width = 640,
+                                   .screen_height = 480,
+                                   .look_from = {-.5, 1.5, .98},
+                                   .look_to = {0., 1., 0.}};
+
+}  // namespace
+
+TEST_CASE("Primary rays", "[benchmark]") {
+    // Every iteration generates the 640x480 primary rays of a frame.
+    Camera camera(kCameraOptions);
+    std::vector<Vector> row(kCameraOptions.screen_width);
+
+    BENCHMARK("Matrix per ray") {
+        Matrix4 m = LookAt(kCameraOptions.look_from, kCameraOptions.look_to);
+        double height = 2 * std::tan(kCameraOptions.fov / 2);
+        double pixel_size = height / kCameraOptions.screen_height;
+        double width = height * kCameraOptions.screen_width / kCameraOptions.screen_height;
+        Vector sum;
+        for (int i = 0; i < kCameraOptions.screen_height; ++i) {
+            for (int j = 0; j < kCameraOptions.screen_width; ++j) {
+                Vector dir(-width / 2 + pixel_size * (j + 0.5),
+                           height / 2 - pixel_size * (i + 0.5), -1);
+                dir.Normalize();
+                Vector world = MultDirMatrix(dir, m);
+                world.Normalize();
+                sum = sum + world;
+            }
+        }
+        return sum;
+    };
+
+    BENCHMARK("Camera::GetRay") {
+        Vector sum;
+        for (int i = 0; i < kCameraOptions.screen_height; ++i) {
+            for (int j = 0; j < kCameraOptions.screen_width; ++j) {
+                sum = sum + camera.GetRay(i, j).GetDirection();
+            }
+        }
+        return sum;
+    };
+
+    BENCHMARK("Camera::GetRowDirections") {
+        Vector sum;
+        for (int i = 0; i < kCameraOptions.screen_height; ++i) {
+            camera.GetRowDirections(i, 0, kCameraOptions.screen_width, row.data());
+            for (const auto& dir : row) {
+                sum = sum + dir;
+            }
+        }
+        return sum;
+    };
+}
+
+TEST_CASE("Rasterized primary visibility", "[benchmark]") {
+    // Primary hits of a 1280x960 frame of the deer and of the Cornell box, traced
+    // or rasterized into a visibility buffer, then the depth and depth 1 frames
+    // they start.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto deer = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    const auto box = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions deer_opts{.screen_width = 1280,
+                            .screen_height = 960,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+    CameraOptions box_opts = kCameraOptions;
+    box_opts.screen_width = 1280;
+    box_opts.screen_height = 960;
+    for (auto [name, scene, camera_opts] :
+         {std::tuple{"deer", &deer, deer_opts}, std::tuple{"box", &box, box_opts}}) {
+        const PrimitiveSet& primitives = scene->GetPrimitives();
+        Camera camera(camera_opts);
+        BENCHMARK(std::string("Trace primary hits, ") + name) {
+            int hits = 0;
+            for (int y = 0; y < camera_opts.screen_height; ++y) {
+                for (int x = 0; x < camera_opts.screen_width; ++x) {
+                    hits += FindClosestHit<KernelFeatures{}, false>(scene->GetAccelerator(),
+                                                                    camera.GetRay(y, x))
+                                .IsValid();
+                }
+            }
+            return hits;
+        };
+        BENCHMARK(std::string("Rasterize, ") + name) {
+            return Rasterize(primitives, camera_opts, 32);
+        };
+        for (RenderMode mode : {RenderMode::kDepth, RenderMode::kFull}) {
+            RenderOptions render_opts{1, mode};
+            std::string suffix =
+                std::string(mode == RenderMode::kDepth ? " depth, " : " full, ") + name;
+            BENCHMARK("Traced" + suffix) {
+                return RenderFrame(*scene, camera_opts, render_opts);
+            };
+            render_opts.primary_visibility = PrimaryVisibility::kRasterize;
+            BENCHMARK("Rasterized" + suffix) {
+                return RenderFrame(*scene, camera_opts, render_opts);
+            };
+        }
+    }
+}
+
+TEST_CASE("Frame sequence", "[benchmark]") {
+    // 8 frames of the deer at 1280x960 around it, traced, tone mapped and written
+    // to PNG one after another, then through the pipeline of RenderSequence.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    const TempDirectory dir("raytracer_sequence_benchmark");
+    std::vector<SequenceFrame> frames;
+    for (int i = 0; i < 8; ++i) {
+        double angle = i * std::numbers::pi / 16;
+        CameraOptions camera_opts{.screen_width = 1280,
+                                  .screen_height = 960,
+                                  .look_from = {180. * std::cos(angle), 200., 180. * std::sin(angle)},
+                                  .look_to = {0., 100., 0.}};
+        frames.push_back({camera_opts, dir / ("frame" + std::to_string(i) + ".png")});
+    }
+    RenderOptions render_opts{1};
+
+    BENCHMARK("Render and Image::Write") {
+        for (const auto& frame : frames) {
+            Render(scene, frame.camera, render_opts).Write(frame.output);
+        }
+    };
+
+    SequenceStats stats;
+    BENCHMARK("RenderSequence") {
+        stats = RenderSequence(scene, frames, render_opts);
+    };
+    WARN("Last sequence: " << stats.wall_ms << " ms, utilization trace "
+         << stats.Utilization(stats.trace) << ", tone map "
+         << stats.Utilization(stats.tone_map) << ", encode "
+         << stats.Utilization(stats.encode) << ", trace waited " << stats.trace.waiting_ms
+         << " ms for room");
+}
+
+TEST_CASE("Render scheduler", "[benchmark]") {
+    // A 320x240 preview of the Cornell box on an idle machine, and while frames of
+    // the box at 1280x960 render without pause on another thread: first with both
+    // at kNormal, so that they share the workers, then with the preview at
+    // kInteractive and the frames at kBackground.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto box = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions preview_camera = kCameraOptions;
+    preview_camera.screen_width = 320;
+    preview_camera.screen_height = 240;
+    CameraOptions final_camera = kCameraOptions;
+    final_camera.screen_width = 1280;
+    final_camera.screen_height = 960;
+    RenderOptions preview_opts{1};
+
+    BENCHMARK("Preview, idle") {
+        return RenderFrame(box, preview_camera, preview_opts);
+    };
+    for (auto [preview_priority, final_priority] :
+         {std::pair{JobPriority::kNormal, JobPriority::kNormal},
+          std::pair{JobPriority::kInteractive, JobPriority::kBackground}}) {
+        std::stop_source stop;
+        int frames = 0;
+        std::thread background([&] {
+            ScopedJobContext context(final_priority, stop.get_token());
+            RenderOptions final_opts{4};
+            final_opts.priority = final_priority;
+            while (!RenderFrame(box, final_camera, final_opts).cancelled) {
+                ++frames;
+            }
+        });
+        preview_opts.priority = preview_priority;
+        std::string name = preview_priority == JobPriority::kNormal
+                               ? "Preview during a frame, both kNormal"
+                               : "kInteractive preview during a kBackground frame";
+        BENCHMARK(std::string(name)) {
+            return RenderFrame(box, preview_camera, preview_opts);
+        };
+        stop.request_stop();
+        background.join();
+        WARN(name << ": " << frames << " frames finished alongside");
+    }
+
+    SchedulerStats stats = GetRenderScheduler().GetStats();
+    for (auto priority : {JobPriority::kInteractive, JobPriority::kNormal, JobPriority::kBackground}) {
+        const PriorityStats& jobs = stats.priorities[static_cast<size_t>(priority)];
+        if (jobs.jobs > 0) {
+            WARN("Priority " << static_cast<int>(priority) << ": " << jobs.jobs
+                 << " jobs, mean queue " << jobs.total_queue_ms / jobs.jobs
+                 << " ms, mean latency " << jobs.total_latency_ms / jobs.jobs
+                 << " ms, max latency " << jobs.max_latency_ms << " ms, "
+                 << jobs.cancelled_tasks << " tasks cancelled");
+        }
+    }
+    WARN(stats.steals << " tasks stolen on " << stats.threads << " threads");
+}
+
+TEST_CASE("Ray queries", "[benchmark]") {
+    // Closest hits of the 640x480 primary rays of the deer, and occlusion of as many
+    // random segments inside its bounds, one ray at a time on one thread and
+    // through the batch queries. The rays per second of every way are printed.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto deer = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .look_from = {100., 200., 150.},
+                              .look_to = {0., 100., 0.}};
+    Camera camera(camera_opts);
+    std::vector<Ray> primary;
+    for (int y = 0; y < camera_opts.screen_height; ++y) {
+        for (int x = 0; x < camera_opts.screen_width; ++x) {
+            primary.push_back(camera.GetRay(y, x));
+        }
+    }
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<double> coord(-60., 60.);
+    std::vector<Ray> segments;
+    std::vector<double> lengths;
+    for (size_t i = 0; i < primary.size(); ++i) {
+        Vector from(coord(rng), coord(rng) + 100., coord(rng));
+        Vector to(coord(rng), coord(rng) + 100., coord(rng));
+        segments.emplace_back(from, to - from);
+        lengths.push_back(Distance(from, to));
+    }
+    const Accelerator& accelerator = deer.GetAccelerator();
+    std::vector<Hit> hits(primary.size());
+    std::unique_ptr<bool[]> occluded(new bool[segments.size()]);
+    std::span<bool> occluded_span(occluded.get(), segments.size());
+
+    auto rays_per_second = [](const std::string& name, size_t rays, auto&& query) {
+        auto start = std::chrono::steady_clock::now();
+        query();
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        WARN(name << ": " << rays / seconds.count() / 1e6 << " Mrays/s");
+    };
+    auto closest_one_by_one = [&] {
+        for (size_t i = 0; i < primary.size(); ++i) {
+            hits[i] = FindClosestHit<KernelFeatures{}, false>(accelerator, primary[i]);
+        }
+    };
+    auto closest_batch = [&] { IntersectClosest(deer, primary, hits, {.attributes = false}); };
+    auto any_one_by_one = [&] {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            occluded[i] = IsOccluded(accelerator, segments[i], lengths[i]);
+        }
+    };
+    auto any_batch = [&] { IntersectAny(deer, segments, lengths, occluded_span); };
+    rays_per_second("Closest hits, one by one", primary.size(), closest_one_by_one);
+    rays_per_second("IntersectClosest", primary.size(), closest_batch);
+    rays_per_second("Any hits, one by one", segments.size(), any_one_by_one);
+    rays_per_second("IntersectAny", segments.size(), any_batch);
+
+    BENCHMARK("Closest hits, one by one") {
+        closest_one_by_one();
+    };
+    BENCHMARK("IntersectClosest") {
+        closest_batch();
+    };
+    BENCHMARK("IntersectClosest with attributes") {
+        IntersectClosest(deer, primary, hits);
+    };
+    BENCHMARK("Any hits, one by one") {
+        any_one_by_one();
+    };
+    BENCHMARK("IntersectAny") {
+        any_batch();
+    };
+}
+
+TEST_CASE("Batch shading", "[benchmark]") {
+    // Direct light of the Cornell box and the deer, shaded hit by hit and in the
+    // lanes of batch_shading.h.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto box = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    const auto deer = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    CameraOptions deer_opts{.screen_width = 640,
+                            .screen_height = 480,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+    for (bool batch : {false, true}) {
+        std::string suffix = batch ? ", batches" : ", one by one";
+        RenderOptions render_opts{1};
+        render_opts.batch_shading = batch;
+        BENCHMARK("Cornell box" + suffix) {
+            return RenderFrame(box, kCameraOptions, render_opts);
+        };
+        BENCHMARK("Deer" + suffix) {
+            return RenderFrame(deer, deer_opts, render_opts);
+        };
+    }
+}
+
+TEST_CASE("Relight", "[benchmark]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    Relighter relighter(scene, camera_opts, render_opts);
+    // Every relight moves the first light and dims the second one.
+    std::vector<Light> lights[2] = {scene.GetLights(), scene.GetLights()};
+    lights[1][0].position = {.5, 1.2, .3};
+    lights[1][1].intensity = {.2, .2, .2};
+    int iteration = 0;
+
+    BENCHMARK("Render") {
+        return Render(scene, camera_opts, render_opts);
+    };
+
+    BENCHMARK("Relighter::Relight") {
+        return relighter.Relight(lights[++iteration % 2]);
+    };
+}
+
+TEST_CASE("Bucketed rendering", "[benchmark]") {
+    // A 1600x1200 depth render written to PNG: the whole 7.7 MB depth frame in
+    // memory against bands of 64 rows, 0.4 MB, spooled to disk.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    CameraOptions camera_opts{.screen_width = 1600,
+                              .screen_height = 1200,
+                              .look_from = {100., 200., 150.},
+                              .look_to = {0., 100., 0.}};
+    RenderOptions render_opts{1, RenderMode::kDepth};
+    const TempDirectory dir("raytracer_bucketed_benchmark");
+    const auto output = dir / "bucketed.png";
+
+    BENCHMARK("Render and Image::Write") {
+        Render(scene, camera_opts, render_opts).Write(output);
+    };
+
+    BENCHMARK("RenderBucketed") {
+        RenderBucketed(scene, camera_opts, render_opts, output, {.band_height = 64});
+    };
+}
+
+TEST_CASE("Path tracing", "[benchmark]") {
+    // 16 paths per pixel of the Cornell box at 160x120, in passes of 1, 1, 2, 4
+    // and 8 samples. The throughput of the last run is printed.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    RenderOptions render_opts{.depth = 1, .mode = RenderMode::kPathTrace, .samples = 16};
+    PathTraceProgress last;
+
+    BENCHMARK("PathTrace") {
+        return PathTrace(scene, camera_opts, render_opts, {},
+                         [&](const RenderedFrame&, const PathTraceProgress& progress) {
+                             last = progress;
+                         });
+    };
+    WARN("Path tracing: " << last.SamplesPerSecond() << " samples/s on "
+         << GetThreadCount() << " threads");
+}
+
+TEST_CASE("Sampler convergence", "[benchmark]") {
+    // RMSE of the Cornell box at 64x48 for every sampler from 1 to 64 paths, then
+    // the time of 16 paths. The reference is 16384 independent paths per pixel
+    // under another seed, so it shares no samples with the estimates; its own
+    // error adds about 0.0015 in quadrature.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    RenderOptions render_opts{.depth = 1,
+                              .mode = RenderMode::kPathTrace,
+                              .samples = 16384,
+                              .sampler = SamplerType::kIndependent,
+                              .seed = 1};
+    auto reference = RenderFrame(scene, camera_opts, render_opts);
+    render_opts.seed = 0;
+    auto rmse = [&](const RenderedFrame& frame) {
+        double sum = 0;
+        for (int y = 0; y < camera_opts.screen_height; ++y) {
+            for (int k = 0; k < camera_opts.screen_width * 3; ++k) {
+                double error = frame.frame.Row(y)[k] - reference.frame.Row(y)[k];
+                sum += error * error;
+            }
+        }
+        return std::sqrt(sum / (camera_opts.screen_width * camera_opts.screen_height * 3));
+    };
+
+    const std::pair<SamplerType, const char*> kSamplers[] = {
+        {SamplerType::kIndependent, "independent"},
+        {SamplerType::kStratified, "stratified"},
+        {SamplerType::kSobol, "sobol"},
+        {SamplerType::kBlueNoise, "blue noise"}};
+    for (auto [type, name] : kSamplers) {
+        render_opts.sampler = type;
+        std::ostringstream errors;
+        for (int samples = 1; samples <= 64; samples *= 2) {
+            render_opts.samples = samples;
+            errors << " " << samples << "=" << rmse(RenderFrame(scene, camera_opts, render_opts));
+        }
+        WARN("RMSE " << name << ":" << errors.str());
+    }
+
+    render_opts.samples = 16;
+    for (auto [type, name] : kSamplers) {
+        render_opts.sampler = type;
+        BENCHMARK(std::string("16 paths ") + name) {
+            return RenderFrame(scene, camera_opts, render_opts);
+        };
+    }
+}
+
+TEST_CASE("Denoising", "[benchmark]") {
+    // RMSE of the Cornell box at 160x120, with and without 3 denoising passes, and
+    // the paths a noisy frame would need for the same error at RMSE ~ 1 / sqrt(paths).
+    // The reference is 2048 independent paths per pixel under another seed; its own
+    // error adds about 0.004 in quadrature. Then the cost of the filter alone on a
+    // 640x480 frame.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    RenderOptions render_opts{.depth = 1,
+                              .mode = RenderMode::kPathTrace,
+                              .samples = 2048,
+                              .sampler = SamplerType::kIndependent,
+                              .seed = 1};
+    auto reference = RenderFrame(scene, camera_opts, render_opts);
+    render_opts.sampler = SamplerType::kSobol;
+    render_opts.seed = 0;
+    auto rmse = [&](const RenderedFrame& result) {
+        double sum = 0;
+        for (int y = 0; y < camera_opts.screen_height; ++y) {
+            for (int k = 0; k < camera_opts.screen_width * 3; ++k) {
+                double error = result.frame.Row(y)[k] - reference.frame.Row(y)[k];
+                sum += error * error;
+            }
+        }
+        return std::sqrt(sum / (camera_opts.screen_width * camera_opts.screen_height * 3));
+    };
+    render_opts.denoise.iterations = 3;
+    for (int samples : {1, 2, 4, 8}) {
+        render_opts.samples = samples;
+        auto result = RenderFrame(scene, camera_opts, render_opts);
+        double noisy = rmse(result);
+        DenoiseFrame(scene, camera_opts, render_opts, &result);
+        double denoised = rmse(result);
+        WARN("Denoising " << samples << " paths: RMSE " << noisy << " -> " << denoised
+                          << ", as good as " << samples * (noisy / denoised) * (noisy / denoised)
+                          << " noisy paths");
+    }
+
+    camera_opts.screen_width = 640;
+    camera_opts.screen_height = 480;
+    render_opts.samples = 1;
+    RenderedFrame noisy = RenderFrame(scene, camera_opts, render_opts);
+    Framebuffer color(640, 480);
+    BENCHMARK("Path trace 640x480, 1 path") {
+        return RenderFrame(scene, camera_opts, render_opts);
+    };
+    BENCHMARK("Denoise 640x480, 3 passes") {
+        for (int y = 0; y < 480; ++y) {
+            std::copy(noisy.frame.Row(y), noisy.frame.Row(y) + 640 * 3, color.Row(y));
+        }
+        Denoise(noisy.guide->depth, noisy.guide->normal, render_opts.denoise, &color);
+        return color.Row(0)[0];
+    };
+}
+
+TEST_CASE("Texture cache", "[benchmark]") {
+    // A wall of 8 quads with 2048x2048 textures, 134 MB of tiles with their mipmaps,
+    // rendered up close through texture budgets from all of it down to 1 MB.
+    const TempDirectory dir("raytracer_texture_benchmark");
+    std::ofstream mtl(dir / "wall.mtl");
+    std::ofstream obj(dir / "wall.obj");
+    obj << "mtllib wall.mtl\nP 0 0 4 1 1 1\nvt 0 0\nvt 1 0\nvt 1 1\nvt 0 1\n";
+    for (int k = 0; k < 8; ++k) {
+        Image texture(2048, 2048);
+        for (int y = 0; y < 2048; ++y) {
+            for (int x = 0; x < 2048; ++x) {
+                texture.SetPixel({(x * (k + 1)) & 255, (y * (k + 3)) & 255, ((x ^ y) + 32 * k) & 255},
+                                 y, x);
+            }
+        }
+        std::string name = "texture" + std::to_string(k);
+        texture.Write(dir / (name + ".png"));
+        mtl << "newmtl " << name << "\nKd 1 1 1\nmap_Kd " << name << ".png\n";
+        double x = k % 4 - 2;
+        double y = k / 4 - 1;
+        obj << "v " << x << ' ' << y << " 0\nv " << x + 1 << ' ' << y << " 0\nv " << x + 1 << ' '
+            << y + 1 << " 0\nv " << x << ' ' << y + 1 << " 0\nusemtl " << name
+            << "\nf -4/1 -3/2 -2/3 -1/4\n";
+    }
+    mtl.close();
+    obj.close();
+    const auto scene = ReadScene(dir / "wall.obj");
+    CameraOptions camera_opts{.screen_width = 1280,
+                              .screen_height = 960,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., 0., 1.2},
+                              .look_to = {0., 0., 0.}};
+    TextureCache& cache = GetTextureCache();
+    RenderFrame(scene, camera_opts, {0});
+    for (size_t budget : {size_t{1} << 30, size_t{16} << 20, size_t{4} << 20, size_t{1} << 20}) {
+        cache.SetBudget(budget);
+        TextureCacheStats before = cache.GetStats();
+        RenderFrame(scene, camera_opts, {0});
+        TextureCacheStats after = cache.GetStats();
+        uint64_t lookups = after.lookups - before.lookups;
+        WARN("Budget " << (budget >> 20) << " MB: "
+             << (after.resident_bytes >> 10) << " KB resident, "
+             << 100. * (after.thread_hits - before.thread_hits) / lookups << "% thread hits, "
+             << 100. * (after.shared_hits - before.shared_hits) / lookups << "% shared hits, "
+             << after.misses - before.misses << " tile reads");
+        BENCHMARK("Frame, " + std::to_string(budget >> 20) + " MB") {
+            return RenderFrame(scene, camera_opts, {0});
+        };
+    }
+    cache.SetBudget(kTextureBudget);
+}
+
+TEST_CASE("Level of detail", "[benchmark]") {
+    // A row of 24 spheres of 16k triangles each going off into the distance, traced
+    // at full detail and at the levels that keep their error within half a pixel
+    // and within two pixels.
+    const TempDirectory dir("raytracer_lod_benchmark");
+    std::ofstream(dir / "spheres.mtl") << "newmtl gray\nKd .7 .7 .7\nKs .3 .3 .3\nNs 40\nal 1 .3 0\n";
+    std::ofstream obj(dir / "spheres.obj");
+    obj << "mtllib spheres.mtl\nusemtl gray\nP 0 10 10 1 1 1\n";
+    constexpr int kRings = 64;
+    constexpr int kSegments = 128;
+    for (int k = 0; k < 24; ++k) {
+        Vector center((k % 2 ? 1.5 : -1.5), 0, -4. * k);
+        std::vector<Vector> directions = {{0, 1, 0}, {0, -1, 0}};
+        for (int r = 1; r < kRings; ++r) {
+            double theta = std::numbers::pi * r / kRings;
+            for (int s = 0; s < kSegments; ++s) {
+                double phi = 2 * std::numbers::pi * s / kSegments;
+                directions.emplace_back(std::sin(theta) * std::cos(phi), std::cos(theta),
+                                        std::sin(theta) * std::sin(phi));
+            }
+        }
+        obj << "o sphere" << k << "\n";
+        for (const auto& d : directions) {
+            obj << "v " << center[0] + d[0] << ' ' << center[1] + d[1] << ' ' << center[2] + d[2]
+                << "\nvn " << d[0] << ' ' << d[1] << ' ' << d[2] << "\n";
+        }
+        int count = 2 + (kRings - 1) * kSegments;
+        auto vertex = [&](int r, int s) {
+            int index = r == 0 ? 0 : r == kRings ? 1 : 2 + (r - 1) * kSegments + s % kSegments;
+            return std::to_string(index - count) + "//" + std::to_string(index - count);
+        };
+        for (int r = 0; r < kRings; ++r) {
+            for (int s = 0; s < kSegments; ++s) {
+                if (r > 0) {
+                    obj << "f " << vertex(r, s) << ' ' << vertex(r + 1, s) << ' '
+                        << vertex(r, s + 1) << "\n";
+                }
+                if (r + 1 < kRings) {
+                    obj << "f " << vertex(r, s + 1) << ' ' << vertex(r + 1, s) << ' '
+                        << vertex(r + 1, s + 1) << "\n";
+                }
+            }
+        }
+    }
+    obj.close();
+    auto start = std::chrono::steady_clock::now();
+    const auto scene = ReadScene(dir / "spheres.obj");
+    WARN("Read with levels of detail in "
+         << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+         << " s");
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., 1., 4.},
+                              .look_to = {0., 0., -10.}};
+    Camera camera(camera_opts);
+    RenderOptions full_opts{1};
+    full_opts.lod_pixel_error = 0;
+    Image full = Render(scene, camera_opts, full_opts);
+    for (auto [pixel_error, name] : {std::pair{0., "0"}, {.5, "0.5"}, {2., "2"}}) {
+        RenderOptions render_opts{1};
+        render_opts.lod_pixel_error = pixel_error;
+        auto stats = scene.GetLodStats(
+            scene.SelectLod(camera.GetOrigin(), camera.GetPixelSpread(), pixel_error));
+        Image image = Render(scene, camera_opts, render_opts);
+        double squares = 0;
+        int matches = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                RGB a = image.GetPixel(y, x);
+                RGB b = full.GetPixel(y, x);
+                double square = (a.r - b.r) * (a.r - b.r) + (a.g - b.g) * (a.g - b.g) +
+                                (a.b - b.b) * (a.b - b.b);
+                squares += square;
+                matches += square < 4;
+            }
+        }
+        int pixels = image.Width() * image.Height();
+        WARN("Pixel error " << pixel_error << ": " << stats.triangles_traced << " of "
+             << stats.triangles_loaded << " triangles traced, RMSE "
+             << std::sqrt(squares / (3 * pixels)) << ", " << 100. * matches / pixels
+             << "% of pixels within 2 of full detail");
+        BENCHMARK(std::string("Frame, pixel error ") + name) {
+            return RenderFrame(scene, camera_opts, render_opts);
+        };
+    }
+}
+
+TEST_CASE("Kernel specialization", "[benchmark]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto triangles = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    const auto spheres = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+
+    for (int depth : {0, 4}) {
+        for (bool specialize : {false, true}) {
+            RenderOptions render_opts{.depth = depth, .specialize = specialize};
+            auto suffix = " depth " + std::to_string(depth) + (specialize ? " specialized" : " generic");
+            BENCHMARK("Cornell box" + suffix) {
+                return RenderFrame(triangles, camera_opts, render_opts);
+            };
+            BENCHMARK("Box with spheres" + suffix) {
+                return RenderFrame(spheres, camera_opts, render_opts);
+            };
+        }
+    }
+    RenderOptions depth_opts{.depth = 4, .mode = RenderMode::kDepth, .specialize = false};
+    BENCHMARK("Depth generic") {
+        return RenderFrame(triangles, camera_opts, depth_opts);
+    };
+    depth_opts.specialize = true;
+    BENCHMARK("Depth specialized") {
+        return RenderFrame(triangles, camera_opts, depth_opts);
+    };
+}
+
+TEST_CASE("Vertex formats", "[benchmark]") {
+    // Triangle and normal memory of every vertex format by Scene::MemoryFootprint,
+    // then a depth 1 frame of the deer in each.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    constexpr VertexFormat kFormats[] = {VertexFormat::kFull, VertexFormat::kCompact,
+                                         VertexFormat::kQuantized};
+    for (const char* path : {"deer/CERF_Free.obj", "box/cube.obj", "classic_box/CornellBox.obj",
+                             "mirrors/scene.obj"}) {
+        std::ostringstream bytes;
+        for (auto format : kFormats) {
+            SceneFootprint footprint = ReadScene(kTestsDir / path, {format}).MemoryFootprint();
+            bytes << " " << footprint.triangles + footprint.normals;
+        }
+        WARN(path << ", full, compact and quantized:" << bytes.str() << " B");
+    }
+
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .look_from = {100., 200., 150.},
+                              .look_to = {0., 100., 0.}};
+    const char* kNames[] = {"full", "compact", "quantized"};
+    for (auto format : kFormats) {
+        const auto scene = ReadScene(kTestsDir / "deer/CERF_Free.obj", {format});
+        BENCHMARK(std::string("Deer, ") + kNames[static_cast<int>(format)]) {
+            return RenderFrame(scene, camera_opts, {1});
+        };
+    }
+}
+
+namespace {
+
+// Primitives of similar size spread evenly through a cube.
+Scene SphereCloud(int count) {
+    std::unordered_map<std::string, Material> materials = {{"white", Material{}}};
+    Material* material = &materials.at("white");
+    material->diffuse_color = {.7, .7, .7};
+    material->albedo = {1, 0, 0};
+    PrimitiveSet primitives;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> coord(-5, 5);
+    for (int i = 0; i < count; ++i) {
+        primitives.Add(SphereObject{material, Sphere({coord(rng), coord(rng), coord(rng)}, .1)});
+    }
+    return Scene(std::move(primitives), {Light{{2, 20, 3}, {1, 1, 1}}}, std::move(materials));
+}
+
+// Axis-aligned blocks of random height, two triangles per face.
+Scene City(int side) {
+    std::unordered_map<std::string, Material> materials = {{"white", Material{}}};
+    Material* material = &materials.at("white");
+    material->diffuse_color = {.7, .7, .7};
+    material->albedo = {1, 0, 0};
+    PrimitiveSet primitives;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> height(.5, 4.5);
+    constexpr int kFaces[6][4] = {{0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1},
+                                  {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}};
+    for (int i = 0; i < side; ++i) {
+        for (int j = 0; j < side; ++j) {
+            Vector low(i, 0, j);
+            Vector high(i + .7, height(rng), j + .7);
+            Vector corners[8];
+            for (int k = 0; k < 8; ++k) {
+                corners[k] = {k & 1 ? high[0] : low[0], k & 2 ? high[1] : low[1],
+                              k & 4 ? high[2] : low[2]};
+            }
+            for (const auto& face : kFaces) {
+                primitives.Add(Object{
+                    material, Triangle(corners[face[0]], corners[face[1]], corners[face[2]]), {}});
+                primitives.Add(Object{
+                    material, Triangle(corners[face[0]], corners[face[2]], corners[face[3]]), {}});
+            }
+        }
+    }
+    return Scene(std::move(primitives), {Light{{2, 20, 3}, {1, 1, 1}}}, std::move(materials));
+}
+
+void BenchmarkAccelerators(const std::string& name, const Scene& scene,
+                           const CameraOptions& camera_opts, int depth, bool brute_force) {
+    for (auto type : {AcceleratorType::kBruteForce, AcceleratorType::kGrid,
+                      AcceleratorType::kKdTree, AcceleratorType::kBvh}) {
+        if (type == AcceleratorType::kBruteForce && !brute_force) {
+            continue;
+        }
+        static const char* kNames[] = {"auto", "brute force", "grid", "kd-tree", "BVH"};
+        std::string label = name + ", " + kNames[static_cast<int>(type)];
+        RenderOptions render_opts{.depth = depth, .accelerator = type};
+        BENCHMARK(label + " build") {
+            return MakeAccelerator(type, scene.GetPrimitives());
+        };
+        BENCHMARK(label + " render") {
+            return RenderFrame(scene, camera_opts, render_opts);
+        };
+    }
+}
+
+}  // namespace
+
+TEST_CASE("Accelerators", "[benchmark]") {
+    // The scenes behind the thresholds of SelectAccelerator: a dozen triangles stay
+    // with brute force, the Cornell boxes and the scanned deer take the BVH, an
+    // even cloud of spheres the grid and an axis-aligned city the kd-tree.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions box_opts{.screen_width = 160,
+                           .screen_height = 120,
+                           .look_from = {-.5, 1.5, .98},
+                           .look_to = {0., 1., 0.}};
+    BenchmarkAccelerators("Cornell box", ReadScene(kTestsDir / "classic_box/CornellBox.obj"),
+                          box_opts, 4, true);
+    BenchmarkAccelerators("Distorted box", ReadScene(kTestsDir / "distorted_box/CornellBox.obj"),
+                          box_opts, 4, true);
+    CameraOptions shapes_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., 1.2, 2.5},
+                              .look_to = {0., .4, -.5}};
+    BenchmarkAccelerators("Shapes", ReadScene(kTestsDir / "primitives/shapes.obj"), shapes_opts, 4,
+                          true);
+    CameraOptions deer_opts{.screen_width = 160,
+                            .screen_height = 120,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+    BenchmarkAccelerators("Deer", ReadScene(kTestsDir / "deer/CERF_Free.obj"), deer_opts, 1, true);
+    CameraOptions cloud_opts{.screen_width = 160,
+                             .screen_height = 120,
+                             .look_from = {0., 0., 12.},
+                             .look_to = {0., 0., 0.}};
+    BenchmarkAccelerators("Sphere cloud", SphereCloud(5000), cloud_opts, 1, false);
+    CameraOptions city_opts{.screen_width = 160,
+                            .screen_height = 120,
+                            .look_from = {-3., 6., -3.},
+                            .look_to = {10., 0., 10.}};
+    BenchmarkAccelerators("City", City(20), city_opts, 1, false);
+}
+
+namespace {
+
+// L1 data read misses and last-level cache misses of this process and of the
+// threads it starts, from perf_event_open. Without a PMU, as in most VMs, or
+// with a strict perf_event_paranoid they are unavailable.
+class CacheMissCounters {
+public:
+    CacheMissCounters() {
+        fds_[0] = Open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        fds_[1] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    }
+
+    CacheMissCounters(const CacheMissCounters&) = delete;
+    CacheMissCounters& operator=(const CacheMissCounters&) = delete;
+
+    ~CacheMissCounters() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    bool Available() const {
+        return fds_[0] >= 0 && fds_[1] >= 0;
+    }
+
+    void Start() {
+        for (int fd : fds_) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    // L1 and last-level misses since Start.
+    std::array<uint64_t, 2> Stop() {
+        std::array<uint64_t, 2> counts{};
+        for (int i = 0; i < 2; ++i) {
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fds_[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+                counts[i] = 0;
+            }
+        }
+        return counts;
+    }
+
+private:
+    static int Open(uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    std::array<int, 2> fds_;
+};
+
+}  // namespace
+
+TEST_CASE("Pixel order", "[benchmark]") {
+    // Scanline tiles and pixels against Hilbert tiles with Morton pixels. Where the
+    // CPU exposes cache counters, the misses of one frame are printed as well.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto box = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    const auto deer = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    CameraOptions deer_opts{.screen_width = 640,
+                            .screen_height = 480,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+    CacheMissCounters counters;
+    if (!counters.Available()) {
+        WARN("Cache miss counters are unavailable, timing only");
+    }
+    for (auto order : {PixelOrder::kScanline, PixelOrder::kSpaceFilling}) {
+        std::string suffix = order == PixelOrder::kScanline ? ", scanline" : ", space-filling";
+        RenderOptions box_render{.depth = 4, .pixel_order = order};
+        RenderOptions deer_render{.depth = 1, .pixel_order = order};
+        auto count_misses = [&](const std::string& name, const Scene& scene,
+                                const CameraOptions& camera_opts, const RenderOptions& opts) {
+            counters.Start();
+            RenderFrame(scene, camera_opts, opts);
+            auto [l1, llc] = counters.Stop();
+            WARN(name << suffix << ": " << l1 << " L1D, " << llc << " LLC misses");
+        };
+        if (counters.Available()) {
+            count_misses("Cornell box", box, kCameraOptions, box_render);
+            count_misses("Deer", deer, deer_opts, deer_render);
+        }
+        BENCHMARK("Cornell box" + suffix) {
+            return RenderFrame(box, kCameraOptions, box_render);
+        };
+        BENCHMARK("Deer" + suffix) {
+            return RenderFrame(deer, deer_opts, deer_render);
+        };
+    }
+}
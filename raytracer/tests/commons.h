@@ -2,9 +2,14 @@
 
 #include <image.h>
 
+#include <atomic>
 #include <cmath>
+#include <filesystem>
 #include <string>
 #include <ranges>
+#include <system_error>
+
+#include <unistd.h>
 
 #include <catch2/catch_test_macros.hpp>
 
@@ -33,3 +38,34 @@ void Compare(const Image& actual, const Image& expected) {
     auto similarity = static_cast<double>(matches) / (actual.Width() * actual.Height());
     CHECK(similarity >= .99);
 }
+
+// Directory of a test under the temp directory, named after the process so that
+// runs do not share it, and removed with its files when the test ends.
+class TempDirectory {
+public:
+    explicit TempDirectory(const std::string& name) {
+        static std::atomic<int> count = 0;
+        path_ = std::filesystem::temp_directory_path() /
+                (name + "_" + std::to_string(getpid()) + "_" + std::to_string(count++));
+        std::filesystem::create_directories(path_);
+    }
+
+    ~TempDirectory() {
+        std::error_code error;
+        std::filesystem::remove_all(path_, error);
+    }
+
+    TempDirectory(const TempDirectory&) = delete;
+    TempDirectory& operator=(const TempDirectory&) = delete;
+
+    const std::filesystem::path& Path() const {
+        return path_;
+    }
+
+    std::filesystem::path operator/(const std::filesystem::path& name) const {
+        return path_ / name;
+    }
+
+private:
+    std::filesystem::path path_;
+};
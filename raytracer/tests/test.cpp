@@ -2,13 +2,32 @@
 #include <options/render_options.h>
 #include <tests/commons.h>
 #include <raytracer.h>
+#include <distributed.h>
+#include <render_server.h>
+#include <progressive.h>
+#include <frame_sequence.h>
+#include <relight.h>
+#include <bucketed.h>
+#include <path_trace.h>
+#include <ray_query.h>
+#include <sampler.h>
 #include <util.h>
 #include <image.h>
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <fstream>
 #include <string_view>
+#include <thread>
 #include <optional>
+#include <set>
 #include <numbers>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stop_token>
 
 #include <catch2/catch_test_macros.hpp>
 
@@ -87,3 +106,1230 @@ TEST_CASE("Deer", "[no_asan]") {
                               .look_to = {0., 100., 0.}};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, {1});
 }
+
+TEST_CASE("Analytic primitives") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., 1.2, 2.5},
+                              .look_to = {0., .4, -.5}};
+    RenderOptions render_opts{4};
+    // Planes and boxes look like the triangles they replace.
+    Compare(Render(kTestsDir / "primitives/analytic.obj", camera_opts, render_opts),
+            Render(kTestsDir / "primitives/tessellated.obj", camera_opts, render_opts));
+    CheckImage("primitives/shapes.obj", "primitives/shapes.png", camera_opts, render_opts);
+
+    // Rays from the camera to points of known normal on every analytic primitive of
+    // the scene hit them at the distance of the point.
+    struct SurfacePoint {
+        PrimitiveType type;
+        Vector point;
+        Vector normal;
+    };
+    const SurfacePoint kPoints[] = {
+        {PrimitiveType::kPlane, {1.2, 0., 1.}, {0., 1., 0.}},
+        {PrimitiveType::kPlane, {1.5, 1.5, -2.}, {0., 0., 1.}},
+        {PrimitiveType::kBox, {-.6, .6, 0.}, {0., 1., 0.}},
+        {PrimitiveType::kBox, {-.6, .3, .3}, {0., 0., 1.}},
+        {PrimitiveType::kDisc, {-1., .6, -1.5}, {.3, .2, 1.}},
+        {PrimitiveType::kCylinder, {.9, .45, -.5}, {0., 0., 1.}},
+        {PrimitiveType::kCylinder, {.9, .9, -.8}, {0., 1., 0.}},
+        {PrimitiveType::kCylinder, {.3, .6, .3}, {0., 1., 0.}},
+        {PrimitiveType::kCylinder, {.3, .3, .6}, {0., 0., 1.}}};
+    const auto shapes = ReadScene(kTestsDir / "primitives/shapes.obj");
+    for (const auto& [type, point, expected_normal] : kPoints) {
+        Vector dir = point - camera_opts.look_from;
+        double distance = Length(dir);
+        dir.Normalize();
+        Hit hit = FindClosestHit(shapes.GetAccelerator(), Ray(camera_opts.look_from, dir));
+        REQUIRE(hit.IsValid());
+        CHECK(hit.type == type);
+        CHECK(std::abs(hit.params.t - distance) < 1e-9);
+        Vector normal = hit.shading_normal;
+        normal.Normalize();
+        if (DotProduct(normal, dir) > 0) {
+            normal = normal.MultiplyOnScalar(-1);
+        }
+        Vector expected = expected_normal;
+        expected.Normalize();
+        CHECK(Length(normal - expected) < 1e-9);
+    }
+}
+
+TEST_CASE("Compact vertex attributes") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    Image expected{kTestsDir / "box/cube.png"};
+    for (auto format : {VertexFormat::kCompact, VertexFormat::kQuantized}) {
+        auto scene = ReadScene(kTestsDir / "box/cube.obj", {format});
+        Compare(Render(scene, camera_opts, {4}), expected);
+    }
+
+    // Triangles and normals of the deer take 244352, 138112 and 106288 bytes.
+    size_t bytes[3];
+    for (auto format : {VertexFormat::kFull, VertexFormat::kCompact, VertexFormat::kQuantized}) {
+        SceneFootprint footprint =
+            ReadScene(kTestsDir / "deer/CERF_Free.obj", {format}).MemoryFootprint();
+        bytes[static_cast<int>(format)] = footprint.triangles + footprint.normals;
+    }
+    CHECK(bytes[1] < .6 * bytes[0]);
+    CHECK(bytes[2] < .8 * bytes[1]);
+}
+
+TEST_CASE("Gamma table") {
+    const auto& gamma = GetGammaTable();
+    for (int i = 0; i <= 100000; ++i) {
+        float value = i / 100000.f;
+        int expected = std::round(std::pow(static_cast<double>(value), 1 / 2.2) * 255);
+        REQUIRE(std::abs(gamma.Encode(value) - expected) <= 1);
+    }
+    CHECK(gamma.Encode(std::nanf("")) == 0);
+    CHECK(gamma.Encode(-1.f) == 0);
+    CHECK(gamma.Encode(1.f) == 255);
+}
+
+TEST_CASE("HDR output") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 70,
+                              .screen_height = 45,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.tile_size = 16;
+    const auto expected = RenderFrame(scene, camera_opts, render_opts).frame;
+    const TempDirectory dir("raytracer_hdr_output");
+
+    RenderToFile(scene, camera_opts, render_opts, dir / "frame.pfm");
+    std::ifstream pfm(dir / "frame.pfm", std::ios::binary);
+    std::string magic;
+    int width, height;
+    double scale;
+    pfm >> magic >> width >> height >> scale;
+    pfm.get();
+    REQUIRE(magic == "PF");
+    REQUIRE(width == 70);
+    REQUIRE(height == 45);
+    CHECK(scale < 0);
+    for (int y = height - 1; y >= 0; --y) {
+        std::vector<float> row(width * 3);
+        pfm.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float));
+        REQUIRE(std::equal(row.begin(), row.end(), expected.Row(y)));
+    }
+
+    RenderToFile(scene, camera_opts, render_opts, dir / "frame.exr");
+    std::ifstream exr(dir / "frame.exr", std::ios::binary);
+    std::vector<char> bytes{std::istreambuf_iterator<char>(exr), {}};
+    auto read_int = [&](size_t offset) {
+        int32_t value;
+        std::memcpy(&value, bytes.data() + offset, sizeof(value));
+        return value;
+    };
+    REQUIRE(read_int(0) == 20000630);
+    CHECK(read_int(4) == 0x202);
+    // The last tile of the offset table is the bottom right one: 6 x 13 pixels.
+    size_t table_end = std::search(bytes.begin(), bytes.end(), "tiledesc", "tiledesc" + 9) -
+                       bytes.begin() + 9 + 4 + 9 + 1 + 15 * sizeof(uint64_t);
+    uint64_t last;
+    std::memcpy(&last, bytes.data() + table_end - sizeof(last), sizeof(last));
+    CHECK(read_int(last) == 4);
+    CHECK(read_int(last + 4) == 2);
+    CHECK(read_int(last + 16) == 6 * 13 * 3 * 4);
+    float red;
+    std::memcpy(&red, bytes.data() + last + 20 + 2 * 6 * 4, sizeof(red));
+    CHECK(red == expected.Row(32)[64 * 3]);
+}
+
+TEST_CASE("Bucketed rendering") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 100,
+                              .screen_height = 75,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    const TempDirectory dir("raytracer_bucketed");
+    const auto output = dir / "bucketed.png";
+    for (auto mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+        RenderOptions render_opts{4, mode};
+        render_opts.tile_size = 16;
+        const auto expected = Render(scene, camera_opts, render_opts);
+        // Bands of 32 rows, a single band, and a band of a single tile.
+        for (int band_height : {20, 1000, 1}) {
+            RenderBucketed(scene, camera_opts, render_opts, output, {.band_height = band_height});
+            CHECK_FALSE(std::filesystem::exists(output.string() + ".spool"));
+            Image actual(output);
+            REQUIRE(actual.Width() == expected.Width());
+            REQUIRE(actual.Height() == expected.Height());
+            for (int y = 0; y < actual.Height(); ++y) {
+                for (int x = 0; x < actual.Width(); ++x) {
+                    REQUIRE(actual.GetPixel(y, x) == expected.GetPixel(y, x));
+                }
+            }
+        }
+    }
+}
+
+namespace {
+
+void CheckSameFrame(const RenderedFrame& actual, const RenderedFrame& expected) {
+    REQUIRE(actual.frame.Width() == expected.frame.Width());
+    REQUIRE(actual.frame.Height() == expected.frame.Height());
+    REQUIRE(actual.frame.Channels() == expected.frame.Channels());
+    CHECK(actual.max_value == expected.max_value);
+    size_t row_bytes = actual.frame.Width() * actual.frame.Channels() * sizeof(float);
+    for (int y = 0; y < actual.frame.Height(); ++y) {
+        REQUIRE(std::memcmp(actual.frame.Row(y), expected.frame.Row(y), row_bytes) == 0);
+    }
+}
+
+// A worker that takes the job and its tiles but never answers. Unless it hangs,
+// its connection ends at once as if it died. Its end of the connection is
+// returned in peer.
+WorkerProcess FaultyWorker(bool hang, int* peer) {
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    if (!hang) {
+        shutdown(fds[1], SHUT_WR);
+    }
+    *peer = fds[1];
+    return {fds[0]};
+}
+
+}  // namespace
+
+TEST_CASE("Kernel specialization") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto triangle = ReadScene(kTestsDir / "triangle/scene.obj");
+    const auto box = ReadScene(kTestsDir / "box/cube.obj");
+    const auto shapes = ReadScene(kTestsDir / "primitives/shapes.obj");
+
+    auto features = SelectKernel(triangle, {1});
+    CHECK(features.triangles_only);
+    CHECK(features.flat_normals);
+    CHECK(features.no_reflection);
+    CHECK(features.no_refraction);
+    features = SelectKernel(box, {4});
+    CHECK(!features.triangles_only);
+    CHECK(!features.no_reflection);
+    CHECK(!features.no_refraction);
+    features = SelectKernel(box, {4, RenderMode::kDepth});
+    CHECK(features.no_reflection);
+    CHECK(features.no_refraction);
+    CHECK(SelectKernel(box, {.depth = 4, .specialize = false}) == KernelFeatures{});
+
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    for (const Scene* scene : {&triangle, &box, &shapes}) {
+        for (auto mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+            for (int depth : {0, 4}) {
+                RenderOptions render_opts{depth, mode};
+                auto expected = RenderFrame(*scene, camera_opts,
+                                            {.depth = depth, .mode = mode, .specialize = false});
+                CheckSameFrame(RenderFrame(*scene, camera_opts, render_opts), expected);
+            }
+        }
+    }
+}
+
+TEST_CASE("Accelerators") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., 1.2, 2.5},
+                              .look_to = {0., .4, -.5}};
+    for (const char* path : {"box/cube.obj", "primitives/shapes.obj", "mirrors/scene.obj"}) {
+        const auto scene = ReadScene(kTestsDir / path);
+        auto expected =
+            RenderFrame(scene, camera_opts, {.depth = 4, .accelerator = AcceleratorType::kBruteForce});
+        for (auto type : {AcceleratorType::kGrid, AcceleratorType::kKdTree, AcceleratorType::kBvh}) {
+            CheckSameFrame(RenderFrame(scene, camera_opts, {.depth = 4, .accelerator = type}),
+                           expected);
+        }
+    }
+    CHECK(ReadScene(kTestsDir / "deer/CERF_Free.obj").GetAccelerator().GetType() ==
+          AcceleratorType::kBvh);
+}
+
+TEST_CASE("Pixel order") {
+    constexpr uint32_t kSide = 8;
+    std::vector<std::pair<uint32_t, uint32_t>> curve(kSide * kSide);
+    for (uint32_t y = 0; y < kSide; ++y) {
+        for (uint32_t x = 0; x < kSide; ++x) {
+            curve[HilbertIndex(kSide, x, y)] = {x, y};
+        }
+    }
+    for (size_t i = 1; i < curve.size(); ++i) {
+        auto [x0, y0] = curve[i - 1];
+        auto [x1, y1] = curve[i];
+        REQUIRE(std::abs(static_cast<int>(x1 - x0)) + std::abs(static_cast<int>(y1 - y0)) == 1);
+    }
+    std::vector<std::pair<int, int>> z = {{0, 0}, {1, 0}, {0, 1}, {1, 1}, {2, 0},
+                                          {2, 1}, {0, 2}, {1, 2}, {2, 2}};
+    CHECK(MortonOrder(3, 3) == z);
+    CHECK(MortonOrder(5, 2).size() == 10);
+
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 150,
+                              .screen_height = 100,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    for (auto mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+        RenderOptions render_opts{4, mode};
+        render_opts.tile_size = 24;
+        auto expected = RenderFrame(scene, camera_opts, render_opts);
+        render_opts.pixel_order = PixelOrder::kSpaceFilling;
+        CheckSameFrame(RenderFrame(scene, camera_opts, render_opts), expected);
+    }
+}
+
+TEST_CASE("Path tracing") {
+    // A lone triangle gets no indirect light, so only the jittered edges differ
+    // from the kFull image.
+    CameraOptions triangle_opts{.screen_width = 640,
+                                .screen_height = 480,
+                                .look_from = {0., 2., 0.},
+                                .look_to = {0., 0., 0.}};
+    CheckImage("triangle/scene.obj", "triangle/scene.png", triangle_opts,
+               {.depth = 1, .mode = RenderMode::kPathTrace, .samples = 4});
+
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 80,
+                              .screen_height = 60,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    RenderOptions render_opts{.depth = 1, .mode = RenderMode::kPathTrace, .samples = 8};
+    auto expected = RenderFrame(scene, camera_opts, render_opts);
+    CheckSameFrame(RenderFrame(scene, camera_opts, render_opts), expected);
+
+    std::vector<int> samples;
+    auto frame = PathTrace(scene, camera_opts, render_opts, {},
+                           [&](const RenderedFrame&, const PathTraceProgress& progress) {
+                               samples.push_back(progress.samples);
+                               CHECK(progress.paths == progress.samples * 80u * 60u);
+                               CHECK(progress.is_final == (progress.samples == 8));
+                               CHECK(progress.SamplesPerSecond() > 0);
+                           });
+    CHECK(samples == std::vector<int>{1, 2, 4, 8});
+    for (int y = 0; y < 60; ++y) {
+        for (int k = 0; k < 80 * 3; ++k) {
+            REQUIRE(std::abs(frame.frame.Row(y)[k] - expected.frame.Row(y)[k]) <= 1e-5f);
+        }
+    }
+
+    samples.clear();
+    PathTrace(scene, camera_opts, render_opts, {.deadline = std::chrono::steady_clock::now()},
+              [&](const RenderedFrame&, const PathTraceProgress& progress) {
+                  samples.push_back(progress.samples);
+              });
+    CHECK(samples == std::vector<int>{1});
+
+    std::stop_source stop;
+    stop.request_stop();
+    samples.clear();
+    frame = PathTrace(scene, camera_opts, render_opts, {.stop_token = stop.get_token()},
+                      [&](const RenderedFrame&, const PathTraceProgress& progress) {
+                          samples.push_back(progress.samples);
+                      });
+    CHECK(samples.empty());
+    CHECK(frame.max_value == 0);
+    auto image = RenderProgressive(scene, camera_opts, render_opts,
+                                   {.stop_token = stop.get_token()},
+                                   [&](const Image&, const ProgressivePass&) { FAIL(); });
+    CHECK(image.Width() == 80);
+    CHECK(image.Height() == 60);
+
+    int passes = 0;
+    RenderProgressive(scene, camera_opts, render_opts, {},
+                      [&](const Image&, const ProgressivePass& pass) {
+                          CHECK(pass.is_final == (++passes == 4));
+                      });
+    CHECK(passes == 4);
+}
+
+TEST_CASE("Samplers") {
+    constexpr SamplerType kTypes[] = {SamplerType::kIndependent, SamplerType::kStratified,
+                                      SamplerType::kSobol, SamplerType::kBlueNoise};
+    for (auto type : kTypes) {
+        auto sampler = MakeSampler(type, 16);
+        CHECK(sampler->GetType() == type);
+        for (uint32_t k = 0; k < 64; ++k) {
+            for (uint32_t d = 0; d < 8; ++d) {
+                double u = sampler->Get(5, 7, k, d);
+                REQUIRE(u >= 0);
+                REQUIRE(u < 1);
+                REQUIRE(u == MakeSampler(type, 16)->Get(5, 7, k, d));
+            }
+        }
+    }
+
+    // Both 16 samples per pixel: one in every 4x4 cell and every 1D stratum of a
+    // pair. Sobol keeps it for any power of two.
+    for (auto type : {SamplerType::kStratified, SamplerType::kSobol}) {
+        auto sampler = MakeSampler(type, 16);
+        for (uint32_t pair = 0; pair < 4; ++pair) {
+            std::set<int> cells;
+            std::set<int> columns;
+            std::set<int> rows;
+            for (uint32_t k = 0; k < 16; ++k) {
+                int column = sampler->Get(3, 2, k, 2 * pair) * 16;
+                int row = sampler->Get(3, 2, k, 2 * pair + 1) * 16;
+                cells.insert(row / 4 * 4 + column / 4);
+                columns.insert(column);
+                rows.insert(row);
+            }
+            CHECK(cells.size() == 16);
+            CHECK(columns.size() == 16);
+            CHECK(rows.size() == 16);
+        }
+    }
+    auto sobol = MakeSampler(SamplerType::kSobol, 1);
+    std::set<int> strata;
+    for (uint32_t k = 0; k < 256; ++k) {
+        strata.insert(sobol->Get(1, 1, k, 5) * 256);
+    }
+    CHECK(strata.size() == 256);
+
+    // At one sample the blue-noise sampler spreads the values of a dimension over
+    // the pixels like the mask: little of their variance survives a box blur.
+    std::set<int> ranks;
+    for (int y = 0; y < kBlueNoiseSize; ++y) {
+        for (int x = 0; x < kBlueNoiseSize; ++x) {
+            ranks.insert(GetBlueNoiseMask().Rank(x, y));
+        }
+    }
+    CHECK(ranks.size() == kBlueNoiseSize * kBlueNoiseSize);
+    CHECK(*ranks.rbegin() == kBlueNoiseSize * kBlueNoiseSize - 1);
+    auto blurred_variance = [](const Sampler& sampler) {
+        double sum = 0;
+        for (int y = 0; y < kBlueNoiseSize; ++y) {
+            for (int x = 0; x < kBlueNoiseSize; ++x) {
+                double mean = 0;
+                for (int dy = 0; dy < 3; ++dy) {
+                    for (int dx = 0; dx < 3; ++dx) {
+                        mean += (sampler.Get(x + dx, y + dy, 0, 3) - .5) / 9;
+                    }
+                }
+                sum += mean * mean;
+            }
+        }
+        return sum / (kBlueNoiseSize * kBlueNoiseSize);
+    };
+    CHECK(blurred_variance(*MakeSampler(SamplerType::kBlueNoise, 1)) <
+          .5 * blurred_variance(*MakeSampler(SamplerType::kIndependent, 1)));
+
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    CameraOptions camera_opts{.screen_width = 40,
+                              .screen_height = 30,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    for (auto type : kTypes) {
+        RenderOptions render_opts{
+            .depth = 1, .mode = RenderMode::kPathTrace, .samples = 4, .sampler = type};
+        auto expected = RenderFrame(scene, camera_opts, render_opts);
+        render_opts.tile_size = 7;
+        render_opts.pixel_order = PixelOrder::kSpaceFilling;
+        CheckSameFrame(RenderFrame(scene, camera_opts, render_opts), expected);
+
+        render_opts.seed = 1;
+        auto reseeded = RenderFrame(scene, camera_opts, render_opts);
+        bool differs = false;
+        for (int y = 0; y < 30 && !differs; ++y) {
+            for (int k = 0; k < 40 * 3; ++k) {
+                differs |= reseeded.frame.Row(y)[k] != expected.frame.Row(y)[k];
+            }
+        }
+        CHECK(differs);
+    }
+}
+
+TEST_CASE("Denoising") {
+    // Two noisy walls meet in the middle of the frame, at different depths and
+    // facing different ways.
+    constexpr int kWidth = 70;
+    constexpr int kHeight = 20;
+    Framebuffer color(kWidth, kHeight);
+    Framebuffer depth(kWidth, kHeight, 1);
+    Framebuffer normal(kWidth, kHeight);
+    auto noise = [](int k) { return (MixBits(k) >> 11) * 0x1p-53 * .2 - .1; };
+    for (int y = 0; y < kHeight; ++y) {
+        for (int x = 0; x < kWidth; ++x) {
+            bool left = x < kWidth / 2;
+            double value = (left ? .2 : .8) + noise(y * kWidth + x);
+            color.SetPixel({value, value, value}, y, x);
+            depth.Row(y)[x] = left ? 1 : 3;
+            normal.SetPixel(left ? Vector(0, 0, 1) : Vector(1, 0, 0), y, x);
+        }
+    }
+    Denoise(depth, normal, {.iterations = 3, .sigma_color = .5f}, &color);
+    for (int y = 0; y < kHeight; ++y) {
+        for (int x = 0; x < kWidth; ++x) {
+            float expected = x < kWidth / 2 ? .2f : .8f;
+            REQUIRE(std::abs(color.Row(y)[3 * x] - expected) < .05f);
+            REQUIRE(color.Row(y)[3 * x + 1] == color.Row(y)[3 * x]);
+        }
+    }
+
+    // A flat frame stays flat whatever the guides.
+    color.Fill(.5f);
+    Denoise(depth, normal, {.iterations = 4}, &color);
+    for (int y = 0; y < kHeight; ++y) {
+        for (int k = 0; k < kWidth * 3; ++k) {
+            REQUIRE(std::abs(color.Row(y)[k] - .5f) < 1e-5f);
+        }
+    }
+    Denoise(depth, normal, {.iterations = 2, .sigma_depth = 0}, &color);
+    for (int y = 0; y < kHeight; ++y) {
+        for (int k = 0; k < kWidth * 3; ++k) {
+            REQUIRE(std::abs(color.Row(y)[k] - .5f) < 1e-5f);
+        }
+    }
+    CHECK_THROWS_AS(Denoise(depth, normal, {.iterations = kMaxDenoiseIterations + 1}, &color),
+                    std::invalid_argument);
+
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto path = kTestsDir / "classic_box/CornellBox.obj";
+    const auto scene = ReadScene(path);
+    CameraOptions camera_opts{.screen_width = 40,
+                              .screen_height = 30,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    // The reference shares no paths with the frames it grades.
+    RenderOptions render_opts{.depth = 1,
+                              .mode = RenderMode::kPathTrace,
+                              .samples = 1024,
+                              .sampler = SamplerType::kIndependent,
+                              .seed = 1};
+    auto reference = RenderFrame(scene, camera_opts, render_opts);
+    render_opts.sampler = SamplerType::kSobol;
+    render_opts.seed = 0;
+    auto rmse = [&](const RenderedFrame& result) {
+        double sum = 0;
+        for (int y = 0; y < 30; ++y) {
+            for (int k = 0; k < 40 * 3; ++k) {
+                double error = result.frame.Row(y)[k] - reference.frame.Row(y)[k];
+                sum += error * error;
+            }
+        }
+        return std::sqrt(sum / (40 * 30 * 3));
+    };
+    render_opts.samples = 4;
+    render_opts.denoise.iterations = 3;
+    auto result = RenderFrame(scene, camera_opts, render_opts);
+    double noisy = rmse(result);
+    // The paths record the first hits that RenderDenoiseGuide traces on its own.
+    REQUIRE(result.guide);
+    auto guide = RenderDenoiseGuide(scene, camera_opts, render_opts);
+    for (int y = 0; y < 30; ++y) {
+        for (int x = 0; x < 40; ++x) {
+            REQUIRE(result.guide->depth.Row(y)[x] == guide.depth.Row(y)[x]);
+        }
+        for (int k = 0; k < 40 * 3; ++k) {
+            REQUIRE(result.guide->normal.Row(y)[k] == guide.normal.Row(y)[k]);
+        }
+    }
+    DenoiseFrame(scene, camera_opts, render_opts, &result);
+    CHECK(rmse(result) < .75 * noisy);
+    CHECK(result.max_value == MaxValue(result.frame));
+
+    // The other entry points filter the same frame, or refuse to.
+    CheckSameFrame(RenderDistributed(path, camera_opts, render_opts,
+                                     {.workers = 2, .worker_executable = RAYTRACER_SERVER}),
+                   result);
+    auto passes = PathTrace(scene, camera_opts, render_opts);
+    for (int y = 0; y < 30; ++y) {
+        for (int k = 0; k < 40 * 3; ++k) {
+            REQUIRE(passes.frame.Row(y)[k] == Approx(result.frame.Row(y)[k]).epsilon(1e-4));
+        }
+    }
+    const TempDirectory dir("raytracer_denoising");
+    CHECK_THROWS_AS(RenderBucketed(scene, camera_opts, render_opts, dir / "denoised.png"),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Distributed rendering") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto path = kTestsDir / "box/cube.obj";
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.tile_size = 8;
+    const auto expected = RenderFrame(ReadScene(path), camera_opts, render_opts);
+
+    CheckSameFrame(RenderDistributed(path, camera_opts, render_opts,
+                                     {.workers = 3, .worker_executable = RAYTRACER_SERVER}),
+                   expected);
+
+    auto workers = LaunchLocalWorkers(1, RAYTRACER_SERVER);
+    int peers[2];
+    workers.push_back(FaultyWorker(false, &peers[0]));
+    workers.push_back(FaultyWorker(true, &peers[1]));
+    DistributedOptions options{.stall_timeout = std::chrono::milliseconds(200)};
+    CheckSameFrame(RenderDistributed(path, camera_opts, render_opts, workers, options), expected);
+    for (int peer : peers) {
+        close(peer);
+    }
+
+    render_opts.mode = RenderMode::kDepth;
+    CheckSameFrame(RenderDistributed(path, camera_opts, render_opts,
+                                     {.workers = 2, .worker_executable = RAYTRACER_SERVER}),
+                   RenderFrame(ReadScene(path), camera_opts, render_opts));
+    CHECK_THROWS_AS(LaunchLocalWorkers(1, "raytracer_missing_worker"), std::runtime_error);
+}
+
+TEST_CASE("Render server") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const TempDirectory dir("raytracer_render_server");
+    const auto socket_path = (dir / "server.sock").string();
+    // Room for one scene only: loading the second one evicts the first.
+    RenderServer server(socket_path, 1);
+    std::thread serve([&] { server.Serve(); });
+
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    const auto box = kTestsDir / "box/cube.obj";
+    const auto triangle = kTestsDir / "triangle/scene.obj";
+    {
+        RenderClient client(socket_path);
+        auto expected = RenderFrame(ReadScene(box), camera_opts, render_opts);
+        CheckSameFrame(client.RenderFrame(box, camera_opts, render_opts), expected);
+        Compare(client.Render(box, camera_opts, render_opts), ToImage(expected, RenderMode::kFull));
+        client.Render(triangle, camera_opts, render_opts);
+        client.Render(box, camera_opts, render_opts);
+        CHECK_THROWS(client.Render(kTestsDir / "missing.obj", camera_opts, render_opts));
+
+        auto stats = client.GetStats();
+        CHECK(stats.requests == 5);
+        CHECK(stats.cache_hits == 1);
+        CHECK(stats.cache_misses == 3);
+        CHECK(stats.evictions == 2);
+        CHECK(stats.resident_scenes == 1);
+        CHECK(stats.max_latency_ms > 0);
+        client.Shutdown();
+    }
+    serve.join();
+
+    // Concurrent misses load the scene once. It is measured with its default
+    // accelerator, and again with the ones a render built.
+    SceneCache cache(size_t{1} << 30);
+    std::vector<std::shared_ptr<const Scene>> scenes(4);
+    std::vector<std::thread> loads;
+    for (auto& scene : scenes) {
+        loads.emplace_back([&] {
+            bool hit;
+            scene = cache.Get(box, &hit);
+        });
+    }
+    for (auto& load : loads) {
+        load.join();
+    }
+    CHECK(std::all_of(scenes.begin(), scenes.end(),
+                      [&](const auto& scene) { return scene == scenes[0]; }));
+    ServerStats cache_stats;
+    cache.FillStats(&cache_stats);
+    CHECK(cache_stats.cache_misses == 1);
+    CHECK(cache_stats.cache_hits == 3);
+    CHECK(cache_stats.resident_bytes == scenes[0]->MemoryFootprint().Total());
+    size_t loaded_bytes = cache_stats.resident_bytes;
+    render_opts.accelerator = AcceleratorType::kBvh;
+    RenderFrame(*scenes[0], camera_opts, render_opts);
+    cache.Remeasure(scenes[0]);
+    cache.FillStats(&cache_stats);
+    CHECK(cache_stats.resident_bytes > loaded_bytes);
+    CHECK(cache_stats.resident_bytes == scenes[0]->MemoryFootprint().Total());
+}
+
+TEST_CASE("Progressive rendering") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    std::vector<ProgressivePass> passes;
+    auto image = RenderProgressive(scene, camera_opts, {4}, {},
+                                   [&](const Image&, const ProgressivePass& pass) {
+                                       passes.push_back(pass);
+                                   });
+    REQUIRE(passes.size() == 4);
+    CHECK(passes[0].stride == 4);
+    CHECK(passes[2].stride == 1);
+    CHECK(passes[2].depth == 1);
+    CHECK(passes[3].depth == 4);
+    CHECK(passes[3].is_final);
+    Compare(image, Image{kTestsDir / "box/cube.png"});
+
+    std::stop_source stop;
+    passes.clear();
+    RenderProgressive(scene, camera_opts, {4}, {.stop_token = stop.get_token()},
+                      [&](const Image&, const ProgressivePass& pass) {
+                          passes.push_back(pass);
+                          stop.request_stop();
+                      });
+    CHECK(passes.size() == 1);
+
+    passes.clear();
+    RenderProgressive(scene, camera_opts, {4}, {.deadline = std::chrono::steady_clock::now()},
+                      [&](const Image&, const ProgressivePass& pass) { passes.push_back(pass); });
+    CHECK(passes.size() == 1);
+}
+
+TEST_CASE("Relighting") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    Relighter relighter(scene, camera_opts, render_opts);
+    const auto original = relighter.Render();
+    Compare(original, Render(scene, camera_opts, render_opts));
+
+    std::vector<Light> lights = scene.GetLights();
+    lights[0].position = {.5, 1.2, .3};
+    lights[1].intensity = {.2, .1, .6};
+    Scene moved(scene.GetPrimitives(), lights, {});
+    Compare(relighter.Relight(lights), Render(moved, camera_opts, render_opts));
+
+    auto materials = scene.GetMaterials();
+    materials.at("floor").diffuse_color = {.9, .1, .1};
+    auto recolored = relighter.Relight(scene.GetLights(), materials);
+    CHECK(!(recolored.GetPixel(110, 80) == original.GetPixel(110, 80)));
+    Compare(relighter.Relight(scene.GetLights(), scene.GetMaterials()), original);
+
+    materials.at("rightSphere").refraction_index = 1.3;
+    relighter.Relight(scene.GetLights(), materials);
+    CHECK(relighter.CachedNodes() > 0);
+
+    CHECK_THROWS_AS(relighter.Relight(scene.GetLights(), {{"missing", Material{}}}),
+                    std::invalid_argument);
+    CHECK_THROWS_AS(Relighter(scene, camera_opts, {4, RenderMode::kDepth}), std::invalid_argument);
+}
+
+TEST_CASE("Texture mapping") {
+    const TempDirectory dir("raytracer_texture_mapping");
+    Image solid(4, 4);
+    Image checker(256, 256);
+    for (int y = 0; y < 256; ++y) {
+        for (int x = 0; x < 256; ++x) {
+            checker.SetPixel((x + y) % 2 ? RGB{0, 0, 0} : RGB{255, 255, 255}, y, x);
+            if (x < 4 && y < 4) {
+                solid.SetPixel({200, 100, 50}, y, x);
+            }
+        }
+    }
+    solid.Write(dir / "solid.png");
+    checker.Write(dir / "checker.png");
+    const auto& linear = GetTexelTable();
+    std::ofstream(dir / "quad.mtl") << "newmtl solid\nKd 1 1 1\nKs .3 .3 .3\nNs 20\nal 1 .2 0\n"
+                                       "map_Kd solid.png\n"
+                                    << "newmtl plain\nKs .3 .3 .3\nNs 20\nal 1 .2 0\nKd "
+                                    << linear[200] << ' ' << linear[100] << ' ' << linear[50]
+                                    << "\nnewmtl checker\nKd 1 1 1\nmap_Kd checker.png\n";
+    for (std::string material : {"solid", "plain", "checker"}) {
+        std::ofstream(dir / (material + ".obj"))
+            << "mtllib quad.mtl\nP 0 0 3 1 1 1\n"
+               "v -1 -1 0\nv 1 -1 0\nv 1 1 0\nv -1 1 0\nvt 0 0\nvt 1 0\nvt 1 1\nvt 0 1\n"
+               "usemtl "
+            << material << "\nf 1/1 2/2 3/3 4/4\n";
+    }
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 64,
+                              .fov = std::numbers::pi / 2,
+                              .look_from = {0., 0., 1.5},
+                              .look_to = {0., 0., 0.}};
+
+    // A texture of one color is that diffuse color.
+    const auto textured = ReadScene(dir / "solid.obj");
+    const auto plain = ReadScene(dir / "plain.obj");
+    for (RenderMode mode : {RenderMode::kFull, RenderMode::kPathTrace}) {
+        RenderOptions render_opts{2, mode, 4};
+        Compare(Render(textured, camera_opts, render_opts), Render(plain, camera_opts, render_opts));
+    }
+    Compare(Render(ReadScene(dir / "solid.obj", {VertexFormat::kQuantized}), camera_opts, {2}),
+            Render(plain, camera_opts, {2}));
+
+    // From afar the checker of 1-texel squares is filtered to gray; close up its
+    // texels cover many pixels.
+    const auto checkered = ReadScene(dir / "checker.obj");
+    auto red_range = [](const Image& image) {
+        int min = 255;
+        int max = 0;
+        for (int y = 16; y < 48; ++y) {
+            for (int x = 16; x < 48; ++x) {
+                min = std::min(min, image.GetPixel(y, x).r);
+                max = std::max(max, image.GetPixel(y, x).r);
+            }
+        }
+        return std::pair{min, max};
+    };
+    auto [far_min, far_max] = red_range(Render(checkered, camera_opts, {1}));
+    CHECK(far_min > .9 * far_max);
+    CameraOptions close_opts = camera_opts;
+    close_opts.fov = std::numbers::pi / 6;
+    close_opts.look_from = {0., 0., .05};
+    auto [close_min, close_max] = red_range(Render(checkered, close_opts, {1}));
+    CHECK(close_min < .5 * close_max);
+    CHECK(GetTextureCache().GetStats().HitRate() > .9);
+
+    Relighter relighter(checkered, camera_opts, {1});
+    Compare(relighter.Render(), Render(checkered, camera_opts, {1}));
+}
+
+TEST_CASE("Level of detail", "[no_asan]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    REQUIRE(scene.GetLod().meshes.size() == 1);
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .look_from = {400., 500., 600.},
+                              .look_to = {0., 100., 0.}};
+    RenderOptions full_opts{1};
+    full_opts.lod_pixel_error = 0;
+    Camera camera(camera_opts);
+    auto levels = scene.SelectLod(camera.GetOrigin(), camera.GetPixelSpread(), .5);
+    CHECK(levels[0] > 0);
+    auto stats = scene.GetLodStats(levels);
+    CHECK(stats.triangles_traced < stats.triangles_loaded);
+    Compare(Render(scene, camera_opts, {1}), Render(scene, camera_opts, full_opts));
+
+    // Close up the deer keeps every triangle.
+    CameraOptions close_opts = camera_opts;
+    close_opts.look_from = {100., 200., 150.};
+    Camera close(close_opts);
+    CHECK(scene.SelectLod(close.GetOrigin(), close.GetPixelSpread(), .5) == std::vector<int>{0});
+}
+
+TEST_CASE("Rasterized primary visibility", "[no_asan]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    struct Case {
+        std::string path;
+        VertexFormat format;
+        CameraOptions camera_opts;
+        int depth;
+    };
+    // The second view of the Cornell box starts inside its walls, which the near
+    // plane clips.
+    std::vector<Case> cases = {
+        {"box/cube.obj", VertexFormat::kFull,
+         {640, 480, std::numbers::pi / 3, {0., .7, 1.75}, {0., .7, 0.}}, 4},
+        {"box/cube.obj", VertexFormat::kQuantized,
+         {640, 480, std::numbers::pi / 3, {0., .7, 1.75}, {0., .7, 0.}}, 4},
+        {"classic_box/CornellBox.obj", VertexFormat::kFull,
+         {500, 500, std::numbers::pi / 2, {-.9, 1.9, -1}, {0., 0., 0.}}, 4},
+        {"mirrors/scene.obj", VertexFormat::kFull,
+         {800, 600, std::numbers::pi / 2, {2., 1.5, -.1}, {1., 1.2, -2.8}}, 9},
+        {"deer/CERF_Free.obj", VertexFormat::kCompact,
+         {500, 500, std::numbers::pi / 2, {100., 200., 150.}, {0., 100., 0.}}, 1}};
+    for (const auto& [path, format, camera_opts, depth] : cases) {
+        const auto scene = ReadScene(kTestsDir / path, {format});
+        REQUIRE(CanRasterize(scene.GetPrimitives()));
+        for (RenderMode mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+            RenderOptions traced{depth, mode};
+            RenderOptions rasterized = traced;
+            rasterized.primary_visibility = PrimaryVisibility::kRasterize;
+            Compare(Render(scene, camera_opts, rasterized), Render(scene, camera_opts, traced));
+        }
+
+        // The buffer holds the primitive and the distance of the traced primary hit.
+        auto buffer = Rasterize(scene.GetPrimitives(), camera_opts, 32);
+        Camera camera(camera_opts);
+        int matches = 0;
+        for (int y = 0; y < camera_opts.screen_height; ++y) {
+            for (int x = 0; x < camera_opts.screen_width; ++x) {
+                Hit hit = FindClosestHit<KernelFeatures{}, false>(scene.GetAccelerator(),
+                                                                  camera.GetRay(y, x));
+                const VisibilitySample& sample = buffer.At(y, x);
+                if (!hit.IsValid()) {
+                    matches += sample.index == -1;
+                } else {
+                    matches += sample.index == hit.index && sample.type == hit.type &&
+                               std::abs(sample.depth - hit.params.t) <= 1e-5 * hit.params.t;
+                }
+            }
+        }
+        CHECK(matches >= .99 * camera_opts.screen_width * camera_opts.screen_height);
+    }
+    CHECK_FALSE(CanRasterize(ReadScene(kTestsDir / "primitives/analytic.obj").GetPrimitives()));
+
+    // Spheres behind the camera cover nothing; one around it may cover anything.
+    Camera camera({64, 48, std::numbers::pi / 2, {0., 0., 0.}, {0., 0., -1.}});
+    Tile behind = SphereBounds(camera, 64, 48, Sphere({0., 0., 5.}, 1.));
+    CHECK(behind.x0 >= behind.x1);
+    Tile around = SphereBounds(camera, 64, 48, Sphere({0., 0., .5}, 1.));
+    CHECK((around.x0 == 0 && around.y0 == 0 && around.x1 == 64 && around.y1 == 48));
+    Tile ahead = SphereBounds(camera, 64, 48, Sphere({0., 0., -5.}, 1.));
+    CHECK(ahead.x0 > 0);
+    CHECK(ahead.x1 < 64);
+    CHECK(ahead.x0 < 32);
+    CHECK(ahead.x1 > 32);
+}
+
+TEST_CASE("Frame sequence") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const TempDirectory dir("raytracer_frame_sequence");
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    const auto reference = ReadScene(kTestsDir / "box/cube.obj");
+    std::vector<Light> moved = scene.GetLights();
+    for (auto& light : moved) {
+        light.position = light.position + Vector(.4, -.3, 0);
+    }
+    // The camera moves every frame; the lights move before the third frame.
+    std::vector<SequenceFrame> frames;
+    for (int i = 0; i < 5; ++i) {
+        CameraOptions camera_opts{.screen_width = 160,
+                                  .screen_height = 120,
+                                  .fov = std::numbers::pi / 3,
+                                  .look_from = {-.2 + .1 * i, .7, 1.75},
+                                  .look_to = {0., .7, 0.}};
+        frames.push_back({camera_opts, dir / ("frame" + std::to_string(i) + ".png")});
+    }
+    frames[2].update = [&](Scene& target) { target.SetLights(moved); };
+    std::vector<int> order;
+    SequenceStats stats =
+        RenderSequence(scene, frames, {4}, {.max_in_flight = 2, .on_frame = [&](int i, const Image&) {
+                                                order.push_back(i);
+                                            }});
+    CHECK(order == std::vector<int>{0, 1, 2, 3, 4});
+    for (int i = 0; i < 5; ++i) {
+        Image expected = Render(reference, frames[i].camera, {4});
+        if (i >= 2) {
+            Scene lit(reference.GetPrimitives(), moved,
+                      std::unordered_map<std::string, Material>(reference.GetMaterials()));
+            Image before = expected;
+            expected = Render(lit, frames[i].camera, {4});
+            CHECK(PixelDistance(expected.GetPixel(100, 40), before.GetPixel(100, 40)) > 10);
+        }
+        Compare(Image(frames[i].output), expected);
+    }
+    for (const StageStats* stage : {&stats.trace, &stats.tone_map, &stats.encode}) {
+        CHECK(stage->frames == 5);
+        CHECK(stage->busy_ms > 0);
+        CHECK(stats.Utilization(*stage) <= 1);
+    }
+    CHECK(stats.max_in_flight >= 1);
+    CHECK(stats.max_in_flight <= 2);
+
+    // A failed write stops the sequence.
+    frames[1].output = dir / "missing" / "frame.png";
+    CHECK_THROWS(RenderSequence(scene, frames, {1}, {.max_in_flight = 1}));
+}
+
+TEST_CASE("Render scheduler") {
+    using namespace std::chrono_literals;
+    RenderScheduler scheduler(3);
+    std::vector<std::atomic<int>> counts(100 * 10);
+    scheduler.Run(0, 100, [&](int i) {
+        scheduler.Run(0, 10, [&](int j) { ++counts[i * 10 + j]; });
+    });
+    CHECK(std::all_of(counts.begin(), counts.end(), [](const auto& c) { return c == 1; }));
+    CHECK_THROWS(scheduler.Run(0, 20, [](int i) {
+        if (i == 7) {
+            throw std::runtime_error("task");
+        }
+    }));
+
+    // One worker makes the order of the tasks deterministic.
+    RenderScheduler single(1);
+    auto hold = [&](std::atomic<bool>* release) {
+        return std::thread([&single, release] {
+            single.Run(0, 1, [&](int) {
+                while (!*release) {
+                    std::this_thread::sleep_for(1ms);
+                }
+            }, {JobPriority::kInteractive});
+        });
+    };
+    auto wait_queued = [&](JobPriority priority, uint64_t tasks) {
+        while (single.GetStats().queued_tasks[static_cast<size_t>(priority)] < tasks) {
+            std::this_thread::sleep_for(1ms);
+        }
+    };
+
+    // Jobs of one class take turns.
+    {
+        std::atomic<bool> release = false;
+        std::thread holder = hold(&release);
+        std::mutex mutex;
+        std::vector<int> order;
+        std::vector<std::thread> jobs;
+        for (int job = 0; job < 2; ++job) {
+            jobs.emplace_back([&, job] {
+                single.Run(0, 20, [&](int) {
+                    std::lock_guard lock(mutex);
+                    order.push_back(job);
+                });
+            });
+        }
+        wait_queued(JobPriority::kNormal, 40);
+        CHECK(single.GetStats().active_jobs == 2);
+        release = true;
+        holder.join();
+        for (auto& job : jobs) {
+            job.join();
+        }
+        REQUIRE(order.size() == 40);
+        for (int i = 0; i < 40; i += 2) {
+            CHECK(order[i] != order[i + 1]);
+        }
+    }
+
+    // An interactive job overtakes a background one at the next task.
+    {
+        std::atomic<bool> release = false;
+        std::thread holder = hold(&release);
+        std::atomic<int> background_done = 0;
+        std::thread background([&] {
+            single.Run(0, 50, [&](int) {
+                std::this_thread::sleep_for(1ms);
+                ++background_done;
+            }, {JobPriority::kBackground});
+        });
+        wait_queued(JobPriority::kBackground, 50);
+        release = true;
+        holder.join();
+        while (background_done == 0) {
+            std::this_thread::sleep_for(1ms);
+        }
+        int done_at_submit = background_done;
+        int done_at_finish = 0;
+        single.Run(0, 5, [&](int i) {
+            if (i == 4) {
+                done_at_finish = background_done;
+            }
+        }, {JobPriority::kInteractive});
+        background.join();
+        CHECK(done_at_finish <= done_at_submit + 5);
+        CHECK(done_at_finish < 50);
+        CHECK(background_done == 50);
+    }
+
+    // Cancellation skips the tasks not started.
+    std::stop_source stop;
+    std::atomic<int> run = 0;
+    single.Run(0, 100, [&](int i) {
+        ++run;
+        if (i == 10) {
+            stop.request_stop();
+        }
+    }, {JobPriority::kNormal, stop.get_token()});
+    CHECK(run == 11);
+    // A task that throws skips the rest.
+    CHECK_THROWS(single.Run(0, 20, [](int i) {
+        if (i == 7) {
+            throw std::runtime_error("task");
+        }
+    }));
+
+    SchedulerStats stats = single.GetStats();
+    CHECK(stats.threads == 1);
+    CHECK(stats.active_jobs == 0);
+    CHECK(stats.queued_tasks == std::array<uint64_t, kJobPriorities>{});
+    const PriorityStats& normal = stats.priorities[static_cast<size_t>(JobPriority::kNormal)];
+    CHECK(normal.jobs == 4);
+    CHECK(normal.tasks == 160);
+    CHECK(normal.cancelled_tasks == 89);
+    CHECK(normal.aborted_tasks == 12);
+    const PriorityStats& interactive =
+        stats.priorities[static_cast<size_t>(JobPriority::kInteractive)];
+    CHECK(interactive.jobs == 3);
+    CHECK(interactive.max_latency_ms >= interactive.max_queue_ms);
+    CHECK(interactive.total_latency_ms > 0);
+
+    // Renders at different priorities share the pool and match those run alone.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    RenderOptions background_opts{4};
+    background_opts.priority = JobPriority::kBackground;
+    background_opts.tile_size = 8;
+    RenderOptions preview_opts{1};
+    preview_opts.priority = JobPriority::kInteractive;
+    std::optional<Image> background_image;
+    std::thread background([&] { background_image = Render(scene, camera_opts, background_opts); });
+    Image preview = Render(scene, camera_opts, preview_opts);
+    background.join();
+    Compare(preview, Render(scene, camera_opts, {1}));
+    Compare(*background_image, Render(scene, camera_opts, {4}));
+
+    std::stop_source cancel;
+    cancel.request_stop();
+    RenderedFrame cancelled = [&] {
+        ScopedJobContext context(JobPriority::kNormal, cancel.get_token());
+        return RenderFrame(scene, camera_opts, {4});
+    }();
+    CHECK(cancelled.cancelled);
+    CHECK(cancelled.max_value == 0);
+    CHECK_FALSE(RenderFrame(scene, camera_opts, {1}).cancelled);
+}
+
+TEST_CASE("Ray queries") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    struct View {
+        const char* path;
+        Vector look_from;
+        Vector center;
+        double scale;
+    };
+    for (const auto& view : {View{"deer/CERF_Free.obj", {100., 200., 150.}, {0., 100., 0.}, 200.},
+                             View{"primitives/analytic.obj", {0., 1.2, 2.5}, {0., .4, -.5}, 3.}}) {
+        const auto scene = ReadScene(kTestsDir / view.path);
+        const Vector& center = view.center;
+        double scale = view.scale;
+        // Chunks of unit rays, camera rays with directions of any length, then
+        // random rays.
+        std::vector<Ray> rays;
+        Camera camera(CameraOptions{.screen_width = 64,
+                                    .screen_height = 48,
+                                    .look_from = view.look_from,
+                                    .look_to = center});
+        for (size_t i = 0; i < kRayQueryChunk; ++i) {
+            rays.emplace_back(camera.GetOrigin(), Vector(0, 0, 1));
+            rays.emplace_back(camera.GetOrigin(), Vector(0, -1, 0));
+        }
+        for (int y = 0; y < 48; ++y) {
+            for (int x = 0; x < 64; ++x) {
+                Ray ray = camera.GetRay(y, x);
+                Vector dir = ray.GetDirection();
+                for (int k = 0; k < x % 3; ++k) {
+                    dir = dir + dir;
+                }
+                rays.emplace_back(ray.GetOrigin(), dir);
+            }
+        }
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<double> coord(-scale, scale);
+        for (int i = 0; i < 1000; ++i) {
+            rays.emplace_back(center + Vector(coord(rng), coord(rng), coord(rng)),
+                              Vector(coord(rng), coord(rng), coord(rng)));
+        }
+        std::vector<double> t_max;
+        for (size_t i = 0; i < rays.size(); ++i) {
+            t_max.push_back(i % 2 ? INFINITY : std::abs(coord(rng)));
+        }
+
+        for (auto type : {AcceleratorType::kAuto, AcceleratorType::kBvh}) {
+            std::vector<Hit> hits(rays.size());
+            IntersectClosest(scene, rays, hits, {.accelerator = type});
+            std::unique_ptr<bool[]> occluded(new bool[rays.size()]);
+            IntersectAny(scene, rays, t_max, {occluded.get(), rays.size()}, {.accelerator = type});
+            const Accelerator& accelerator = scene.GetAccelerator(type);
+            for (size_t i = 0; i < rays.size(); ++i) {
+                Hit expected = FindClosestHit(accelerator, rays[i]);
+                REQUIRE(hits[i].IsValid() == expected.IsValid());
+                if (expected.IsValid()) {
+                    CHECK(hits[i].index == expected.index);
+                    CHECK(hits[i].params.t == expected.params.t);
+                    CHECK(Length(hits[i].shading_normal - expected.shading_normal) == 0);
+                }
+                CHECK(occluded[i] == IsOccluded(accelerator, rays[i], t_max[i]));
+            }
+        }
+        std::vector<Hit> bare(rays.size());
+        IntersectClosest(scene, rays, bare, {.attributes = false});
+        CHECK(std::none_of(bare.begin(), bare.end(), [](const Hit& hit) { return hit.intersection; }));
+    }
+    const auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    std::vector<Ray> rays(3, Ray({0, 0, 0}, {0, 0, 1}));
+    std::vector<Hit> hits(2);
+    CHECK_THROWS_AS(IntersectClosest(scene, rays, hits), std::invalid_argument);
+    std::vector<double> t_max(3, 1.);
+    bool occluded[2];
+    CHECK_THROWS_AS(IntersectAny(scene, rays, t_max, occluded), std::invalid_argument);
+    IntersectClosest(scene, {}, {});
+}
+
+TEST_CASE("Batch shading") {
+    std::vector<double> bases = {0., 1e-310, 1e-300, 1e-10, .01, .3, .5, .70710678, .7071068, .9, 1.};
+    std::vector<double> exponents = {0., .5, 1., 3., 10., 64., 100., 1000.};
+    Lanes base;
+    Lanes exponent;
+    for (size_t i = 0; i < kShadeBatch; ++i) {
+        base[i] = bases[i % bases.size()];
+        exponent[i] = exponents[i / bases.size() % exponents.size()];
+    }
+    for (int round = 0; round < 2; ++round) {
+        Lanes power = PowLanes(base, exponent);
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            double expected = std::pow(std::max(base[i], 1e-300), exponent[i]);
+            INFO(base[i] << "^" << exponent[i]);
+            CHECK(std::abs(power[i] - expected) <= 1e-9 * expected + 1e-307);
+        }
+        std::mt19937 rng(3);
+        std::uniform_real_distribution<double> unit(0., 1.);
+        for (size_t i = 0; i < kShadeBatch; ++i) {
+            base[i] = unit(rng);
+            exponent[i] = 200 * unit(rng);
+        }
+    }
+
+    // The frames of shading in batches and one by one agree up to the rounding of
+    // PowLanes, whatever the order and the source of the primary hits.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions box_camera{.screen_width = 160,
+                             .screen_height = 120,
+                             .fov = std::numbers::pi / 3,
+                             .look_from = {0., .7, 1.75},
+                             .look_to = {0., .7, 0.}};
+    CameraOptions deer_camera{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {100., 200., 150.},
+                              .look_to = {0., 100., 0.}};
+    std::vector<std::pair<const char*, CameraOptions>> views = {
+        {"box/cube.obj", box_camera},
+        {"primitives/shapes.obj", box_camera},
+        {"classic_box/CornellBox.obj", box_camera},
+        {"deer/CERF_Free.obj", deer_camera}};
+    for (const auto& [path, camera_opts] : views) {
+        const auto scene = ReadScene(kTestsDir / path);
+        for (int depth : {0, 4}) {
+            RenderOptions render_opts{depth};
+            render_opts.tile_size = 24;
+            for (auto order : {PixelOrder::kScanline, PixelOrder::kSpaceFilling}) {
+                for (auto visibility : {PrimaryVisibility::kTrace, PrimaryVisibility::kRasterize}) {
+                    INFO(path << ", depth " << depth);
+                    render_opts.pixel_order = order;
+                    render_opts.primary_visibility = visibility;
+                    render_opts.batch_shading = true;
+                    auto batch = RenderFrame(scene, camera_opts, render_opts);
+                    render_opts.batch_shading = false;
+                    auto expected = RenderFrame(scene, camera_opts, render_opts);
+                    CHECK(std::abs(batch.max_value - expected.max_value) <= 1e-6 * expected.max_value);
+                    for (int y = 0; y < camera_opts.screen_height; ++y) {
+                        for (int x = 0; x < camera_opts.screen_width; ++x) {
+                            Vector actual = batch.frame.GetPixel(y, x);
+                            Vector pixel = expected.frame.GetPixel(y, x);
+                            REQUIRE(Length(actual - pixel) <= 1e-6 * (Length(pixel) + 1e-3));
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
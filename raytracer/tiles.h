@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Half-open rectangle of pixels [x0, x1) x [y0, y1).
+struct Tile {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// Row-major list of tiles covering a width x height frame; edge tiles are clipped.
+std::vector<Tile> SplitIntoTiles(int width, int height, int tile_size) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            tiles.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+        }
+    }
+    return tiles;
+}
+
+// Position of cell (x, y) along the Hilbert curve through a side x side grid; side
+// is a power of two.
+uint64_t HilbertIndex(uint32_t side, uint32_t x, uint32_t y) {
+    uint64_t index = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+uint32_t NextPowerOfTwo(uint32_t value) {
+    uint32_t power = 1;
+    while (power < value) {
+        power *= 2;
+    }
+    return power;
+}
+
+// Reorders the tiles of SplitIntoTiles along a Hilbert curve, so that tiles
+// handed out one after another are neighbours.
+void SortTilesHilbert(std::vector<Tile>* tiles, int tile_size) {
+    uint32_t side = 1;
+    for (const Tile& tile : *tiles) {
+        side = std::max(side, NextPowerOfTwo(std::max(tile.x0, tile.y0) / tile_size + 1));
+    }
+    auto index = [&](const Tile& tile) {
+        return HilbertIndex(side, tile.x0 / tile_size, tile.y0 / tile_size);
+    };
+    std::sort(tiles->begin(), tiles->end(),
+              [&](const Tile& a, const Tile& b) { return index(a) < index(b); });
+}
+
+// Calls visit(x, y) with the offsets of the pixels of a width x height block in
+// Morton order, decoding them on the way.
+template <class Visit>
+void ForEachMorton(int width, int height, Visit&& visit) {
+    auto compact = [](uint32_t code) {
+        code &= 0x55555555;
+        code = (code | (code >> 1)) & 0x33333333;
+        code = (code | (code >> 2)) & 0x0f0f0f0f;
+        code = (code | (code >> 4)) & 0x00ff00ff;
+        return (code | (code >> 8)) & 0x0000ffff;
+    };
+    uint32_t side = NextPowerOfTwo(std::max(width, height));
+    for (uint32_t code = 0; code < side * side; ++code) {
+        int x = compact(code);
+        int y = compact(code >> 1);
+        if (x < width && y < height) {
+            visit(x, y);
+        }
+    }
+}
+
+// Offsets (x, y) of the pixels of a width x height block in Morton order.
+std::vector<std::pair<int, int>> MortonOrder(int width, int height) {
+    std::vector<std::pair<int, int>> order;
+    order.reserve(static_cast<size_t>(width) * height);
+    ForEachMorton(width, height, [&](int x, int y) { order.emplace_back(x, y); });
+    return order;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <framebuffer.h>
+#include <parallel.h>
+#include <image.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Maps a linear value in [0, 1] to round(255 * x^(1 / 2.2)) without calling std::pow.
+// thresholds_[k] is the smallest input that encodes to k, so encoding is a
+// branch-free binary search. NaN and negative inputs encode to 0.
+class GammaTable {
+public:
+    GammaTable() {
+        thresholds_[0] = -std::numeric_limits<float>::infinity();
+        for (int k = 1; k < 256; ++k) {
+            thresholds_[k] = std::pow((k - 0.5) / 255, 2.2);
+        }
+    }
+
+    int Encode(float value) const {
+        int k = 0;
+        for (int step = 128; step > 0; step >>= 1) {
+            k += (thresholds_[k + step] <= value) ? step : 0;
+        }
+        return k;
+    }
+
+private:
+    std::array<float, 256> thresholds_;
+};
+
+const GammaTable& GetGammaTable() {
+    static const GammaTable kTable;
+    return kTable;
+}
+
+// Largest channel value of the frame; NaNs are skipped.
+float MaxValue(const Framebuffer& frame) {
+    std::vector<float> row_max(frame.Height(), 0.f);
+    ParallelFor(0, frame.Height(), [&](int y) {
+        const float* row = frame.Row(y);
+        size_t count = static_cast<size_t>(frame.Width()) * frame.Channels();
+        float max_value = 0.f;
+        for (size_t k = 0; k < count; ++k) {
+            max_value = row[k] > max_value ? row[k] : max_value;
+        }
+        row_max[y] = max_value;
+    });
+    float max_value = 0.f;
+    for (float value : row_max) {
+        max_value = std::max(max_value, value);
+    }
+    return max_value;
+}
+
+// Pixels of a row tone-mapped at a time, in a buffer on the stack.
+constexpr int kToneMapBlock = 256;
+
+// Reinhard tone mapping with white point max_value followed by gamma 2.2, for
+// a row of width pixels.
+void ToneMapRow(const float* row, int width, float max_value, RGB* out) {
+    const GammaTable& gamma = GetGammaTable();
+    const float inv_white = 1.f / (max_value * max_value);
+    std::array<float, 3 * kToneMapBlock> mapped;
+    for (int x0 = 0; x0 < width; x0 += kToneMapBlock) {
+        int pixels = std::min(kToneMapBlock, width - x0);
+        const float* block = row + 3 * x0;
+        for (int k = 0; k < 3 * pixels; ++k) {
+            float v = block[k];
+            mapped[k] = v * (1.f + v * inv_white) / (1.f + v);
+        }
+        for (int x = 0; x < pixels; ++x) {
+            out[x0 + x] = {gamma.Encode(mapped[3 * x]), gamma.Encode(mapped[3 * x + 1]),
+                           gamma.Encode(mapped[3 * x + 2])};
+        }
+    }
+}
+
+// Negative depth marks pixels without a hit; they are painted white.
+void DepthToRow(const float* row, int width, float max_depth, RGB* out) {
+    for (int x = 0; x < width; ++x) {
+        if (row[x] < 0) {
+            out[x] = {255, 255, 255};
+        } else {
+            int c = std::round(row[x] / max_depth * 255);
+            out[x] = {c, c, c};
+        }
+    }
+}
+
+// Zero normals mark pixels without a hit; they stay black.
+void NormalToRow(const float* row, int width, RGB* out) {
+    for (int x = 0; x < width; ++x) {
+        const float* n = row + 3 * x;
+        if (n[0] == 0 && n[1] == 0 && n[2] == 0) {
+            out[x] = {0, 0, 0};
+            continue;
+        }
+        int c1 = std::round((n[0] * 0.5 + 0.5) * 255);
+        int c2 = std::round((n[1] * 0.5 + 0.5) * 255);
+        int c3 = std::round((n[2] * 0.5 + 0.5) * 255);
+        out[x] = {c1, c2, c3};
+    }
+}
+
+// Converts every row of frame with convert(row, width, out), into a row buffer
+// every thread reuses.
+template <class Convert>
+Image ConvertFrame(const Framebuffer& frame, Convert&& convert) {
+    Image img(frame.Width(), frame.Height());
+    ParallelFor(0, frame.Height(), [&](int y) {
+        thread_local std::vector<RGB> pixels;
+        pixels.resize(frame.Width());
+        convert(frame.Row(y), frame.Width(), pixels.data());
+        for (int x = 0; x < frame.Width(); ++x) {
+            img.SetPixel(pixels[x], y, x);
+        }
+    });
+    return img;
+}
+
+Image ToneMap(const Framebuffer& frame, float max_value) {
+    return ConvertFrame(frame, [&](const float* row, int width, RGB* out) {
+        ToneMapRow(row, width, max_value, out);
+    });
+}
+
+Image DepthToImage(const Framebuffer& depth, float max_depth) {
+    return ConvertFrame(depth, [&](const float* row, int width, RGB* out) {
+        DepthToRow(row, width, max_depth, out);
+    });
+}
+
+Image NormalToImage(const Framebuffer& normals) {
+    return ConvertFrame(normals, NormalToRow);
+}